@@ -0,0 +1,195 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <stdexcept>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "fde.h"
+#include "multivector_file.h"
+
+// Helpers shared by the benchmark and evaluation tools.
+
+inline double seconds_since(const std::chrono::steady_clock::time_point& start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Nearest-rank percentile, p in [0, 100]. Sorts a copy of the samples.
+inline double percentile(std::vector<double> samples, double p) {
+    if (samples.empty()) return 0.0;
+    std::sort(samples.begin(), samples.end());
+    size_t rank = static_cast<size_t>(std::ceil(p / 100.0 * samples.size()));
+    return samples[std::min(samples.size() - 1, rank == 0 ? 0 : rank - 1)];
+}
+
+// Reads a "<field>: <n> kB" line from /proc/self/status; 0 if unavailable.
+inline size_t read_proc_status_kb(const std::string& field) {
+    std::ifstream status("/proc/self/status");
+    std::string line;
+    while (std::getline(status, line)) {
+        if (line.compare(0, field.size() + 1, field + ":") == 0) {
+            return std::stoull(line.substr(field.size() + 1));
+        }
+    }
+    return 0;
+}
+
+// Resets VmHWM to the current RSS so that the next peak reading covers only
+// what follows. Silently does nothing on kernels without clear_refs.
+inline void reset_peak_rss() {
+    std::ofstream clear_refs("/proc/self/clear_refs");
+    if (clear_refs) clear_refs << "5";
+}
+
+// Appends num_tokens random unit-norm rows of the given width to out.
+inline void append_unit_tokens(std::vector<float>& out, size_t num_tokens, size_t dimensions, std::mt19937_64& gen) {
+    std::normal_distribution<float> normal(0.0f, 1.0f);
+    std::vector<float> v(dimensions);
+    for (size_t t = 0; t < num_tokens; t++) {
+        float norm = 0.0f;
+        for (float& x : v) {
+            x = normal(gen);
+            norm += x * x;
+        }
+        norm = std::sqrt(norm);
+        for (float x : v) out.push_back(x / norm);
+    }
+}
+
+// Ragged multi-vector collection with one id per document. Either owns its
+// tokens or, when loaded from an fp32 .mvf file, views the file mapping.
+struct MultiVectorSet {
+    size_t dimensions = 0;
+    std::vector<float> tokens;
+    std::vector<int64_t> offsets{0};
+    std::vector<std::string> doc_ids;
+    std::shared_ptr<const MultiVectorFile> file;
+
+    size_t num_docs() const { return doc_ids.size(); }
+    RaggedTokenView view() const {
+        if (file) return file->view();
+        return {tokens.data(), offsets.data(), num_docs(), static_cast<size_t>(offsets.back()), dimensions};
+    }
+    TokenMatrixView document(size_t i) const { return view().document(i); }
+};
+
+inline MultiVectorSet load_multivector_file(const std::string& path) {
+    MultiVectorSet set;
+    auto file = std::make_shared<const MultiVectorFile>(path);
+    set.dimensions = file->dimensions();
+    set.doc_ids = file->doc_ids();
+    if (file->dtype() == MultiVectorDType::FP32) {
+        set.file = std::move(file);
+    } else {
+        set.tokens = file->decode_tokens();
+        set.offsets.assign(file->offsets(), file->offsets() + file->num_docs() + 1);
+    }
+    return set;
+}
+
+// Random unit-norm tokens. Document lengths are drawn uniformly from
+// [tokens_per_doc / 2, tokens_per_doc * 3 / 2].
+inline MultiVectorSet make_synthetic_dataset(size_t num_docs, size_t tokens_per_doc, size_t dimensions, uint64_t seed) {
+    MultiVectorSet data;
+    data.dimensions = dimensions;
+    std::mt19937_64 gen(seed);
+    const size_t min_tokens = std::max<size_t>(1, tokens_per_doc / 2);
+    std::uniform_int_distribution<size_t> length_dist(min_tokens, std::max(min_tokens, tokens_per_doc * 3 / 2));
+    for (size_t d = 0; d < num_docs; d++) {
+        const size_t num_tokens = length_dist(gen);
+        append_unit_tokens(data.tokens, num_tokens, dimensions, gen);
+        data.offsets.push_back(data.offsets.back() + num_tokens);
+        data.doc_ids.push_back(std::to_string(d));
+    }
+    return data;
+}
+
+// Flat JSON object; values are stored already encoded.
+class JsonRecord {
+    private:
+    std::vector<std::pair<std::string, std::string>> fields;
+
+    static std::string quote(const std::string& s) {
+        std::string out = "\"";
+        for (char c : s) {
+            if (c == '"' || c == '\\') out += '\\';
+            out += c;
+        }
+        return out + "\"";
+    }
+
+    public:
+    JsonRecord& set(const std::string& key, const std::string& value) {
+        fields.emplace_back(key, quote(value));
+        return *this;
+    }
+    JsonRecord& set(const std::string& key, const char* value) { return set(key, std::string(value)); }
+    JsonRecord& set(const std::string& key, double value) {
+        std::ostringstream out;
+        if (std::isfinite(value)) out << std::setprecision(10) << value;
+        else out << "null";
+        fields.emplace_back(key, out.str());
+        return *this;
+    }
+    JsonRecord& set(const std::string& key, size_t value) {
+        fields.emplace_back(key, std::to_string(value));
+        return *this;
+    }
+
+    void write(std::ostream& out) const {
+        out << "{";
+        for (size_t i = 0; i < fields.size(); i++) {
+            out << (i ? ", " : "") << quote(fields[i].first) << ": " << fields[i].second;
+        }
+        out << "}";
+    }
+};
+
+// Writes {"tool": ..., "results": [...]} to path, or stdout if path is empty.
+inline void write_json_report(const std::string& path, const std::string& tool, const std::vector<JsonRecord>& results) {
+    std::ofstream file;
+    if (!path.empty()) {
+        file.open(path);
+        if (!file) throw std::runtime_error("cannot open " + path + " for writing");
+    }
+    std::ostream& out = path.empty() ? std::cout : file;
+    out << "{\"tool\": \"" << tool << "\", \"results\": [\n";
+    for (size_t i = 0; i < results.size(); i++) {
+        out << "  ";
+        results[i].write(out);
+        out << (i + 1 < results.size() ? ",\n" : "\n");
+    }
+    out << "]}\n";
+}
+
+// Parses "1,2,8" into {1, 2, 8}.
+inline std::vector<size_t> parse_size_list(const std::string& s) {
+    std::vector<size_t> values;
+    std::stringstream in(s);
+    std::string item;
+    while (std::getline(in, item, ',')) {
+        if (!item.empty()) values.push_back(std::stoull(item));
+    }
+    return values;
+}
+
+// Parses "0,0.9,0.95" into {0, 0.9, 0.95}.
+inline std::vector<double> parse_double_list(const std::string& s) {
+    std::vector<double> values;
+    std::stringstream in(s);
+    std::string item;
+    while (std::getline(in, item, ',')) {
+        if (!item.empty()) values.push_back(std::stod(item));
+    }
+    return values;
+}
@@ -0,0 +1,335 @@
+// muvera_bench: microbenchmarks for the FDE pipeline and Chamfer engines, plus
+// end-to-end build/query throughput for every retriever. Results are written
+// as one JSON report so runs can be diffed for regressions.
+//
+//   muvera_bench [--quick] [--output report.json] [--filter name]
+//                [--threads 1,4,8] [--docs N] [--queries N] [--min-time s]
+//                [--data corpus.mvf] [--huge-pages none|transparent|explicit]
+//                [--numa first_touch|interleave|bind:NODE] [--pin-threads]
+//
+// With --data, the end-to-end pass indexes the given .mvf file (queried with
+// its own documents) instead of a synthetic dataset. The memory-placement
+// flags set the MemoryPolicy of every end-to-end retriever, and --pin-threads
+// also pins the query threads.
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "bench_common.h"
+#include "fde.h"
+#include "memory_policy.h"
+#include "retriever.h"
+
+struct FDESimilarityBenchAccess {
+    static std::vector<float> apply_ams(const FDESimilarity& fde, const std::vector<float>& v, size_t rep_id) {
+        return fde.apply_ams(v, rep_id);
+    }
+    static std::vector<float> apply_countsketch(const FDESimilarity& fde, const std::vector<float>& v) {
+        return fde.apply_countsketch(v);
+    }
+    static size_t d_fde(const FDESimilarity& fde) { return fde.d_fde; }
+};
+
+struct BenchOptions {
+    bool quick = false;
+    std::string output;
+    std::string filter;
+    std::string data_path;
+    std::vector<size_t> threads = {1, 4, 8};
+    size_t num_docs = 2000;
+    size_t num_queries = 200;
+    double min_time = 0.25;
+    MemoryPolicy memory_policy;
+    std::string memory_policy_name = "none,first_touch";
+};
+
+// Keeps results observable so the timed calls are not optimized away.
+static volatile float bench_sink;
+
+// Runs op until at least min_time seconds have elapsed, doubling the batch
+// size each round, and reports the mean time per call of the final batch.
+template <typename F>
+static JsonRecord time_op(const std::string& name, const BenchOptions& options, F&& op) {
+    op(); // warm-up
+    size_t iterations = 1;
+    double elapsed = 0.0;
+    while (true) {
+        const auto start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < iterations; i++) op();
+        elapsed = seconds_since(start);
+        if (elapsed >= options.min_time || iterations >= (1ULL << 30)) break;
+        iterations *= 2;
+    }
+    JsonRecord record;
+    record.set("benchmark", name).set("iterations", iterations).set("ns_per_op", elapsed * 1e9 / iterations);
+    return record;
+}
+
+static bool selected(const BenchOptions& options, const std::string& name) {
+    return options.filter.empty() || name.find(options.filter) != std::string::npos;
+}
+
+struct FDESweep {
+    std::vector<size_t> dimensions;
+    std::vector<size_t> tokens_per_doc;
+    std::vector<size_t> k_sim;
+    std::vector<size_t> r_reps;
+};
+
+static FDESweep fde_sweep(const BenchOptions& options) {
+    if (options.quick) return {{128}, {32}, {4}, {10}};
+    return {{64, 128, 256}, {16, 64, 256}, {3, 5, 7}, {5, 10, 20}};
+}
+
+static void run_micro_benchmarks(const BenchOptions& options, std::vector<JsonRecord>& results) {
+    const size_t d_proj = 16;
+    const size_t d_final = 10240;
+    const FDESweep sweep = fde_sweep(options);
+
+    for (size_t dimensions : sweep.dimensions) {
+        for (size_t k_sim : sweep.k_sim) {
+            // Stages that only depend on dimensions and k_sim.
+            auto tag = [&](JsonRecord record) {
+                results.push_back(record.set("dimensions", dimensions).set("k_sim", k_sim));
+                std::cerr << "." << std::flush;
+            };
+            std::mt19937_64 gen(dimensions * 31 + k_sim);
+            std::vector<float> token;
+            append_unit_tokens(token, 1, dimensions, gen);
+            if (selected(options, "simhash.compute_hash")) {
+                SimHash simhash(dimensions, k_sim, 42);
+                tag(time_op("simhash.compute_hash", options, [&]() { bench_sink = simhash.compute_hash(token.data()); }));
+            }
+            FDESimilarity one_rep(dimensions, d_proj, d_final, k_sim, 1, 42);
+            if (selected(options, "fde.apply_ams")) {
+                tag(time_op("fde.apply_ams", options, [&]() {
+                    bench_sink = FDESimilarityBenchAccess::apply_ams(one_rep, token, 0)[0];
+                }));
+            }
+
+            for (size_t r_reps : sweep.r_reps) {
+                if (selected(options, "fde.construct")) {
+                    // Startup cost: SimHash hyperplanes and AMS parameters for every rep.
+                    JsonRecord record = time_op("fde.construct", options, [&]() {
+                        FDESimilarity built(dimensions, d_proj, d_final, k_sim, r_reps, 42);
+                        bench_sink = static_cast<float>(FDESimilarityBenchAccess::d_fde(built));
+                    });
+                    tag(record.set("r_reps", r_reps));
+                }
+                FDESimilarity fde(dimensions, d_proj, d_final, k_sim, r_reps, 42);
+                if (selected(options, "fde.apply_countsketch")) {
+                    std::vector<float> v(FDESimilarityBenchAccess::d_fde(fde));
+                    for (size_t i = 0; i < v.size(); i++) v[i] = static_cast<float>(i % 17) - 8.0f;
+                    JsonRecord record = time_op("fde.apply_countsketch", options, [&]() {
+                        bench_sink = FDESimilarityBenchAccess::apply_countsketch(fde, v)[0];
+                    });
+                    tag(record.set("r_reps", r_reps));
+                }
+                for (size_t num_tokens : sweep.tokens_per_doc) {
+                    std::vector<float> P, Q;
+                    append_unit_tokens(P, num_tokens, dimensions, gen);
+                    append_unit_tokens(Q, num_tokens, dimensions, gen);
+                    const TokenMatrixView doc{P.data(), num_tokens, dimensions};
+                    const TokenMatrixView query{Q.data(), num_tokens, dimensions};
+                    if (selected(options, "fde.encode_document")) {
+                        JsonRecord record = time_op("fde.encode_document", options, [&]() {
+                            bench_sink = fde.encode_document(doc)[0];
+                        });
+                        tag(record.set("r_reps", r_reps).set("tokens_per_doc", num_tokens));
+                    }
+                    if (selected(options, "fde.encode_query")) {
+                        JsonRecord record = time_op("fde.encode_query", options, [&]() {
+                            bench_sink = fde.encode_query(query)[0];
+                        });
+                        tag(record.set("r_reps", r_reps).set("tokens_per_doc", num_tokens));
+                    }
+                }
+            }
+        }
+
+        // The Chamfer engines only depend on dimensions and token counts.
+        for (size_t num_tokens : sweep.tokens_per_doc) {
+            std::mt19937_64 gen(dimensions * 131 + num_tokens);
+            std::vector<float> P, Q;
+            append_unit_tokens(P, num_tokens, dimensions, gen);
+            append_unit_tokens(Q, num_tokens, dimensions, gen);
+            const TokenMatrixView doc{P.data(), num_tokens, dimensions};
+            const TokenMatrixView query{Q.data(), num_tokens, dimensions};
+            auto tag = [&](JsonRecord record) {
+                results.push_back(record.set("dimensions", dimensions).set("tokens_per_doc", num_tokens));
+                std::cerr << "." << std::flush;
+            };
+            if (selected(options, "exact_chamfer.compute_similarity")) {
+                ExactChamferSimilarity exact(dimensions);
+                tag(time_op("exact_chamfer.compute_similarity", options, [&]() {
+                    bench_sink = exact.compute_similarity(doc, query);
+                }));
+            }
+            if (selected(options, "relaxed_chamfer.compute_similarity")) {
+                RelaxedChamferSimilarity relaxed(dimensions, 1);
+                tag(time_op("relaxed_chamfer.compute_similarity", options, [&]() {
+                    bench_sink = relaxed.compute_similarity(doc, query);
+                }));
+            }
+        }
+    }
+    std::cerr << std::endl;
+}
+
+// Runs num_queries queries spread over num_threads threads and records QPS
+// and per-query latency percentiles.
+static JsonRecord run_queries(const std::string& name, const AbstractRetriever& retriever, const MultiVectorSet& queries,
+    const size_t num_queries, const size_t num_threads, const size_t top_k, const MemoryPolicy& policy)
+{
+    std::vector<double> latencies(num_queries);
+    std::atomic<size_t> next(0);
+    auto worker = [&](const size_t t) {
+        pin_worker_thread(policy, t);
+        for (size_t i = next.fetch_add(1); i < num_queries; i = next.fetch_add(1)) {
+            const auto start = std::chrono::steady_clock::now();
+            bench_sink = static_cast<float>(retriever.get_top_k(queries.document(i % queries.num_docs()), top_k).size());
+            latencies[i] = seconds_since(start);
+        }
+    };
+    const auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> pool;
+    for (size_t t = 0; t < num_threads; t++) pool.emplace_back(worker, t);
+    for (auto& t : pool) t.join();
+    const double elapsed = seconds_since(start);
+
+    JsonRecord record;
+    record.set("benchmark", name).set("threads", num_threads).set("queries", num_queries).set("qps", num_queries / elapsed)
+        .set("p50_ms", percentile(latencies, 50) * 1e3).set("p99_ms", percentile(latencies, 99) * 1e3);
+    return record;
+}
+
+static void run_end_to_end(const BenchOptions& options, std::vector<JsonRecord>& results) {
+    const size_t top_k = 10;
+    MultiVectorSet data, queries;
+    if (options.data_path.empty()) {
+        data = make_synthetic_dataset(options.num_docs, 32, 128, 1);
+        queries = make_synthetic_dataset(std::min<size_t>(options.num_queries, 1000), 32, 128, 2);
+    } else {
+        data = load_multivector_file(options.data_path);
+        queries = data;
+    }
+    const size_t num_docs = data.num_docs();
+    const size_t dimensions = data.dimensions;
+    const size_t tokens_per_doc = data.view().num_tokens / std::max<size_t>(1, num_docs);
+
+    struct Candidate {
+        std::string name;
+        std::function<std::unique_ptr<AbstractRetriever>()> make;
+    };
+    const std::vector<Candidate> candidates = {
+        {"exact_chamfer", [&]() {
+            auto exact = std::make_unique<ExactChamferRetriever>(dimensions, num_docs);
+            exact->set_memory_policy(options.memory_policy);
+            return exact;
+        }},
+        {"relaxed_chamfer", [&]() {
+            auto relaxed = std::make_unique<RelaxedChamferRetriever>(dimensions, num_docs, 1);
+            relaxed->set_memory_policy(options.memory_policy);
+            return relaxed;
+        }},
+        {"muvera", [&]() {
+            auto muvera = std::make_unique<MuveraRetriever>(dimensions, num_docs, 16, 10240, 5, 20, 42);
+            muvera->set_memory_policy(options.memory_policy);
+            return muvera;
+        }},
+    };
+
+    for (const Candidate& candidate : candidates) {
+        if (!selected(options, "e2e." + candidate.name)) continue;
+        std::cerr << "e2e." << candidate.name << std::endl;
+        reset_peak_rss();
+        const size_t rss_before = read_proc_status_kb("VmRSS");
+
+        std::unique_ptr<AbstractRetriever> retriever = candidate.make();
+        const auto start = std::chrono::steady_clock::now();
+        retriever->index_dataset(data.view(), data.doc_ids);
+        const double build_seconds = seconds_since(start);
+
+        for (size_t num_threads : options.threads) {
+            retriever->reset_stats();
+            JsonRecord record = run_queries("e2e." + candidate.name, *retriever, queries, options.num_queries, num_threads, top_k, options.memory_policy);
+            record.set("num_docs", num_docs)
+                .set("dimensions", dimensions).set("tokens_per_doc", tokens_per_doc).set("top_k", top_k)
+                .set("build_seconds", build_seconds).set("memory_policy", options.memory_policy_name)
+                .set("rss_before_kb", rss_before).set("peak_rss_kb", read_proc_status_kb("VmHWM"));
+            // Per-stage breakdown of the queries above (empty when stats are compiled out).
+            const StatsSnapshot stats = retriever->get_stats();
+            for (const auto& [stage, stage_stats] : stats.stages) {
+                record.set("stage." + stage + ".mean_us", stage_stats.mean_us)
+                    .set("stage." + stage + ".p99_us", stage_stats.p99_us);
+            }
+            for (const auto& [counter, value] : stats.counters) {
+                record.set("counter." + counter + ".per_query", static_cast<double>(value) / options.num_queries);
+            }
+            results.push_back(record);
+        }
+    }
+}
+
+static BenchOptions parse_options(int argc, char** argv) {
+    BenchOptions options;
+    bool docs_set = false, queries_set = false;
+    std::string huge_pages = "none", numa = "first_touch";
+    for (int i = 1; i < argc; i++) {
+        const std::string arg = argv[i];
+        auto value = [&]() -> std::string {
+            if (i + 1 >= argc) throw std::invalid_argument(arg + " requires a value");
+            return argv[++i];
+        };
+        if (arg == "--quick") options.quick = true;
+        else if (arg == "--output") options.output = value();
+        else if (arg == "--filter") options.filter = value();
+        else if (arg == "--threads") options.threads = parse_size_list(value());
+        else if (arg == "--docs") { options.num_docs = std::stoull(value()); docs_set = true; }
+        else if (arg == "--queries") { options.num_queries = std::stoull(value()); queries_set = true; }
+        else if (arg == "--data") options.data_path = value();
+        else if (arg == "--min-time") options.min_time = std::stod(value());
+        else if (arg == "--huge-pages") huge_pages = value();
+        else if (arg == "--numa") numa = value();
+        else if (arg == "--pin-threads") options.memory_policy.pin_threads = true;
+        else throw std::invalid_argument("unknown option " + arg);
+    }
+    if (huge_pages == "none") options.memory_policy.huge_pages = HugePagePolicy::NONE;
+    else if (huge_pages == "transparent") options.memory_policy.huge_pages = HugePagePolicy::TRANSPARENT;
+    else if (huge_pages == "explicit") options.memory_policy.huge_pages = HugePagePolicy::EXPLICIT;
+    else throw std::invalid_argument("--huge-pages must be none, transparent or explicit");
+    if (numa == "first_touch") options.memory_policy.numa = NumaPolicy::FIRST_TOUCH;
+    else if (numa == "interleave") options.memory_policy.numa = NumaPolicy::INTERLEAVE;
+    else if (numa.rfind("bind:", 0) == 0) {
+        options.memory_policy.numa = NumaPolicy::BIND;
+        options.memory_policy.numa_node = std::stoi(numa.substr(5));
+    } else throw std::invalid_argument("--numa must be first_touch, interleave or bind:NODE");
+    options.memory_policy_name = huge_pages + "," + numa + (options.memory_policy.pin_threads ? ",pinned" : "");
+    if (options.quick) {
+        if (!docs_set) options.num_docs = 300;
+        if (!queries_set) options.num_queries = 50;
+        options.min_time = std::min(options.min_time, 0.05);
+    }
+    return options;
+}
+
+int main(int argc, char** argv) {
+    try {
+        const BenchOptions options = parse_options(argc, argv);
+        std::vector<JsonRecord> results;
+        run_micro_benchmarks(options, results);
+        run_end_to_end(options, results);
+        write_json_report(options.output, "muvera_bench", results);
+    } catch (const std::exception& e) {
+        std::cerr << "muvera_bench: " << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
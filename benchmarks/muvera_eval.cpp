@@ -0,0 +1,511 @@
+// muvera_eval: recall/nDCG/latency evaluation of MuveraRetriever against exact
+// Chamfer ground truth, swept over FDE and DiskANN parameters.
+//
+// Datasets are either synthetic (clustered, so that neighbours are
+// meaningful) or loaded from a BEIR-style directory of precomputed
+// multi-vector embeddings:
+//   corpus.mvf, queries.mvf         binary multi-vector files (multivector_file.h), or
+//   corpus.fvecs, corpus_ids.tsv    token rows; "doc_id<TAB>num_tokens" per document
+//   queries.fvecs, queries_ids.tsv  same layout for queries
+//   qrels.tsv                       optional BEIR qrels: query-id, corpus-id, score
+// .fvecs rows are an int32 dimension followed by that many float32 values.
+//
+// Exact top-k is computed once with ExactChamferRetriever on all cores and
+// cached under --cache-dir, keyed by a fingerprint of the data and k.
+//
+//   muvera_eval [--data dir | --synthetic-docs N --synthetic-queries N]
+//               [--k 10] [--d-proj 16] [--d-final 10240] [--k-sim 5] [--r-reps 20]
+//               [--search-width 10,50,100] [--threads 0] [--cache-dir .] [--output report.json]
+//               [--export dir] [--merge-threshold 0,0.95] [--max-tokens 0,32] [--cap-policy norm|cluster]
+//
+// --export writes the dataset being evaluated to dir/corpus.mvf and
+// dir/queries.mvf, e.g. to pin a synthetic dataset for later runs.
+//
+// --merge-threshold and --max-tokens sweep ingest token pruning
+// (token_pruning.h). Ground truth always comes from the unpruned corpus, so
+// each pruned configuration also reports the recall of exact Chamfer over
+// the pruned corpus: the quality lost to pruning alone, before MuVERA.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "bench_common.h"
+#include "concurrency.h"
+#include "fde.h"
+#include "retriever.h"
+#include "token_pruning.h"
+
+struct EvalOptions {
+    std::string data_dir;
+    size_t synthetic_docs = 5000;
+    size_t synthetic_queries = 200;
+    size_t synthetic_dimensions = 128;
+    size_t synthetic_tokens = 32;
+    size_t top_k = 10;
+    std::vector<size_t> d_proj = {16};
+    std::vector<size_t> d_final = {10240};
+    std::vector<size_t> k_sim = {5};
+    std::vector<size_t> r_reps = {20};
+    std::vector<size_t> search_width = {10, 50, 100, 200};
+    size_t num_threads = 0;
+    std::string cache_dir = ".";
+    std::string output;
+    std::string export_dir;
+    std::vector<double> merge_threshold = {0.0};
+    std::vector<size_t> max_tokens = {0};
+    TokenCapPolicy cap_policy = TokenCapPolicy::NORM;
+};
+
+struct EvalDataset {
+    std::string name;
+    MultiVectorSet corpus;
+    MultiVectorSet queries;
+    // qrels[query index] maps corpus doc_id -> graded relevance.
+    std::vector<std::unordered_map<std::string, double>> qrels;
+};
+
+// Documents are noisy samples around a few topic centroids and each query is
+// a perturbed subset of one document's tokens.
+static EvalDataset make_clustered_dataset(const EvalOptions& options) {
+    const size_t dimensions = options.synthetic_dimensions;
+    const size_t num_topics = std::max<size_t>(1, options.synthetic_docs / 50);
+    const size_t centroids_per_topic = 8;
+    std::mt19937_64 gen(2024);
+    std::normal_distribution<float> normal(0.0f, 1.0f);
+    auto normalize = [&](std::vector<float>& v) {
+        float norm = 0.0f;
+        for (float x : v) norm += x * x;
+        norm = std::sqrt(norm);
+        for (float& x : v) x /= norm;
+    };
+
+    std::vector<std::vector<float>> centroids;
+    for (size_t c = 0; c < num_topics * centroids_per_topic; c++) {
+        std::vector<float> v;
+        append_unit_tokens(v, 1, dimensions, gen);
+        centroids.push_back(std::move(v));
+    }
+    auto sample_near = [&](const std::vector<float>& center, float noise, std::vector<float>& out) {
+        std::vector<float> v(dimensions);
+        for (size_t i = 0; i < dimensions; i++) v[i] = center[i] + noise * normal(gen) / std::sqrt(float(dimensions));
+        normalize(v);
+        out.insert(out.end(), v.begin(), v.end());
+    };
+
+    EvalDataset data;
+    data.name = "synthetic_clustered";
+    data.corpus.dimensions = data.queries.dimensions = dimensions;
+    std::uniform_int_distribution<size_t> topic_dist(0, num_topics - 1);
+    std::uniform_int_distribution<size_t> centroid_dist(0, centroids_per_topic - 1);
+    const size_t min_tokens = std::max<size_t>(1, options.synthetic_tokens / 2);
+    std::uniform_int_distribution<size_t> length_dist(min_tokens, std::max(min_tokens, options.synthetic_tokens * 3 / 2));
+    for (size_t d = 0; d < options.synthetic_docs; d++) {
+        const size_t topic = topic_dist(gen);
+        const size_t num_tokens = length_dist(gen);
+        for (size_t t = 0; t < num_tokens; t++) {
+            sample_near(centroids[topic * centroids_per_topic + centroid_dist(gen)], 1.0f, data.corpus.tokens);
+        }
+        data.corpus.offsets.push_back(data.corpus.offsets.back() + num_tokens);
+        data.corpus.doc_ids.push_back(std::to_string(d));
+    }
+
+    std::uniform_int_distribution<size_t> doc_dist(0, options.synthetic_docs - 1);
+    for (size_t q = 0; q < options.synthetic_queries; q++) {
+        const TokenMatrixView source = data.corpus.document(doc_dist(gen));
+        const size_t num_tokens = std::max<size_t>(1, source.num_tokens / 2);
+        for (size_t t = 0; t < num_tokens; t++) {
+            sample_near(std::vector<float>(source.row(t), source.row(t) + dimensions), 0.5f, data.queries.tokens);
+        }
+        data.queries.offsets.push_back(data.queries.offsets.back() + num_tokens);
+        data.queries.doc_ids.push_back("q" + std::to_string(q));
+    }
+    return data;
+}
+
+// Maps <dir>/<prefix>.mvf if present, else reads <dir>/<prefix>.fvecs and
+// <dir>/<prefix>_ids.tsv.
+static MultiVectorSet load_multivector_set(const std::string& dir, const std::string& prefix) {
+    if (std::ifstream(dir + "/" + prefix + ".mvf")) return load_multivector_file(dir + "/" + prefix + ".mvf");
+    MultiVectorSet set;
+    std::ifstream ids(dir + "/" + prefix + "_ids.tsv");
+    if (!ids) throw std::runtime_error("cannot open " + dir + "/" + prefix + "_ids.tsv");
+    std::string line;
+    while (std::getline(ids, line)) {
+        if (line.empty()) continue;
+        const size_t tab = line.find('\t');
+        if (tab == std::string::npos) throw std::runtime_error("malformed line in " + prefix + "_ids.tsv: " + line);
+        set.doc_ids.push_back(line.substr(0, tab));
+        set.offsets.push_back(set.offsets.back() + std::stoll(line.substr(tab + 1)));
+    }
+
+    std::ifstream vectors(dir + "/" + prefix + ".fvecs", std::ios::binary);
+    if (!vectors) throw std::runtime_error("cannot open " + dir + "/" + prefix + ".fvecs");
+    const size_t num_tokens = set.offsets.back();
+    for (size_t t = 0; t < num_tokens; t++) {
+        int32_t d = 0;
+        if (!vectors.read(reinterpret_cast<char*>(&d), sizeof(d))) {
+            throw std::runtime_error(prefix + ".fvecs has fewer rows than " + prefix + "_ids.tsv declares");
+        }
+        if (set.dimensions == 0) {
+            set.dimensions = d;
+            set.tokens.resize(num_tokens * set.dimensions);
+        } else if (static_cast<size_t>(d) != set.dimensions) {
+            throw std::runtime_error(prefix + ".fvecs mixes dimensions");
+        }
+        vectors.read(reinterpret_cast<char*>(set.tokens.data() + t * set.dimensions), d * sizeof(float));
+    }
+    set.view().validate();
+    return set;
+}
+
+static EvalDataset load_beir_dataset(const std::string& dir) {
+    EvalDataset data;
+    data.name = dir;
+    data.corpus = load_multivector_set(dir, "corpus");
+    data.queries = load_multivector_set(dir, "queries");
+    if (data.corpus.dimensions != data.queries.dimensions) {
+        throw std::runtime_error("corpus and query dimensions differ");
+    }
+
+    std::ifstream qrels(dir + "/qrels.tsv");
+    if (!qrels) return data;
+    std::unordered_map<std::string, size_t> query_index;
+    for (size_t q = 0; q < data.queries.num_docs(); q++) query_index[data.queries.doc_ids[q]] = q;
+    data.qrels.resize(data.queries.num_docs());
+    std::string line;
+    while (std::getline(qrels, line)) {
+        std::stringstream fields(line);
+        std::string query_id, doc_id, score;
+        if (!std::getline(fields, query_id, '\t') || !std::getline(fields, doc_id, '\t') || !std::getline(fields, score, '\t')) continue;
+        auto it = query_index.find(query_id);
+        if (it == query_index.end()) continue; // header or unknown query
+        data.qrels[it->second][doc_id] = std::stod(score);
+    }
+    return data;
+}
+
+static uint64_t fnv1a(uint64_t hash, const void* data, size_t bytes) {
+    const unsigned char* p = static_cast<const unsigned char*>(data);
+    for (size_t i = 0; i < bytes; i++) {
+        hash ^= p[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+static uint64_t fingerprint(const MultiVectorSet& set, uint64_t hash) {
+    const RaggedTokenView view = set.view();
+    hash = fnv1a(hash, &view.dimensions, sizeof(view.dimensions));
+    hash = fnv1a(hash, view.offsets, (view.num_docs + 1) * sizeof(int64_t));
+    return fnv1a(hash, view.tokens, view.num_tokens * view.dimensions * sizeof(float));
+}
+
+// Exact top-k corpus indices per query, best first.
+using GroundTruth = std::vector<std::vector<uint32_t>>;
+
+static const char ground_truth_magic[8] = {'M', 'V', 'G', 'T', 'v', '1', 0, 0};
+
+static bool load_ground_truth(const std::string& path, size_t num_queries, size_t top_k, GroundTruth& truth) {
+    std::ifstream in(path, std::ios::binary);
+    char magic[8];
+    uint64_t header[2];
+    if (!in.read(magic, sizeof(magic)) || std::memcmp(magic, ground_truth_magic, sizeof(magic)) != 0) return false;
+    if (!in.read(reinterpret_cast<char*>(header), sizeof(header)) || header[0] != num_queries || header[1] != top_k) return false;
+    truth.assign(num_queries, {});
+    for (auto& row : truth) {
+        uint32_t count = 0;
+        if (!in.read(reinterpret_cast<char*>(&count), sizeof(count)) || count > top_k) return false;
+        row.resize(count);
+        if (!in.read(reinterpret_cast<char*>(row.data()), count * sizeof(uint32_t))) return false;
+    }
+    return true;
+}
+
+static void save_ground_truth(const std::string& path, size_t top_k, const GroundTruth& truth) {
+    std::ofstream out(path + ".tmp", std::ios::binary);
+    const uint64_t header[2] = {truth.size(), top_k};
+    out.write(ground_truth_magic, sizeof(ground_truth_magic));
+    out.write(reinterpret_cast<const char*>(header), sizeof(header));
+    for (const auto& row : truth) {
+        const uint32_t count = row.size();
+        out.write(reinterpret_cast<const char*>(&count), sizeof(count));
+        out.write(reinterpret_cast<const char*>(row.data()), count * sizeof(uint32_t));
+    }
+    out.close();
+    if (!out || std::rename((path + ".tmp").c_str(), path.c_str()) != 0) {
+        std::cerr << "muvera_eval: could not write ground truth cache " << path << std::endl;
+    }
+}
+
+static GroundTruth compute_ground_truth(const EvalDataset& data, const EvalOptions& options, JsonRecord& report) {
+    const uint64_t key = fingerprint(data.queries, fingerprint(data.corpus, 14695981039346656037ULL));
+    std::ostringstream path;
+    path << options.cache_dir << "/gt_" << std::hex << key << std::dec << "_k" << options.top_k << ".bin";
+    report.set("ground_truth_cache", path.str());
+
+    GroundTruth truth;
+    if (load_ground_truth(path.str(), data.queries.num_docs(), options.top_k, truth)) {
+        report.set("ground_truth_cached", "yes");
+        return truth;
+    }
+
+    const auto start = std::chrono::steady_clock::now();
+    ExactChamferRetriever exact(data.corpus.dimensions, data.corpus.num_docs());
+    exact.index_dataset(data.corpus.view(), data.corpus.doc_ids);
+    std::unordered_map<std::string, uint32_t> doc_index;
+    for (uint32_t d = 0; d < data.corpus.num_docs(); d++) doc_index[data.corpus.doc_ids[d]] = d;
+
+    truth.assign(data.queries.num_docs(), {});
+    parallel_for(0, data.queries.num_docs(), options.num_threads, [&](size_t q) {
+        for (const std::string& id : exact.get_top_k(data.queries.document(q), options.top_k)) {
+            truth[q].push_back(doc_index.at(id));
+        }
+    });
+    report.set("ground_truth_cached", "no").set("ground_truth_seconds", seconds_since(start));
+    save_ground_truth(path.str(), options.top_k, truth);
+    return truth;
+}
+
+static double dcg_discount(size_t rank) { return 1.0 / std::log2(static_cast<double>(rank) + 2.0); }
+
+// nDCG@k of a ranked list given graded relevance of each retrieved item and
+// the full set of relevance grades available for the query.
+static double ndcg(const std::vector<double>& retrieved_gains, std::vector<double> all_gains, size_t top_k) {
+    double dcg = 0.0, ideal = 0.0;
+    for (size_t i = 0; i < retrieved_gains.size() && i < top_k; i++) dcg += retrieved_gains[i] * dcg_discount(i);
+    std::sort(all_gains.rbegin(), all_gains.rend());
+    for (size_t i = 0; i < all_gains.size() && i < top_k; i++) ideal += all_gains[i] * dcg_discount(i);
+    return ideal > 0.0 ? dcg / ideal : 0.0;
+}
+
+struct QualityMetrics {
+    double recall = 0.0;       // against exact Chamfer top-k
+    double ndcg = 0.0;         // against exact Chamfer top-k, binary gains
+    double qrels_recall = 0.0; // against qrels, when present
+    double qrels_ndcg = 0.0;
+};
+
+static QualityMetrics score(const EvalDataset& data, const GroundTruth& truth,
+    const std::vector<std::vector<std::string>>& results, size_t top_k)
+{
+    QualityMetrics metrics;
+    size_t num_qrels_queries = 0;
+    for (size_t q = 0; q < results.size(); q++) {
+        std::unordered_set<std::string> exact_ids;
+        for (uint32_t d : truth[q]) exact_ids.insert(data.corpus.doc_ids[d]);
+        std::vector<double> gains;
+        size_t hits = 0;
+        for (const std::string& id : results[q]) {
+            const bool hit = exact_ids.count(id) > 0;
+            hits += hit;
+            gains.push_back(hit ? 1.0 : 0.0);
+        }
+        if (!exact_ids.empty()) metrics.recall += static_cast<double>(hits) / exact_ids.size();
+        metrics.ndcg += ndcg(gains, std::vector<double>(exact_ids.size(), 1.0), top_k);
+
+        if (q < data.qrels.size() && !data.qrels[q].empty()) {
+            num_qrels_queries++;
+            std::vector<double> qrels_gains, all_gains;
+            size_t relevant = 0, relevant_hits = 0;
+            for (const auto& [doc_id, grade] : data.qrels[q]) {
+                all_gains.push_back(grade);
+                relevant += grade > 0.0;
+            }
+            for (const std::string& id : results[q]) {
+                auto it = data.qrels[q].find(id);
+                const double grade = it == data.qrels[q].end() ? 0.0 : it->second;
+                qrels_gains.push_back(grade);
+                relevant_hits += grade > 0.0;
+            }
+            if (relevant) metrics.qrels_recall += static_cast<double>(relevant_hits) / std::min(relevant, top_k);
+            metrics.qrels_ndcg += ndcg(qrels_gains, all_gains, top_k);
+        }
+    }
+    if (!results.empty()) {
+        metrics.recall /= results.size();
+        metrics.ndcg /= results.size();
+    }
+    if (num_qrels_queries) {
+        metrics.qrels_recall /= num_qrels_queries;
+        metrics.qrels_ndcg /= num_qrels_queries;
+    }
+    return metrics;
+}
+
+// Fields describing one pruning configuration, shared by its records.
+struct PruningReport {
+    TokenPruningOptions options;
+    double merge_threshold = 0.0;     // as given, before narrowing to float
+    double token_ratio = 1.0;         // stored tokens / original tokens
+    double pruning_seconds = 0.0;
+    QualityMetrics exact_metrics;      // exact Chamfer over the pruned corpus
+};
+
+static PruningReport evaluate_pruning(const EvalDataset& data, const GroundTruth& truth, const EvalOptions& options,
+    const TokenPruningOptions& pruning, const double merge_threshold)
+{
+    PruningReport report;
+    report.options = pruning;
+    report.merge_threshold = merge_threshold;
+    if (!pruning.is_enabled()) return report;
+    std::vector<float> tokens;
+    std::vector<int64_t> offsets;
+    const auto start = std::chrono::steady_clock::now();
+    const RaggedTokenView pruned = prune_dataset(data.corpus.view(), pruning, tokens, offsets, options.num_threads);
+    report.pruning_seconds = seconds_since(start);
+    report.token_ratio = static_cast<double>(pruned.num_tokens) / data.corpus.view().num_tokens;
+
+    ExactChamferRetriever exact(data.corpus.dimensions, data.corpus.num_docs());
+    exact.index_dataset(pruned, data.corpus.doc_ids);
+    std::vector<std::vector<std::string>> retrieved(data.queries.num_docs());
+    parallel_for(0, data.queries.num_docs(), options.num_threads, [&](size_t q) {
+        retrieved[q] = exact.get_top_k(data.queries.document(q), options.top_k);
+    });
+    report.exact_metrics = score(data, truth, retrieved, options.top_k);
+    return report;
+}
+
+// Sweeps the FDE and DiskANN parameters for one pruning configuration.
+static void evaluate_muvera(const EvalDataset& data, const GroundTruth& truth, const EvalOptions& options,
+    const PruningReport& pruning_report, std::vector<JsonRecord>& results)
+{
+    const TokenPruningOptions& pruning = pruning_report.options;
+    const size_t num_queries = data.queries.num_docs();
+    for (size_t d_proj : options.d_proj)
+    for (size_t d_final : options.d_final)
+    for (size_t k_sim : options.k_sim)
+    for (size_t r_reps : options.r_reps) {
+        std::cerr << "d_proj=" << d_proj << " d_final=" << d_final << " k_sim=" << k_sim << " r_reps=" << r_reps << std::endl;
+        MuveraRetriever muvera(data.corpus.dimensions, data.corpus.num_docs(), d_proj, d_final, k_sim, r_reps, 42);
+        muvera.set_token_pruning(pruning);
+        const auto build_start = std::chrono::steady_clock::now();
+        muvera.index_dataset(data.corpus.view(), data.corpus.doc_ids);
+        const double build_seconds = seconds_since(build_start);
+
+        for (size_t width : options.search_width) {
+            muvera.set_search_width(width);
+            std::vector<std::vector<std::string>> retrieved(num_queries);
+            std::vector<double> latencies(num_queries);
+            const auto start = std::chrono::steady_clock::now();
+            parallel_for(0, num_queries, options.num_threads, [&](size_t q) {
+                const auto query_start = std::chrono::steady_clock::now();
+                retrieved[q] = muvera.get_top_k(data.queries.document(q), options.top_k);
+                latencies[q] = seconds_since(query_start);
+            });
+            const double elapsed = seconds_since(start);
+            const QualityMetrics metrics = score(data, truth, retrieved, options.top_k);
+
+            JsonRecord record;
+            record.set("dataset", data.name).set("d_proj", d_proj).set("d_final", d_final).set("k_sim", k_sim)
+                .set("r_reps", r_reps).set("search_width", std::max(width, options.top_k)).set("top_k", options.top_k)
+                .set("recall", metrics.recall).set("ndcg", metrics.ndcg)
+                .set("build_seconds", build_seconds).set("qps", num_queries / elapsed)
+                .set("p50_ms", percentile(latencies, 50) * 1e3).set("p99_ms", percentile(latencies, 99) * 1e3);
+            if (!data.qrels.empty()) record.set("qrels_recall", metrics.qrels_recall).set("qrels_ndcg", metrics.qrels_ndcg);
+            record.set("merge_threshold", pruning_report.merge_threshold).set("max_tokens", pruning.max_tokens)
+                .set("cap_policy", pruning.cap_policy == TokenCapPolicy::NORM ? "norm" : "cluster")
+                .set("token_ratio", pruning_report.token_ratio);
+            if (pruning.is_enabled()) {
+                record.set("pruning_seconds", pruning_report.pruning_seconds)
+                    .set("pruned_exact_recall", pruning_report.exact_metrics.recall)
+                    .set("pruned_exact_ndcg", pruning_report.exact_metrics.ndcg);
+            }
+            results.push_back(record);
+        }
+    }
+}
+
+static void evaluate(const EvalDataset& data, const GroundTruth& truth, const EvalOptions& options,
+    std::vector<JsonRecord>& results)
+{
+    for (double merge_threshold : options.merge_threshold)
+    for (size_t max_tokens : options.max_tokens) {
+        TokenPruningOptions pruning;
+        pruning.merge_threshold = static_cast<float>(merge_threshold);
+        pruning.max_tokens = max_tokens;
+        pruning.cap_policy = options.cap_policy;
+        pruning.validate();
+        const PruningReport pruning_report = evaluate_pruning(data, truth, options, pruning, merge_threshold);
+        if (pruning.is_enabled()) {
+            std::cerr << "merge_threshold=" << merge_threshold << " max_tokens=" << max_tokens << ": "
+                      << pruning_report.token_ratio * 100 << "% of tokens kept, exact recall "
+                      << pruning_report.exact_metrics.recall << std::endl;
+        }
+        evaluate_muvera(data, truth, options, pruning_report, results);
+    }
+}
+
+static EvalOptions parse_options(int argc, char** argv) {
+    EvalOptions options;
+    for (int i = 1; i < argc; i++) {
+        const std::string arg = argv[i];
+        auto value = [&]() -> std::string {
+            if (i + 1 >= argc) throw std::invalid_argument(arg + " requires a value");
+            return argv[++i];
+        };
+        if (arg == "--data") options.data_dir = value();
+        else if (arg == "--synthetic-docs") options.synthetic_docs = std::stoull(value());
+        else if (arg == "--synthetic-queries") options.synthetic_queries = std::stoull(value());
+        else if (arg == "--synthetic-dimensions") options.synthetic_dimensions = std::stoull(value());
+        else if (arg == "--synthetic-tokens") options.synthetic_tokens = std::stoull(value());
+        else if (arg == "--k") options.top_k = std::stoull(value());
+        else if (arg == "--d-proj") options.d_proj = parse_size_list(value());
+        else if (arg == "--d-final") options.d_final = parse_size_list(value());
+        else if (arg == "--k-sim") options.k_sim = parse_size_list(value());
+        else if (arg == "--r-reps") options.r_reps = parse_size_list(value());
+        else if (arg == "--search-width") options.search_width = parse_size_list(value());
+        else if (arg == "--threads") options.num_threads = std::stoull(value());
+        else if (arg == "--cache-dir") options.cache_dir = value();
+        else if (arg == "--output") options.output = value();
+        else if (arg == "--export") options.export_dir = value();
+        else if (arg == "--merge-threshold") options.merge_threshold = parse_double_list(value());
+        else if (arg == "--max-tokens") options.max_tokens = parse_size_list(value());
+        else if (arg == "--cap-policy") {
+            const std::string policy = value();
+            if (policy == "norm") options.cap_policy = TokenCapPolicy::NORM;
+            else if (policy == "cluster") options.cap_policy = TokenCapPolicy::CLUSTER;
+            else throw std::invalid_argument("--cap-policy must be norm or cluster");
+        }
+        else throw std::invalid_argument("unknown option " + arg);
+    }
+    return options;
+}
+
+int main(int argc, char** argv) {
+    try {
+        const EvalOptions options = parse_options(argc, argv);
+        const EvalDataset data = options.data_dir.empty() ? make_clustered_dataset(options) : load_beir_dataset(options.data_dir);
+        std::cerr << data.name << ": " << data.corpus.num_docs() << " documents, " << data.queries.num_docs()
+                  << " queries, " << data.corpus.dimensions << " dimensions" << std::endl;
+        if (!options.export_dir.empty()) {
+            write_multivector_file(options.export_dir + "/corpus.mvf", data.corpus.view(), data.corpus.doc_ids);
+            write_multivector_file(options.export_dir + "/queries.mvf", data.queries.view(), data.queries.doc_ids);
+        }
+
+        JsonRecord ground_truth_report;
+        ground_truth_report.set("dataset", data.name).set("num_docs", data.corpus.num_docs())
+            .set("num_queries", data.queries.num_docs()).set("top_k", options.top_k);
+        const GroundTruth truth = compute_ground_truth(data, options, ground_truth_report);
+
+        std::vector<JsonRecord> results = {ground_truth_report};
+        evaluate(data, truth, options, results);
+        write_json_report(options.output, "muvera_eval", results);
+    } catch (const std::exception& e) {
+        std::cerr << "muvera_eval: " << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
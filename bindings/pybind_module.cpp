@@ -1,36 +1,478 @@
 #include <pybind11/pybind11.h>
+#include <pybind11/numpy.h>
 #include <pybind11/stl.h>
 #include "fde.h"
+#include "memory_policy.h"
+#include "multivector_file.h"
 #include "retriever.h"
+#include "scheduler.h"
+#include "sharded_retriever.h"
 
 namespace py = pybind11;
 
+// float32 / int64 C-contiguous arrays are passed through without a copy;
+// anything else (lists, float64, strided views) is converted once by NumPy.
+using FloatArray = py::array_t<float, py::array::c_style | py::array::forcecast>;
+using OffsetArray = py::array_t<int64_t, py::array::c_style | py::array::forcecast>;
+
+// Zero-copy view over a [num_tokens, dimensions] token matrix.
+static TokenMatrixView as_token_matrix(const FloatArray& tokens) {
+    if (tokens.ndim() != 2) {
+        throw std::invalid_argument("expected a 2-D [num_tokens, dimensions] float32 array");
+    }
+    return TokenMatrixView{tokens.data(), static_cast<size_t>(tokens.shape(0)), static_cast<size_t>(tokens.shape(1))};
+}
+
+// Zero-copy view over ragged documents: document i is tokens[offsets[i]:offsets[i + 1]].
+static RaggedTokenView as_ragged(const FloatArray& tokens, const OffsetArray& offsets) {
+    if (offsets.ndim() != 1 || offsets.shape(0) < 1) {
+        throw std::invalid_argument("expected a 1-D int64 offsets array of length num_docs + 1");
+    }
+    const TokenMatrixView matrix = as_token_matrix(tokens);
+    RaggedTokenView view{matrix.data, offsets.data(), static_cast<size_t>(offsets.shape(0) - 1), matrix.num_tokens, matrix.dimensions};
+    view.validate();
+    return view;
+}
+
+// {"enabled": bool, "stages": {name: {...}}, "counters": {name: int}}.
+static py::dict stats_to_dict(const StatsSnapshot& snapshot) {
+    py::dict stages;
+    for (const auto& [name, stage] : snapshot.stages) {
+        py::dict entry;
+        entry["count"] = stage.count;
+        entry["total_ms"] = stage.total_ns / 1e6;
+        entry["mean_us"] = stage.mean_us;
+        entry["p50_us"] = stage.p50_us;
+        entry["p99_us"] = stage.p99_us;
+        entry["max_us"] = stage.max_us;
+        entry["histogram"] = stage.histogram;
+        stages[py::str(name)] = entry;
+    }
+    py::dict result;
+    result["enabled"] = snapshot.enabled;
+    result["stages"] = stages;
+    result["counters"] = snapshot.counters;
+    return result;
+}
+
+// {"total": int, "components": {name: int}}, in bytes.
+static py::dict memory_usage_to_dict(const MemoryUsage& usage) {
+    py::dict result;
+    result["total"] = usage.total();
+    result["components"] = usage.components;
+    return result;
+}
+
+// Methods shared by every retriever. The GIL is released while C++ reads the
+// NumPy buffers, which stay alive as arguments for the duration of the call.
+template <typename Retriever, typename PyClass>
+static void bind_retriever_methods(PyClass& cls) {
+    cls
+        .def("index_dataset",
+            static_cast<void (Retriever::*)(const std::vector<std::vector<std::vector<float>>>&, const std::vector<std::string>)>(&Retriever::index_dataset),
+            py::arg("dataset"), py::arg("doc_ids"))
+        .def("index_dataset", [](Retriever& self, const FloatArray& tokens, const OffsetArray& offsets, const std::vector<std::string>& doc_ids) {
+            const RaggedTokenView view = as_ragged(tokens, offsets);
+            py::gil_scoped_release release;
+            self.index_dataset(view, doc_ids);
+        }, py::arg("tokens"), py::arg("offsets"), py::arg("doc_ids"))
+        .def("index_dataset", [](Retriever& self, const MultiVectorFile& file) {
+            py::gil_scoped_release release;
+            self.index_dataset(file);
+        }, py::arg("file"))
+        .def("load_index", &Retriever::load_index)
+        .def("save_index", &Retriever::save_index)
+        .def("add_document", [](Retriever& self, const FloatArray& P, const std::string& doc_id) {
+            const TokenMatrixView view = as_token_matrix(P);
+            py::gil_scoped_release release;
+            self.add_document(view, doc_id);
+        }, py::arg("P"), py::arg("doc_id"))
+        .def("delete_document", &Retriever::delete_document, py::call_guard<py::gil_scoped_release>())
+        .def("update_document", [](Retriever& self, const FloatArray& P, const std::string& doc_id) {
+            const TokenMatrixView view = as_token_matrix(P);
+            py::gil_scoped_release release;
+            self.update_document(view, doc_id);
+        }, py::arg("P"), py::arg("doc_id"))
+        .def("num_documents", &Retriever::num_documents)
+        .def("get_stats", [](const Retriever& self) { return stats_to_dict(self.get_stats()); })
+        .def("reset_stats", &Retriever::reset_stats)
+        .def("memory_usage", [](const Retriever& self) { return memory_usage_to_dict(self.memory_usage()); })
+        .def("get_top_k", [](const Retriever& self, const FloatArray& Q, const size_t top_k) {
+            const TokenMatrixView view = as_token_matrix(Q);
+            py::gil_scoped_release release;
+            return self.get_top_k(view, top_k);
+        }, py::arg("Q"), py::arg("top_k"))
+        .def("enable_query_cache", [](Retriever& self, size_t capacity, size_t num_shards, const std::string& eviction,
+                bool cache_encodings, bool cache_results) {
+            QueryCacheOptions options;
+            options.capacity = capacity;
+            options.num_shards = num_shards;
+            if (eviction == "lru") options.eviction = CacheEviction::LRU;
+            else if (eviction == "tinylfu") options.eviction = CacheEviction::TINY_LFU;
+            else throw std::invalid_argument("eviction must be 'lru' or 'tinylfu'");
+            options.cache_encodings = cache_encodings;
+            options.cache_results = cache_results;
+            self.enable_query_cache(options);
+        }, py::arg("capacity") = 4096, py::arg("num_shards") = 16, py::arg("eviction") = "tinylfu",
+            py::arg("cache_encodings") = true, py::arg("cache_results") = true)
+        .def("set_token_pruning", [](Retriever& self, float merge_threshold, size_t max_tokens, const std::string& cap_policy) {
+            TokenPruningOptions options;
+            options.merge_threshold = merge_threshold;
+            options.max_tokens = max_tokens;
+            if (cap_policy == "norm") options.cap_policy = TokenCapPolicy::NORM;
+            else if (cap_policy == "cluster") options.cap_policy = TokenCapPolicy::CLUSTER;
+            else throw std::invalid_argument("cap_policy must be 'norm' or 'cluster'");
+            self.set_token_pruning(options);
+        }, py::arg("merge_threshold") = 0.0f, py::arg("max_tokens") = 0, py::arg("cap_policy") = "norm")
+        .def("get_token_pruning", [](const Retriever& self) {
+            const TokenPruningOptions options = self.get_token_pruning();
+            py::dict result;
+            result["merge_threshold"] = options.merge_threshold;
+            result["max_tokens"] = options.max_tokens;
+            result["cap_policy"] = options.cap_policy == TokenCapPolicy::NORM ? "norm" : "cluster";
+            return result;
+        })
+        .def("disable_query_cache", &Retriever::disable_query_cache)
+        .def("query_cache_size", &Retriever::query_cache_size);
+}
+
+// set_memory_policy(huge_pages, numa, numa_node, pin_threads), for the
+// retrievers that place their large buffers by a MemoryPolicy.
+template <typename Retriever, typename PyClass>
+static void bind_memory_policy(PyClass& cls) {
+    cls.def("set_memory_policy", [](Retriever& self, const std::string& huge_pages, const std::string& numa,
+            int numa_node, bool pin_threads) {
+        MemoryPolicy policy;
+        if (huge_pages == "none") policy.huge_pages = HugePagePolicy::NONE;
+        else if (huge_pages == "transparent") policy.huge_pages = HugePagePolicy::TRANSPARENT;
+        else if (huge_pages == "explicit") policy.huge_pages = HugePagePolicy::EXPLICIT;
+        else throw std::invalid_argument("huge_pages must be 'none', 'transparent' or 'explicit'");
+        if (numa == "first_touch") policy.numa = NumaPolicy::FIRST_TOUCH;
+        else if (numa == "interleave") policy.numa = NumaPolicy::INTERLEAVE;
+        else if (numa == "bind") policy.numa = NumaPolicy::BIND;
+        else throw std::invalid_argument("numa must be 'first_touch', 'interleave' or 'bind'");
+        policy.numa_node = numa_node;
+        policy.pin_threads = pin_threads;
+        self.set_memory_policy(policy);
+    }, py::arg("huge_pages") = "none", py::arg("numa") = "first_touch", py::arg("numa_node") = 0,
+        py::arg("pin_threads") = false);
+}
+
+// Encodes a ragged batch into a freshly allocated [num_docs, d_final] array.
+template <typename T>
+static py::array_t<T> encode_batch(const FDESimilarity& self, const FloatArray& tokens, const OffsetArray& offsets,
+    const bool queries, const size_t num_threads)
+{
+    const RaggedTokenView view = as_ragged(tokens, offsets);
+    py::array_t<T> out({view.num_docs, self.get_d_final()});
+    T* out_data = out.mutable_data();
+    {
+        py::gil_scoped_release release;
+        if (queries) self.encode_queries(view, out_data, num_threads);
+        else self.encode_documents(view, out_data, num_threads);
+    }
+    return out;
+}
+
+static py::array encode_batch(const FDESimilarity& self, const FloatArray& tokens, const OffsetArray& offsets,
+    const bool queries, const std::string& dtype, const size_t num_threads)
+{
+    if (dtype == "float32") return encode_batch<float>(self, tokens, offsets, queries, num_threads);
+    if (dtype == "int8") return encode_batch<int8_t>(self, tokens, offsets, queries, num_threads);
+    throw std::invalid_argument("dtype must be 'float32' or 'int8'");
+}
+
+// Arrays aliasing the read-only file mapping keep the file alive and must
+// not be writable.
+template <typename T>
+static py::array_t<T> mapped_array(std::vector<size_t> shape, const T* data, const std::shared_ptr<MultiVectorFile>& file) {
+    py::array_t<T> array(shape, data, py::cast(file));
+    array.attr("setflags")(py::arg("write") = false);
+    return array;
+}
+
+// Document i of an .mvf file as a [num_tokens, dimensions] float32 array,
+// zero-copy for fp32 files.
+static py::array_t<float> file_document(const std::shared_ptr<MultiVectorFile>& file, const size_t i) {
+    if (i >= file->num_docs()) throw py::index_error("document index out of range");
+    if (file->dtype() == MultiVectorDType::FP32) {
+        const TokenMatrixView doc = file->document(i);
+        return mapped_array<float>({doc.num_tokens, doc.dimensions}, doc.data, file);
+    }
+    std::vector<float> scratch;
+    const TokenMatrixView doc = file->document(i, scratch);
+    return py::array_t<float>({doc.num_tokens, doc.dimensions}, doc.data);
+}
+
+static MultiVectorDType parse_dtype(const std::string& dtype) {
+    if (dtype == "float32") return MultiVectorDType::FP32;
+    if (dtype == "float16") return MultiVectorDType::FP16;
+    throw std::invalid_argument("dtype must be 'float32' or 'float16'");
+}
+
+// The scheduler's workers take the GIL to resolve Python futures, so it must
+// be joined with the GIL released.
+struct ReleaseGilDeleter {
+    void operator()(QueryScheduler* scheduler) const {
+        py::gil_scoped_release release;
+        delete scheduler;
+    }
+};
+
+template <typename Retriever>
+static void bind_scheduler_init(py::class_<QueryScheduler, std::unique_ptr<QueryScheduler, ReleaseGilDeleter>>& cls) {
+    cls.def(py::init([](const Retriever& retriever, const size_t max_pending, const size_t max_batch,
+            const int64_t batch_window_us, const size_t encode_threads, const size_t search_threads) {
+            QuerySchedulerOptions options;
+            options.max_pending = max_pending;
+            options.max_batch = max_batch;
+            options.batch_window = std::chrono::microseconds(batch_window_us);
+            options.encode_threads = encode_threads;
+            options.search_threads = search_threads;
+            return new QueryScheduler(retriever, options);
+        }), py::keep_alive<1, 2>(), py::arg("retriever"), py::arg("max_pending") = 1024, py::arg("max_batch") = 32,
+        py::arg("batch_window_us") = 100, py::arg("encode_threads") = 1, py::arg("search_threads") = 0);
+}
+
+// Returns a concurrent.futures.Future resolved from a search worker; wrap it
+// with asyncio.wrap_future to await it.
+static py::object submit_query_future(QueryScheduler& self, const FloatArray& Q, const size_t top_k) {
+    const TokenMatrixView view = as_token_matrix(Q);
+    // Copies of the callback are made and dropped on worker threads without
+    // the GIL, so the Python future is only ever touched through this
+    // shared_ptr, whose deleter takes the GIL.
+    std::shared_ptr<py::object> future(
+        new py::object(py::module_::import("concurrent.futures").attr("Future")()),
+        [](py::object* f) { py::gil_scoped_acquire acquire; delete f; });
+    py::object result = *future;
+    self.submit_query(view, top_k, [future](std::vector<std::string> results, std::exception_ptr error) {
+        py::gil_scoped_acquire acquire;
+        try {
+            if (!future->attr("set_running_or_notify_cancel")().cast<bool>()) return;
+            if (error) {
+                try {
+                    std::rethrow_exception(error);
+                } catch (const std::exception& e) {
+                    future->attr("set_exception")(py::module_::import("builtins").attr("RuntimeError")(e.what()));
+                } catch (...) {
+                    future->attr("set_exception")(py::module_::import("builtins").attr("RuntimeError")("unknown error"));
+                }
+            } else {
+                future->attr("set_result")(py::cast(results));
+            }
+        } catch (py::error_already_set&) {
+        }
+    });
+    return result;
+}
+
+static ShardingOptions sharding_options(const std::string& partition, const std::vector<std::string>& range_boundaries,
+    const int64_t shard_timeout_ms, const size_t fanout_threads)
+{
+    ShardingOptions options;
+    if (partition == "hash") options.partition = ShardPartition::HASH;
+    else if (partition == "range") options.partition = ShardPartition::RANGE;
+    else throw std::invalid_argument("partition must be 'hash' or 'range'");
+    options.range_boundaries = range_boundaries;
+    options.shard_timeout = std::chrono::milliseconds(shard_timeout_ms);
+    options.fanout_threads = fanout_threads;
+    return options;
+}
+
+template <typename Retriever>
+static void bind_shard_server_init(py::class_<ShardServer>& cls) {
+    cls.def(py::init<Retriever&, const std::string&>(), py::keep_alive<1, 2>(), py::arg("retriever"), py::arg("endpoint"));
+}
+
 PYBIND11_MODULE(muvera_pybind, m) {
     m.doc() = "Python bindings for Muvera and ExactChamfer retrievers";
 
-    py::class_<ExactChamferRetriever>(m, "ExactChamferRetriever")
-        .def(py::init<size_t, size_t>()) // _dimensions, _max_points
-        .def("index_dataset", &ExactChamferRetriever::index_dataset)
-        .def("load_index", &ExactChamferRetriever::load_index)
-        .def("save_index", &ExactChamferRetriever::save_index)
-        .def("add_document", &ExactChamferRetriever::add_document)
-        .def("get_top_k", &ExactChamferRetriever::get_top_k);
-    
-    py::class_<RelaxedChamferRetriever>(m, "RelaxedChamferRetriever")
-        .def(py::init<size_t, size_t, size_t>()) // _dimensions, _max_points, _softmax_s
-        .def("index_dataset", &RelaxedChamferRetriever::index_dataset)
-        .def("load_index", &RelaxedChamferRetriever::load_index)
-        .def("save_index", &RelaxedChamferRetriever::save_index)
-        .def("add_document", &RelaxedChamferRetriever::add_document)
-        .def("get_top_k", &RelaxedChamferRetriever::get_top_k)
-        .def("get_softmax_s", &RelaxedChamferRetriever::get_softmax_s);
-
-    py::class_<MuveraRetriever>(m, "MuveraRetriever")
-        .def(py::init<size_t, size_t, size_t, size_t, size_t, size_t, uint64_t>())
+    // Binary ragged multi-vector files; see include/multivector_file.h.
+    m.def("write_multivector_file", [](const std::string& path, const FloatArray& tokens, const OffsetArray& offsets,
+            const std::vector<std::string>& doc_ids, const std::string& dtype) {
+        const RaggedTokenView view = as_ragged(tokens, offsets);
+        const MultiVectorDType file_dtype = parse_dtype(dtype);
+        py::gil_scoped_release release;
+        write_multivector_file(path, view, doc_ids, file_dtype);
+    }, py::arg("path"), py::arg("tokens"), py::arg("offsets"), py::arg("doc_ids"), py::arg("dtype") = "float32");
+
+    py::class_<MultiVectorFile, std::shared_ptr<MultiVectorFile>>(m, "MultiVectorFile")
+        .def(py::init<const std::string&>(), py::arg("path"))
+        .def("num_docs", &MultiVectorFile::num_docs)
+        .def("__len__", &MultiVectorFile::num_docs)
+        .def("num_tokens", &MultiVectorFile::num_tokens)
+        .def("dimensions", &MultiVectorFile::dimensions)
+        .def("dtype", [](const MultiVectorFile& self) {
+            return self.dtype() == MultiVectorDType::FP16 ? "float16" : "float32";
+        })
+        .def("doc_id", &MultiVectorFile::doc_id)
+        .def("doc_ids", &MultiVectorFile::doc_ids)
+        .def("document", &file_document, py::arg("i"))
+        .def("__getitem__", &file_document)
+        .def("offsets", [](const std::shared_ptr<MultiVectorFile>& self) {
+            return mapped_array<int64_t>({self->num_docs() + 1}, self->offsets(), self);
+        });
+
+    // Standalone FDE encoder, for pushing encodings into external vector stores.
+    py::class_<FDESimilarity>(m, "FDEEncoder")
+        .def(py::init<size_t, size_t, size_t, size_t, size_t, uint64_t>(),
+            py::arg("dimensions"), py::arg("d_proj"), py::arg("d_final"), py::arg("k_sim"), py::arg("r_reps"), py::arg("seed"))
+        .def("get_d_fde", &FDESimilarity::get_d_fde)
+        .def("get_d_final", &FDESimilarity::get_d_final)
+        .def("get_stats", [](const FDESimilarity& self) { return stats_to_dict(self.get_stats()); })
+        .def("reset_stats", &FDESimilarity::reset_stats)
+        .def("memory_usage", [](const FDESimilarity& self) { return memory_usage_to_dict(self.memory_usage()); })
+        .def_static("estimate_memory_usage", [](size_t dimensions, size_t k_sim, size_t r_reps) {
+            return memory_usage_to_dict(FDESimilarity::estimate_memory_usage(dimensions, k_sim, r_reps));
+        }, py::arg("dimensions"), py::arg("k_sim"), py::arg("r_reps"))
+        .def("encode_document", [](const FDESimilarity& self, const FloatArray& P) {
+            const TokenMatrixView view = as_token_matrix(P);
+            std::vector<float> encoding;
+            {
+                py::gil_scoped_release release;
+                encoding = self.encode_document(view);
+            }
+            return py::array_t<float>(encoding.size(), encoding.data());
+        }, py::arg("P"))
+        .def("encode_query", [](const FDESimilarity& self, const FloatArray& Q) {
+            const TokenMatrixView view = as_token_matrix(Q);
+            std::vector<float> encoding;
+            {
+                py::gil_scoped_release release;
+                encoding = self.encode_query(view);
+            }
+            return py::array_t<float>(encoding.size(), encoding.data());
+        }, py::arg("Q"))
+        .def("encode_documents", [](const FDESimilarity& self, const FloatArray& tokens, const OffsetArray& offsets,
+                const std::string& dtype, const size_t num_threads) {
+            return encode_batch(self, tokens, offsets, false, dtype, num_threads);
+        }, py::arg("tokens"), py::arg("offsets"), py::arg("dtype") = "float32", py::arg("num_threads") = 0)
+        .def("encode_queries", [](const FDESimilarity& self, const FloatArray& tokens, const OffsetArray& offsets,
+                const std::string& dtype, const size_t num_threads) {
+            return encode_batch(self, tokens, offsets, true, dtype, num_threads);
+        }, py::arg("tokens"), py::arg("offsets"), py::arg("dtype") = "float32", py::arg("num_threads") = 0);
+
+    py::class_<ExactChamferRetriever> exact(m, "ExactChamferRetriever");
+    exact.def(py::init<size_t, size_t>()) // _dimensions, _max_points
+        .def_static("estimate_memory_usage", [](size_t dimensions, size_t num_docs, size_t avg_tokens_per_doc, size_t avg_doc_id_length) {
+            return memory_usage_to_dict(ExactChamferRetriever::estimate_memory_usage(dimensions, num_docs, avg_tokens_per_doc, avg_doc_id_length));
+        }, py::arg("dimensions"), py::arg("num_docs"), py::arg("avg_tokens_per_doc"), py::arg("avg_doc_id_length") = 16);
+    bind_retriever_methods<ExactChamferRetriever>(exact);
+    bind_memory_policy<ExactChamferRetriever>(exact);
+
+    py::class_<RelaxedChamferRetriever> relaxed(m, "RelaxedChamferRetriever");
+    relaxed.def(py::init<size_t, size_t, size_t>()) // _dimensions, _max_points, _softmax_s
+        .def("get_softmax_s", &RelaxedChamferRetriever::get_softmax_s)
+        .def_static("estimate_memory_usage", [](size_t dimensions, size_t num_docs, size_t avg_tokens_per_doc, size_t avg_doc_id_length) {
+            return memory_usage_to_dict(RelaxedChamferRetriever::estimate_memory_usage(dimensions, num_docs, avg_tokens_per_doc, avg_doc_id_length));
+        }, py::arg("dimensions"), py::arg("num_docs"), py::arg("avg_tokens_per_doc"), py::arg("avg_doc_id_length") = 16);
+    bind_retriever_methods<RelaxedChamferRetriever>(relaxed);
+    bind_memory_policy<RelaxedChamferRetriever>(relaxed);
+
+    py::class_<MuveraRetriever> muvera(m, "MuveraRetriever");
+    muvera.def(py::init<size_t, size_t, size_t, size_t, size_t, size_t, uint64_t>())
         .def("get_embedding_dim", &MuveraRetriever::get_embedding_dim)
-        .def("index_dataset", &MuveraRetriever::index_dataset)
-        .def("load_index", &MuveraRetriever::load_index)
-        .def("save_index", &MuveraRetriever::save_index)
-        .def("add_document", &MuveraRetriever::add_document)
-        .def("get_top_k", &MuveraRetriever::get_top_k);
+        .def_static("estimate_memory_usage", [](size_t dimensions, size_t max_points, size_t d_proj, size_t d_final,
+                size_t k_sim, size_t r_reps, size_t num_docs, size_t avg_doc_id_length) {
+            return memory_usage_to_dict(MuveraRetriever::estimate_memory_usage(dimensions, max_points, d_proj, d_final,
+                k_sim, r_reps, num_docs, avg_doc_id_length));
+        }, py::arg("dimensions"), py::arg("max_points"), py::arg("d_proj"), py::arg("d_final"), py::arg("k_sim"),
+            py::arg("r_reps"), py::arg("num_docs"), py::arg("avg_doc_id_length") = 16)
+        .def("consolidate", &MuveraRetriever::consolidate, py::call_guard<py::gil_scoped_release>())
+        .def("set_compaction_policy", &MuveraRetriever::set_compaction_policy)
+        .def("compact", &MuveraRetriever::compact, py::call_guard<py::gil_scoped_release>())
+        .def("num_segments", &MuveraRetriever::num_segments)
+        .def("set_search_width", &MuveraRetriever::set_search_width)
+        .def("get_search_width", &MuveraRetriever::get_search_width)
+        .def("set_graph_parameters", &MuveraRetriever::set_graph_parameters, py::arg("R"), py::arg("L"), py::arg("alpha"))
+        .def("index_dataset_checkpointed", [](MuveraRetriever& self, const FloatArray& tokens, const OffsetArray& offsets,
+                const std::vector<std::string>& doc_ids, const std::string& fde_path, size_t chunk_docs,
+                const std::vector<std::vector<std::string>>& labels) {
+            const RaggedTokenView view = as_ragged(tokens, offsets);
+            py::gil_scoped_release release;
+            return self.index_dataset_checkpointed(view, doc_ids, fde_path, chunk_docs, labels);
+        }, py::arg("tokens"), py::arg("offsets"), py::arg("doc_ids"), py::arg("fde_path"), py::arg("chunk_docs") = 65536,
+            py::arg("labels") = std::vector<std::vector<std::string>>())
+        .def("index_dataset_checkpointed", [](MuveraRetriever& self, const MultiVectorFile& file, const std::string& fde_path,
+                size_t chunk_docs) {
+            py::gil_scoped_release release;
+            return self.index_dataset_checkpointed(file, fde_path, chunk_docs);
+        }, py::arg("file"), py::arg("fde_path"), py::arg("chunk_docs") = 65536)
+        .def("enable_labels", &MuveraRetriever::enable_labels)
+        .def("has_labels", &MuveraRetriever::has_labels)
+        .def("set_filter_brute_force_threshold", &MuveraRetriever::set_filter_brute_force_threshold, py::arg("num_documents"))
+        .def("get_filter_brute_force_threshold", &MuveraRetriever::get_filter_brute_force_threshold);
+    bind_retriever_methods<MuveraRetriever>(muvera);
+    bind_memory_policy<MuveraRetriever>(muvera);
+    // Labeled overloads, tried after the unlabeled ones above.
+    muvera
+        .def("index_dataset", [](MuveraRetriever& self, const FloatArray& tokens, const OffsetArray& offsets,
+                const std::vector<std::string>& doc_ids, const std::vector<std::vector<std::string>>& labels) {
+            const RaggedTokenView view = as_ragged(tokens, offsets);
+            py::gil_scoped_release release;
+            self.index_dataset(view, doc_ids, labels);
+        }, py::arg("tokens"), py::arg("offsets"), py::arg("doc_ids"), py::arg("labels"))
+        .def("add_document", [](MuveraRetriever& self, const FloatArray& P, const std::string& doc_id, const std::vector<std::string>& labels) {
+            const TokenMatrixView view = as_token_matrix(P);
+            py::gil_scoped_release release;
+            self.add_document(view, doc_id, labels);
+        }, py::arg("P"), py::arg("doc_id"), py::arg("labels"))
+        .def("update_document", [](MuveraRetriever& self, const FloatArray& P, const std::string& doc_id, const std::vector<std::string>& labels) {
+            const TokenMatrixView view = as_token_matrix(P);
+            py::gil_scoped_release release;
+            self.update_document(view, doc_id, labels);
+        }, py::arg("P"), py::arg("doc_id"), py::arg("labels"))
+        .def("get_top_k", [](const MuveraRetriever& self, const FloatArray& Q, const size_t top_k, const std::string& label) {
+            const TokenMatrixView view = as_token_matrix(Q);
+            py::gil_scoped_release release;
+            return self.get_top_k(view, top_k, label);
+        }, py::arg("Q"), py::arg("top_k"), py::arg("label"));
+
+    m.def("numa_nodes", &numa_nodes);
+
+    // Scatter-gather over shards; see include/sharded_retriever.h.
+    py::class_<ShardedRetriever> sharded(m, "ShardedRetriever");
+    sharded
+        .def(py::init([](size_t dimensions, size_t max_points_per_shard, size_t d_proj, size_t d_final, size_t k_sim,
+                size_t r_reps, uint64_t seed, size_t num_shards, const std::string& partition,
+                const std::vector<std::string>& range_boundaries, int64_t shard_timeout_ms, size_t fanout_threads) {
+            return new ShardedRetriever(dimensions, max_points_per_shard, d_proj, d_final, k_sim, r_reps, seed, num_shards,
+                sharding_options(partition, range_boundaries, shard_timeout_ms, fanout_threads));
+        }), py::arg("dimensions"), py::arg("max_points_per_shard"), py::arg("d_proj"), py::arg("d_final"), py::arg("k_sim"),
+            py::arg("r_reps"), py::arg("seed"), py::arg("num_shards"), py::arg("partition") = "hash",
+            py::arg("range_boundaries") = std::vector<std::string>(), py::arg("shard_timeout_ms") = 1000, py::arg("fanout_threads") = 0)
+        .def(py::init([](size_t dimensions, size_t d_proj, size_t d_final, size_t k_sim, size_t r_reps, uint64_t seed,
+                const std::vector<std::string>& endpoints, const std::string& partition,
+                const std::vector<std::string>& range_boundaries, int64_t shard_timeout_ms, size_t fanout_threads) {
+            return new ShardedRetriever(dimensions, d_proj, d_final, k_sim, r_reps, seed, endpoints,
+                sharding_options(partition, range_boundaries, shard_timeout_ms, fanout_threads));
+        }), py::arg("dimensions"), py::arg("d_proj"), py::arg("d_final"), py::arg("k_sim"), py::arg("r_reps"), py::arg("seed"),
+            py::arg("endpoints"), py::arg("partition") = "hash", py::arg("range_boundaries") = std::vector<std::string>(),
+            py::arg("shard_timeout_ms") = 1000, py::arg("fanout_threads") = 0)
+        .def("num_shards", &ShardedRetriever::num_shards)
+        .def("shard_for", &ShardedRetriever::shard_for, py::arg("doc_id"))
+        .def("shard_num_documents", &ShardedRetriever::shard_num_documents, py::arg("shard"),
+            py::call_guard<py::gil_scoped_release>());
+    bind_retriever_methods<ShardedRetriever>(sharded);
+
+    py::class_<ShardServer> shard_server(m, "ShardServer");
+    bind_shard_server_init<MuveraRetriever>(shard_server);
+    bind_shard_server_init<ExactChamferRetriever>(shard_server);
+    bind_shard_server_init<RelaxedChamferRetriever>(shard_server);
+    shard_server
+        .def("endpoint", &ShardServer::endpoint)
+        .def("serve", &ShardServer::serve, py::call_guard<py::gil_scoped_release>())
+        .def("stop", &ShardServer::stop);
+
+    // Asynchronous queries; see include/scheduler.h.
+    py::register_exception<QueryRejected>(m, "QueryRejected");
+    py::class_<QueryScheduler, std::unique_ptr<QueryScheduler, ReleaseGilDeleter>> scheduler(m, "QueryScheduler");
+    bind_scheduler_init<ExactChamferRetriever>(scheduler);
+    bind_scheduler_init<RelaxedChamferRetriever>(scheduler);
+    bind_scheduler_init<MuveraRetriever>(scheduler);
+    bind_scheduler_init<ShardedRetriever>(scheduler);
+    scheduler
+        .def("submit_query", &submit_query_future, py::arg("Q"), py::arg("top_k"))
+        .def("shutdown", &QueryScheduler::shutdown, py::call_guard<py::gil_scoped_release>())
+        .def("num_pending", &QueryScheduler::num_pending);
 }
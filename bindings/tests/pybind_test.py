@@ -1,7 +1,13 @@
 import time
 import random
 import numpy as np
-from muvera_pybind import ExactChamferRetriever, MuveraRetriever
+import os
+import tempfile
+
+import threading
+
+from muvera_pybind import (ExactChamferRetriever, FDEEncoder, MultiVectorFile, MuveraRetriever, QueryRejected,
+                           QueryScheduler, ShardedRetriever, ShardServer, numa_nodes, write_multivector_file)
 
 def test_exact_chamfer_retriever_large_100D_top50():
     dimensions = 100
@@ -57,21 +63,20 @@ def test_muvera_retriever_large_100D_top50():
     )
 
     # === Generate synthetic dataset ===
+    # Ragged layout: document d is tokens[offsets[d]:offsets[d + 1]], read zero-copy.
     rng = np.random.default_rng(12345)
-    dataset = [
-        [rng.uniform(-3.0, 3.0, dimensions).astype(np.float32).tolist() for _ in range(vectors_per_doc)]
-        for _ in range(num_docs)
-    ]
+    tokens = rng.uniform(-3.0, 3.0, (num_docs * vectors_per_doc, dimensions)).astype(np.float32)
+    offsets = np.arange(0, num_docs * vectors_per_doc + 1, vectors_per_doc, dtype=np.int64)
     doc_ids = [str(d + 1) for d in range(num_docs)]
 
     # === Index dataset (timed) ===
     t0 = time.perf_counter()
-    muvera.index_dataset(dataset, doc_ids)
+    muvera.index_dataset(tokens, offsets, doc_ids)
     index_time_ms = (time.perf_counter() - t0) * 1000
 
     # === Query (timed) ===
     query_idx = 100
-    query_doc = dataset[query_idx]
+    query_doc = tokens[offsets[query_idx]:offsets[query_idx + 1]]
 
     q0 = time.perf_counter()
     result = muvera.get_top_k(query_doc, top_k)
@@ -86,7 +91,261 @@ def test_muvera_retriever_large_100D_top50():
     print(f"   Indexing time: {index_time_ms:.2f} ms")
     print(f"   Query time:    {query_time_ms:.2f} ms")
 
+def test_fde_encoder_batch():
+    dimensions = 100
+    num_docs = 64
+    encoder = FDEEncoder(dimensions, 64, 4096, 7, 10, 42)
+
+    rng = np.random.default_rng(12345)
+    lengths = rng.integers(1, 8, num_docs)
+    offsets = np.concatenate([[0], np.cumsum(lengths)]).astype(np.int64)
+    tokens = rng.uniform(-3.0, 3.0, (offsets[-1], dimensions)).astype(np.float32)
+
+    t0 = time.perf_counter()
+    fdes = encoder.encode_documents(tokens, offsets)
+    encode_time_ms = (time.perf_counter() - t0) * 1000
+    fdes_int8 = encoder.encode_documents(tokens, offsets, dtype="int8")
+    queries = encoder.encode_queries(tokens, offsets)
+
+    assert fdes.shape == (num_docs, encoder.get_d_final()) and fdes.dtype == np.float32
+    assert fdes_int8.shape == fdes.shape and fdes_int8.dtype == np.int8
+    for d in (0, num_docs - 1):
+        doc = tokens[offsets[d]:offsets[d + 1]]
+        assert np.array_equal(fdes[d], encoder.encode_document(doc))
+        assert np.array_equal(queries[d], encoder.encode_query(doc))
+
+    stats = encoder.get_stats()
+    if stats["enabled"]:
+        # float32 + int8 batches plus the two single-document checks.
+        assert stats["counters"]["documents_encoded"] == 2 * num_docs + 2
+        assert stats["counters"]["queries_encoded"] == num_docs + 2
+        assert stats["stages"]["countsketch"]["count"] == 3 * num_docs + 4
+
+    print("✅ test_fde_encoder_batch passed")
+    print(f"   Encoding time: {encode_time_ms:.2f} ms")
+
+def test_multivector_file():
+    dimensions = 32
+    rng = np.random.default_rng(7)
+    lengths = rng.integers(1, 6, 100)
+    offsets = np.concatenate([[0], np.cumsum(lengths)]).astype(np.int64)
+    tokens = rng.standard_normal((offsets[-1], dimensions)).astype(np.float32)
+    doc_ids = [f"doc-{d}" for d in range(len(lengths))]
+
+    with tempfile.TemporaryDirectory() as tmp:
+        path = os.path.join(tmp, "corpus.mvf")
+        write_multivector_file(path, tokens, offsets, doc_ids)
+        mvf = MultiVectorFile(path)
+        assert len(mvf) == len(doc_ids) and mvf.dimensions() == dimensions
+        assert mvf.doc_ids() == doc_ids
+        assert np.array_equal(mvf.offsets(), offsets)
+        assert np.array_equal(mvf[5], tokens[offsets[5]:offsets[6]])
+        assert not mvf[5].flags.writeable
+
+        retriever = ExactChamferRetriever(dimensions, len(doc_ids))
+        retriever.index_dataset(mvf)
+        assert retriever.get_top_k(mvf[42], 1) == ["doc-42"]
+
+        fp16_path = os.path.join(tmp, "corpus_fp16.mvf")
+        write_multivector_file(fp16_path, tokens, offsets, doc_ids, dtype="float16")
+        assert MultiVectorFile(fp16_path).dtype() == "float16"
+        assert np.allclose(MultiVectorFile(fp16_path)[5], tokens[offsets[5]:offsets[6]], atol=1e-2)
+
+    print("✅ test_multivector_file passed")
+
+
+def test_query_scheduler():
+    dimensions = 16
+    num_docs = 200
+    rng = np.random.default_rng(7)
+    tokens = rng.standard_normal((num_docs * 4, dimensions)).astype(np.float32)
+    offsets = np.arange(0, num_docs * 4 + 1, 4, dtype=np.int64)
+    muvera = MuveraRetriever(dimensions, num_docs, 16, 1024, 4, 4, 42)
+    muvera.index_dataset(tokens, offsets, [str(d) for d in range(num_docs)])
+
+    scheduler = QueryScheduler(muvera, max_pending=256, max_batch=8, search_threads=4)
+    queries = [tokens[offsets[q]:offsets[q + 1]] for q in range(50)]
+    futures = [scheduler.submit_query(Q, 10) for Q in queries]
+    for Q, future in zip(queries, futures):
+        assert future.result(timeout=30) == muvera.get_top_k(Q, 10)
+
+    scheduler.shutdown()
+    try:
+        scheduler.submit_query(queries[0], 10)
+        assert False, "submit_query after shutdown should be rejected"
+    except QueryRejected:
+        pass
+    print("✅ test_query_scheduler passed")
+
+
+def test_sharded_retriever():
+    dimensions = 16
+    num_docs = 300
+    rng = np.random.default_rng(11)
+    tokens = rng.standard_normal((num_docs * 4, dimensions)).astype(np.float32)
+    offsets = np.arange(0, num_docs * 4 + 1, 4, dtype=np.int64)
+    doc_ids = [str(d) for d in range(num_docs)]
+
+    local = ShardedRetriever(dimensions, 500, 16, 1024, 4, 4, 42, num_shards=3)
+    local.index_dataset(tokens, offsets, doc_ids)
+    assert local.num_documents() == num_docs
+    assert sum(local.shard_num_documents(s) for s in range(3)) == num_docs
+
+    # One remote shard served from a background thread over a Unix socket.
+    worker = MuveraRetriever(dimensions, 500, 16, 1024, 4, 4, 42)
+    server = ShardServer(worker, "unix:" + os.path.join(tempfile.mkdtemp(), "shard.sock"))
+    serving = threading.Thread(target=server.serve)
+    serving.start()
+    remote = ShardedRetriever(dimensions, 16, 1024, 4, 4, 42, endpoints=[server.endpoint()])
+    remote.index_dataset(tokens, offsets, doc_ids)
+    for q in range(0, num_docs, 50):
+        Q = tokens[offsets[q]:offsets[q + 1]]
+        assert remote.get_top_k(Q, 10) == worker.get_top_k(Q, 10)
+    server.stop()
+    serving.join()
+    print("✅ test_sharded_retriever passed")
+
+
+def test_muvera_labels():
+    dimensions = 16
+    num_docs = 200
+    rng = np.random.default_rng(3)
+    tokens = rng.standard_normal((num_docs * 4, dimensions)).astype(np.float32)
+    offsets = np.arange(0, num_docs * 4 + 1, 4, dtype=np.int64)
+    labels = [["en"] if d % 2 == 0 else ["fr"] for d in range(num_docs)]
+    labels[7].append("rare")
+    muvera = MuveraRetriever(dimensions, num_docs, 16, 1024, 4, 4, 42)
+    muvera.index_dataset(tokens, offsets, [str(d) for d in range(num_docs)], labels)
+    assert muvera.has_labels()
+
+    Q = tokens[offsets[3]:offsets[4]]
+    assert all(int(d) % 2 == 0 for d in muvera.get_top_k(Q, 10, "en"))
+    assert muvera.get_top_k(Q, 10, "rare") == ["7"]
+    muvera.update_document(Q, "7", ["en"])
+    assert muvera.get_top_k(Q, 10, "rare") == []
+    assert muvera.get_top_k(Q, 10, "missing") == []
+    print("✅ test_muvera_labels passed")
+
+
+def test_query_cache():
+    dimensions = 16
+    num_docs = 100
+    rng = np.random.default_rng(5)
+    tokens = rng.standard_normal((num_docs * 4, dimensions)).astype(np.float32)
+    offsets = np.arange(0, num_docs * 4 + 1, 4, dtype=np.int64)
+    muvera = MuveraRetriever(dimensions, num_docs, 16, 1024, 4, 4, 42)
+    muvera.index_dataset(tokens, offsets, [str(d) for d in range(num_docs)])
+    muvera.enable_query_cache(capacity=64, eviction="lru")
+
+    Q = tokens[offsets[9]:offsets[10]]
+    first = muvera.get_top_k(Q, 5)
+    assert muvera.get_top_k(Q, 5) == first
+    assert muvera.query_cache_size() == 1
+    muvera.delete_document("9")
+    assert "9" not in muvera.get_top_k(Q, 5)
+    stats = muvera.get_stats()
+    if stats["enabled"]:
+        assert stats["counters"]["query_cache_hits"] == 1
+    muvera.disable_query_cache()
+    print("✅ test_query_cache passed")
+
+
+def test_memory_policy():
+    dimensions = 16
+    num_docs = 100
+    rng = np.random.default_rng(13)
+    tokens = rng.standard_normal((num_docs * 4, dimensions)).astype(np.float32)
+    offsets = np.arange(0, num_docs * 4 + 1, 4, dtype=np.int64)
+    doc_ids = [str(d) for d in range(num_docs)]
+    baseline = MuveraRetriever(dimensions, num_docs, 16, 1024, 4, 4, 42)
+    placed = MuveraRetriever(dimensions, num_docs, 16, 1024, 4, 4, 42)
+    placed.set_memory_policy(huge_pages="transparent", numa="interleave", pin_threads=True)
+    baseline.index_dataset(tokens, offsets, doc_ids)
+    placed.index_dataset(tokens, offsets, doc_ids)
+    Q = tokens[offsets[2]:offsets[3]]
+    assert baseline.get_top_k(Q, 10) == placed.get_top_k(Q, 10)
+    exact = ExactChamferRetriever(dimensions, num_docs)
+    exact.set_memory_policy(huge_pages="transparent", numa="interleave", pin_threads=True)
+    exact.index_dataset(tokens, offsets, doc_ids)
+    assert exact.get_top_k(Q, 1) == ["2"]
+    assert len(numa_nodes()) >= 1
+    print("✅ test_memory_policy passed")
+
+
+def test_memory_usage():
+    dimensions = 16
+    num_docs = 100
+    rng = np.random.default_rng(17)
+    tokens = rng.standard_normal((num_docs * 4, dimensions)).astype(np.float32)
+    offsets = np.arange(0, num_docs * 4 + 1, 4, dtype=np.int64)
+    muvera = MuveraRetriever(dimensions, num_docs, 16, 1024, 4, 4, 42)
+    muvera.index_dataset(tokens, offsets, [str(d) for d in range(num_docs)])
+    usage = muvera.memory_usage()
+    assert usage["total"] == sum(usage["components"].values())
+    assert usage["components"]["diskann.graph"] > 0
+    estimate = MuveraRetriever.estimate_memory_usage(dimensions, num_docs, 16, 1024, 4, 4, num_docs)
+    assert estimate["components"]["diskann.vectors"] == usage["components"]["diskann.vectors"]
+    assert FDEEncoder(dimensions, 16, 1024, 4, 4, 42).memory_usage() == FDEEncoder.estimate_memory_usage(dimensions, 4, 4)
+    exact = ExactChamferRetriever.estimate_memory_usage(dimensions, num_docs, 4)
+    assert exact["components"]["dataset"] >= num_docs * 4 * dimensions * 4
+    print("✅ test_memory_usage passed")
+
+
+def test_checkpointed_build():
+    dimensions = 16
+    num_docs = 100
+    rng = np.random.default_rng(19)
+    tokens = rng.standard_normal((num_docs * 4, dimensions)).astype(np.float32)
+    offsets = np.arange(0, num_docs * 4 + 1, 4, dtype=np.int64)
+    doc_ids = [str(d) for d in range(num_docs)]
+    with tempfile.TemporaryDirectory() as tmp:
+        fde_path = os.path.join(tmp, "build.fde")
+        first = MuveraRetriever(dimensions, num_docs, 16, 1024, 4, 4, 42)
+        assert first.index_dataset_checkpointed(tokens, offsets, doc_ids, fde_path, chunk_docs=32) == num_docs
+        assert os.path.exists(fde_path + ".manifest")
+        retuned = MuveraRetriever(dimensions, num_docs, 16, 1024, 4, 4, 42)
+        retuned.set_graph_parameters(R=32, L=64, alpha=1.1)
+        assert retuned.index_dataset_checkpointed(tokens, offsets, doc_ids, fde_path) == 0
+        Q = tokens[offsets[3]:offsets[4]]
+        assert retuned.get_top_k(Q, 1) == ["3"]
+    print("✅ test_checkpointed_build passed")
+
+
+def test_token_pruning():
+    dimensions = 16
+    num_docs = 50
+    rng = np.random.default_rng(23)
+    base = rng.standard_normal((num_docs * 4, dimensions)).astype(np.float32)
+    # Every token appears three times with a little noise.
+    tokens = np.repeat(base, 3, axis=0) + 1e-3 * rng.standard_normal((num_docs * 12, dimensions)).astype(np.float32)
+    offsets = np.arange(0, num_docs * 12 + 1, 12, dtype=np.int64)
+    doc_ids = [str(d) for d in range(num_docs)]
+    exact = ExactChamferRetriever(dimensions, num_docs)
+    exact.set_token_pruning(merge_threshold=0.99)
+    assert exact.get_token_pruning()["cap_policy"] == "norm"
+    exact.index_dataset(tokens, offsets, doc_ids)
+    stats = exact.get_stats()
+    if stats["enabled"]:
+        assert stats["counters"]["tokens_pruned"] == num_docs * 8
+    muvera = MuveraRetriever(dimensions, num_docs, 16, 1024, 4, 4, 42)
+    muvera.set_token_pruning(max_tokens=4, cap_policy="cluster")
+    muvera.index_dataset(tokens, offsets, doc_ids)
+    Q = tokens[offsets[5]:offsets[6]]
+    assert exact.get_top_k(Q, 1) == ["5"]
+    assert muvera.get_top_k(Q, 1) == ["5"]
+    print("✅ test_token_pruning passed")
+
 
 if __name__ == "__main__":
     test_exact_chamfer_retriever_large_100D_top50()
     test_muvera_retriever_large_100D_top50()
+    test_fde_encoder_batch()
+    test_multivector_file()
+    test_query_scheduler()
+    test_sharded_retriever()
+    test_muvera_labels()
+    test_query_cache()
+    test_memory_policy()
+    test_memory_usage()
+    test_checkpointed_build()
+    test_token_pruning()
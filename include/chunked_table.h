@@ -0,0 +1,107 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+
+// Append-only table whose entries never move once written.
+//
+// Storage is a fixed directory of geometrically growing chunks (chunk c holds
+// base_chunk_size << c entries), so appending never reallocates existing
+// entries. The writer fills the next slot and then publishes it by bumping the
+// size with release semantics; readers that observe size() with acquire
+// semantics may read any index below it without locking.
+//
+// Writers must be serialized externally. pop_back, clear and overwriting a
+// published entry are not safe against concurrent readers and require the
+// caller to exclude them.
+template <typename T>
+class ChunkedTable {
+    private:
+    static constexpr size_t log_base_chunk_size = 10; // 1024 entries in chunk 0
+    static constexpr size_t base_chunk_size = size_t(1) << log_base_chunk_size;
+    static constexpr size_t max_chunks = 48;
+
+    std::array<std::atomic<T*>, max_chunks> chunks;
+    std::atomic<size_t> published_size;
+
+    static size_t chunk_of(size_t i) {
+        // Chunk c starts at base_chunk_size * (2^c - 1).
+        const uint64_t j = (i >> log_base_chunk_size) + 1;
+        return 63 - __builtin_clzll(j);
+    }
+    static size_t chunk_start(size_t c) { return base_chunk_size * ((size_t(1) << c) - 1); }
+    static size_t chunk_capacity(size_t c) { return base_chunk_size << c; }
+
+    T& slot(size_t i) const {
+        const size_t c = chunk_of(i);
+        return chunks[c].load(std::memory_order_acquire)[i - chunk_start(c)];
+    }
+
+    void ensure_chunk(size_t i) {
+        const size_t c = chunk_of(i);
+        if (c >= max_chunks) {
+            throw std::length_error("ChunkedTable.ensure_chunk: table is full.");
+        }
+        if (chunks[c].load(std::memory_order_relaxed) == nullptr) {
+            chunks[c].store(new T[chunk_capacity(c)](), std::memory_order_release);
+        }
+    }
+
+    public:
+    ChunkedTable() : published_size(0) {
+        for (auto& c : chunks) c.store(nullptr, std::memory_order_relaxed);
+    }
+    ~ChunkedTable() {
+        for (auto& c : chunks) delete[] c.load(std::memory_order_relaxed);
+    }
+    ChunkedTable(const ChunkedTable&) = delete;
+    ChunkedTable& operator=(const ChunkedTable&) = delete;
+
+    size_t size() const { return published_size.load(std::memory_order_acquire); }
+
+    // Bytes of the chunks allocated so far, excluding memory owned by the entries.
+    size_t allocated_bytes() const {
+        size_t bytes = 0;
+        for (size_t c = 0; c < max_chunks; c++) {
+            if (chunks[c].load(std::memory_order_acquire) != nullptr) bytes += chunk_capacity(c) * sizeof(T);
+        }
+        return bytes;
+    }
+    // Bytes of the chunks a table of n entries allocates.
+    static size_t allocated_bytes_for(const size_t n) {
+        return n == 0 ? 0 : chunk_start(chunk_of(n - 1) + 1) * sizeof(T);
+    }
+    bool empty() const { return size() == 0; }
+
+    const T& operator[](size_t i) const { return slot(i); }
+    T& operator[](size_t i) { return slot(i); }
+
+    // Writes v into the next slot and then makes it visible to readers.
+    template <typename U>
+    void push_back(U&& v) {
+        const size_t n = published_size.load(std::memory_order_relaxed);
+        ensure_chunk(n);
+        slot(n) = std::forward<U>(v);
+        published_size.store(n + 1, std::memory_order_release);
+    }
+
+    // REQUIRES: !empty() and no concurrent readers
+    void pop_back() {
+        const size_t n = published_size.load(std::memory_order_relaxed);
+        published_size.store(n - 1, std::memory_order_release);
+        slot(n - 1) = T();
+    }
+
+    // Releases all chunks.
+    // REQUIRES: no concurrent readers
+    void clear() {
+        published_size.store(0, std::memory_order_release);
+        for (auto& c : chunks) {
+            delete[] c.load(std::memory_order_relaxed);
+            c.store(nullptr, std::memory_order_relaxed);
+        }
+    }
+};
@@ -0,0 +1,127 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <shared_mutex>
+#include <thread>
+#include <vector>
+
+// Shared mutex that does not starve writers under a continuous stream of
+// overlapping readers. A waiting writer holds the gate, which new readers must
+// pass before taking the shared lock, so the writer gets in as soon as the
+// readers already inside drain. Usable with std::shared_lock/std::unique_lock.
+class WriterPreferringSharedMutex {
+    private:
+    std::mutex gate;
+    std::shared_mutex rw;
+
+    public:
+    void lock() {
+        std::lock_guard<std::mutex> g(gate);
+        rw.lock();
+    }
+    void unlock() { rw.unlock(); }
+
+    void lock_shared() {
+        std::lock_guard<std::mutex> g(gate);
+        rw.lock_shared();
+    }
+    void unlock_shared() { rw.unlock_shared(); }
+};
+
+// Runs f(i) for every i in [begin, end) on num_threads threads (0 means one
+// per hardware thread), including the calling thread. Indices are handed out
+// dynamically in small chunks so uneven documents balance out. The first
+// exception thrown by f stops the loop and is rethrown to the caller.
+template <typename F>
+void parallel_for(const size_t begin, const size_t end, size_t num_threads, F&& f) {
+    if (end <= begin) return;
+    if (num_threads == 0) num_threads = std::max(1u, std::thread::hardware_concurrency());
+    num_threads = std::min(num_threads, end - begin);
+    if (num_threads == 1) {
+        for (size_t i = begin; i < end; i++) f(i);
+        return;
+    }
+
+    const size_t chunk = std::max<size_t>(1, (end - begin) / (num_threads * 16));
+    std::atomic<size_t> next(begin);
+    std::exception_ptr error;
+    std::mutex error_mutex;
+    auto worker = [&]() {
+        try {
+            for (size_t i = next.fetch_add(chunk); i < end; i = next.fetch_add(chunk)) {
+                const size_t chunk_end = std::min(end, i + chunk);
+                for (size_t j = i; j < chunk_end; j++) f(j);
+            }
+        } catch (...) {
+            std::lock_guard<std::mutex> lock(error_mutex);
+            if (!error) error = std::current_exception();
+            next.store(end);
+        }
+    };
+    std::vector<std::thread> threads;
+    threads.reserve(num_threads - 1);
+    for (size_t t = 0; t + 1 < num_threads; t++) threads.emplace_back(worker);
+    worker();
+    for (auto& t : threads) t.join();
+    if (error) std::rethrow_exception(error);
+}
+
+// Fixed set of worker threads running submitted tasks in FIFO order. Tasks
+// must not throw. The destructor runs every task already submitted, then
+// joins the workers.
+class ThreadPool {
+    private:
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::deque<std::function<void()>> tasks;
+    bool stopping = false;
+    std::vector<std::thread> workers;
+
+    public:
+    explicit ThreadPool(size_t num_threads) {
+        if (num_threads == 0) num_threads = std::max(1u, std::thread::hardware_concurrency());
+        for (size_t t = 0; t < num_threads; t++) {
+            workers.emplace_back([this]() {
+                while (true) {
+                    std::function<void()> task;
+                    {
+                        std::unique_lock<std::mutex> lock(mutex);
+                        cv.wait(lock, [this] { return stopping || !tasks.empty(); });
+                        if (tasks.empty()) return;
+                        task = std::move(tasks.front());
+                        tasks.pop_front();
+                    }
+                    task();
+                }
+            });
+        }
+    }
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        cv.notify_all();
+        for (auto& t : workers) t.join();
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    void submit(std::function<void()> task) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            tasks.push_back(std::move(task));
+        }
+        cv.notify_one();
+    }
+
+    size_t num_threads() const { return workers.size(); }
+};
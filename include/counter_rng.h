@@ -0,0 +1,42 @@
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+
+// Stateless, counter-based random numbers: every value is a pure function of
+// (seed, stream, index), so parameter tables can be generated in any order,
+// in parallel, or recomputed on the fly instead of being stored.
+
+inline uint64_t splitmix64(uint64_t x) {
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+// Key for one parameter stream; hoist it out of loops over index.
+inline uint64_t counter_stream_key(const uint64_t seed, const uint64_t stream) {
+    return splitmix64(seed ^ splitmix64(stream));
+}
+
+// Entry index of the SplitMix64 sequence started at key.
+inline uint64_t counter_random(const uint64_t key, const uint64_t index) {
+    return splitmix64(key + index * 0x9e3779b97f4a7c15ULL);
+}
+
+// Maps the low 32 bits of bits uniformly onto [0, n).
+inline uint32_t counter_range(const uint64_t bits, const uint32_t n) {
+    return static_cast<uint32_t>(((bits & 0xffffffffULL) * n) >> 32);
+}
+
+// +1 or -1 from the top bit.
+inline float counter_sign(const uint64_t bits) {
+    return (bits >> 63) ? -1.0f : 1.0f;
+}
+
+// Standard normal sample via Box-Muller on the two 32-bit halves.
+inline float counter_gaussian(const uint64_t bits) {
+    const double u1 = ((bits >> 32) + 0.5) / 4294967296.0; // (0, 1)
+    const double u2 = (bits & 0xffffffffULL) / 4294967296.0;
+    return static_cast<float>(std::sqrt(-2.0 * std::log(u1)) * std::cos(6.283185307179586 * u2));
+}
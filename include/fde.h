@@ -1,7 +1,45 @@
+#pragma once
+
 #include <cstdint>
 #include <vector>
 
+#include "memory_usage.h"
+#include "stats.h"
+
+// Non-owning view of a row-major [num_tokens x dimensions] token matrix.
+struct TokenMatrixView {
+    const float* data;
+    size_t num_tokens;
+    size_t dimensions;
+
+    const float* row(size_t i) const { return data + i * dimensions; }
+};
+
+// Non-owning view of a ragged multi-vector collection: document i is rows
+// offsets[i] .. offsets[i + 1] of a row-major [num_tokens x dimensions] matrix.
+struct RaggedTokenView {
+    const float* tokens;
+    const int64_t* offsets; // num_docs + 1 entries
+    size_t num_docs;
+    size_t num_tokens;
+    size_t dimensions;
+
+    TokenMatrixView document(size_t i) const {
+        return {tokens + offsets[i] * dimensions, static_cast<size_t>(offsets[i + 1] - offsets[i]), dimensions};
+    }
+
+    // Throws unless offsets are non-decreasing and inside the token matrix.
+    void validate() const;
+};
+
+// Copies a document (or every document) into contiguous row-major storage.
+std::vector<float> flatten_tokens(const std::vector<std::vector<float>>& P, size_t dimensions);
+void flatten_dataset(const std::vector<std::vector<std::vector<float>>>& dataset, size_t dimensions,
+    std::vector<float>& tokens, std::vector<int64_t>& offsets);
+
+float dot_product(const float* h, const float* p, size_t dimensions);
 float dot_product(const std::vector<float>& h, const std::vector<float>& p, size_t dimensions);
+float cosine_similarity(const float* h, const float* p, size_t dimensions);
 float cosine_similarity(const std::vector<float>& h, const std::vector<float>& p, size_t dimensions);
 
 class AbstractLSH {
@@ -12,22 +50,23 @@ class AbstractLSH {
     public:
     AbstractLSH(size_t _dimensions, size_t _k_sim): dimensions(_dimensions), k_sim(_k_sim) {};
     virtual ~AbstractLSH() = default;
-    virtual uint32_t compute_hash(const std::vector<float>& v) const = 0;
-        // REQUIRES: v.size() == dimensions
+    virtual uint32_t compute_hash(const float* v) const = 0;
+        // REQUIRES: v points to dimensions floats
         // ENSURES: 0 <= result < 2^k_sim
+    uint32_t compute_hash(const std::vector<float>& v) const { return compute_hash(v.data()); }
+        // REQUIRES: v.size() == dimensions
 };
 
 class SimHash : public AbstractLSH {
     private:
-    std::vector<std::vector<float>> hyperplanes;
+    std::vector<float> hyperplanes; // row-major [k_sim x dimensions] Gaussian entries
     uint64_t seed;
 
-    // Generates a random Gaussian vector
-    std::vector<float> generate_gaussian_vector(size_t d);
-
     public:
     SimHash(size_t dimensions, size_t k_sim, uint64_t _seed);
-    uint32_t compute_hash(const std::vector<float>& v) const;
+    using AbstractLSH::compute_hash;
+    uint32_t compute_hash(const float* v) const override;
+    size_t hyperplane_bytes() const { return hyperplanes.capacity() * sizeof(float); }
 };
 
 // TODO: Add type templating and PQ
@@ -41,12 +80,19 @@ class AbstractChamferSimilarity {
 
     
     // Computes (an approximation for) the chamfer similartiy between P and Q
-    virtual float compute_similarity(const std::vector<std::vector<float>>& P, const std::vector<std::vector<float>>& Q) const = 0;
+    virtual float compute_similarity(const TokenMatrixView& P, const TokenMatrixView& Q) const = 0;
+        // REQUIRES: P.dimensions == Q.dimensions == dimensions
+        // REQUIRES: ||p|| == 1 for any p in P and ||q|| == 1 for any q in Q
+
+    float compute_similarity(const std::vector<std::vector<float>>& P, const std::vector<std::vector<float>>& Q) const;
         // REQUIRES: p.size() == dimensions && ||p|| == 1 for any p in P
         // REQUIRES: q.size() == dimensions && ||q|| == 1 for any q in Q
 };
 
 class FDESimilarity : public AbstractChamferSimilarity {
+    // Lets benchmarks/muvera_bench.cpp time the private encoding stages.
+    friend struct FDESimilarityBenchAccess;
+
     private:
         size_t d_proj;
         size_t d_final;
@@ -57,16 +103,17 @@ class FDESimilarity : public AbstractChamferSimilarity {
         uint64_t seed;
         bool use_ams = true;
     
-        std::vector<std::vector<std::vector<float>>> all_S; // dense random matrices
+        // All random parameters are derived from (seed, stream, index) with
+        // the counter-based generator in counter_rng.h.
+        std::vector<std::vector<std::vector<float>>> all_S; // dense random matrices, only built if !use_ams
 
          // sparse random matrices if using AMS per-block projection
         std::vector<std::pair<std::vector<int32_t>, std::vector<int8_t>>> all_S_sparse;
         std::vector<SimHash> all_simhash;
 
-        std::vector<int32_t> countsketch_index; // d_fde -> d_final
-        std::vector<int8_t> countsketch_sign; // ±1
+        uint64_t countsketch_key; // CountSketch buckets and signs are recomputed per entry
     
-        std::vector<std::vector<float>> get_scaled_S();
+        std::vector<std::vector<float>> get_scaled_S(size_t rep_id) const;
         void initialize_scaled_S_AMS();
         
         // Use CountSketch for the final projection as in the google graph mining
@@ -77,22 +124,60 @@ class FDESimilarity : public AbstractChamferSimilarity {
         // For using AMS instead of dense random matrix during per-block projection.
         std::vector<float> apply_ams(const std::vector<float>& v, size_t rep_id) const;
 
-        uint32_t compute_hash_from_rep_idx(size_t idx, const std::vector<float>& v) const;
+        uint32_t compute_hash_from_rep_idx(size_t idx, const float* v) const;
         std::vector<float> compute_proj_from_rep_idx(size_t idx, const std::vector<float>& v) const;
     
-        std::vector<float> encode_document_once(size_t idx, const std::vector<std::vector<float>>& P) const;
-        std::vector<float> encode_query_once(size_t idx, const std::vector<std::vector<float>>& Q) const;
+        // Time spent in each encoding stage, summed over repetitions and
+        // recorded once per encode call.
+        struct EncodeTimings {
+            uint64_t hash_ns = 0;
+            uint64_t projection_ns = 0;
+            uint64_t occupied_buckets = 0;
+        };
+        mutable StatsRegistry stats;
+
+        std::vector<float> encode_document_once(size_t idx, const TokenMatrixView& P, EncodeTimings& timings) const;
+        std::vector<float> encode_query_once(size_t idx, const TokenMatrixView& Q, EncodeTimings& timings) const;
+        void record_encode(const EncodeTimings& timings, uint64_t countsketch_ns, Counter counter) const;
     
     public:
         FDESimilarity(size_t _dimensions, size_t _d_proj, size_t _d_final, size_t _k_sim, size_t _r_reps, uint64_t _seed);
     
         size_t get_d_fde();
+        size_t get_d_final() const { return d_final; }
+        // Hash of the constructor parameters; encoders with equal
+        // fingerprints produce identical encodings.
+        uint64_t fingerprint() const;
 
+        std::vector<float> encode_document(const TokenMatrixView& P) const;
         std::vector<float> encode_document(const std::vector<std::vector<float>>& P) const;
+        std::vector<float> encode_query(const TokenMatrixView& Q) const;
         std::vector<float> encode_query(const std::vector<std::vector<float>>& Q) const;
-        float compute_similarity(
-            const std::vector<std::vector<float>>& P,
-            const std::vector<std::vector<float>>& Q) const;
+
+        // Batch encoders: row i of out (a row-major [num_docs x d_final]
+        // buffer) receives the encoding of document i. Documents are encoded
+        // on num_threads threads (0 means one per hardware thread). The int8
+        // variants scale each row so that its largest magnitude maps to 127;
+        // cosine similarity between encodings is unaffected by that scale.
+        void encode_documents(const RaggedTokenView& P, float* out, size_t num_threads = 0) const;
+        void encode_documents(const RaggedTokenView& P, int8_t* out, size_t num_threads = 0) const;
+        void encode_queries(const RaggedTokenView& Q, float* out, size_t num_threads = 0) const;
+        void encode_queries(const RaggedTokenView& Q, int8_t* out, size_t num_threads = 0) const;
+
+        // Hash / projection / countsketch timings and bucket occupancy of
+        // every encode call made through this encoder.
+        StatsSnapshot get_stats() const { return stats.snapshot(); }
+        void reset_stats() { stats.reset(); }
+
+        // Bytes of the SimHash hyperplanes and projection tables. CountSketch
+        // buckets and signs are recomputed per entry and take no memory.
+        MemoryUsage memory_usage() const;
+        // What memory_usage() reports for an encoder built with these
+        // parameters, without building it.
+        static MemoryUsage estimate_memory_usage(size_t dimensions, size_t k_sim, size_t r_reps);
+
+        using AbstractChamferSimilarity::compute_similarity;
+        float compute_similarity(const TokenMatrixView& P, const TokenMatrixView& Q) const override;
 };
 
 class ExactChamferSimilarity : public AbstractChamferSimilarity {
@@ -100,7 +185,8 @@ class ExactChamferSimilarity : public AbstractChamferSimilarity {
     ExactChamferSimilarity(size_t dimensions);
 
     // TODO: SIMD optimizations
-    float compute_similarity(const std::vector<std::vector<float>>& P, const std::vector<std::vector<float>>& Q) const;
+    using AbstractChamferSimilarity::compute_similarity;
+    float compute_similarity(const TokenMatrixView& P, const TokenMatrixView& Q) const override;
 };
 
 class RelaxedChamferSimilarity : public AbstractChamferSimilarity {
@@ -113,5 +199,6 @@ class RelaxedChamferSimilarity : public AbstractChamferSimilarity {
     size_t get_softmax_s() { return softmax_s; }
 
     // TODO: SIMD optimizations
-    float compute_similarity(const std::vector<std::vector<float>>& P, const std::vector<std::vector<float>>& Q) const;
+    using AbstractChamferSimilarity::compute_similarity;
+    float compute_similarity(const TokenMatrixView& P, const TokenMatrixView& Q) const override;
 };
\ No newline at end of file
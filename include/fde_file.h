@@ -0,0 +1,76 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "fde.h"
+
+// Document FDEs of one bulk build (".fde"), written in place through a shared
+// writable mapping so that the graph build reads them straight from the page
+// cache. Little-endian layout:
+//   [0, 64)          FDEFileHeader
+//   payload_offset   num_docs x d_final fp32 encodings, row-major
+// Progress lives in a small text manifest next to it ("<path>.manifest"),
+// replaced atomically after each committed chunk of rows has been flushed,
+// so a killed build resumes from the last committed chunk. The header and
+// the manifest both record which encoder and which dataset the rows belong
+// to; a file built for anything else is discarded and rebuilt.
+struct FDEFileHeader {
+    char magic[8]; // "MUVERAFD"
+    uint32_t version;
+    uint32_t reserved;
+    uint64_t num_docs;
+    uint64_t d_final;
+    uint64_t encoder_fingerprint;
+    uint64_t dataset_fingerprint;
+    uint64_t payload_offset;
+    uint64_t reserved2;
+};
+static_assert(sizeof(FDEFileHeader) == 64, "FDEFileHeader must stay 64 bytes");
+
+// Hash of the document count, the token offsets and the doc ids. Token
+// values are not hashed, so that checking a multi-GB dataset stays cheap;
+// a dataset rewritten in place with the same shapes and ids is not detected.
+uint64_t dataset_fingerprint(const RaggedTokenView& dataset, const std::vector<std::string>& doc_ids);
+
+class FDEMatrixFile {
+    private:
+    std::string path;
+    int fd = -1;
+    void* mapping = nullptr;
+    size_t mapping_size = 0;
+    FDEFileHeader header;
+    size_t completed = 0;
+
+    std::string manifest_path() const { return path + ".manifest"; }
+    // Committed rows recorded by a manifest for this header; 0 if the
+    // manifest is missing, unreadable or for another file.
+    size_t read_manifest() const;
+    void write_manifest() const;
+    void close();
+
+    public:
+    // Opens the file at path if it was built for the same encoder, dataset
+    // and shape, keeping its committed rows; otherwise (re)creates it with
+    // no rows committed.
+    FDEMatrixFile(const std::string& _path, const size_t num_docs, const size_t d_final,
+        const uint64_t encoder_fingerprint, const uint64_t dataset_fingerprint);
+    ~FDEMatrixFile();
+    FDEMatrixFile(const FDEMatrixFile&) = delete;
+    FDEMatrixFile& operator=(const FDEMatrixFile&) = delete;
+
+    size_t num_docs() const { return header.num_docs; }
+    size_t d_final() const { return header.d_final; }
+    float* data() { return reinterpret_cast<float*>(static_cast<char*>(mapping) + header.payload_offset); }
+    const float* data() const { return reinterpret_cast<const float*>(static_cast<const char*>(mapping) + header.payload_offset); }
+
+    // Rows [0, completed_docs()) hold committed encodings.
+    size_t completed_docs() const { return completed; }
+    bool complete() const { return completed == header.num_docs; }
+
+    // Flushes rows [completed_docs(), end) to disk, then records end in the
+    // manifest.
+    // REQUIRES: completed_docs() <= end <= num_docs()
+    void commit(const size_t end);
+};
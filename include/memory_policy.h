@@ -0,0 +1,116 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+enum class HugePagePolicy {
+    NONE,        // regular 4 KB pages
+    TRANSPARENT, // 2 MB aligned mapping with madvise(MADV_HUGEPAGE)
+    EXPLICIT,    // MAP_HUGETLB from the reserved 2 MB pool; falls back to
+                 // TRANSPARENT when the pool is empty
+};
+
+enum class NumaPolicy {
+    FIRST_TOUCH, // the kernel default: pages land on the node that writes them first
+    INTERLEAVE,  // pages round-robin over every online node
+    BIND,        // pages only on MemoryPolicy::numa_node
+};
+
+// Placement of the large buffers (MuVERA FDE matrices, brute-force token
+// arenas) and of the threads that fill them. Every setting is a hint: when the kernel refuses it
+// (no NUMA support, no huge pages, restricted affinity) the buffer or thread
+// falls back to the default and the work proceeds.
+struct MemoryPolicy {
+    HugePagePolicy huge_pages = HugePagePolicy::NONE;
+    NumaPolicy numa = NumaPolicy::FIRST_TOUCH;
+    int numa_node = 0; // BIND only
+    // Pin encode workers to CPUs: to numa_node's CPUs under BIND, round-robin
+    // over the nodes under INTERLEAVE, and one CPU each otherwise.
+    bool pin_threads = false;
+
+    bool is_default() const {
+        return huge_pages == HugePagePolicy::NONE && numa == NumaPolicy::FIRST_TOUCH && !pin_threads;
+    }
+    // Throws if numa_node is not an online node.
+    void validate() const;
+};
+
+// Online NUMA nodes, from sysfs; {0} on machines without NUMA.
+std::vector<int> numa_nodes();
+// CPUs of a node that the process may run on; every allowed CPU for node -1.
+std::vector<int> numa_node_cpus(const int node);
+
+// Pins the calling thread for worker index worker under policy. Returns false
+// if the policy does not pin or the kernel refused.
+bool pin_worker_thread(const MemoryPolicy& policy, const size_t worker);
+
+// Page-aligned buffer placed according to a MemoryPolicy. A default policy
+// uses aligned_alloc; anything else maps anonymous memory so that huge pages
+// and mbind apply before the first touch. Contents are uninitialized.
+class LargeBuffer {
+    private:
+    void* data_ = nullptr;
+    size_t bytes_ = 0;
+    size_t mapped_bytes_ = 0; // 0 if allocated with aligned_alloc
+    bool huge_pages_ = false;
+    bool numa_applied_ = false;
+
+    void release();
+
+    public:
+    LargeBuffer() = default;
+    LargeBuffer(const size_t bytes, const MemoryPolicy& policy);
+    ~LargeBuffer() { release(); }
+
+    LargeBuffer(LargeBuffer&& other) noexcept;
+    LargeBuffer& operator=(LargeBuffer&& other) noexcept;
+    LargeBuffer(const LargeBuffer&) = delete;
+    LargeBuffer& operator=(const LargeBuffer&) = delete;
+
+    template <typename T>
+    T* as() const { return static_cast<T*>(data_); }
+    size_t size() const { return bytes_; }
+    // Whether the mapping got huge pages (MAP_HUGETLB, or MADV_HUGEPAGE
+    // accepted) and whether mbind succeeded.
+    bool huge_pages() const { return huge_pages_; }
+    bool numa_applied() const { return numa_applied_; }
+};
+
+// parallel_for on num_threads freshly started threads, each pinned by
+// pin_worker_thread before taking indices, so that the pages they first
+// touch follow the policy. The calling thread only waits. Indices are
+// handed out dynamically; the first exception is rethrown.
+template <typename F>
+void pinned_parallel_for(const MemoryPolicy& policy, const size_t begin, const size_t end, size_t num_threads, F&& f) {
+    if (end <= begin) return;
+    if (num_threads == 0) num_threads = std::max(1u, std::thread::hardware_concurrency());
+    num_threads = std::min(num_threads, end - begin);
+
+    const size_t chunk = std::max<size_t>(1, (end - begin) / (num_threads * 16));
+    std::atomic<size_t> next(begin);
+    std::exception_ptr error;
+    std::mutex error_mutex;
+    auto worker = [&](const size_t t) {
+        pin_worker_thread(policy, t);
+        try {
+            for (size_t i = next.fetch_add(chunk); i < end; i = next.fetch_add(chunk)) {
+                const size_t chunk_end = std::min(end, i + chunk);
+                for (size_t j = i; j < chunk_end; j++) f(j);
+            }
+        } catch (...) {
+            std::lock_guard<std::mutex> lock(error_mutex);
+            if (!error) error = std::current_exception();
+            next.store(end);
+        }
+    };
+    std::vector<std::thread> threads;
+    threads.reserve(num_threads);
+    for (size_t t = 0; t < num_threads; t++) threads.emplace_back(worker, t);
+    for (auto& t : threads) t.join();
+    if (error) std::rethrow_exception(error);
+}
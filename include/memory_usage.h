@@ -0,0 +1,47 @@
+#pragma once
+
+#include <cstddef>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <utility>
+
+// Bytes held by each component of a retriever or encoder, keyed by names
+// such as "fde.simhash_hyperplanes" or "diskann.graph". Containers owned by
+// this library are measured from their current allocations; DiskANN's
+// stores are opaque and are estimated from the parameters they were
+// preallocated with.
+struct MemoryUsage {
+    std::map<std::string, size_t> components;
+
+    void add(const std::string& component, const size_t bytes) { components[component] += bytes; }
+    // Sums other's components into this one, component by component.
+    void merge(const MemoryUsage& other) {
+        for (const auto& [component, bytes] : other.components) add(component, bytes);
+    }
+    size_t total() const {
+        size_t sum = 0;
+        for (const auto& [component, bytes] : components) sum += bytes;
+        return sum;
+    }
+};
+
+// Heap bytes of a std::string beyond the object itself; strings that fit the
+// small-string buffer have none.
+inline size_t string_heap_bytes(const size_t length) {
+    return length > 15 ? length + 1 : 0;
+}
+inline size_t string_heap_bytes(const std::string& s) {
+    return s.capacity() > 15 ? s.capacity() + 1 : 0;
+}
+
+// Bucket array plus one node per element (next pointer, cached hash, value),
+// not counting heap memory owned by the keys and values.
+template <typename K, typename V>
+size_t unordered_map_bytes(const size_t num_elements, const size_t bucket_count) {
+    return bucket_count * sizeof(void*) + num_elements * (sizeof(std::pair<const K, V>) + sizeof(void*) + sizeof(size_t));
+}
+template <typename K, typename V>
+size_t unordered_map_bytes(const std::unordered_map<K, V>& map) {
+    return unordered_map_bytes<K, V>(map.size(), map.bucket_count());
+}
@@ -0,0 +1,103 @@
+#pragma once
+
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "fde.h"
+
+// Binary ragged multi-vector collection (".mvf"). Little-endian layout:
+//   [0, 64)          MultiVectorFileHeader
+//   payload_offset   num_tokens x dimensions token values, row-major, fp32 or fp16
+//   offsets_offset   int64[num_docs + 1] token offsets; document i is rows offsets[i] .. offsets[i + 1]
+//   ids_offset       uint64[num_docs + 1] byte offsets into the doc id blob that follows
+// Every section starts on a 64-byte boundary, so fp32 payloads and offsets
+// can be used in place from a read-only mapping.
+enum class MultiVectorDType : uint32_t {
+    FP32 = 0,
+    FP16 = 1,
+};
+
+struct MultiVectorFileHeader {
+    char magic[8]; // "MUVERAMV"
+    uint32_t version;
+    uint32_t dtype;
+    uint64_t num_docs;
+    uint64_t num_tokens;
+    uint64_t dimensions;
+    uint64_t payload_offset;
+    uint64_t offsets_offset;
+    uint64_t ids_offset;
+};
+static_assert(sizeof(MultiVectorFileHeader) == 64, "MultiVectorFileHeader must stay 64 bytes");
+
+uint16_t float_to_fp16(float x);
+float fp16_to_float(uint16_t h);
+
+// Streams documents to an .mvf file. Offsets and ids are buffered in memory
+// and written by close(); the payload is written as documents arrive.
+class MultiVectorFileWriter {
+    private:
+    std::ofstream out;
+    std::string path;
+    MultiVectorFileHeader header;
+    std::vector<int64_t> offsets;
+    std::vector<std::string> doc_ids;
+    std::vector<uint16_t> fp16_buffer;
+    bool closed = false;
+
+    void pad_to_alignment();
+
+    public:
+    MultiVectorFileWriter(const std::string& _path, size_t _dimensions, MultiVectorDType _dtype = MultiVectorDType::FP32);
+    ~MultiVectorFileWriter();
+
+    void add_document(const TokenMatrixView& P, const std::string& doc_id);
+        // REQUIRES: P.dimensions == dimensions
+    void close();
+};
+
+void write_multivector_file(const std::string& path, const RaggedTokenView& dataset,
+    const std::vector<std::string>& doc_ids, MultiVectorDType dtype = MultiVectorDType::FP32);
+    // REQUIRES: dataset.num_docs == doc_ids.size()
+
+// Read-only memory mapping of an .mvf file. Documents of fp32 files are
+// returned as views into the mapping; fp16 documents are decoded on demand.
+class MultiVectorFile {
+    private:
+    int fd = -1;
+    void* mapping = nullptr;
+    size_t mapping_size = 0;
+    MultiVectorFileHeader header;
+    const void* payload;
+    const int64_t* token_offsets;
+    const uint64_t* id_offsets;
+    const char* id_blob;
+
+    public:
+    explicit MultiVectorFile(const std::string& path);
+    ~MultiVectorFile();
+    MultiVectorFile(const MultiVectorFile&) = delete;
+    MultiVectorFile& operator=(const MultiVectorFile&) = delete;
+
+    size_t num_docs() const { return header.num_docs; }
+    size_t num_tokens() const { return header.num_tokens; }
+    size_t dimensions() const { return header.dimensions; }
+    MultiVectorDType dtype() const { return static_cast<MultiVectorDType>(header.dtype); }
+    const int64_t* offsets() const { return token_offsets; }
+    const void* raw_payload() const { return payload; }
+
+    std::string doc_id(size_t i) const;
+    std::vector<std::string> doc_ids() const;
+
+    // Zero-copy views; throw unless dtype() == FP32.
+    RaggedTokenView view() const;
+    TokenMatrixView document(size_t i) const;
+
+    // Works for any dtype: fp16 rows are decoded into scratch.
+    TokenMatrixView document(size_t i, std::vector<float>& scratch) const;
+
+    // Decodes the whole payload to fp32.
+    std::vector<float> decode_tokens() const;
+};
@@ -0,0 +1,113 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "fde.h"
+
+enum class CacheEviction {
+    LRU,      // evict the least recently used entry
+    TINY_LFU, // LRU order, but a new query only displaces the LRU entry if it
+              // has been seen more often recently (count-min sketch, aged)
+};
+
+struct QueryCacheOptions {
+    // Entries across all shards. Each entry holds a copy of the query tokens,
+    // its encoding and its result ids.
+    size_t capacity = 4096;
+    // Independently locked partitions, selected by the query hash.
+    size_t num_shards = 16;
+    CacheEviction eviction = CacheEviction::TINY_LFU;
+    bool cache_encodings = true;
+    bool cache_results = true;
+};
+
+// Bounded concurrent cache from a query token matrix to its encoding and its
+// top-k result ids. Queries are matched on their exact token bytes; the hash
+// only picks the shard and the bucket.
+//
+// Results are stamped with the retriever's write generation when the query
+// started and only served while the generation is unchanged, so any write
+// invalidates every cached result at once. Encodings depend only on the query
+// and stay valid across writes.
+class QueryCache {
+    public:
+    struct Lookup {
+        bool has_results = false;
+        std::vector<std::string> results;
+        std::vector<float> encoding; // empty if not cached
+    };
+
+    private:
+    struct Entry {
+        uint64_t hash;
+        std::vector<float> tokens;
+        size_t dimensions;
+        std::vector<float> encoding;
+        bool has_results = false;
+        size_t results_top_k = 0;
+        uint64_t results_generation = 0;
+        std::vector<std::string> results;
+    };
+
+    // 4-row count-min sketch of 8-bit counters. Every counter is halved after
+    // sample_size increments so that popularity decays.
+    class FrequencySketch {
+        private:
+        std::vector<uint8_t> counters;
+        size_t mask;
+        size_t additions = 0;
+        size_t sample_size;
+
+        size_t index(const uint64_t hash, const size_t row) const;
+
+        public:
+        explicit FrequencySketch(const size_t capacity);
+        void increment(const uint64_t hash);
+        uint8_t estimate(const uint64_t hash) const;
+        size_t memory_bytes() const { return counters.capacity(); }
+    };
+
+    struct Shard {
+        std::mutex mutex;
+        std::list<Entry> entries; // most recently used first
+        std::unordered_map<uint64_t, std::list<Entry>::iterator> index;
+        std::unique_ptr<FrequencySketch> sketch; // TINY_LFU only
+    };
+
+    const QueryCacheOptions options;
+    size_t shard_capacity;
+    std::vector<std::unique_ptr<Shard>> shards;
+    std::atomic<size_t> num_entries;
+
+    Shard& shard_for(const uint64_t hash) const { return *shards[hash % shards.size()]; }
+    static bool matches(const Entry& entry, const TokenMatrixView& Q);
+
+    public:
+    explicit QueryCache(const QueryCacheOptions _options = QueryCacheOptions());
+
+    static uint64_t hash_query(const TokenMatrixView& Q);
+
+    // Results are returned only if they were cached for the same top_k at the
+    // given generation; the encoding is returned whenever it is cached.
+    Lookup lookup(const TokenMatrixView& Q, const uint64_t hash, const size_t top_k, const uint64_t generation);
+
+    // Records the encoding and results of a query that started at generation.
+    // Results from an older generation than the cached ones are ignored. Under
+    // TINY_LFU a new query may be refused admission.
+    void insert(const TokenMatrixView& Q, const uint64_t hash, const size_t top_k, const uint64_t generation,
+        const std::vector<float>& encoding, const std::vector<std::string>& results);
+
+    size_t size() const { return num_entries.load(std::memory_order_relaxed); }
+    // Bytes held by the cached entries and the frequency sketches.
+    size_t memory_bytes() const;
+    size_t capacity() const { return shard_capacity * shards.size(); }
+    const QueryCacheOptions& get_options() const { return options; }
+    void clear();
+};
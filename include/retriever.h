@@ -1,8 +1,27 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <iostream>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <thread>
+#include <unordered_map>
 #include <unordered_set>
 #include <vector>
 #include <string>
 
+#include "chunked_table.h"
+#include "concurrency.h"
+#include "fde.h"
+#include "memory_policy.h"
+#include "multivector_file.h"
+#include "query_cache.h"
+#include "stats.h"
+#include "token_pruning.h"
+
 #include "abstract_index.h"
 #include "index.h"
 #include "index_config.h"
@@ -10,25 +29,159 @@
 #include "ann_exception.h"
 #include "utils.h"
 
+// One search result. Scores are comparable between retrievers built with the
+// same parameters (e.g. the shards of a ShardedRetriever); higher is better.
+struct ScoredDocument {
+    std::string doc_id;
+    float score;
+};
+
+// Retrievers allow any number of concurrent get_top_k callers alongside
+// writers. Writers serialize on write_mutex, which readers never take.
+// doc_ids is append-only between structural changes, so reading an entry
+// below doc_ids.size() needs no lock.
 class AbstractRetriever {
     protected:
     size_t dimensions;
     size_t max_points;
-    bool initialized;
-    std::vector<std::string> doc_ids;
+    std::atomic<bool> initialized;
+    ChunkedTable<std::string> doc_ids;
+    std::unordered_map<std::string, uint32_t> doc_id_to_internal; // doc_id -> index into doc_ids, guarded by write_mutex
+    mutable std::mutex write_mutex;
+    mutable StatsRegistry stats;
+
+    // Optional query cache, swapped atomically; null when disabled. Every
+    // write bumps write_generation, which invalidates all cached results.
+    std::shared_ptr<QueryCache> query_cache;
+    std::atomic<uint64_t> write_generation;
+
+    // Optional ingest token pruning, swapped atomically; null when disabled.
+    std::shared_ptr<const TokenPruningOptions> token_pruning;
+
+    // Declared at the top of every write. The generation is bumped when the
+    // write returns or throws, after its effects are visible, so that results
+    // cached by queries overlapping the write are never served afterwards.
+    class CacheInvalidation {
+        private:
+        AbstractRetriever& retriever;
+        public:
+        explicit CacheInvalidation(AbstractRetriever& _retriever) : retriever(_retriever) {}
+        ~CacheInvalidation() { retriever.write_generation.fetch_add(1, std::memory_order_acq_rel); }
+    };
+
+    // get_top_k through the query cache. encode(Q) returns the query encoding
+    // and is skipped when the cache holds it; search(encoding, cacheable)
+    // returns the result ids and may clear cacheable for partial results.
+    template <typename Encode, typename Search>
+    std::vector<std::string> cached_top_k(const TokenMatrixView& Q, const size_t top_k, Encode&& encode, Search&& search) const {
+        const std::shared_ptr<QueryCache> cache = std::atomic_load(&query_cache);
+        bool cacheable = true;
+        if (!cache) return search(encode(Q), cacheable);
+        const uint64_t generation = write_generation.load(std::memory_order_acquire);
+        const uint64_t hash = QueryCache::hash_query(Q);
+        QueryCache::Lookup cached = cache->lookup(Q, hash, top_k, generation);
+        if (cached.has_results) {
+            stats.add(Counter::QUERY_CACHE_HITS, 1);
+            return std::move(cached.results);
+        }
+        stats.add(Counter::QUERY_CACHE_MISSES, 1);
+        if (cached.encoding.empty()) {
+            cached.encoding = encode(Q);
+        } else {
+            stats.add(Counter::ENCODING_CACHE_HITS, 1);
+        }
+        std::vector<std::string> results = search(cached.encoding, cacheable);
+        if (cacheable) cache->insert(Q, hash, top_k, generation, cached.encoding, results);
+        return results;
+    }
+
+    // "doc_ids", "doc_id_map" and "query_cache" components.
+    // REQUIRES: write_mutex is held
+    MemoryUsage base_memory_usage() const {
+        MemoryUsage usage;
+        size_t doc_id_bytes = doc_ids.allocated_bytes();
+        for (size_t i = 0; i < doc_ids.size(); i++) doc_id_bytes += string_heap_bytes(doc_ids[i]);
+        usage.add("doc_ids", doc_id_bytes);
+        size_t map_bytes = unordered_map_bytes(doc_id_to_internal);
+        for (const auto& [doc_id, internal] : doc_id_to_internal) map_bytes += string_heap_bytes(doc_id);
+        usage.add("doc_id_map", map_bytes);
+        const std::shared_ptr<QueryCache> cache = std::atomic_load(&query_cache);
+        if (cache) usage.add("query_cache", cache->memory_bytes());
+        return usage;
+    }
+    // Estimate of base_memory_usage() for num_docs documents.
+    static MemoryUsage estimate_base_memory_usage(const size_t num_docs, const size_t avg_doc_id_length) {
+        MemoryUsage usage;
+        usage.add("doc_ids", ChunkedTable<std::string>::allocated_bytes_for(num_docs) + num_docs * string_heap_bytes(avg_doc_id_length));
+        usage.add("doc_id_map", unordered_map_bytes<std::string, uint32_t>(num_docs, num_docs) + num_docs * string_heap_bytes(avg_doc_id_length));
+        return usage;
+    }
+
+    // The rows of P as they are to be stored: P itself when token pruning is
+    // disabled, else its pruned rows, held in scratch.
+    TokenMatrixView prune_document(const TokenMatrixView& P, std::vector<float>& scratch) const {
+        const std::shared_ptr<const TokenPruningOptions> options = std::atomic_load(&token_pruning);
+        if (!options) return P;
+        StageTimer pruning_timer(stats, Stage::TOKEN_PRUNING);
+        scratch.clear();
+        const size_t kept = prune_tokens(P, *options, scratch);
+        stats.add(Counter::TOKENS_PRUNED, P.num_tokens - kept);
+        return TokenMatrixView{scratch.data(), kept, P.dimensions};
+    }
+    // prune_document for every document; the pruned dataset is held in
+    // tokens and offsets.
+    RaggedTokenView prune_documents(const RaggedTokenView& _dataset, std::vector<float>& tokens, std::vector<int64_t>& offsets) const {
+        const std::shared_ptr<const TokenPruningOptions> options = std::atomic_load(&token_pruning);
+        if (!options || _dataset.num_docs == 0) return _dataset;
+        StageTimer pruning_timer(stats, Stage::TOKEN_PRUNING);
+        const RaggedTokenView pruned = prune_dataset(_dataset, *options, tokens, offsets);
+        stats.add(Counter::TOKENS_PRUNED, (_dataset.offsets[_dataset.num_docs] - _dataset.offsets[0]) - pruned.num_tokens);
+        return pruned;
+    }
+    uint64_t token_pruning_fingerprint() const {
+        const std::shared_ptr<const TokenPruningOptions> options = std::atomic_load(&token_pruning);
+        return options ? options->fingerprint() : 0;
+    }
+
+    void check_dimensions(const size_t _dimensions, const char* caller) const {
+        if (_dimensions != dimensions) {
+            throw std::runtime_error(std::string(caller) + ": token dimension mismatch.");
+        }
+    }
 
     public:
     AbstractRetriever(const size_t _dimensions, const size_t _max_points)
     :dimensions(_dimensions), max_points(_max_points) {
         initialized = false;
-        doc_ids = std::vector<std::string>();
+        write_generation = 0;
+        doc_id_to_internal = std::unordered_map<std::string, uint32_t>();
     };
     virtual ~AbstractRetriever() = default;
 
+    // The TokenMatrixView / RaggedTokenView overloads are the primary entry
+    // points and read the caller's buffers in place; the nested vector
+    // overloads flatten their input first.
+
     // Initializes the retriever with the dataset
-    virtual void index_dataset(const std::vector<std::vector<std::vector<float>>>& _dataset, const std::vector<std::string> _doc_ids) = 0;
-    // REQUIRES: dataset.size() == doc_ids.size()
+    virtual void index_dataset(const RaggedTokenView& _dataset, const std::vector<std::string> _doc_ids) = 0;
+    // REQUIRES: dataset.num_docs == doc_ids.size()
     // ENSURES: initialized
+    void index_dataset(const std::vector<std::vector<std::vector<float>>>& _dataset, const std::vector<std::string> _doc_ids) {
+        std::vector<float> tokens;
+        std::vector<int64_t> offsets;
+        flatten_dataset(_dataset, dimensions, tokens, offsets);
+        index_dataset(RaggedTokenView{tokens.data(), offsets.data(), _dataset.size(), tokens.size() / dimensions, dimensions}, _doc_ids);
+    }
+    // Indexes a memory-mapped .mvf file. fp32 files are read in place; fp16
+    // files are decoded to fp32 first.
+    void index_dataset(const MultiVectorFile& file) {
+        if (file.dtype() == MultiVectorDType::FP32) {
+            index_dataset(file.view(), file.doc_ids());
+            return;
+        }
+        const std::vector<float> tokens = file.decode_tokens();
+        index_dataset(RaggedTokenView{tokens.data(), file.offsets(), file.num_docs(), file.num_tokens(), file.dimensions()}, file.doc_ids());
+    }
 
     // Loads the retriever from a checkpoint
     virtual void load_index(const std::string &checkpoint_dir) = 0;
@@ -38,72 +191,528 @@ class AbstractRetriever {
     virtual void save_index(const std::string &checkpoint_dir) = 0;
 
     // Adds a document into the retriever.
-    virtual void add_document(const std::vector<std::vector<float>>& P, const std::string doc_id) = 0;
+    virtual void add_document(const TokenMatrixView& P, const std::string doc_id) = 0;
+    // REQUIRES: doc_id is not already in the retriever
+    void add_document(const std::vector<std::vector<float>>& P, const std::string doc_id) {
+        const std::vector<float> P_flat = flatten_tokens(P, dimensions);
+        add_document(TokenMatrixView{P_flat.data(), P.size(), dimensions}, doc_id);
+    }
+
+    // Removes a document from the retriever.
+    virtual void delete_document(const std::string doc_id) = 0;
+    // REQUIRES: doc_id is in the retriever
+
+    // Replaces the contents of an existing document.
+    virtual void update_document(const TokenMatrixView& P, const std::string doc_id) = 0;
+    // REQUIRES: doc_id is in the retriever
+    void update_document(const std::vector<std::vector<float>>& P, const std::string doc_id) {
+        const std::vector<float> P_flat = flatten_tokens(P, dimensions);
+        update_document(TokenMatrixView{P_flat.data(), P.size(), dimensions}, doc_id);
+    }
+
+    // Number of live (non-deleted) documents.
+    virtual size_t num_documents() const {
+        std::lock_guard<std::mutex> lock(write_mutex);
+        return doc_id_to_internal.size();
+    }
+
+    // Bytes held by the retriever, by component. Safe to call concurrently
+    // with queries; blocks writers while it walks the document tables.
+    virtual MemoryUsage memory_usage() const = 0;
+
+    // Per-stage latency histograms and counters accumulated since
+    // construction or the last reset_stats(). Safe to call concurrently with
+    // queries and writes; empty when built with MUVERA_ENABLE_STATS=0.
+    virtual StatsSnapshot get_stats() const { return stats.snapshot(); }
+    virtual void reset_stats() { stats.reset(); }
 
     // Retrieves the top k documents based on a query.
-    virtual std::vector<std::string> get_top_k(const std::vector<std::vector<float>>& Q, const size_t top_k) const = 0;
+    virtual std::vector<std::string> get_top_k(const TokenMatrixView& Q, const size_t top_k) const = 0;
+    std::vector<std::string> get_top_k(const std::vector<std::vector<float>>& Q, const size_t top_k) const {
+        const std::vector<float> Q_flat = flatten_tokens(Q, dimensions);
+        return get_top_k(TokenMatrixView{Q_flat.data(), Q.size(), dimensions}, top_k);
+    }
+
+    // Two-stage query path, used by QueryScheduler to batch and pipeline
+    // queries. encode_queries runs the query-side preprocessing for a batch
+    // (FDE encoding for MuveraRetriever; nothing for the brute-force
+    // retrievers) and search_encoded finishes one query from its encoding, so
+    // get_top_k(Q, k) == search_encoded(Q, encode_queries(Q)[0], k).
+    virtual std::vector<std::vector<float>> encode_queries(const RaggedTokenView& Q, const size_t num_threads = 0) const {
+        check_dimensions(Q.dimensions, "AbstractRetriever.encode_queries");
+        return std::vector<std::vector<float>>(Q.num_docs);
+    }
+    // search_encoded with scores, best first; used to merge shards.
+    virtual std::vector<ScoredDocument> search_encoded_scored(const TokenMatrixView& Q, const std::vector<float>& encoding, const size_t top_k) const = 0;
+    virtual std::vector<std::string> search_encoded(const TokenMatrixView& Q, const std::vector<float>& encoding, const size_t top_k) const {
+        return result_ids(search_encoded_scored(Q, encoding, top_k));
+    }
+
+    static std::vector<std::string> result_ids(const std::vector<ScoredDocument>& results) {
+        std::vector<std::string> ids;
+        ids.reserve(results.size());
+        for (const auto& result : results) ids.push_back(result.doc_id);
+        return ids;
+    }
+
+    size_t get_dimensions() const { return dimensions; }
+
+    // Caches query encodings and top-k results of get_top_k calls, keyed on
+    // the exact query tokens. Replaces any existing cache.
+    void enable_query_cache(const QueryCacheOptions& options = QueryCacheOptions()) {
+        std::atomic_store(&query_cache, std::make_shared<QueryCache>(options));
+    }
+    void disable_query_cache() {
+        std::atomic_store(&query_cache, std::shared_ptr<QueryCache>());
+    }
+    // Number of cached queries; 0 when the cache is disabled.
+    size_t query_cache_size() const {
+        const std::shared_ptr<QueryCache> cache = std::atomic_load(&query_cache);
+        return cache ? cache->size() : 0;
+    }
+
+    // Prunes the tokens of every document indexed, added or updated from now
+    // on (see token_pruning.h). Stored documents are not revisited and
+    // queries are never pruned. Default-constructed options disable pruning.
+    void set_token_pruning(const TokenPruningOptions& options) {
+        options.validate();
+        std::atomic_store(&token_pruning, options.is_enabled()
+            ? std::make_shared<const TokenPruningOptions>(options) : std::shared_ptr<const TokenPruningOptions>());
+    }
+    TokenPruningOptions get_token_pruning() const {
+        const std::shared_ptr<const TokenPruningOptions> options = std::atomic_load(&token_pruning);
+        return options ? *options : TokenPruningOptions();
+    }
+};
+
+// A document's row-major token matrix. Documents indexed by index_dataset
+// point into the retriever's token arena; added and updated documents own
+// their tokens, whose buffer moves with the entry.
+struct StoredTokens {
+    const float* data = nullptr;
+    size_t num_tokens = 0;
+    std::vector<float> owned; // empty for arena documents
+
+    StoredTokens() = default;
+    StoredTokens(const float* _data, const size_t _num_tokens): data(_data), num_tokens(_num_tokens) {}
+    StoredTokens(std::vector<float> tokens, const size_t dimensions): owned(std::move(tokens)) {
+        data = owned.data();
+        num_tokens = owned.size() / dimensions;
+    }
+    // A copy would point at the source's buffer.
+    StoredTokens(const StoredTokens&) = delete;
+    StoredTokens& operator=(const StoredTokens&) = delete;
+    StoredTokens(StoredTokens&&) = default;
+    StoredTokens& operator=(StoredTokens&&) = default;
 };
 
 class ExactChamferRetriever : public AbstractRetriever {
     private:
     std::unique_ptr<ExactChamferSimilarity> similarity_engine;
-    std::vector<std::vector<std::vector<float>>> dataset;
+    // Documents are stored as flat row-major token matrices. Appends are
+    // published without blocking readers; swap-removes, in-place updates and
+    // replacing token_arena take dataset_lock exclusively.
+    ChunkedTable<StoredTokens> dataset;
+    LargeBuffer token_arena; // every document of the last index_dataset, contiguous
+    mutable WriterPreferringSharedMutex dataset_lock;
+    MemoryPolicy memory_policy; // guarded by write_mutex
 
     public:
     ExactChamferRetriever(const size_t _dimensions, const size_t _max_points);
 
-    void index_dataset(const std::vector<std::vector<std::vector<float>>>& _dataset, const std::vector<std::string> _doc_ids) override;
+    using AbstractRetriever::index_dataset;
+    using AbstractRetriever::add_document;
+    using AbstractRetriever::update_document;
+    using AbstractRetriever::get_top_k;
+
+    void index_dataset(const RaggedTokenView& _dataset, const std::vector<std::string> _doc_ids) override;
     
     void load_index(const std::string &checkpoint_dir) override;
 
     void save_index(const std::string &checkpoint_dir) override;
 
-    void add_document(const std::vector<std::vector<float>>& P, const std::string doc_id) override;
-    std::vector<std::string> get_top_k(const std::vector<std::vector<float>>& Q, const size_t top_k) const override;
+    void add_document(const TokenMatrixView& P, const std::string doc_id) override;
+
+    // Swap-removes the document with the last one in the dataset.
+    void delete_document(const std::string doc_id) override;
+
+    void update_document(const TokenMatrixView& P, const std::string doc_id) override;
+
+    std::vector<std::string> get_top_k(const TokenMatrixView& Q, const size_t top_k) const override;
+    // Brute-force scan; the encoding is unused. Scores are Chamfer similarities.
+    std::vector<ScoredDocument> search_encoded_scored(const TokenMatrixView& Q, const std::vector<float>& encoding, const size_t top_k) const override;
+
+    // Placement of the token arena that index_dataset copies documents into,
+    // and pinning of the threads that copy them. Queries scan on the caller's
+    // thread; pin_worker_thread pins query threads to match.
+    void set_memory_policy(const MemoryPolicy& policy);
+    MemoryPolicy get_memory_policy() const;
+
+    // "dataset" holds the token matrices.
+    MemoryUsage memory_usage() const override;
+    // Footprint of num_docs documents, before indexing them.
+    static MemoryUsage estimate_memory_usage(const size_t dimensions, const size_t num_docs,
+        const size_t avg_tokens_per_doc, const size_t avg_doc_id_length = 16);
 };
 
 class RelaxedChamferRetriever : public AbstractRetriever {
     private:
     std::unique_ptr<RelaxedChamferSimilarity> similarity_engine;
-    std::vector<std::vector<std::vector<float>>> dataset;
+    // Documents are stored as flat row-major token matrices. Appends are
+    // published without blocking readers; swap-removes, in-place updates and
+    // replacing token_arena take dataset_lock exclusively.
+    ChunkedTable<StoredTokens> dataset;
+    LargeBuffer token_arena; // every document of the last index_dataset, contiguous
+    mutable WriterPreferringSharedMutex dataset_lock;
+    MemoryPolicy memory_policy; // guarded by write_mutex
 
     public:
     RelaxedChamferRetriever(const size_t _dimensions, const size_t _max_points, const size_t _softmax_s);
 
-    void index_dataset(const std::vector<std::vector<std::vector<float>>>& _dataset, const std::vector<std::string> _doc_ids) override;
+    using AbstractRetriever::index_dataset;
+    using AbstractRetriever::add_document;
+    using AbstractRetriever::update_document;
+    using AbstractRetriever::get_top_k;
+
+    void index_dataset(const RaggedTokenView& _dataset, const std::vector<std::string> _doc_ids) override;
     
     void load_index(const std::string &checkpoint_dir) override;
 
     void save_index(const std::string &checkpoint_dir) override;
 
-    void add_document(const std::vector<std::vector<float>>& P, const std::string doc_id) override;
-    std::vector<std::string> get_top_k(const std::vector<std::vector<float>>& Q, const size_t top_k) const override;
+    void add_document(const TokenMatrixView& P, const std::string doc_id) override;
+
+    // Swap-removes the document with the last one in the dataset.
+    void delete_document(const std::string doc_id) override;
+
+    void update_document(const TokenMatrixView& P, const std::string doc_id) override;
+
+    std::vector<std::string> get_top_k(const TokenMatrixView& Q, const size_t top_k) const override;
+    // Brute-force scan; the encoding is unused. Scores are relaxed Chamfer similarities.
+    std::vector<ScoredDocument> search_encoded_scored(const TokenMatrixView& Q, const std::vector<float>& encoding, const size_t top_k) const override;
+
+    // Placement of the token arena that index_dataset copies documents into,
+    // and pinning of the threads that copy them. Queries scan on the caller's
+    // thread; pin_worker_thread pins query threads to match.
+    void set_memory_policy(const MemoryPolicy& policy);
+    MemoryPolicy get_memory_policy() const;
+
+    // "dataset" holds the token matrices.
+    MemoryUsage memory_usage() const override;
+    // Footprint of num_docs documents, before indexing them.
+    static MemoryUsage estimate_memory_usage(const size_t dimensions, const size_t num_docs,
+        const size_t avg_tokens_per_doc, const size_t avg_doc_id_length = 16);
 
     size_t get_softmax_s() { return similarity_engine->get_softmax_s(); };
 };
 
+// One DiskANN graph holding a subset of a MuveraRetriever's documents.
+// The newest segment is mutable and receives inserts until it is full; it is
+// then sealed and only ever loses documents until compaction rebuilds it.
+struct MuveraSegment {
+    std::unique_ptr<diskann::AbstractIndex> index;
+    size_t capacity;
+    std::atomic<size_t> num_inserted;    // including deleted points
+    std::atomic<size_t> num_deleted;     // including consolidated points
+    std::atomic<size_t> pending_deletes; // lazily deleted since the last consolidation
+    bool sealed;                          // guarded by insert_lock
+    WriterPreferringSharedMutex insert_lock; // shared by inserters, exclusive for sealing
+
+    // A filtered dynamic DiskANN index needs a frozen start point per distinct
+    // label, allocated up front, so a filtered segment holds at most
+    // label_capacity labels (0 when unfiltered). labels records every label
+    // admitted to the segment; filtered searches skip segments without theirs.
+    size_t label_capacity;
+    mutable std::mutex labels_mutex;
+    std::unordered_set<uint32_t> labels; // guarded by labels_mutex
+
+    MuveraSegment(std::unique_ptr<diskann::AbstractIndex> _index, const size_t _capacity, const size_t _label_capacity = 0)
+    : index(std::move(_index)), capacity(_capacity), num_inserted(0), num_deleted(0), pending_deletes(0), sealed(false),
+      label_capacity(_label_capacity) {};
+
+    size_t num_live() const { return num_inserted.load() - num_deleted.load(); }
+    bool has_label(const uint32_t label) const {
+        std::lock_guard<std::mutex> guard(labels_mutex);
+        return labels.count(label) != 0;
+    }
+    // Records _labels as held by the segment, unless that would take it past
+    // label_capacity, in which case nothing is recorded and false is returned.
+    bool admit_labels(const std::vector<uint32_t>& _labels) {
+        std::lock_guard<std::mutex> guard(labels_mutex);
+        size_t num_new = 0;
+        for (uint32_t label : _labels) num_new += labels.count(label) == 0;
+        if (labels.size() + num_new > label_capacity) return false;
+        labels.insert(_labels.begin(), _labels.end());
+        return true;
+    }
+};
+
+// MuveraRetriever keeps its documents in a list of DiskANN segments, LSM style:
+// sealed segments plus one mutable segment of max_points capacity. Queries
+// search every segment and merge the per-segment top-k by distance, so the
+// retriever grows without a capacity chosen up front. A background thread
+// consolidates lazy deletes and compacts runs of small sealed segments into
+// one rebuilt segment.
 class MuveraRetriever : public AbstractRetriever {
     private:
+    using SegmentList = std::vector<std::shared_ptr<MuveraSegment>>;
+
     std::unique_ptr<FDESimilarity> fde_engine;
-    std::unique_ptr<diskann::AbstractIndex> diskann_index;
+    std::unique_ptr<diskann::IndexWriteParameters> index_write_params;
     size_t embedding_dim;
 
+    // Published with std::atomic_load/std::atomic_store; readers search a
+    // snapshot. The last segment is the mutable one.
+    std::shared_ptr<const SegmentList> segments;
+    std::mutex segments_mutex; // serializes changes to the segment list, taken after write_mutex
+    std::mutex compaction_mutex; // serializes compactions
+    size_t compaction_merge_factor;
+    std::atomic<size_t> search_width;
+
+    // Deleted documents keep their slot in doc_ids (the DiskANN tag) and are
+    // marked here; DiskANN only lazily deletes them until consolidation.
+    // Slot 0 is never used, as DiskANN reserves tag 0.
+    // Tags are published in doc_ids before the point is inserted into DiskANN,
+    // so every tag a search can return resolves without locking.
+    ChunkedTable<std::atomic<uint8_t>> tombstones;
+
+    // Label filtering, off until enable_labels(). Label strings map to dense
+    // ids from 1; documents without labels get UNLABELED so that every point
+    // in a filtered DiskANN index has a label. Postings keep the tags of
+    // deleted documents until they outnumber the live ones.
+    static constexpr uint32_t UNLABELED = 0;
+
+    MemoryPolicy memory_policy; // guarded by write_mutex
+    std::atomic<bool> labels_enabled;
+    std::atomic<size_t> filter_brute_force_threshold;
+    ChunkedTable<std::vector<uint32_t>> tag_labels; // label ids per tag, parallel to doc_ids
+    mutable WriterPreferringSharedMutex labels_lock; // guards the three maps below, taken after write_mutex
+    std::unordered_map<std::string, uint32_t> label_ids;
+    std::unordered_map<uint32_t, std::vector<uint32_t>> label_postings;
+    std::unordered_map<uint32_t, size_t> label_live;
+
+    // Background consolidation of lazily deleted points and segment compaction.
+    std::thread consolidation_thread;
+    std::mutex consolidation_mutex;
+    std::condition_variable consolidation_cv;
+    bool stop_consolidation;
+    bool compaction_requested;
+    size_t pending_deletes;
+    size_t consolidation_min_deletes;
+    std::chrono::milliseconds consolidation_interval;
+
+    void consolidation_loop();
+    std::shared_ptr<const SegmentList> get_segments() const { return std::atomic_load(&segments); }
+    std::unique_ptr<diskann::AbstractIndex> create_segment_index(const size_t capacity, const size_t label_capacity) const;
+    std::shared_ptr<MuveraSegment> create_mutable_segment() const;
+    // Seals full_segment if it is still the mutable segment and publishes a new one.
+    void roll_mutable_segment(const std::shared_ptr<MuveraSegment>& full_segment);
+    // Picks sealed segments for the next compaction; empty if none is due.
+    std::vector<std::shared_ptr<MuveraSegment>> pick_compaction(const SegmentList& current) const;
+    // Rebuilds the live documents of one picked set of segments; false if none was due.
+    bool compact_once();
+    // Consolidates segments with pending deletes; a segment whose
+    // consolidation fails keeps its count for the next pass.
+    void consolidate_segments();
+
+    // Encodes _dataset into the rows of out, pinning workers if policy says so.
+    void encode_dataset(const RaggedTokenView& _dataset, float* out, const MemoryPolicy& policy) const;
+    // Reserves tags for the documents and builds their sealed segment from
+    // their encodings, one row of embedding_dim floats per document. Other
+    // writers are only blocked while tags are reserved and while the doc_ids
+    // are mapped and the segment published; a doc_id added in between makes
+    // the whole batch fail.
+    void index_encoded(const float* fdes, const std::vector<std::string>& _doc_ids, const std::vector<std::vector<std::string>>& labels);
+
+    // Builds a sealed segment from n encodings. Filtered segments are built
+    // by parallel labeled inserts, since DiskANN's bulk build takes no labels.
+    std::shared_ptr<MuveraSegment> build_segment(const float* fdes, const std::vector<uint32_t>& tags);
+
+    // REQUIRES: write_mutex is held
+    std::vector<uint32_t> intern_labels(const std::vector<std::string>& labels);
+    // REQUIRES: write_mutex is held
+    uint32_t reserve_tag(const std::string& doc_id, const std::vector<uint32_t>& labels = {});
+    // reserve_tag without mapping doc_id, for points that are only mapped
+    // once inserted: a document's replacement, or a bulk-built segment.
+    // REQUIRES: write_mutex is held
+    uint32_t append_tag(const std::string& doc_id, const std::vector<uint32_t>& labels);
+    // Tombstones tag and lazily deletes it from the segment holding it; a
+    // tag whose insert is still in flight is deleted by that insert.
+    // Unmaps doc_id only if it still points at tag.
+    void lazy_delete_tag(const uint32_t tag, const std::string& doc_id);
+    // Drops a deleted tag from its labels' live counts.
+    // REQUIRES: write_mutex is held and the tag is tombstoned
+    void release_labels(const uint32_t tag);
+    // Undoes reserve_tag for a tag whose point never made it into a segment:
+    // tombstones it, unmaps doc_id if it still points at it and releases its labels.
+    // REQUIRES: write_mutex is held
+    void abandon_tag(const uint32_t tag, const std::string& doc_id);
+    // labels == nullptr keeps the document's current labels.
+    void replace_document(const TokenMatrixView& P, const std::string& doc_id, const std::vector<std::string>* labels);
+    // Inserts into the mutable segment without holding write_mutex. If the
+    // insert fails or throws, the tag is abandoned before the error propagates.
+    void insert_encoding(const std::vector<float>& encoding, const uint32_t tag, const std::string& doc_id);
+    // Inserts, rolling the mutable segment while it is full; false if DiskANN
+    // refuses the point for any other reason.
+    bool try_insert_encoding(const std::vector<float>& encoding, const uint32_t tag);
+    int insert_point(MuveraSegment& segment, const float* encoding, const uint32_t tag) const;
+
+    // Per-segment graph search merged by distance; with a label, DiskANN
+    // only visits points carrying it.
+    std::vector<ScoredDocument> search_segments(const std::vector<float>& query_encoding, const size_t top_k, const uint32_t* label) const;
+    // The top_k (distance, tag) candidates, best first, as documents. A
+    // document being replaced can briefly be live under both its old and
+    // new tag; only its best-scoring tag is kept.
+    std::vector<ScoredDocument> top_documents(std::vector<std::pair<float, uint32_t>>& candidates, const size_t top_k) const;
+    // Exact scan over the FDEs of one label's documents.
+    std::vector<ScoredDocument> scan_label(const std::vector<float>& query_encoding, const size_t top_k, const uint32_t label) const;
+
     public:
     MuveraRetriever(const size_t _dimensions, const size_t _max_points, const size_t _d_proj, const size_t _d_final,
         const size_t _k_sim, const size_t _r_reps, const uint64_t _seed
     );
+    ~MuveraRetriever() override;
 
     size_t get_embedding_dim() {
         return embedding_dim;
     }
 
-    void index_dataset(const std::vector<std::vector<std::vector<float>>>& _dataset, const std::vector<std::string> _doc_ids) override;
+    // The background thread consolidates once at least min_deletes documents are
+    // pending, or every interval if any are pending.
+    void set_consolidation_policy(const size_t min_deletes, const std::chrono::milliseconds interval);
+
+    // Synchronously consolidates all pending deletes into the graphs.
+    void consolidate();
+
+    // Background compaction merges merge_factor sealed segments of similar
+    // size (in live documents) into one.
+    void set_compaction_policy(const size_t merge_factor);
+
+    // DiskANN candidate list size L used for each segment search. get_top_k
+    // searches with max(top_k, search_width), so 0 means L = top_k.
+    void set_search_width(const size_t L) { search_width = L; }
+    size_t get_search_width() const { return search_width; }
+
+    // Synchronously runs compactions until none is due.
+    void compact();
+
+    size_t num_segments() const { return get_segments()->size(); }
+
+    // Placement of the FDE buffers that index_dataset and compaction build
+    // segments from, and pinning of the index_dataset encode threads. The
+    // DiskANN graphs allocate their own memory and are not affected.
+    void set_memory_policy(const MemoryPolicy& policy);
+    MemoryPolicy get_memory_policy() const;
+
+    // Graph degree bound R (default 64), build candidate list size L (default
+    // 128) and pruning alpha (default 1.2) of every segment built from now
+    // on. Must be called before index_dataset.
+    void set_graph_parameters(const size_t R, const size_t L, const float alpha);
+
+    // Builds every segment as a DiskANN filtered index so that documents can
+    // carry labels (tenant, language, date bucket, ...) and queries can be
+    // restricted to one label during graph traversal. Must be called before
+    // index_dataset; index_dataset with labels calls it.
+    void enable_labels();
+    bool has_labels() const { return labels_enabled; }
+
+    // Filtered queries on labels with at most this many live documents scan
+    // those documents' FDEs exactly instead of searching the graph, where
+    // very rare labels are poorly connected. Defaults to SIZE_MAX, i.e.
+    // always scan: DiskANN resolves a filter label through the label map it
+    // reads from label files, which dynamic labeled inserts do not fill, so
+    // the filtered graph search is only usable with a DiskANN build that
+    // resolves labels of inserted points.
+    void set_filter_brute_force_threshold(const size_t num_documents) { filter_brute_force_threshold = num_documents; }
+    size_t get_filter_brute_force_threshold() const { return filter_brute_force_threshold; }
+
+    // Includes the FDE encoder's hash / projection / countsketch stages.
+    StatsSnapshot get_stats() const override;
+    void reset_stats() override;
+
+    // Adds the encoder's "fde.*" components, "tombstones", "labels" and
+    // per-segment "diskann.*" estimates to the AbstractRetriever components.
+    MemoryUsage memory_usage() const override;
+    // Peak footprint of index_dataset on num_docs documents: one sealed
+    // segment of num_docs points, the empty mutable segment, and the
+    // "build.fde_buffer" that exists only while the segment is built.
+    static MemoryUsage estimate_memory_usage(const size_t dimensions, const size_t max_points, const size_t d_proj,
+        const size_t d_final, const size_t k_sim, const size_t r_reps, const size_t num_docs,
+        const size_t avg_doc_id_length = 16);
+
+    using AbstractRetriever::index_dataset;
+    using AbstractRetriever::add_document;
+    using AbstractRetriever::update_document;
+    using AbstractRetriever::get_top_k;
+
+    void index_dataset(const RaggedTokenView& _dataset, const std::vector<std::string> _doc_ids) override;
+    // labels[i] are the labels of document i; an empty labels vector means
+    // no document has labels.
+    // REQUIRES: labels.empty() || labels.size() == doc_ids.size()
+    void index_dataset(const RaggedTokenView& _dataset, const std::vector<std::string> _doc_ids, const std::vector<std::vector<std::string>>& labels);
+    void index_dataset(const std::vector<std::vector<std::vector<float>>>& _dataset, const std::vector<std::string> _doc_ids, const std::vector<std::vector<std::string>>& labels) {
+        std::vector<float> tokens;
+        std::vector<int64_t> offsets;
+        flatten_dataset(_dataset, dimensions, tokens, offsets);
+        index_dataset(RaggedTokenView{tokens.data(), offsets.data(), _dataset.size(), tokens.size() / dimensions, dimensions}, _doc_ids, labels);
+    }
+    // Like index_dataset, but encodes into the FDE file at fde_path (see
+    // fde_file.h) chunk_docs documents at a time, committing each chunk, and
+    // builds the graph from the mapped file. If the file already holds
+    // committed rows for this encoder and dataset, encoding resumes after
+    // them; a complete file is reused as is, e.g. by a fresh retriever with
+    // other set_graph_parameters. The memory policy's pinning applies, its
+    // page placement does not. Returns the number of documents encoded.
+    size_t index_dataset_checkpointed(const RaggedTokenView& _dataset, const std::vector<std::string> _doc_ids,
+        const std::string& fde_path, const size_t chunk_docs = 65536, const std::vector<std::vector<std::string>>& labels = {});
+    size_t index_dataset_checkpointed(const MultiVectorFile& file, const std::string& fde_path, const size_t chunk_docs = 65536) {
+        if (file.dtype() == MultiVectorDType::FP32) {
+            return index_dataset_checkpointed(file.view(), file.doc_ids(), fde_path, chunk_docs);
+        }
+        const std::vector<float> tokens = file.decode_tokens();
+        return index_dataset_checkpointed(RaggedTokenView{tokens.data(), file.offsets(), file.num_docs(), file.num_tokens(), file.dimensions()},
+            file.doc_ids(), fde_path, chunk_docs);
+    }
 
     void load_index(const std::string &checkpoint_dir) override;
 
     void save_index(const std::string &checkpoint_dir) override;
 
-    void add_document(const std::vector<std::vector<float>>& P, const std::string doc_id) override;
+    void add_document(const TokenMatrixView& P, const std::string doc_id) override;
+    // REQUIRES: labels.empty() || has_labels()
+    void add_document(const TokenMatrixView& P, const std::string doc_id, const std::vector<std::string>& labels);
+    void add_document(const std::vector<std::vector<float>>& P, const std::string doc_id, const std::vector<std::string>& labels) {
+        const std::vector<float> P_flat = flatten_tokens(P, dimensions);
+        add_document(TokenMatrixView{P_flat.data(), P.size(), dimensions}, doc_id, labels);
+    }
+
+    // Lazily deletes the document from its segment; the slot is reclaimed by
+    // the next consolidation or compaction.
+    void delete_document(const std::string doc_id) override;
+
+    // Lazily deletes the old version and inserts the new one under a fresh tag
+    // into the mutable segment. The document keeps its labels.
+    void update_document(const TokenMatrixView& P, const std::string doc_id) override;
+    // Also replaces the document's labels.
+    // REQUIRES: has_labels()
+    void update_document(const TokenMatrixView& P, const std::string doc_id, const std::vector<std::string>& labels);
+    void update_document(const std::vector<std::vector<float>>& P, const std::string doc_id, const std::vector<std::string>& labels) {
+        const std::vector<float> P_flat = flatten_tokens(P, dimensions);
+        update_document(TokenMatrixView{P_flat.data(), P.size(), dimensions}, doc_id, labels);
+    }
+
+    std::vector<std::string> get_top_k(const TokenMatrixView& Q, const size_t top_k) const override;
+    // Top k among the documents carrying label; empty if no document has it.
+    // REQUIRES: has_labels()
+    std::vector<std::string> get_top_k(const TokenMatrixView& Q, const size_t top_k, const std::string& label) const;
+    std::vector<std::string> get_top_k(const std::vector<std::vector<float>>& Q, const size_t top_k, const std::string& label) const {
+        const std::vector<float> Q_flat = flatten_tokens(Q, dimensions);
+        return get_top_k(TokenMatrixView{Q_flat.data(), Q.size(), dimensions}, top_k, label);
+    }
 
-    std::vector<std::string> get_top_k(const std::vector<std::vector<float>>& Q, const size_t top_k) const override;
+    // Batch FDE query encoding on num_threads threads.
+    std::vector<std::vector<float>> encode_queries(const RaggedTokenView& Q, const size_t num_threads = 0) const override;
+    // Searches every segment with a precomputed query FDE; Q is unused.
+    // Scores are negated DiskANN distances.
+    std::vector<ScoredDocument> search_encoded_scored(const TokenMatrixView& Q, const std::vector<float>& encoding, const size_t top_k) const override;
 };
\ No newline at end of file
@@ -0,0 +1,108 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "fde.h"
+#include "retriever.h"
+
+// Thrown by QueryScheduler::submit_query when a query is not admitted: the
+// scheduler already holds max_pending queries, or has been shut down.
+class QueryRejected : public std::runtime_error {
+    public:
+    using std::runtime_error::runtime_error;
+};
+
+struct QuerySchedulerOptions {
+    // Admission limit on queries that are queued or in flight.
+    size_t max_pending = 1024;
+    // Largest number of queued queries encoded together in one call.
+    size_t max_batch = 32;
+    // How long the encode stage waits for a partial batch to fill up once the
+    // first query of the batch has arrived. Zero encodes whatever is queued.
+    std::chrono::microseconds batch_window = std::chrono::microseconds(100);
+    // Threads used inside each batched encode call.
+    size_t encode_threads = 1;
+    // Search workers; 0 means one per hardware thread.
+    size_t search_threads = 0;
+};
+
+// Asynchronous front end for a retriever. Submitted queries go through two
+// pipelined stages: one thread drains the queue in micro-batches and encodes
+// them with retriever.encode_queries, then a pool of search workers finishes
+// each query with retriever.search_encoded. The next batch is encoded while
+// earlier queries are still in graph search.
+//
+// The retriever must outlive the scheduler. Writes to the retriever may run
+// concurrently with scheduled queries, as with get_top_k.
+class QueryScheduler {
+    public:
+    // Called exactly once per admitted query, from a search worker, with
+    // either the results or the exception the query raised. Exceptions thrown
+    // by the callback itself are discarded.
+    using Callback = std::function<void(std::vector<std::string> results, std::exception_ptr error)>;
+
+    private:
+    struct Request {
+        std::vector<float> tokens;
+        size_t num_tokens;
+        size_t top_k;
+        std::vector<float> encoding;
+        std::exception_ptr error;
+        Callback callback;
+    };
+
+    const AbstractRetriever& retriever;
+    const QuerySchedulerOptions options;
+
+    mutable std::mutex mutex;
+    std::condition_variable encode_cv;
+    std::condition_variable search_cv;
+    std::deque<std::unique_ptr<Request>> submitted; // waiting to be encoded
+    std::deque<std::unique_ptr<Request>> encoded;   // waiting for a search worker
+    size_t pending = 0;                             // admitted and not yet completed
+    bool stopping = false;
+    bool encoding_done = false;
+
+    std::thread encode_thread;
+    std::vector<std::thread> search_threads;
+
+    void enqueue(const TokenMatrixView& Q, const size_t top_k, Callback callback);
+    void encode_batch(std::vector<std::unique_ptr<Request>>& batch);
+    void encode_loop();
+    void search_loop();
+
+    public:
+    QueryScheduler(const AbstractRetriever& _retriever, const QuerySchedulerOptions _options = QuerySchedulerOptions());
+    // Completes every admitted query, then stops the workers.
+    ~QueryScheduler();
+
+    QueryScheduler(const QueryScheduler&) = delete;
+    QueryScheduler& operator=(const QueryScheduler&) = delete;
+
+    // Queues a query and returns a future for its top_k doc_ids, best first.
+    // Q is copied, so the caller's buffer may be reused immediately.
+    // Throws QueryRejected if the query is not admitted.
+    std::future<std::vector<std::string>> submit_query(const TokenMatrixView& Q, const size_t top_k);
+    std::future<std::vector<std::string>> submit_query(const std::vector<std::vector<float>>& Q, const size_t top_k);
+    // Callback form; the callback must not block for long since it runs on a
+    // search worker.
+    void submit_query(const TokenMatrixView& Q, const size_t top_k, Callback callback);
+
+    // Stops admitting queries, completes the admitted ones and joins the
+    // workers. Idempotent.
+    void shutdown();
+
+    // Number of admitted queries that have not completed yet.
+    size_t num_pending() const;
+};
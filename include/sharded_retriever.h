@@ -0,0 +1,195 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "concurrency.h"
+#include "fde.h"
+#include "retriever.h"
+#include "stats.h"
+
+enum class ShardPartition {
+    HASH,  // FNV-1a of the doc_id modulo the number of shards
+    RANGE, // sorted doc_id ranges split at ShardingOptions::range_boundaries
+};
+
+struct ShardingOptions {
+    ShardPartition partition = ShardPartition::HASH;
+    // RANGE only: num_shards - 1 strictly increasing doc_ids. Shard i holds
+    // the doc_ids in [range_boundaries[i - 1], range_boundaries[i]).
+    std::vector<std::string> range_boundaries;
+    // How long a query waits for the shards before answering without the
+    // ones that have not responded. Zero waits indefinitely.
+    std::chrono::milliseconds shard_timeout = std::chrono::milliseconds(1000);
+    // Threads that fan queries out to shards; 0 means one per hardware
+    // thread, and never fewer than the number of shards. One shard runs at
+    // most fanout_threads - (num_shards - 1) searches at a time; its searches
+    // beyond that fail at once, so a slow shard cannot take the threads the
+    // other shards need.
+    size_t fanout_threads = 0;
+};
+
+// One partition of a ShardedRetriever: a retriever in this process, or one
+// served by a ShardServer in another process.
+class Shard {
+    public:
+    virtual ~Shard() = default;
+    virtual void index_dataset(const RaggedTokenView& dataset, const std::vector<std::string>& doc_ids) = 0;
+    virtual void add_document(const TokenMatrixView& P, const std::string& doc_id) = 0;
+    virtual void delete_document(const std::string& doc_id) = 0;
+    virtual void update_document(const TokenMatrixView& P, const std::string& doc_id) = 0;
+    // Throws without searching once the deadline has passed. Remote shards
+    // also give up at the deadline mid-search; an in-process search that has
+    // started runs to completion and the caller stops waiting instead.
+    virtual std::vector<ScoredDocument> search(const TokenMatrixView& Q, const std::vector<float>& encoding,
+        const size_t top_k, const std::chrono::steady_clock::time_point deadline) const = 0;
+    virtual size_t num_documents() const = 0;
+    // Empty for remote shards, which keep their stats in their own process.
+    virtual StatsSnapshot get_stats() const = 0;
+    virtual void reset_stats() = 0;
+    // Empty for remote shards, like get_stats.
+    virtual MemoryUsage memory_usage() const = 0;
+};
+
+// Result of a sharded query, including which shards it is missing.
+struct ShardedSearchResult {
+    std::vector<ScoredDocument> results;  // best first
+    std::vector<size_t> missing_shards;   // timed out or failed
+};
+
+// Partitions documents across shards that each hold their own MuVERA index.
+// Queries are FDE-encoded once, searched on every shard in parallel, and the
+// per-shard top-k lists are merged by score. A shard that misses the
+// deadline or fails is left out of the answer and counted in the
+// shards_missing counter; a query fails only if every shard does.
+//
+// All shards must be built with the same FDE parameters as the
+// ShardedRetriever, or their scores will not be comparable.
+class ShardedRetriever : public AbstractRetriever {
+    private:
+    std::unique_ptr<FDESimilarity> fde_engine;
+    ShardingOptions options;
+    std::vector<std::unique_ptr<Shard>> shards;
+    // Searches running on each shard, capped at max_shard_searches.
+    mutable std::vector<std::atomic<size_t>> shard_searches;
+    size_t max_shard_searches = 1;
+    // Declared last so that in-flight shard searches finish before the
+    // shards are destroyed.
+    std::unique_ptr<ThreadPool> fanout_pool;
+
+    void init(const size_t num_shards);
+
+    public:
+    // num_shards in-process MuveraRetriever shards of max_points_per_shard
+    // documents each.
+    ShardedRetriever(const size_t _dimensions, const size_t _max_points_per_shard, const size_t _d_proj,
+        const size_t _d_final, const size_t _k_sim, const size_t _r_reps, const uint64_t _seed,
+        const size_t num_shards, const ShardingOptions _options = ShardingOptions());
+    // One remote shard per endpoint ("unix:/path" or "tcp:host:port"), each a
+    // ShardServer over a retriever built with the same FDE parameters.
+    ShardedRetriever(const size_t _dimensions, const size_t _d_proj, const size_t _d_final,
+        const size_t _k_sim, const size_t _r_reps, const uint64_t _seed,
+        const std::vector<std::string>& endpoints, const ShardingOptions _options = ShardingOptions());
+    // In-process shards built by the caller, for example with their own
+    // search or memory settings. Each must use the same FDE parameters and
+    // may already hold documents.
+    ShardedRetriever(const size_t _dimensions, const size_t _d_proj, const size_t _d_final,
+        const size_t _k_sim, const size_t _r_reps, const uint64_t _seed,
+        std::vector<std::unique_ptr<AbstractRetriever>> local_shards, const ShardingOptions _options = ShardingOptions());
+    ~ShardedRetriever();
+
+    size_t num_shards() const { return shards.size(); }
+    size_t shard_for(const std::string& doc_id) const;
+    size_t shard_num_documents(const size_t shard) const { return shards.at(shard)->num_documents(); }
+
+    // Sharded query that also reports the shards missing from the answer.
+    ShardedSearchResult search_shards(const TokenMatrixView& Q, const std::vector<float>& encoding, const size_t top_k) const;
+
+    size_t num_documents() const override;
+
+    // Includes the query encoder and every in-process shard.
+    StatsSnapshot get_stats() const override;
+    void reset_stats() override;
+    // The query encoder plus every in-process shard, summed by component.
+    MemoryUsage memory_usage() const override;
+
+    using AbstractRetriever::index_dataset;
+    using AbstractRetriever::add_document;
+    using AbstractRetriever::update_document;
+    using AbstractRetriever::get_top_k;
+
+    // Builds every shard in parallel from its partition of the dataset.
+    void index_dataset(const RaggedTokenView& _dataset, const std::vector<std::string> _doc_ids) override;
+
+    void load_index(const std::string &checkpoint_dir) override;
+
+    void save_index(const std::string &checkpoint_dir) override;
+
+    void add_document(const TokenMatrixView& P, const std::string doc_id) override;
+
+    void delete_document(const std::string doc_id) override;
+
+    void update_document(const TokenMatrixView& P, const std::string doc_id) override;
+
+    // Returns partial results if some shards time out or fail.
+    std::vector<std::string> get_top_k(const TokenMatrixView& Q, const size_t top_k) const override;
+
+    std::vector<std::vector<float>> encode_queries(const RaggedTokenView& Q, const size_t num_threads = 0) const override;
+    std::vector<ScoredDocument> search_encoded_scored(const TokenMatrixView& Q, const std::vector<float>& encoding, const size_t top_k) const override;
+};
+
+// Serves a retriever to remote ShardedRetrievers on a Unix socket
+// ("unix:/path") or TCP ("tcp:host:port"; port 0 picks a free port). Each
+// connection is handled on its own thread. Messages use the host's byte
+// order, so clients and servers must share an architecture.
+class ShardServer {
+    private:
+    AbstractRetriever& retriever;
+    int listen_fd = -1;
+    std::string bound_endpoint;
+    std::string unix_path;
+    std::atomic<bool> stopping{false};
+    // One per accepted client; serve() joins those that have finished. The
+    // fd is closed only after the join, so stop() never shuts down a reused
+    // descriptor.
+    struct Connection {
+        std::thread thread;
+        int fd = -1;
+        std::atomic<bool> finished{false};
+    };
+    std::mutex connections_mutex;
+    std::list<Connection> connections;
+
+    void handle_connection(const int fd, std::atomic<bool>& finished);
+    void reap_finished_connections();
+    // REQUIRES: connections_mutex held
+    void shutdown_connections();
+
+    public:
+    // Binds and listens immediately, so clients may connect before serve().
+    ShardServer(AbstractRetriever& _retriever, const std::string& endpoint);
+    ~ShardServer();
+
+    ShardServer(const ShardServer&) = delete;
+    ShardServer& operator=(const ShardServer&) = delete;
+
+    // The endpoint clients should use, with the actual TCP port.
+    const std::string& endpoint() const { return bound_endpoint; }
+
+    // Accepts and serves connections until stop(); closes them on return.
+    // serve() must have returned before the server is destroyed.
+    void serve();
+    // Makes serve() return within about 100 ms. Shuts down every client
+    // connection, so a client stalled mid-request does not hold serve() up.
+    // Safe from any thread.
+    void stop();
+    // Client connections still being served; closed ones are joined within
+    // about 100 ms.
+    size_t num_connections();
+};
@@ -0,0 +1,155 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Built-in latency and counter instrumentation. Compile with
+// MUVERA_ENABLE_STATS=0 (CMake option MUVERA_ENABLE_STATS=OFF) to turn every
+// recording call into a no-op; get_stats() then returns an empty snapshot.
+#ifndef MUVERA_ENABLE_STATS
+#define MUVERA_ENABLE_STATS 1
+#endif
+
+enum class Stage : size_t {
+    HASH,          // SimHash bucketing and per-bucket aggregation
+    PROJECTION,    // per-bucket AMS / dense projection
+    COUNTSKETCH,   // final d_fde -> d_final projection
+    GRAPH_SEARCH,  // DiskANN search over every segment
+    GRAPH_INSERT,  // DiskANN inserts and bulk builds
+    RERANK,        // merging candidates, tombstone filtering, id translation
+    CHAMFER_SCAN,  // brute-force Chamfer scan
+    FILTER_SCAN,   // exact FDE scan over the documents of a rare label
+    TOKEN_PRUNING, // ingest-time token merging and capping
+    QUERY,         // whole get_top_k call
+    NUM_STAGES
+};
+
+enum class Counter : size_t {
+    DOCUMENTS_ENCODED,
+    QUERIES_ENCODED,
+    OCCUPIED_BUCKETS,      // non-empty SimHash buckets, summed over repetitions
+    SEGMENTS_SEARCHED,
+    GRAPH_CANDIDATES,      // results returned by DiskANN before merging
+    DISTANCE_COMPUTATIONS, // token-token similarities in brute-force scans
+    SHARDS_MISSING,        // shards that timed out or failed during a sharded query
+    QUERY_CACHE_HITS,      // get_top_k calls answered from the query cache
+    QUERY_CACHE_MISSES,
+    ENCODING_CACHE_HITS,   // cache misses that still reused a cached query encoding
+    TOKENS_PRUNED,         // document tokens removed by ingest token pruning
+    NUM_COUNTERS
+};
+
+const char* stage_name(Stage stage);
+const char* counter_name(Counter counter);
+
+struct StageStats {
+    uint64_t count = 0;
+    uint64_t total_ns = 0;
+    // Latencies below are read from the histogram and are accurate to 1/4 of
+    // a power of two.
+    double mean_us = 0.0;
+    double p50_us = 0.0;
+    double p99_us = 0.0;
+    double max_us = 0.0;
+    std::vector<uint64_t> histogram; // see StatsRegistry::bucket_upper_ns
+};
+
+struct StatsSnapshot {
+    bool enabled = MUVERA_ENABLE_STATS;
+    std::map<std::string, StageStats> stages;
+    std::map<std::string, uint64_t> counters;
+
+    // Adds other's samples to this snapshot; percentiles are recomputed.
+    void merge(const StatsSnapshot& other);
+};
+
+inline uint64_t stats_now_ns() {
+#if MUVERA_ENABLE_STATS
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+#else
+    return 0;
+#endif
+}
+
+// Per-instance accumulator. Each thread adds into one of a few cache-line
+// aligned slots with relaxed atomics, so recording never takes a lock and
+// threads only share a slot once there are more threads than slots.
+// snapshot() sums the slots and may be called at any time.
+class StatsRegistry {
+    public:
+    // Histogram bucket b holds durations up to bucket_upper_ns(b): four
+    // buckets per power of two up to ~7.5 s, the last one open-ended.
+    static constexpr size_t sub_buckets = 4;
+    static constexpr size_t num_buckets = 32 * sub_buckets;
+    static uint64_t bucket_upper_ns(size_t bucket);
+    static size_t bucket_for(uint64_t ns);
+
+#if MUVERA_ENABLE_STATS
+    private:
+    static constexpr size_t num_slots = 8;
+    static constexpr size_t num_stages = static_cast<size_t>(Stage::NUM_STAGES);
+    static constexpr size_t num_counters = static_cast<size_t>(Counter::NUM_COUNTERS);
+
+    struct alignas(64) Slot {
+        std::array<std::atomic<uint64_t>, num_counters> counters{};
+        std::array<std::atomic<uint64_t>, num_stages> stage_count{};
+        std::array<std::atomic<uint64_t>, num_stages> stage_total_ns{};
+        std::array<std::array<std::atomic<uint64_t>, num_buckets>, num_stages> histograms{};
+    };
+    std::unique_ptr<Slot[]> slots;
+
+    static size_t thread_slot() {
+        static std::atomic<size_t> next_slot{0};
+        thread_local const size_t slot = next_slot.fetch_add(1, std::memory_order_relaxed) % num_slots;
+        return slot;
+    }
+
+    public:
+    StatsRegistry(): slots(new Slot[num_slots]) {}
+
+    void record(const Stage stage, const uint64_t ns) {
+        Slot& slot = slots[thread_slot()];
+        const size_t s = static_cast<size_t>(stage);
+        slot.stage_count[s].fetch_add(1, std::memory_order_relaxed);
+        slot.stage_total_ns[s].fetch_add(ns, std::memory_order_relaxed);
+        slot.histograms[s][bucket_for(ns)].fetch_add(1, std::memory_order_relaxed);
+    }
+    void add(const Counter counter, const uint64_t value) {
+        slots[thread_slot()].counters[static_cast<size_t>(counter)].fetch_add(value, std::memory_order_relaxed);
+    }
+    StatsSnapshot snapshot() const;
+    void reset();
+#else
+    public:
+    void record(Stage, uint64_t) {}
+    void add(Counter, uint64_t) {}
+    StatsSnapshot snapshot() const { return StatsSnapshot(); }
+    void reset() {}
+#endif
+};
+
+// Records the lifetime of the enclosing scope as one sample of stage.
+class StageTimer {
+#if MUVERA_ENABLE_STATS
+    private:
+    StatsRegistry& registry;
+    Stage stage;
+    uint64_t start;
+
+    public:
+    StageTimer(StatsRegistry& _registry, const Stage _stage): registry(_registry), stage(_stage), start(stats_now_ns()) {}
+    ~StageTimer() { registry.record(stage, stats_now_ns() - start); }
+#else
+    public:
+    StageTimer(StatsRegistry&, Stage) {}
+#endif
+    StageTimer(const StageTimer&) = delete;
+    StageTimer& operator=(const StageTimer&) = delete;
+};
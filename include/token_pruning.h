@@ -0,0 +1,40 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "fde.h"
+
+enum class TokenCapPolicy {
+    NORM,    // keep the max_tokens tokens of largest L2 norm, in document order
+    CLUSTER, // replace the tokens by the means of max_tokens spherical k-means clusters
+};
+
+// Optional ingest stage that shrinks each document's token matrix before it is
+// encoded and stored. Near-duplicate tokens (punctuation, stopwords, repeated
+// terms) barely change a document's Chamfer similarity, which takes a max over
+// document tokens, but every stored token costs rerank memory and scan time.
+struct TokenPruningOptions {
+    // Tokens whose cosine similarity to an earlier kept token (the running
+    // mean of the tokens merged into it) is at least this are merged into it.
+    // 0 disables merging.
+    float merge_threshold = 0.0f;
+    // Cap on tokens per document after merging; 0 means no cap.
+    size_t max_tokens = 0;
+    TokenCapPolicy cap_policy = TokenCapPolicy::NORM;
+
+    bool is_enabled() const { return merge_threshold > 0.0f || max_tokens > 0; }
+    // Throws unless 0 <= merge_threshold <= 1.
+    void validate() const;
+    // Hash of the options; 0 when pruning is disabled.
+    uint64_t fingerprint() const;
+};
+
+// Appends the pruned rows of P to out and returns how many were appended.
+// Empty documents stay empty; every other document keeps at least one token.
+size_t prune_tokens(const TokenMatrixView& P, const TokenPruningOptions& options, std::vector<float>& out);
+
+// Prunes every document of dataset on num_threads threads into tokens and
+// offsets, which are overwritten, and returns a view of them.
+RaggedTokenView prune_dataset(const RaggedTokenView& dataset, const TokenPruningOptions& options,
+    std::vector<float>& tokens, std::vector<int64_t>& offsets, size_t num_threads = 0);
@@ -1,6 +1,8 @@
 #include <immintrin.h> 
 #include <iostream>
+#include <algorithm>
 #include <bitset>
+#include <memory>
 #include <random>
 #include <vector>
 
@@ -9,6 +11,8 @@
 
 #include <cmath>
 
+#include "concurrency.h"
+#include "counter_rng.h"
 #include "fde.h"
 #include "index.h"
 #include "index_config.h"
@@ -16,16 +20,65 @@
 #include "ann_exception.h"
 #include "utils.h"
 
-float dot_product(const std::vector<float>& h, const std::vector<float>& p, size_t _dimensions) {
-    // REQUIRES: h.size() == dimensions && p.size() == dimensions
+void RaggedTokenView::validate() const {
+    if (num_docs > 0 && offsets == nullptr) {
+        throw std::runtime_error("RaggedTokenView.validate: missing offsets.");
+    }
+    for (size_t i = 0; i < num_docs; i++) {
+        if (offsets[i] < 0 || offsets[i] > offsets[i + 1]) {
+            throw std::runtime_error("RaggedTokenView.validate: offsets must be non-negative and non-decreasing.");
+        }
+    }
+    if (num_docs > 0 && static_cast<size_t>(offsets[num_docs]) > num_tokens) {
+        throw std::runtime_error("RaggedTokenView.validate: offsets point past the token matrix.");
+    }
+}
+
+std::vector<float> flatten_tokens(const std::vector<std::vector<float>>& P, size_t dimensions) {
+    std::vector<float> result;
+    result.reserve(P.size() * dimensions);
+    for (const auto& p : P) {
+        if (p.size() != dimensions) {
+            throw std::runtime_error("flatten_tokens: token dimension mismatch.");
+        }
+        result.insert(result.end(), p.begin(), p.end());
+    }
+    return result;
+}
+
+void flatten_dataset(const std::vector<std::vector<std::vector<float>>>& dataset, size_t dimensions,
+    std::vector<float>& tokens, std::vector<int64_t>& offsets)
+{
+    size_t num_tokens = 0;
+    for (const auto& P : dataset) num_tokens += P.size();
+    tokens.clear();
+    tokens.reserve(num_tokens * dimensions);
+    offsets.assign(1, 0);
+    offsets.reserve(dataset.size() + 1);
+    for (const auto& P : dataset) {
+        for (const auto& p : P) {
+            if (p.size() != dimensions) {
+                throw std::runtime_error("flatten_dataset: token dimension mismatch.");
+            }
+            tokens.insert(tokens.end(), p.begin(), p.end());
+        }
+        offsets.push_back(offsets.back() + P.size());
+    }
+}
+
+float dot_product(const float* h, const float* p, size_t _dimensions) {
     float result = 0.0;
     for (size_t i = 0; i < _dimensions; i++)
         result += h[i] * p[i];
     return result;
 };
 
-float cosine_similarity(const std::vector<float>& h, const std::vector<float>& p, size_t _dimensions) {
+float dot_product(const std::vector<float>& h, const std::vector<float>& p, size_t _dimensions) {
     // REQUIRES: h.size() == dimensions && p.size() == dimensions
+    return dot_product(h.data(), p.data(), _dimensions);
+};
+
+float cosine_similarity(const float* h, const float* p, size_t _dimensions) {
     float dot = 0.0f;
     float norm_h = 0.0f;
     float norm_p = 0.0f;
@@ -41,66 +94,84 @@ float cosine_similarity(const std::vector<float>& h, const std::vector<float>& p
     return dot / denom;
 }
 
-// TODO: Implement SIMD optimizations
-// TODO: Use type template to support datatypes other than float floats.
-std::vector<float> SimHash::generate_gaussian_vector(size_t d) {
-    std::mt19937 gen(seed);
-    std::normal_distribution<float>dist(0.0, 1.0); // standard Gaussian
-    std::vector<float> result(d);
-    for (size_t i = 0; i < d; i++)
-        result[i] = dist(gen);
-    return result;
+float cosine_similarity(const std::vector<float>& h, const std::vector<float>& p, size_t _dimensions) {
+    // REQUIRES: h.size() == dimensions && p.size() == dimensions
+    return cosine_similarity(h.data(), p.data(), _dimensions);
+}
+
+// Independent parameter streams; per-repetition streams put the repetition
+// index in the low 32 bits.
+enum ParameterStream : uint64_t {
+    SIMHASH_STREAM = 1,
+    DENSE_S_STREAM = 2,
+    AMS_STREAM = 3,
+    COUNTSKETCH_STREAM = 4,
 };
 
+static uint64_t rep_stream(const ParameterStream stream, const size_t rep_id) {
+    return (static_cast<uint64_t>(stream) << 32) | rep_id;
+}
+
+// TODO: Implement SIMD optimizations
+// TODO: Use type template to support datatypes other than float floats.
 SimHash::SimHash(size_t dimensions, size_t k_sim, size_t _seed): AbstractLSH(dimensions, k_sim), seed(_seed) {
-    hyperplanes.reserve(k_sim);
-    for (size_t i = 0; i < k_sim; i++) {
-        hyperplanes.push_back(generate_gaussian_vector(dimensions));
+    const uint64_t key = counter_stream_key(seed, SIMHASH_STREAM);
+    hyperplanes.resize(k_sim * dimensions);
+    for (size_t i = 0; i < hyperplanes.size(); i++) {
+        hyperplanes[i] = counter_gaussian(counter_random(key, i));
     }
 };
 
-uint32_t SimHash::compute_hash(const std::vector<float>& v) const {
+uint32_t SimHash::compute_hash(const float* v) const {
     uint32_t hash = 0;
     for (size_t i = 0; i < k_sim; i++) {
-        if (dot_product(hyperplanes[i], v, dimensions) >= 0) {
+        if (dot_product(hyperplanes.data() + i * dimensions, v, dimensions) >= 0) {
             hash |= (1ULL << i); // Little Endian
         }
     }
     return hash;
 };
 
+float AbstractChamferSimilarity::compute_similarity(
+    const std::vector<std::vector<float>>& P,
+    const std::vector<std::vector<float>>& Q) const
+{
+    const std::vector<float> P_flat = flatten_tokens(P, dimensions);
+    const std::vector<float> Q_flat = flatten_tokens(Q, dimensions);
+    return compute_similarity(TokenMatrixView{P_flat.data(), P.size(), dimensions},
+                              TokenMatrixView{Q_flat.data(), Q.size(), dimensions});
+};
+
 ExactChamferSimilarity::ExactChamferSimilarity(size_t dimensions): AbstractChamferSimilarity(dimensions) {};
 
 // TODO: SIMD optimizations
-float ExactChamferSimilarity::compute_similarity(
-    const std::vector<std::vector<float>>& P,
-    const std::vector<std::vector<float>>& Q) const
+float ExactChamferSimilarity::compute_similarity(const TokenMatrixView& P, const TokenMatrixView& Q) const
 {
     float result = 0.0;
-    for (auto q: Q) {
+    for (size_t i = 0; i < Q.num_tokens; i++) {
+        const float* q = Q.row(i);
         float best = 0.0;
-        for (auto p: P) {
-            float c = cosine_similarity(p, q, dimensions);
+        for (size_t j = 0; j < P.num_tokens; j++) {
+            float c = cosine_similarity(P.row(j), q, dimensions);
             best = c > best ? c : best;
         }
         result += best;
     }
-    return result / float(Q.size());
+    return result / float(Q.num_tokens);
 };
 
 RelaxedChamferSimilarity::RelaxedChamferSimilarity(size_t _dimensions, size_t _softmax_s):\
     AbstractChamferSimilarity(_dimensions), softmax_s(_softmax_s) {};
 
 // TODO: SIMD optimizations
-float RelaxedChamferSimilarity::compute_similarity(
-    const std::vector<std::vector<float>>& P,
-    const std::vector<std::vector<float>>& Q) const
+float RelaxedChamferSimilarity::compute_similarity(const TokenMatrixView& P, const TokenMatrixView& Q) const
 {
     float result = 0.0;
-    for (auto q: Q) {
+    for (size_t i = 0; i < Q.num_tokens; i++) {
+        const float* q = Q.row(i);
         std::priority_queue<float, std::vector<float>, std::greater<float>> pq;
-        for (auto p: P) {
-            float c = cosine_similarity(p, q, dimensions);
+        for (size_t j = 0; j < P.num_tokens; j++) {
+            float c = cosine_similarity(P.row(j), q, dimensions);
             pq.push(c);
             if (pq.size() > softmax_s) pq.pop();
         }
@@ -112,21 +183,18 @@ float RelaxedChamferSimilarity::compute_similarity(
         }
         result += q_sum / float(m);
     }
-    return result / float(Q.size());
+    return result / float(Q.num_tokens);
 }
 
 
-std::vector<std::vector<float>> FDESimilarity::get_scaled_S() { // (1 / sqrt(d_proj))S
-    std::mt19937 gen(seed + 103);
-    std::uniform_int_distribution<int> binary_dist(0, 1);
-
+std::vector<std::vector<float>> FDESimilarity::get_scaled_S(const size_t rep_id) const { // (1 / sqrt(d_proj))S
+    const uint64_t key = counter_stream_key(seed, rep_stream(DENSE_S_STREAM, rep_id));
     float scale = 1.0 / std::sqrt(d_proj);
     std::vector<std::vector<float>> result(d_proj, std::vector<float>(dimensions));
 
-    for (int i = 0; i < d_proj; i++) {
-        for (int j = 0; j < dimensions; j++) {
-            int sign = binary_dist(gen) ? 1 : -1;
-            result[i][j] = sign * scale;
+    for (size_t i = 0; i < d_proj; i++) {
+        for (size_t j = 0; j < dimensions; j++) {
+            result[i][j] = counter_sign(counter_random(key, i * dimensions + j)) * scale;
         }
     }
     return result;
@@ -134,23 +202,23 @@ std::vector<std::vector<float>> FDESimilarity::get_scaled_S() { // (1 / sqrt(d_p
 
 void FDESimilarity::initialize_scaled_S_AMS() {
     all_S_sparse.clear();
-    all_S_sparse.reserve(r_reps);
+    all_S_sparse.resize(r_reps);
 
-    for (size_t rep_id = 0; rep_id < r_reps; rep_id++) {
+    // Each rep draws from its own counter stream, so reps fill in parallel
+    // and the result does not depend on the thread count.
+    parallel_for(0, r_reps, 0, [&](size_t rep_id) {
         std::vector<int32_t> S_index(dimensions);
         std::vector<int8_t>  S_sign(dimensions);
 
-        std::mt19937 gen(seed + 200 + rep_id);
-        std::uniform_int_distribution<int32_t> index_dist(0, static_cast<int32_t>(d_proj - 1));
-        std::uniform_int_distribution binary_dist(0, 1);
-
+        const uint64_t key = counter_stream_key(seed, rep_stream(AMS_STREAM, rep_id));
         for (size_t i = 0; i < dimensions; ++i) {
-            S_index[i] = index_dist(gen);
-            S_sign[i]  = binary_dist(gen) ? 1 : -1;
+            const uint64_t bits = counter_random(key, i);
+            S_index[i] = counter_range(bits, d_proj);
+            S_sign[i]  = counter_sign(bits) > 0 ? 1 : -1;
         }
 
-        all_S_sparse.emplace_back(std::move(S_index), std::move(S_sign));
-    }
+        all_S_sparse[rep_id] = {std::move(S_index), std::move(S_sign)};
+    });
 }
 
 std::vector<float> FDESimilarity::apply_countsketch(const std::vector<float>& v) const {
@@ -159,7 +227,9 @@ std::vector<float> FDESimilarity::apply_countsketch(const std::vector<float>& v)
     std::vector<float> v_final(d_final, 0.0f);
 
     for (size_t i = 0; i < d_fde; i++) {
-        v_final[countsketch_index[i]] += countsketch_sign[i] * v[i];
+        if (v[i] == 0.0f) continue; // empty buckets project to zero
+        const uint64_t bits = counter_random(countsketch_key, i);
+        v_final[counter_range(bits, d_final)] += counter_sign(bits) * v[i];
     }
     return v_final;
 }
@@ -180,7 +250,7 @@ std::vector<float> FDESimilarity::apply_ams(
     return result;
 }
 
-uint32_t FDESimilarity::compute_hash_from_rep_idx(size_t idx, const std::vector<float>& v) const {
+uint32_t FDESimilarity::compute_hash_from_rep_idx(size_t idx, const float* v) const {
     // REQUIRES: 0 <= idx < r_reps && v.size() == dimensions
     return all_simhash[idx].compute_hash(v);
 };
@@ -198,14 +268,16 @@ std::vector<float> FDESimilarity::compute_proj_from_rep_idx(size_t idx, const st
 };
 
 
-std::vector<float> FDESimilarity::encode_document_once(size_t idx, const std::vector<std::vector<float>> &P) const {
+std::vector<float> FDESimilarity::encode_document_once(size_t idx, const TokenMatrixView &P, EncodeTimings& timings) const {
     // idx is the repetition index
     std::vector<std::vector<float>> P_hash_grouped;
     std::vector<size_t> bucket_counts(B, 0);
+    const uint64_t hash_start = stats_now_ns();
     P_hash_grouped.resize(B);
     for (size_t i = 0; i < B; i++)
         P_hash_grouped[i] = std::vector<float>(dimensions, 0.0);
-    for (auto p: P) {
+    for (size_t t = 0; t < P.num_tokens; t++) {
+        const float* p = P.row(t);
         uint32_t hash_value = compute_hash_from_rep_idx(idx, p);
         bucket_counts[hash_value] ++;
         // TODO: float-check the type conversion here
@@ -215,91 +287,209 @@ std::vector<float> FDESimilarity::encode_document_once(size_t idx, const std::ve
         }
     }
 
+    const uint64_t projection_start = stats_now_ns();
+    timings.hash_ns += projection_start - hash_start;
+    timings.occupied_buckets += B - std::count(bucket_counts.begin(), bucket_counts.end(), 0);
+
     std::vector<float> P_phi;
     P_phi.reserve(B * d_proj);
     for (size_t i = 0; i < B; i++) {
         std::vector<float> projection = use_ams ? apply_ams(P_hash_grouped[i], idx) : compute_proj_from_rep_idx(idx, P_hash_grouped[i]);
         P_phi.insert(P_phi.end(), projection.begin(), projection.end());
     }
+    timings.projection_ns += stats_now_ns() - projection_start;
     return P_phi;
 };
 
-std::vector<float> FDESimilarity::encode_query_once(size_t idx, const std::vector<std::vector<float>> &Q) const {
+std::vector<float> FDESimilarity::encode_query_once(size_t idx, const TokenMatrixView &Q, EncodeTimings& timings) const {
     // idx is the repetition index
+    const uint64_t hash_start = stats_now_ns();
     std::vector<std::vector<float>> Q_hash_grouped;
+#if MUVERA_ENABLE_STATS
+    std::vector<bool> occupied(B, false);
+#endif
     Q_hash_grouped.resize(B);
     for (size_t i = 0; i < B; i++)
         Q_hash_grouped[i] = std::vector<float>(dimensions, 0.0);
-    for (auto q: Q) {
+    for (size_t t = 0; t < Q.num_tokens; t++) {
+        const float* q = Q.row(t);
         uint32_t hash_value = compute_hash_from_rep_idx(idx, q);
+#if MUVERA_ENABLE_STATS
+        occupied[hash_value] = true;
+#endif
         // TODO: float-check the type conversion here
         for (size_t j = 0; j < dimensions; j++) Q_hash_grouped[hash_value][j] += q[j];
     }
+    const uint64_t projection_start = stats_now_ns();
+    timings.hash_ns += projection_start - hash_start;
+#if MUVERA_ENABLE_STATS
+    timings.occupied_buckets += std::count(occupied.begin(), occupied.end(), true);
+#endif
+
     std::vector<float> Q_phi;
     Q_phi.reserve(B * d_proj);
     for (size_t i = 0; i < B; i++) {
         std::vector<float> projection = use_ams ? apply_ams(Q_hash_grouped[i], idx) : compute_proj_from_rep_idx(idx, Q_hash_grouped[i]);
         Q_phi.insert(Q_phi.end(), projection.begin(), projection.end());
     }
+    timings.projection_ns += stats_now_ns() - projection_start;
     return Q_phi;
 }
     
+void FDESimilarity::record_encode(const EncodeTimings& timings, const uint64_t countsketch_ns, const Counter counter) const {
+    stats.record(Stage::HASH, timings.hash_ns);
+    stats.record(Stage::PROJECTION, timings.projection_ns);
+    stats.record(Stage::COUNTSKETCH, countsketch_ns);
+    stats.add(Counter::OCCUPIED_BUCKETS, timings.occupied_buckets);
+    stats.add(counter, 1);
+}
+
 size_t FDESimilarity::get_d_fde() {
     return d_fde;
 };
 
-std::vector<float> FDESimilarity::encode_document(const std::vector<std::vector<float>> &P) const {
+std::vector<float> FDESimilarity::encode_document(const TokenMatrixView &P) const {
     // TODO: implement fill_empty_clusters
     std::vector<float> result;
     result.reserve(d_fde);
+    EncodeTimings timings;
     for(size_t idx = 0; idx < r_reps; idx++) {
-        std::vector<float> trial = encode_document_once(idx, P);
+        std::vector<float> trial = encode_document_once(idx, P, timings);
         result.insert(result.end(), trial.begin(), trial.end());
     }
-    return apply_countsketch(result);
+    const uint64_t countsketch_start = stats_now_ns();
+    std::vector<float> encoding = apply_countsketch(result);
+    record_encode(timings, stats_now_ns() - countsketch_start, Counter::DOCUMENTS_ENCODED);
+    return encoding;
 };
 
-std::vector<float> FDESimilarity::encode_query(const std::vector<std::vector<float>> &Q) const {
+std::vector<float> FDESimilarity::encode_document(const std::vector<std::vector<float>> &P) const {
+    const std::vector<float> P_flat = flatten_tokens(P, dimensions);
+    return encode_document(TokenMatrixView{P_flat.data(), P.size(), dimensions});
+};
+
+std::vector<float> FDESimilarity::encode_query(const TokenMatrixView &Q) const {
     std::vector<float> result;
     result.reserve(d_fde);
+    EncodeTimings timings;
     for(size_t idx = 0; idx < r_reps; idx++) {
-        std::vector<float> trial = encode_query_once(idx, Q);
+        std::vector<float> trial = encode_query_once(idx, Q, timings);
         result.insert(result.end(), trial.begin(), trial.end());
     }
-    return apply_countsketch(result);
+    const uint64_t countsketch_start = stats_now_ns();
+    std::vector<float> encoding = apply_countsketch(result);
+    record_encode(timings, stats_now_ns() - countsketch_start, Counter::QUERIES_ENCODED);
+    return encoding;
 };
 
+std::vector<float> FDESimilarity::encode_query(const std::vector<std::vector<float>> &Q) const {
+    const std::vector<float> Q_flat = flatten_tokens(Q, dimensions);
+    return encode_query(TokenMatrixView{Q_flat.data(), Q.size(), dimensions});
+};
+
+static void store_encoding(const std::vector<float>& encoding, float* out) {
+    std::memcpy(out, encoding.data(), encoding.size() * sizeof(float));
+}
+
+static void store_encoding(const std::vector<float>& encoding, int8_t* out) {
+    float max_abs = 0.0f;
+    for (float x : encoding) max_abs = std::max(max_abs, std::abs(x));
+    const float scale = max_abs > 0.0f ? 127.0f / max_abs : 0.0f;
+    for (size_t i = 0; i < encoding.size(); i++) {
+        out[i] = static_cast<int8_t>(std::lrint(encoding[i] * scale));
+    }
+}
+
+void FDESimilarity::encode_documents(const RaggedTokenView& P, float* out, size_t num_threads) const {
+    P.validate();
+    parallel_for(0, P.num_docs, num_threads, [&](size_t i) {
+        store_encoding(encode_document(P.document(i)), out + i * d_final);
+    });
+}
+
+void FDESimilarity::encode_documents(const RaggedTokenView& P, int8_t* out, size_t num_threads) const {
+    P.validate();
+    parallel_for(0, P.num_docs, num_threads, [&](size_t i) {
+        store_encoding(encode_document(P.document(i)), out + i * d_final);
+    });
+}
+
+void FDESimilarity::encode_queries(const RaggedTokenView& Q, float* out, size_t num_threads) const {
+    Q.validate();
+    parallel_for(0, Q.num_docs, num_threads, [&](size_t i) {
+        store_encoding(encode_query(Q.document(i)), out + i * d_final);
+    });
+}
+
+void FDESimilarity::encode_queries(const RaggedTokenView& Q, int8_t* out, size_t num_threads) const {
+    Q.validate();
+    parallel_for(0, Q.num_docs, num_threads, [&](size_t i) {
+        store_encoding(encode_query(Q.document(i)), out + i * d_final);
+    });
+}
+
 
 FDESimilarity::FDESimilarity(const size_t _dimensions, const size_t _d_proj, const size_t _d_final,
     const size_t _k_sim, const size_t _r_reps, const uint64_t _seed
 ): AbstractChamferSimilarity(_dimensions), d_proj(_d_proj), d_final(_d_final),
 k_sim(_k_sim), r_reps(_r_reps), seed(_seed) {
     B = 1ULL << _k_sim;
+    const uint64_t simhash_key = counter_stream_key(seed, SIMHASH_STREAM);
+    // SimHash has no empty state, so build each rep's hyperplanes in parallel
+    // and move them into place in rep order.
+    std::vector<std::unique_ptr<SimHash>> simhash(r_reps);
+    parallel_for(0, r_reps, 0, [&](size_t i) {
+        simhash[i] = std::make_unique<SimHash>(dimensions, k_sim, counter_random(simhash_key, i));
+    });
     all_simhash.reserve(r_reps);
-    all_S.reserve(r_reps);
-    for (size_t i = 0; i < r_reps; i++) {
-        all_simhash.emplace_back(dimensions, k_sim, seed + i);
-        all_S.push_back(get_scaled_S());
-    }
+    for (size_t i = 0; i < r_reps; i++) all_simhash.push_back(std::move(*simhash[i]));
     initialize_scaled_S_AMS();
+    if (!use_ams) {
+        all_S.resize(r_reps);
+        parallel_for(0, r_reps, 0, [&](size_t i) { all_S[i] = get_scaled_S(i); });
+    }
     d_fde = B * d_proj * r_reps;
+    countsketch_key = counter_stream_key(seed, COUNTSKETCH_STREAM);
+};
 
-    // Initialize CountSketch
-    std::mt19937 gen(seed + 107);
-    std::uniform_int_distribution<int32_t> index_dist(0, d_final - 1);
-    std::uniform_int_distribution<int> binary_dist(0, 1);
+uint64_t FDESimilarity::fingerprint() const {
+    uint64_t hash = splitmix64(seed);
+    for (uint64_t parameter : {uint64_t(dimensions), uint64_t(d_proj), uint64_t(d_final), uint64_t(k_sim), uint64_t(r_reps), uint64_t(use_ams)}) {
+        hash = splitmix64(hash ^ parameter);
+    }
+    return hash;
+}
 
-    countsketch_index.resize(d_fde);
-    countsketch_sign.resize(d_fde);
-    for (size_t i = 0; i < d_fde; i++) {
-        countsketch_index[i] = index_dist(gen);
-        countsketch_sign[i] = binary_dist(gen) ? 1 : -1;
+MemoryUsage FDESimilarity::memory_usage() const {
+    MemoryUsage usage;
+    size_t simhash_bytes = all_simhash.capacity() * sizeof(SimHash);
+    for (const SimHash& simhash : all_simhash) simhash_bytes += simhash.hyperplane_bytes();
+    usage.add("fde.simhash_hyperplanes", simhash_bytes);
+    size_t ams_bytes = all_S_sparse.capacity() * sizeof(all_S_sparse[0]);
+    for (const auto& [S_index, S_sign] : all_S_sparse) {
+        ams_bytes += S_index.capacity() * sizeof(int32_t) + S_sign.capacity() * sizeof(int8_t);
     }
-};
+    usage.add("fde.ams_tables", ams_bytes);
+    if (!all_S.empty()) {
+        size_t dense_bytes = all_S.capacity() * sizeof(all_S[0]);
+        for (const auto& S : all_S) {
+            dense_bytes += S.capacity() * sizeof(S[0]);
+            for (const auto& row : S) dense_bytes += row.capacity() * sizeof(float);
+        }
+        usage.add("fde.dense_projections", dense_bytes);
+    }
+    return usage;
+}
 
-float FDESimilarity::compute_similarity(
+MemoryUsage FDESimilarity::estimate_memory_usage(const size_t dimensions, const size_t k_sim, const size_t r_reps) {
+    // Mirrors memory_usage() for the AMS projection the constructor builds.
+    MemoryUsage usage;
+    usage.add("fde.simhash_hyperplanes", r_reps * (sizeof(SimHash) + k_sim * dimensions * sizeof(float)));
+    usage.add("fde.ams_tables", r_reps * (sizeof(std::pair<std::vector<int32_t>, std::vector<int8_t>>)
+        + dimensions * (sizeof(int32_t) + sizeof(int8_t))));
+    return usage;
+}
 
-    const std::vector<std::vector<float>>& P,
-    const std::vector<std::vector<float>>& Q) const {
+float FDESimilarity::compute_similarity(const TokenMatrixView& P, const TokenMatrixView& Q) const {
     return cosine_similarity(encode_document(P), encode_query(Q), d_final);
 };
@@ -0,0 +1,149 @@
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+
+#include "counter_rng.h"
+#include "fde_file.h"
+
+static const char fde_file_magic[8] = {'M', 'U', 'V', 'E', 'R', 'A', 'F', 'D'};
+static const uint32_t fde_file_version = 1;
+static const size_t fde_file_alignment = 64;
+static const char* fde_manifest_format = "muvera-fde-manifest";
+
+uint64_t dataset_fingerprint(const RaggedTokenView& dataset, const std::vector<std::string>& doc_ids) {
+    uint64_t hash = splitmix64(dataset.num_docs ^ (dataset.dimensions << 40));
+    for (size_t i = 0; i < dataset.num_docs; i++) {
+        hash = splitmix64(hash ^ static_cast<uint64_t>(dataset.offsets[i + 1] - dataset.offsets[i]));
+    }
+    for (const std::string& doc_id : doc_ids) {
+        for (unsigned char c : doc_id) hash = (hash ^ c) * 0x100000001b3ULL;
+        hash = splitmix64(hash ^ doc_id.size());
+    }
+    return hash;
+}
+
+FDEMatrixFile::FDEMatrixFile(const std::string& _path, const size_t num_docs, const size_t d_final,
+    const uint64_t encoder_fingerprint, const uint64_t dataset_fingerprint)
+    : path(_path), header() {
+    std::memcpy(header.magic, fde_file_magic, sizeof(header.magic));
+    header.version = fde_file_version;
+    header.num_docs = num_docs;
+    header.d_final = d_final;
+    header.encoder_fingerprint = encoder_fingerprint;
+    header.dataset_fingerprint = dataset_fingerprint;
+    header.payload_offset = fde_file_alignment;
+    mapping_size = header.payload_offset + num_docs * d_final * sizeof(float);
+
+    fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+        throw std::runtime_error("FDEMatrixFile: cannot open " + path + ": " + std::strerror(errno));
+    }
+    FDEFileHeader existing;
+    struct stat st;
+    const bool reusable = ::fstat(fd, &st) == 0 && static_cast<size_t>(st.st_size) == mapping_size
+        && ::pread(fd, &existing, sizeof(existing), 0) == static_cast<ssize_t>(sizeof(existing))
+        && std::memcmp(&existing, &header, sizeof(header)) == 0;
+    if (!reusable) {
+        // Drop any stale manifest before the rows it described are overwritten.
+        std::remove(manifest_path().c_str());
+        if (::ftruncate(fd, 0) != 0 || ::ftruncate(fd, mapping_size) != 0
+            || ::pwrite(fd, &header, sizeof(header), 0) != static_cast<ssize_t>(sizeof(header))
+            || ::fsync(fd) != 0) {
+            const std::string reason = std::strerror(errno);
+            ::close(fd);
+            throw std::runtime_error("FDEMatrixFile: cannot size " + path + ": " + reason);
+        }
+    }
+    mapping = ::mmap(nullptr, mapping_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (mapping == MAP_FAILED) {
+        mapping = nullptr;
+        ::close(fd);
+        throw std::runtime_error("FDEMatrixFile: cannot map " + path + ": " + std::strerror(errno));
+    }
+    if (reusable) {
+        completed = read_manifest();
+    } else {
+        write_manifest();
+    }
+}
+
+FDEMatrixFile::~FDEMatrixFile() {
+    close();
+}
+
+void FDEMatrixFile::close() {
+    if (mapping != nullptr) ::munmap(mapping, mapping_size);
+    if (fd >= 0) ::close(fd);
+    mapping = nullptr;
+    fd = -1;
+}
+
+size_t FDEMatrixFile::read_manifest() const {
+    std::ifstream in(manifest_path());
+    std::string format;
+    int version = 0;
+    uint64_t encoder = 0, dataset = 0, num_docs = 0, d_final = 0, completed_docs = 0;
+    std::string key;
+    if (!(in >> format >> version) || format != fde_manifest_format || version != 1) return 0;
+    if (!(in >> key >> encoder) || key != "encoder_fingerprint") return 0;
+    if (!(in >> key >> dataset) || key != "dataset_fingerprint") return 0;
+    if (!(in >> key >> num_docs) || key != "num_docs") return 0;
+    if (!(in >> key >> d_final) || key != "d_final") return 0;
+    if (!(in >> key >> completed_docs) || key != "completed_docs") return 0;
+    if (encoder != header.encoder_fingerprint || dataset != header.dataset_fingerprint
+        || num_docs != header.num_docs || d_final != header.d_final || completed_docs > num_docs) {
+        return 0;
+    }
+    return completed_docs;
+}
+
+void FDEMatrixFile::write_manifest() const {
+    // Written beside the manifest and renamed over it, so a crash leaves
+    // either the old progress or the new one.
+    const std::string temp_path = manifest_path() + ".tmp";
+    {
+        std::ofstream out(temp_path, std::ios::trunc);
+        out << fde_manifest_format << " 1\n"
+            << "encoder_fingerprint " << header.encoder_fingerprint << "\n"
+            << "dataset_fingerprint " << header.dataset_fingerprint << "\n"
+            << "num_docs " << header.num_docs << "\n"
+            << "d_final " << header.d_final << "\n"
+            << "completed_docs " << completed << "\n";
+        out.close();
+        if (!out) {
+            throw std::runtime_error("FDEMatrixFile: failed writing " + temp_path + ".");
+        }
+    }
+    const int temp_fd = ::open(temp_path.c_str(), O_RDONLY);
+    if (temp_fd >= 0) {
+        ::fsync(temp_fd);
+        ::close(temp_fd);
+    }
+    if (std::rename(temp_path.c_str(), manifest_path().c_str()) != 0) {
+        throw std::runtime_error("FDEMatrixFile: cannot replace " + manifest_path() + ": " + std::strerror(errno));
+    }
+}
+
+void FDEMatrixFile::commit(const size_t end) {
+    if (end < completed || end > header.num_docs) {
+        throw std::runtime_error("FDEMatrixFile.commit: end " + std::to_string(end) + " is outside ["
+            + std::to_string(completed) + ", " + std::to_string(header.num_docs) + "].");
+    }
+    if (end == completed) return;
+    const size_t row_bytes = header.d_final * sizeof(float);
+    const size_t page_size = static_cast<size_t>(::sysconf(_SC_PAGESIZE));
+    const size_t begin = (header.payload_offset + completed * row_bytes) / page_size * page_size;
+    const size_t limit = header.payload_offset + end * row_bytes;
+    if (::msync(static_cast<char*>(mapping) + begin, limit - begin, MS_SYNC) != 0) {
+        throw std::runtime_error("FDEMatrixFile.commit: cannot flush " + path + ": " + std::strerror(errno));
+    }
+    completed = end;
+    write_manifest();
+}
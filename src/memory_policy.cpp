@@ -0,0 +1,178 @@
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+
+#include "memory_policy.h"
+
+// From <numaif.h>; spelled out so that the library needs no libnuma headers.
+static const int mpol_bind = 2;
+static const int mpol_interleave = 3;
+static const size_t huge_page_size = size_t(2) << 20;
+
+// Parses a sysfs CPU / node list such as "0-3,8,10-11".
+static std::vector<int> parse_id_list(const std::string& list) {
+    std::vector<int> ids;
+    std::stringstream stream(list);
+    std::string range;
+    while (std::getline(stream, range, ',')) {
+        if (range.empty() || range == "\n") continue;
+        const size_t dash = range.find('-');
+        const int first = std::stoi(range.substr(0, dash));
+        const int last = dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+        for (int id = first; id <= last; id++) ids.push_back(id);
+    }
+    return ids;
+}
+
+static std::vector<int> read_id_list(const std::string& path) {
+    std::ifstream in(path);
+    std::string line;
+    if (!in || !std::getline(in, line)) return {};
+    return parse_id_list(line);
+}
+
+std::vector<int> numa_nodes() {
+    std::vector<int> nodes = read_id_list("/sys/devices/system/node/online");
+    if (nodes.empty()) nodes.push_back(0);
+    return nodes;
+}
+
+std::vector<int> numa_node_cpus(const int node) {
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) return {};
+    std::vector<int> cpus;
+    if (node >= 0) {
+        cpus = read_id_list("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+    }
+    if (cpus.empty()) {
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) cpus.push_back(cpu);
+    }
+    std::vector<int> result;
+    for (int cpu : cpus) {
+        if (cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowed)) result.push_back(cpu);
+    }
+    return result;
+}
+
+void MemoryPolicy::validate() const {
+    if (numa != NumaPolicy::BIND) return;
+    const std::vector<int> nodes = numa_nodes();
+    if (std::find(nodes.begin(), nodes.end(), numa_node) == nodes.end()) {
+        throw std::runtime_error("MemoryPolicy.validate: NUMA node " + std::to_string(numa_node) + " is not online.");
+    }
+}
+
+bool pin_worker_thread(const MemoryPolicy& policy, const size_t worker) {
+    if (!policy.pin_threads) return false;
+    std::vector<int> cpus;
+    switch (policy.numa) {
+        case NumaPolicy::BIND:
+            cpus = numa_node_cpus(policy.numa_node);
+            break;
+        case NumaPolicy::INTERLEAVE: {
+            const std::vector<int> nodes = numa_nodes();
+            cpus = numa_node_cpus(nodes[worker % nodes.size()]);
+            break;
+        }
+        case NumaPolicy::FIRST_TOUCH: {
+            const std::vector<int> allowed = numa_node_cpus(-1);
+            if (!allowed.empty()) cpus = {allowed[worker % allowed.size()]};
+            break;
+        }
+    }
+    if (cpus.empty()) return false;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu : cpus) CPU_SET(cpu, &set);
+    return sched_setaffinity(0, sizeof(set), &set) == 0;
+}
+
+// Applies the NUMA part of policy to [addr, addr + length) before first touch.
+static bool apply_numa_policy(void* addr, const size_t length, const MemoryPolicy& policy) {
+    if (policy.numa == NumaPolicy::FIRST_TOUCH) return false;
+    const std::vector<int> nodes = policy.numa == NumaPolicy::BIND ? std::vector<int>{policy.numa_node} : numa_nodes();
+    const size_t bits_per_word = 8 * sizeof(unsigned long);
+    int max_node = 0;
+    for (int node : nodes) max_node = std::max(max_node, node);
+    std::vector<unsigned long> mask(max_node / bits_per_word + 1, 0);
+    for (int node : nodes) mask[node / bits_per_word] |= 1UL << (node % bits_per_word);
+    const int mode = policy.numa == NumaPolicy::BIND ? mpol_bind : mpol_interleave;
+    return syscall(SYS_mbind, addr, length, mode, mask.data(), mask.size() * bits_per_word + 1, 0) == 0;
+}
+
+LargeBuffer::LargeBuffer(const size_t bytes, const MemoryPolicy& policy) : bytes_(bytes) {
+    if (bytes == 0) return;
+    if (policy.huge_pages == HugePagePolicy::NONE && policy.numa == NumaPolicy::FIRST_TOUCH) {
+        const size_t alignment = 64;
+        data_ = std::aligned_alloc(alignment, (bytes + alignment - 1) / alignment * alignment);
+        if (data_ == nullptr) throw std::bad_alloc();
+        return;
+    }
+
+    const size_t length = (bytes + huge_page_size - 1) / huge_page_size * huge_page_size;
+    if (policy.huge_pages == HugePagePolicy::EXPLICIT) {
+        void* addr = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (addr != MAP_FAILED) {
+            data_ = addr;
+            mapped_bytes_ = length;
+            huge_pages_ = true;
+        }
+    }
+    if (data_ == nullptr) {
+        // Over-map by one huge page and trim, so that the buffer starts on a
+        // 2 MB boundary and transparent huge pages can back all of it.
+        const size_t padded = length + huge_page_size;
+        void* addr = mmap(nullptr, padded, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (addr == MAP_FAILED) throw std::bad_alloc();
+        const uintptr_t start = reinterpret_cast<uintptr_t>(addr);
+        const uintptr_t aligned = (start + huge_page_size - 1) / huge_page_size * huge_page_size;
+        if (aligned > start) munmap(addr, aligned - start);
+        const size_t tail = start + padded - (aligned + length);
+        if (tail > 0) munmap(reinterpret_cast<void*>(aligned + length), tail);
+        data_ = reinterpret_cast<void*>(aligned);
+        mapped_bytes_ = length;
+        if (policy.huge_pages != HugePagePolicy::NONE) {
+            huge_pages_ = madvise(data_, length, MADV_HUGEPAGE) == 0;
+        }
+    }
+    numa_applied_ = apply_numa_policy(data_, mapped_bytes_, policy);
+}
+
+void LargeBuffer::release() {
+    if (data_ == nullptr) return;
+    if (mapped_bytes_ > 0) {
+        munmap(data_, mapped_bytes_);
+    } else {
+        std::free(data_);
+    }
+    data_ = nullptr;
+}
+
+LargeBuffer::LargeBuffer(LargeBuffer&& other) noexcept
+    : data_(other.data_), bytes_(other.bytes_), mapped_bytes_(other.mapped_bytes_),
+      huge_pages_(other.huge_pages_), numa_applied_(other.numa_applied_) {
+    other.data_ = nullptr;
+}
+
+LargeBuffer& LargeBuffer::operator=(LargeBuffer&& other) noexcept {
+    if (this != &other) {
+        release();
+        data_ = other.data_;
+        bytes_ = other.bytes_;
+        mapped_bytes_ = other.mapped_bytes_;
+        huge_pages_ = other.huge_pages_;
+        numa_applied_ = other.numa_applied_;
+        other.data_ = nullptr;
+    }
+    return *this;
+}
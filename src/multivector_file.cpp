@@ -0,0 +1,277 @@
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+
+#include "multivector_file.h"
+
+static const char multivector_magic[8] = {'M', 'U', 'V', 'E', 'R', 'A', 'M', 'V'};
+static const uint32_t multivector_version = 1;
+static const size_t multivector_alignment = 64;
+
+static size_t dtype_size(const uint32_t dtype) {
+    switch (static_cast<MultiVectorDType>(dtype)) {
+        case MultiVectorDType::FP32: return sizeof(float);
+        case MultiVectorDType::FP16: return sizeof(uint16_t);
+    }
+    throw std::runtime_error("MultiVectorFile: unknown dtype " + std::to_string(dtype));
+}
+
+// IEEE 754 binary16 conversion with round-to-nearest-even. Implemented in
+// software because the library is not built with F16C.
+uint16_t float_to_fp16(const float x) {
+    uint32_t f;
+    std::memcpy(&f, &x, sizeof(f));
+    const uint32_t sign = (f >> 16) & 0x8000;
+    const uint32_t abs = f & 0x7fffffff;
+    if (abs >= 0x7f800000) { // inf or nan
+        return sign | 0x7c00 | (abs > 0x7f800000 ? 0x200 : 0);
+    }
+    if (abs >= 0x477ff000) { // rounds to >= 65520: overflow to inf
+        return sign | 0x7c00;
+    }
+    if (abs < 0x38800000) { // subnormal or zero in fp16
+        if (abs < 0x33000000) return sign; // below half the smallest subnormal
+        const uint32_t mantissa = (abs & 0x7fffff) | 0x800000;
+        const int shift = 126 - (abs >> 23); // value / 2^-24 == mantissa >> shift
+        uint32_t half = mantissa >> shift;
+        const uint32_t rest = mantissa & ((1u << shift) - 1);
+        const uint32_t halfway = 1u << (shift - 1);
+        if (rest > halfway || (rest == halfway && (half & 1))) half++;
+        return sign | half;
+    }
+    uint32_t half = ((abs >> 13) - (112 << 10));
+    const uint32_t rest = abs & 0x1fff;
+    if (rest > 0x1000 || (rest == 0x1000 && (half & 1))) half++;
+    return sign | half;
+}
+
+float fp16_to_float(const uint16_t h) {
+    const uint32_t sign = static_cast<uint32_t>(h & 0x8000) << 16;
+    uint32_t exponent = (h >> 10) & 0x1f;
+    uint32_t mantissa = h & 0x3ff;
+    uint32_t f;
+    if (exponent == 0x1f) {
+        f = sign | 0x7f800000 | (mantissa << 13);
+    } else if (exponent != 0) {
+        f = sign | ((exponent + 112) << 23) | (mantissa << 13);
+    } else if (mantissa == 0) {
+        f = sign;
+    } else { // subnormal: normalize
+        exponent = 113;
+        while ((mantissa & 0x400) == 0) {
+            mantissa <<= 1;
+            exponent--;
+        }
+        f = sign | (exponent << 23) | ((mantissa & 0x3ff) << 13);
+    }
+    float x;
+    std::memcpy(&x, &f, sizeof(x));
+    return x;
+}
+
+
+MultiVectorFileWriter::MultiVectorFileWriter(const std::string& _path, const size_t _dimensions, const MultiVectorDType _dtype)
+    : out(_path, std::ios::binary | std::ios::trunc), path(_path), header(), offsets{0} {
+    if (!out) {
+        throw std::runtime_error("MultiVectorFileWriter: cannot open " + path + " for writing.");
+    }
+    if (_dimensions == 0) {
+        throw std::runtime_error("MultiVectorFileWriter: dimensions must be positive.");
+    }
+    std::memcpy(header.magic, multivector_magic, sizeof(header.magic));
+    header.version = multivector_version;
+    header.dtype = static_cast<uint32_t>(_dtype);
+    dtype_size(header.dtype);
+    header.dimensions = _dimensions;
+    header.payload_offset = sizeof(MultiVectorFileHeader);
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+}
+
+MultiVectorFileWriter::~MultiVectorFileWriter() {
+    if (!closed) {
+        try {
+            close();
+        } catch (...) {
+        }
+    }
+}
+
+void MultiVectorFileWriter::pad_to_alignment() {
+    static const char zeros[multivector_alignment] = {};
+    const size_t position = out.tellp();
+    const size_t padding = (multivector_alignment - position % multivector_alignment) % multivector_alignment;
+    out.write(zeros, padding);
+}
+
+void MultiVectorFileWriter::add_document(const TokenMatrixView& P, const std::string& doc_id) {
+    if (closed) {
+        throw std::runtime_error("MultiVectorFileWriter.add_document: writer is closed.");
+    }
+    if (P.dimensions != header.dimensions) {
+        throw std::runtime_error("MultiVectorFileWriter.add_document: expected " + std::to_string(header.dimensions)
+            + "-dimensional tokens, got " + std::to_string(P.dimensions) + ".");
+    }
+    const size_t num_values = P.num_tokens * P.dimensions;
+    if (static_cast<MultiVectorDType>(header.dtype) == MultiVectorDType::FP16) {
+        fp16_buffer.resize(num_values);
+        for (size_t i = 0; i < num_values; i++) fp16_buffer[i] = float_to_fp16(P.data[i]);
+        out.write(reinterpret_cast<const char*>(fp16_buffer.data()), num_values * sizeof(uint16_t));
+    } else {
+        out.write(reinterpret_cast<const char*>(P.data), num_values * sizeof(float));
+    }
+    offsets.push_back(offsets.back() + P.num_tokens);
+    doc_ids.push_back(doc_id);
+}
+
+void MultiVectorFileWriter::close() {
+    if (closed) return;
+    closed = true;
+    header.num_docs = doc_ids.size();
+    header.num_tokens = offsets.back();
+
+    pad_to_alignment();
+    header.offsets_offset = out.tellp();
+    out.write(reinterpret_cast<const char*>(offsets.data()), offsets.size() * sizeof(int64_t));
+
+    pad_to_alignment();
+    header.ids_offset = out.tellp();
+    std::vector<uint64_t> id_offsets{0};
+    for (const std::string& id : doc_ids) id_offsets.push_back(id_offsets.back() + id.size());
+    out.write(reinterpret_cast<const char*>(id_offsets.data()), id_offsets.size() * sizeof(uint64_t));
+    for (const std::string& id : doc_ids) out.write(id.data(), id.size());
+
+    out.seekp(0);
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    out.close();
+    if (!out) {
+        throw std::runtime_error("MultiVectorFileWriter: failed writing " + path + ".");
+    }
+}
+
+void write_multivector_file(const std::string& path, const RaggedTokenView& dataset,
+    const std::vector<std::string>& doc_ids, const MultiVectorDType dtype)
+{
+    if (dataset.num_docs != doc_ids.size()) {
+        throw std::runtime_error("write_multivector_file: dataset and doc_ids have different sizes.");
+    }
+    dataset.validate();
+    MultiVectorFileWriter writer(path, dataset.dimensions, dtype);
+    for (size_t i = 0; i < dataset.num_docs; i++) {
+        writer.add_document(dataset.document(i), doc_ids[i]);
+    }
+    writer.close();
+}
+
+
+MultiVectorFile::MultiVectorFile(const std::string& path) {
+    fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw std::runtime_error("MultiVectorFile: cannot open " + path + ": " + std::strerror(errno));
+    }
+    struct stat st;
+    if (::fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(MultiVectorFileHeader)) {
+        ::close(fd);
+        throw std::runtime_error("MultiVectorFile: " + path + " is too small to be a multi-vector file.");
+    }
+    mapping_size = st.st_size;
+    mapping = ::mmap(nullptr, mapping_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (mapping == MAP_FAILED) {
+        mapping = nullptr;
+        ::close(fd);
+        throw std::runtime_error("MultiVectorFile: cannot map " + path + ": " + std::strerror(errno));
+    }
+
+    const char* base = static_cast<const char*>(mapping);
+    std::memcpy(&header, base, sizeof(header));
+    auto fail = [&](const std::string& reason) {
+        ::munmap(mapping, mapping_size);
+        ::close(fd);
+        throw std::runtime_error("MultiVectorFile: " + path + ": " + reason);
+    };
+    if (std::memcmp(header.magic, multivector_magic, sizeof(header.magic)) != 0) fail("bad magic.");
+    if (header.version != multivector_version) fail("unsupported version " + std::to_string(header.version) + ".");
+    if (header.dtype > static_cast<uint32_t>(MultiVectorDType::FP16)) fail("unknown dtype.");
+    if (header.dimensions == 0) fail("zero dimensions.");
+
+    // Each section must fit in the file; the products cannot overflow for
+    // any file that fits on disk, but guard them anyway.
+    auto section_fits = [&](uint64_t offset, uint64_t count, uint64_t size) {
+        return offset % multivector_alignment == 0 && offset <= mapping_size
+            && (size == 0 || count <= (mapping_size - offset) / size);
+    };
+    const size_t value_size = dtype_size(header.dtype);
+    if (header.num_tokens > mapping_size / header.dimensions) fail("truncated payload.");
+    if (!section_fits(header.payload_offset, header.num_tokens * header.dimensions, value_size)) fail("truncated payload.");
+    if (!section_fits(header.offsets_offset, header.num_docs + 1, sizeof(int64_t))) fail("truncated offsets.");
+    if (!section_fits(header.ids_offset, header.num_docs + 1, sizeof(uint64_t))) fail("truncated ids.");
+
+    payload = base + header.payload_offset;
+    token_offsets = reinterpret_cast<const int64_t*>(base + header.offsets_offset);
+    id_offsets = reinterpret_cast<const uint64_t*>(base + header.ids_offset);
+    id_blob = base + header.ids_offset + (header.num_docs + 1) * sizeof(uint64_t);
+
+    if (token_offsets[0] != 0 || static_cast<uint64_t>(token_offsets[header.num_docs]) != header.num_tokens) fail("bad offsets.");
+    try {
+        RaggedTokenView{nullptr, token_offsets, header.num_docs, header.num_tokens, header.dimensions}.validate();
+    } catch (const std::runtime_error& e) {
+        fail(e.what());
+    }
+    const size_t blob_capacity = mapping_size - (id_blob - base);
+    for (size_t i = 0; i < header.num_docs; i++) {
+        if (id_offsets[i] > id_offsets[i + 1]) fail("bad id offsets.");
+    }
+    if (id_offsets[0] != 0 || id_offsets[header.num_docs] > blob_capacity) fail("truncated ids.");
+}
+
+MultiVectorFile::~MultiVectorFile() {
+    if (mapping) ::munmap(mapping, mapping_size);
+    if (fd >= 0) ::close(fd);
+}
+
+std::string MultiVectorFile::doc_id(const size_t i) const {
+    return std::string(id_blob + id_offsets[i], id_offsets[i + 1] - id_offsets[i]);
+}
+
+std::vector<std::string> MultiVectorFile::doc_ids() const {
+    std::vector<std::string> ids;
+    ids.reserve(header.num_docs);
+    for (size_t i = 0; i < header.num_docs; i++) ids.push_back(doc_id(i));
+    return ids;
+}
+
+RaggedTokenView MultiVectorFile::view() const {
+    if (dtype() != MultiVectorDType::FP32) {
+        throw std::runtime_error("MultiVectorFile.view: zero-copy views need an fp32 file; use decode_tokens().");
+    }
+    return RaggedTokenView{static_cast<const float*>(payload), token_offsets, header.num_docs, header.num_tokens, header.dimensions};
+}
+
+TokenMatrixView MultiVectorFile::document(const size_t i) const {
+    return view().document(i);
+}
+
+TokenMatrixView MultiVectorFile::document(const size_t i, std::vector<float>& scratch) const {
+    if (dtype() == MultiVectorDType::FP32) return document(i);
+    const size_t num_tokens = token_offsets[i + 1] - token_offsets[i];
+    const uint16_t* values = static_cast<const uint16_t*>(payload) + token_offsets[i] * header.dimensions;
+    scratch.resize(num_tokens * header.dimensions);
+    for (size_t j = 0; j < scratch.size(); j++) scratch[j] = fp16_to_float(values[j]);
+    return TokenMatrixView{scratch.data(), num_tokens, header.dimensions};
+}
+
+std::vector<float> MultiVectorFile::decode_tokens() const {
+    const size_t num_values = header.num_tokens * header.dimensions;
+    if (dtype() == MultiVectorDType::FP32) {
+        const float* values = static_cast<const float*>(payload);
+        return std::vector<float>(values, values + num_values);
+    }
+    const uint16_t* values = static_cast<const uint16_t*>(payload);
+    std::vector<float> tokens(num_values);
+    for (size_t j = 0; j < num_values; j++) tokens[j] = fp16_to_float(values[j]);
+    return tokens;
+}
@@ -1,20 +1,62 @@
 #include <immintrin.h>
 
+#include <algorithm>
+#include <chrono>
+#include <cmath>
 #include <iostream>
+#include <limits>
+#include <map>
 #include <memory>
+#include <mutex>
 #include <stdexcept>
+#include <string_view>
+#include <thread>
 #include <unordered_set>
 #include <vector>
 
 #include "fde.h"
+#include "fde_file.h"
 #include "retriever.h"
+#include "tsl/robin_set.h"
 
 
+// Documents pruned per batch while encoding a dataset with token pruning on.
+static const size_t pruning_chunk_docs = 8192;
+
+// Default out-degree bound R of the segment graphs.
+static const size_t graph_max_degree = 64;
+
+// Distinct labels a filtered mutable segment can take before it is rolled;
+// each costs DiskANN a frozen point.
+static const size_t mutable_segment_label_capacity = 256;
+
+// DiskANN keeps its in-memory stores private, so a segment's footprint is
+// estimated from what it preallocates for capacity points plus the frozen
+// start points (one, or one per label for filtered indexes): float vectors
+// padded to 8 dimensions, adjacency lists reserved at 1.3 * 1.05 * R, one
+// lock per point, the tag maps and, for filtered indexes, a label list per
+// point. label_capacity is 0 for unfiltered indexes.
+static MemoryUsage estimate_segment_memory_usage(const size_t capacity, const size_t embedding_dim, const size_t max_degree,
+    const size_t label_capacity)
+{
+    MemoryUsage usage;
+    const bool filtered = label_capacity > 0;
+    const size_t slots = capacity + std::max<size_t>(1, label_capacity);
+    const size_t padded_dim = (embedding_dim + 7) / 8 * 8;
+    const size_t reserved_degree = static_cast<size_t>(std::ceil(max_degree * 1.3 * 1.05));
+    usage.add("diskann.vectors", slots * padded_dim * sizeof(float));
+    usage.add("diskann.graph", slots * (reserved_degree * sizeof(uint32_t) + sizeof(std::vector<uint32_t>)));
+    usage.add("diskann.locks", slots * sizeof(std::mutex));
+    usage.add("diskann.tags", capacity * 64);
+    if (filtered) usage.add("diskann.labels", slots * (sizeof(std::vector<uint32_t>) + sizeof(uint32_t)));
+    return usage;
+}
+
 MuveraRetriever::MuveraRetriever(const size_t _dimensions, const size_t _max_points, const size_t _d_proj, const size_t _d_final,
     const size_t _k_sim, const size_t _r_reps, const uint64_t _seed
 ): AbstractRetriever(_dimensions, _max_points) {
     const size_t L = 128;
-    const size_t R = 64;
+    const size_t R = graph_max_degree;
     const size_t Lf = 128;
     const float alpha = 1.2;
     const size_t num_threads = 8;
@@ -29,65 +71,483 @@ MuveraRetriever::MuveraRetriever(const size_t _dimensions, const size_t _max_poi
             .with_saturate_graph(false)
             .with_num_threads(num_threads)
             .build();
+    index_write_params = std::make_unique<diskann::IndexWriteParameters>(index_build_params);
+
+    labels_enabled = false;
+    filter_brute_force_threshold = std::numeric_limits<size_t>::max();
 
-    diskann::IndexConfig config = diskann::IndexConfigBuilder()
+    // DiskANN's insert_point rejects tag 0, which it keeps for hidden points,
+    // so slot 0 is a permanently deleted placeholder and tags start at 1.
+    doc_ids.push_back(std::string());
+    tombstones.push_back(uint8_t(1));
+    tag_labels.push_back(std::vector<uint32_t>());
+
+    // max_points is the capacity of each mutable segment, not of the retriever.
+    std::atomic_store(&segments, std::shared_ptr<const SegmentList>(
+        std::make_shared<SegmentList>(SegmentList{create_mutable_segment()})));
+    compaction_merge_factor = 4;
+    search_width = 0;
+
+    stop_consolidation = false;
+    compaction_requested = false;
+    pending_deletes = 0;
+    consolidation_min_deletes = std::max<size_t>(1, max_points / 20);
+    consolidation_interval = std::chrono::seconds(60);
+    consolidation_thread = std::thread(&MuveraRetriever::consolidation_loop, this);
+};
+
+MuveraRetriever::~MuveraRetriever() {
+    {
+        std::lock_guard<std::mutex> lock(consolidation_mutex);
+        stop_consolidation = true;
+    }
+    consolidation_cv.notify_all();
+    if (consolidation_thread.joinable()) consolidation_thread.join();
+}
+
+std::unique_ptr<diskann::AbstractIndex> MuveraRetriever::create_segment_index(const size_t capacity, const size_t label_capacity) const {
+    diskann::IndexConfigBuilder builder = diskann::IndexConfigBuilder();
+    if (labels_enabled) {
+        builder.is_filtered(true).with_label_type("uint32").with_num_frozen_pts(static_cast<uint32_t>(label_capacity));
+    }
+    diskann::IndexConfig config = builder
         .with_metric(diskann::Metric::COSINE)
         .with_dimension(embedding_dim) // TODO: change this to final projection dimension after final projection is implemented
-        .with_max_points(max_points)
+        .with_max_points(capacity)
         .is_dynamic_index(true)
-        .with_index_write_params(index_build_params)
+        .with_index_write_params(*index_write_params)
         .is_enable_tags(true)
+        .is_concurrent_consolidate(true)
         .is_use_opq(true)
         .is_pq_dist_build(false)
         .with_data_type("float")
         .build();
     diskann::IndexFactory index_factory(config);
-    diskann_index = index_factory.create_instance();
-};
+    return index_factory.create_instance();
+}
+
+std::shared_ptr<MuveraSegment> MuveraRetriever::build_segment(const float* fdes, const std::vector<uint32_t>& tags) {
+    const size_t n = tags.size();
+    std::unordered_set<uint32_t> segment_labels;
+    if (labels_enabled) {
+        for (uint32_t tag : tags) segment_labels.insert(tag_labels[tag].begin(), tag_labels[tag].end());
+    }
+    auto segment = std::make_shared<MuveraSegment>(create_segment_index(n, segment_labels.size()), n, segment_labels.size());
+    segment->labels = std::move(segment_labels);
+    if (labels_enabled) {
+        segment->index->set_start_points_at_random(1.0f);
+        std::atomic<bool> failed(false);
+        parallel_for(0, n, index_write_params->num_threads, [&](size_t i) {
+            if (insert_point(*segment, fdes + i * embedding_dim, tags[i]) != 0) failed = true;
+        });
+        if (failed) {
+            throw std::runtime_error("MuveraRetriever.build_segment: DiskANN insert failed.");
+        }
+    } else {
+        segment->index->build(fdes, n, tags);
+    }
+    segment->num_inserted = n;
+    segment->sealed = true;
+    return segment;
+}
+
+int MuveraRetriever::insert_point(MuveraSegment& segment, const float* encoding, const uint32_t tag) const {
+    if (labels_enabled) {
+        return segment.index->insert_point(encoding, tag, tag_labels[tag]);
+    }
+    return segment.index->insert_point(encoding, tag);
+}
+
+void MuveraRetriever::set_memory_policy(const MemoryPolicy& policy) {
+    policy.validate();
+    std::lock_guard<std::mutex> write_guard(write_mutex);
+    memory_policy = policy;
+}
+
+MemoryPolicy MuveraRetriever::get_memory_policy() const {
+    std::lock_guard<std::mutex> write_guard(write_mutex);
+    return memory_policy;
+}
+
+void MuveraRetriever::set_graph_parameters(const size_t R, const size_t L, const float alpha) {
+    if (R == 0 || L < R) {
+        throw std::runtime_error("MuveraRetriever.set_graph_parameters: R must be positive and L at least R.");
+    }
+    std::lock_guard<std::mutex> write_guard(write_mutex);
+    if (initialized) {
+        throw std::runtime_error("MuveraRetriever.set_graph_parameters: must be called before index_dataset.");
+    }
+    index_write_params = std::make_unique<diskann::IndexWriteParameters>(
+        diskann::IndexWriteParametersBuilder(L, R)
+            .with_filter_list_size(index_write_params->filter_list_size)
+            .with_alpha(alpha)
+            .with_saturate_graph(index_write_params->saturate_graph)
+            .with_num_threads(index_write_params->num_threads)
+            .build());
+    // As in enable_labels, the empty mutable segment is simply replaced.
+    std::lock_guard<std::mutex> segments_guard(segments_mutex);
+    std::atomic_store(&segments, std::shared_ptr<const SegmentList>(
+        std::make_shared<SegmentList>(SegmentList{create_mutable_segment()})));
+}
+
+void MuveraRetriever::enable_labels() {
+    std::lock_guard<std::mutex> write_guard(write_mutex);
+    if (labels_enabled) return;
+    if (initialized) {
+        throw std::runtime_error("MuveraRetriever.enable_labels: must be called before index_dataset.");
+    }
+    labels_enabled = true;
+    // Nothing has been inserted yet, so the unfiltered mutable segment is
+    // simply replaced.
+    std::lock_guard<std::mutex> segments_guard(segments_mutex);
+    std::atomic_store(&segments, std::shared_ptr<const SegmentList>(
+        std::make_shared<SegmentList>(SegmentList{create_mutable_segment()})));
+}
+
+std::shared_ptr<MuveraSegment> MuveraRetriever::create_mutable_segment() const {
+    const size_t label_capacity = labels_enabled ? mutable_segment_label_capacity : 0;
+    auto segment = std::make_shared<MuveraSegment>(create_segment_index(max_points, label_capacity), max_points, label_capacity);
+    // An empty dynamic index needs its frozen start point before the first insert.
+    segment->index->set_start_points_at_random(1.0f);
+    return segment;
+}
+
+void MuveraRetriever::roll_mutable_segment(const std::shared_ptr<MuveraSegment>& full_segment) {
+    {
+        std::lock_guard<std::mutex> segments_guard(segments_mutex);
+        auto current = get_segments();
+        if (current->back() != full_segment) return; // Another writer already rolled it.
+        {
+            std::unique_lock<WriterPreferringSharedMutex> seal_guard(full_segment->insert_lock);
+            full_segment->sealed = true;
+        }
+        auto next = std::make_shared<SegmentList>(*current);
+        next->push_back(create_mutable_segment());
+        std::atomic_store(&segments, std::shared_ptr<const SegmentList>(next));
+    }
+    {
+        std::lock_guard<std::mutex> lock(consolidation_mutex);
+        compaction_requested = true;
+    }
+    consolidation_cv.notify_all();
+}
+
+void MuveraRetriever::consolidation_loop() {
+    std::unique_lock<std::mutex> lock(consolidation_mutex);
+    while (!stop_consolidation) {
+        consolidation_cv.wait_for(lock, consolidation_interval, [this] {
+            return stop_consolidation || compaction_requested || pending_deletes >= consolidation_min_deletes;
+        });
+        if (stop_consolidation) break;
+        pending_deletes = 0;
+        compaction_requested = false;
+        lock.unlock();
+        // Every pass, so that segments whose consolidation failed are retried
+        // at least once per interval.
+        consolidate_segments();
+        compact();
+        lock.lock();
+    }
+}
+
+void MuveraRetriever::set_consolidation_policy(const size_t min_deletes, const std::chrono::milliseconds interval) {
+    {
+        std::lock_guard<std::mutex> lock(consolidation_mutex);
+        consolidation_min_deletes = std::max<size_t>(1, min_deletes);
+        consolidation_interval = interval;
+    }
+    consolidation_cv.notify_all();
+}
 
+void MuveraRetriever::set_compaction_policy(const size_t merge_factor) {
+    {
+        std::lock_guard<std::mutex> compaction_guard(compaction_mutex);
+        compaction_merge_factor = std::max<size_t>(2, merge_factor);
+    }
+    std::lock_guard<std::mutex> lock(consolidation_mutex);
+    compaction_requested = true;
+    consolidation_cv.notify_all();
+}
 
-void MuveraRetriever::index_dataset(const std::vector<std::vector<std::vector<float>>>& _dataset, const std::vector<std::string> _doc_ids)
+void MuveraRetriever::consolidate_segments() {
+    auto current = get_segments();
+    for (const auto& segment : *current) {
+        const size_t deletes = segment->pending_deletes.exchange(0);
+        if (deletes == 0) continue;
+        const diskann::consolidation_report report = segment->index->consolidate_deletes(*index_write_params);
+        if (report._status != diskann::consolidation_report::status_code::SUCCESS) {
+            // Left for the next pass.
+            segment->pending_deletes += deletes;
+        }
+    }
+}
+
+void MuveraRetriever::consolidate() {
+    {
+        std::lock_guard<std::mutex> lock(consolidation_mutex);
+        pending_deletes = 0;
+    }
+    consolidate_segments();
+}
+
+std::vector<std::shared_ptr<MuveraSegment>> MuveraRetriever::pick_compaction(const SegmentList& current) const {
+    // Size-tiered: a sealed segment with L live documents is in tier
+    // ceil(log_f(L / max_points)), and merge_factor segments of one tier merge.
+    std::map<size_t, std::vector<std::shared_ptr<MuveraSegment>>> tiers;
+    for (size_t i = 0; i + 1 < current.size(); i++) { // The last segment is mutable.
+        const auto& segment = current[i];
+        const size_t live = segment->num_live();
+        if (2 * live < segment->num_inserted.load()) {
+            return {segment}; // Mostly deleted: rebuild on its own.
+        }
+        size_t tier = 0;
+        for (size_t bound = max_points; live > bound; bound *= compaction_merge_factor) tier++;
+        tiers[tier].push_back(segment);
+        if (tiers[tier].size() >= compaction_merge_factor) return tiers[tier];
+    }
+    return {};
+}
+
+bool MuveraRetriever::compact_once() {
+    std::lock_guard<std::mutex> compaction_guard(compaction_mutex);
+    const auto victims = pick_compaction(*get_segments());
+    if (victims.empty()) return false;
+
+    std::vector<tsl::robin_set<uint32_t>> active_tags(victims.size());
+    size_t num_active = 0;
+    for (size_t v = 0; v < victims.size(); v++) {
+        victims[v]->index->get_active_tags(active_tags[v]);
+        num_active += active_tags[v].size();
+    }
+    LargeBuffer fdes(num_active * embedding_dim * sizeof(float), get_memory_policy());
+    std::vector<uint32_t> tags;
+    for (size_t v = 0; v < victims.size(); v++) {
+        for (uint32_t tag : active_tags[v]) {
+            if (tombstones[tag].load(std::memory_order_acquire)) continue;
+            // Skipped if deleted since get_active_tags.
+            if (victims[v]->index->get_vector_by_tag(tag, fdes.as<float>() + tags.size() * embedding_dim) != 0) continue;
+            tags.push_back(tag);
+        }
+    }
+
+    std::shared_ptr<MuveraSegment> merged;
+    if (!tags.empty()) {
+        merged = build_segment(fdes.as<float>(), tags);
+    }
+
+    // Deletes go through write_mutex, so none can slip in between the
+    // tombstone re-check and publishing the new list.
+    std::lock_guard<std::mutex> write_guard(write_mutex);
+    if (merged) {
+        for (uint32_t tag : tags) {
+            if (!tombstones[tag].load(std::memory_order_acquire)) continue;
+            merged->index->lazy_delete(tag);
+            merged->num_deleted++;
+            merged->pending_deletes++;
+        }
+    }
+    std::lock_guard<std::mutex> segments_guard(segments_mutex);
+    auto next = std::make_shared<SegmentList>();
+    bool placed = false;
+    for (const auto& segment : *get_segments()) {
+        if (std::find(victims.begin(), victims.end(), segment) == victims.end()) {
+            next->push_back(segment);
+        } else if (!placed) {
+            if (merged) next->push_back(merged);
+            placed = true;
+        }
+    }
+    std::atomic_store(&segments, std::shared_ptr<const SegmentList>(next));
+    return true;
+}
+
+void MuveraRetriever::compact() {
+    while (compact_once()) {}
+}
+
+MemoryUsage MuveraRetriever::memory_usage() const {
+    std::lock_guard<std::mutex> write_guard(write_mutex);
+    MemoryUsage usage = base_memory_usage();
+    usage.merge(fde_engine->memory_usage());
+    usage.add("tombstones", tombstones.allocated_bytes());
+    if (labels_enabled) {
+        size_t label_bytes = tag_labels.allocated_bytes();
+        for (size_t tag = 0; tag < tag_labels.size(); tag++) label_bytes += tag_labels[tag].capacity() * sizeof(uint32_t);
+        std::shared_lock<WriterPreferringSharedMutex> labels_guard(labels_lock);
+        label_bytes += unordered_map_bytes(label_ids) + unordered_map_bytes(label_postings) + unordered_map_bytes(label_live);
+        for (const auto& [label, id] : label_ids) label_bytes += string_heap_bytes(label);
+        for (const auto& [id, postings] : label_postings) label_bytes += postings.capacity() * sizeof(uint32_t);
+        usage.add("labels", label_bytes);
+    }
+    for (const auto& segment : *get_segments()) {
+        usage.merge(estimate_segment_memory_usage(segment->capacity, embedding_dim, index_write_params->max_degree, segment->label_capacity));
+    }
+    return usage;
+}
+
+MemoryUsage MuveraRetriever::estimate_memory_usage(const size_t dimensions, const size_t max_points, const size_t d_proj,
+    const size_t d_final, const size_t k_sim, const size_t r_reps, const size_t num_docs, const size_t avg_doc_id_length)
+{
+    (void)d_proj; // only shapes the encodings, which are not kept after the build
+    MemoryUsage usage = estimate_base_memory_usage(num_docs, avg_doc_id_length);
+    usage.merge(FDESimilarity::estimate_memory_usage(dimensions, k_sim, r_reps));
+    usage.add("tombstones", ChunkedTable<std::atomic<uint8_t>>::allocated_bytes_for(num_docs));
+    if (num_docs > 0) usage.merge(estimate_segment_memory_usage(num_docs, d_final, graph_max_degree, 0));
+    usage.merge(estimate_segment_memory_usage(max_points, d_final, graph_max_degree, 0));
+    usage.add("build.fde_buffer", num_docs * d_final * sizeof(float));
+    return usage;
+}
+
+StatsSnapshot MuveraRetriever::get_stats() const {
+    StatsSnapshot snapshot = stats.snapshot();
+    snapshot.merge(fde_engine->get_stats());
+    return snapshot;
+}
+
+void MuveraRetriever::reset_stats() {
+    stats.reset();
+    fde_engine->reset_stats();
+}
+
+
+void MuveraRetriever::index_dataset(const RaggedTokenView& _dataset, const std::vector<std::string> _doc_ids)
+{
+    index_dataset(_dataset, _doc_ids, {});
+}
+
+void MuveraRetriever::index_dataset(const RaggedTokenView& _dataset, const std::vector<std::string> _doc_ids,
+    const std::vector<std::vector<std::string>>& labels)
 {
-    if (_dataset.size() != _doc_ids.size()) {
+    CacheInvalidation invalidation(*this);
+    if (_dataset.num_docs != _doc_ids.size()) {
         throw std::runtime_error("MuveraRetriever.index_dataset: dataset and doc_ids have different sizes.");
     }
-    const size_t total_size = _dataset.size() * embedding_dim;
+    if (!labels.empty() && labels.size() != _doc_ids.size()) {
+        throw std::runtime_error("MuveraRetriever.index_dataset: labels and doc_ids have different sizes.");
+    }
+    check_dimensions(_dataset.dimensions, "MuveraRetriever.index_dataset");
+    _dataset.validate();
+    const size_t total_size = _dataset.num_docs * embedding_dim;
 
-    auto deleter = [](float* p){ std::free(p); };
-    std::unique_ptr<float[], decltype(deleter)> fdes_aligned(
-        static_cast<float*>(std::aligned_alloc(32, total_size * sizeof(float))),
-        deleter
-    );
+    const MemoryPolicy policy = get_memory_policy();
+    LargeBuffer fdes_aligned(total_size * sizeof(float), policy);
+
+    if (!labels.empty()) enable_labels();
+
+    encode_dataset(_dataset, fdes_aligned.as<float>(), policy);
+    index_encoded(fdes_aligned.as<float>(), _doc_ids, labels);
+}
 
-    size_t offset = 0;
-    for(const auto& P : _dataset) {
-        std::vector<float> embedding = fde_engine->encode_document(P);
-        if (embedding.size() != embedding_dim) {
-            throw std::runtime_error("MuveraRetriever.index_dataset: embedding dimension mismatch.");
+size_t MuveraRetriever::index_dataset_checkpointed(const RaggedTokenView& _dataset, const std::vector<std::string> _doc_ids,
+    const std::string& fde_path, const size_t chunk_docs, const std::vector<std::vector<std::string>>& labels)
+{
+    CacheInvalidation invalidation(*this);
+    if (_dataset.num_docs != _doc_ids.size()) {
+        throw std::runtime_error("MuveraRetriever.index_dataset_checkpointed: dataset and doc_ids have different sizes.");
+    }
+    if (!labels.empty() && labels.size() != _doc_ids.size()) {
+        throw std::runtime_error("MuveraRetriever.index_dataset_checkpointed: labels and doc_ids have different sizes.");
+    }
+    if (chunk_docs == 0) {
+        throw std::runtime_error("MuveraRetriever.index_dataset_checkpointed: chunk_docs must be positive.");
+    }
+    check_dimensions(_dataset.dimensions, "MuveraRetriever.index_dataset_checkpointed");
+    _dataset.validate();
+
+    FDEMatrixFile fde_file(fde_path, _dataset.num_docs, embedding_dim, fde_engine->fingerprint(),
+        dataset_fingerprint(_dataset, _doc_ids) ^ token_pruning_fingerprint());
+    if (!labels.empty()) enable_labels();
+
+    const MemoryPolicy policy = get_memory_policy();
+    const size_t resumed_docs = fde_file.completed_docs();
+    for (size_t begin = resumed_docs; begin < _dataset.num_docs; begin += chunk_docs) {
+        const size_t end = std::min(_dataset.num_docs, begin + chunk_docs);
+        const RaggedTokenView chunk{_dataset.tokens, _dataset.offsets + begin, end - begin, _dataset.num_tokens, _dataset.dimensions};
+        encode_dataset(chunk, fde_file.data() + begin * embedding_dim, policy);
+        fde_file.commit(end);
+    }
+    index_encoded(fde_file.data(), _doc_ids, labels);
+    return _dataset.num_docs - resumed_docs;
+}
+
+void MuveraRetriever::encode_dataset(const RaggedTokenView& _dataset, float* out, const MemoryPolicy& policy) const {
+    // Only the encodings are kept, so pruned tokens are produced a bounded
+    // chunk at a time rather than as a copy of the whole dataset.
+    const size_t chunk_docs = std::atomic_load(&token_pruning) ? pruning_chunk_docs : std::max<size_t>(1, _dataset.num_docs);
+    std::vector<float> pruned_tokens;
+    std::vector<int64_t> pruned_offsets;
+    for (size_t begin = 0; begin < _dataset.num_docs; begin += chunk_docs) {
+        const size_t end = std::min(_dataset.num_docs, begin + chunk_docs);
+        const RaggedTokenView chunk = prune_documents(
+            RaggedTokenView{_dataset.tokens, _dataset.offsets + begin, end - begin, _dataset.num_tokens, _dataset.dimensions},
+            pruned_tokens, pruned_offsets);
+        float* chunk_out = out + begin * embedding_dim;
+        if (policy.pin_threads) {
+            // Pinned workers write, and so first touch, the rows they encode.
+            pinned_parallel_for(policy, 0, chunk.num_docs, 0, [&](size_t i) {
+                const std::vector<float> encoding = fde_engine->encode_document(chunk.document(i));
+                std::copy(encoding.begin(), encoding.end(), chunk_out + i * embedding_dim);
+            });
+        } else {
+            fde_engine->encode_documents(chunk, chunk_out);
         }
-        std::memcpy(fdes_aligned.get() + offset, embedding.data(), embedding_dim * sizeof(float));
-        offset += embedding_dim;
     }
+}
 
-    std::any any_data = std::any(static_cast<const float*>(fdes_aligned.get()));  // Store in std::any
-    
-    // Sanity check for std::any casting.
-    // try {
-    //     const float* casted_data = std::any_cast<const float*>(any_data);
-    // } catch (const std::bad_any_cast &e) {
-    //     std::cout << "Bad any cast: " << e.what() << std::endl;
-    // }
+void MuveraRetriever::index_encoded(const float* fdes, const std::vector<std::string>& _doc_ids,
+    const std::vector<std::vector<std::string>>& labels)
+{
+    // write_mutex is only held to reserve the tags and to publish the
+    // segment, so other writers proceed while the graph is built. The tags
+    // stay unmapped, and so unreachable by deletes and updates, until then.
     std::vector<uint32_t> num_doc_ids = std::vector<uint32_t>();
-    num_doc_ids.reserve(_doc_ids.size());
-    for (uint32_t i = doc_ids.size(); i < doc_ids.size() + _doc_ids.size(); i++) {
-        num_doc_ids.push_back(i);
+    {
+        std::lock_guard<std::mutex> write_guard(write_mutex);
+        // Every doc_id is checked before any tag is reserved, so a rejected
+        // batch leaves the retriever as it was.
+        std::unordered_set<std::string> batch_doc_ids;
+        batch_doc_ids.reserve(_doc_ids.size());
+        for (const std::string& doc_id : _doc_ids) {
+            if (doc_id_to_internal.count(doc_id) != 0) {
+                throw std::runtime_error("MuveraRetriever.index_dataset: doc_id " + doc_id + " already exists.");
+            }
+            if (!batch_doc_ids.insert(doc_id).second) {
+                throw std::runtime_error("MuveraRetriever.index_dataset: duplicate doc_id " + doc_id);
+            }
+        }
+        num_doc_ids.reserve(_doc_ids.size());
+        for (size_t i = 0; i < _doc_ids.size(); i++) {
+            num_doc_ids.push_back(append_tag(_doc_ids[i], labels.empty() ? std::vector<uint32_t>() : intern_labels(labels[i])));
+        }
+        // From here on the index is open to writers, and its graph
+        // parameters and label mode are fixed.
+        initialized = true;
     }
-    doc_ids.insert(doc_ids.end(), _doc_ids.begin(), _doc_ids.end());
-
+    if (_doc_ids.empty()) return;
 
-    diskann_index->build(static_cast<const float*>(fdes_aligned.get()), static_cast<size_t>(_dataset.size()), num_doc_ids);
+    // The dataset becomes a sealed segment sized to fit, ahead of the mutable one.
+    std::shared_ptr<MuveraSegment> segment;
+    try {
+        StageTimer build_timer(stats, Stage::GRAPH_INSERT);
+        segment = build_segment(fdes, num_doc_ids);
+    } catch (...) {
+        std::lock_guard<std::mutex> write_guard(write_mutex);
+        for (size_t i = 0; i < _doc_ids.size(); i++) abandon_tag(num_doc_ids[i], _doc_ids[i]);
+        throw;
+    }
 
-    initialized = true;
+    std::lock_guard<std::mutex> write_guard(write_mutex);
+    // A concurrent add_document may have taken a doc_id during the build.
+    for (const std::string& doc_id : _doc_ids) {
+        if (doc_id_to_internal.count(doc_id) == 0) continue;
+        for (size_t i = 0; i < _doc_ids.size(); i++) abandon_tag(num_doc_ids[i], _doc_ids[i]);
+        throw std::runtime_error("MuveraRetriever.index_dataset: doc_id " + doc_id + " already exists.");
+    }
+    for (size_t i = 0; i < _doc_ids.size(); i++) doc_id_to_internal.emplace(_doc_ids[i], num_doc_ids[i]);
+    std::lock_guard<std::mutex> segments_guard(segments_mutex);
+    auto next = std::make_shared<SegmentList>(*get_segments());
+    next->insert(next->end() - 1, segment);
+    std::atomic_store(&segments, std::shared_ptr<const SegmentList>(next));
 }
 
 void MuveraRetriever::load_index(const std::string &checkpoint_dir) {
@@ -102,40 +562,362 @@ void MuveraRetriever::save_index(const std::string &checkpoint_dir) {
 
 }
 
-void MuveraRetriever::add_document(const std::vector<std::vector<float>>& P, const std::string doc_id) {
+std::vector<uint32_t> MuveraRetriever::intern_labels(const std::vector<std::string>& labels) {
+    std::vector<uint32_t> ids;
+    std::unique_lock<WriterPreferringSharedMutex> labels_guard(labels_lock);
+    for (const auto& label : labels) {
+        const uint32_t id = label_ids.emplace(label, static_cast<uint32_t>(label_ids.size() + 1)).first->second;
+        if (std::find(ids.begin(), ids.end(), id) == ids.end()) ids.push_back(id);
+    }
+    return ids;
+}
+
+uint32_t MuveraRetriever::reserve_tag(const std::string& doc_id, const std::vector<uint32_t>& labels) {
+    if (doc_id_to_internal.count(doc_id) != 0) {
+        throw std::runtime_error("MuveraRetriever.reserve_tag: doc_id " + doc_id + " already exists.");
+    }
+    const uint32_t tag = append_tag(doc_id, labels);
+    doc_id_to_internal.emplace(doc_id, tag);
+    return tag;
+}
+
+uint32_t MuveraRetriever::append_tag(const std::string& doc_id, const std::vector<uint32_t>& labels) {
+    const uint32_t tag = doc_ids.size();
+    if (labels_enabled) {
+        std::unique_lock<WriterPreferringSharedMutex> labels_guard(labels_lock);
+        for (uint32_t label : labels) {
+            label_postings[label].push_back(tag);
+            label_live[label]++;
+        }
+        tag_labels.push_back(labels.empty() ? std::vector<uint32_t>{UNLABELED} : labels);
+    } else {
+        tag_labels.push_back(std::vector<uint32_t>());
+    }
+    tombstones.push_back(uint8_t(0));
+    doc_ids.push_back(doc_id);
+    return tag;
+}
+
+void MuveraRetriever::release_labels(const uint32_t tag) {
+    if (!labels_enabled) return;
+    std::unique_lock<WriterPreferringSharedMutex> labels_guard(labels_lock);
+    for (uint32_t label : tag_labels[tag]) {
+        if (label == UNLABELED) continue;
+        const size_t live = --label_live[label];
+        std::vector<uint32_t>& postings = label_postings[label];
+        if (postings.size() > 2 * live + 16) {
+            postings.erase(std::remove_if(postings.begin(), postings.end(), [this](uint32_t t) {
+                return tombstones[t].load(std::memory_order_acquire) != 0;
+            }), postings.end());
+        }
+    }
+}
+
+void MuveraRetriever::lazy_delete_tag(const uint32_t tag, const std::string& doc_id) {
+    // Tombstoned before the segments are tried: if no segment holds the tag
+    // yet, its insert is still in flight and deletes the point itself once
+    // it sees the tombstone (see try_insert_encoding).
+    tombstones[tag].store(1, std::memory_order_seq_cst);
+    auto current = get_segments();
+    for (auto it = current->rbegin(); it != current->rend(); ++it) {
+        if ((*it)->index->lazy_delete(tag) != 0) continue;
+        (*it)->num_deleted++;
+        (*it)->pending_deletes++;
+        break;
+    }
+    auto it = doc_id_to_internal.find(doc_id);
+    if (it != doc_id_to_internal.end() && it->second == tag) doc_id_to_internal.erase(it);
+    release_labels(tag);
+    bool should_consolidate;
+    {
+        std::lock_guard<std::mutex> lock(consolidation_mutex);
+        pending_deletes++;
+        should_consolidate = pending_deletes >= consolidation_min_deletes;
+    }
+    if (should_consolidate) consolidation_cv.notify_all();
+}
+
+void MuveraRetriever::abandon_tag(const uint32_t tag, const std::string& doc_id) {
+    // Already released if the document was deleted while it was inserted.
+    if (tombstones[tag].exchange(1, std::memory_order_acq_rel) != 0) return;
+    auto it = doc_id_to_internal.find(doc_id);
+    if (it != doc_id_to_internal.end() && it->second == tag) doc_id_to_internal.erase(it);
+    release_labels(tag);
+}
+
+void MuveraRetriever::insert_encoding(const std::vector<float>& encoding, const uint32_t tag, const std::string& doc_id) {
+    try {
+        if (try_insert_encoding(encoding, tag)) return;
+    } catch (...) {
+        std::lock_guard<std::mutex> write_guard(write_mutex);
+        abandon_tag(tag, doc_id);
+        throw;
+    }
+    std::lock_guard<std::mutex> write_guard(write_mutex);
+    abandon_tag(tag, doc_id);
+    throw std::runtime_error("MuveraRetriever.insert_encoding: DiskANN insert failed for doc_id " + doc_id);
+}
+
+bool MuveraRetriever::try_insert_encoding(const std::vector<float>& encoding, const uint32_t tag) {
+    while (true) {
+        std::shared_ptr<MuveraSegment> segment = get_segments()->back();
+        {
+            std::shared_lock<WriterPreferringSharedMutex> insert_guard(segment->insert_lock);
+            if (!segment->sealed && labels_enabled && !segment->admit_labels(tag_labels[tag])) {
+                // Out of frozen points; only a fresh segment can take new labels.
+                if (tag_labels[tag].size() > segment->label_capacity) return false;
+            } else if (!segment->sealed) {
+                const uint64_t insert_start = stats_now_ns();
+                const int status = insert_point(*segment, encoding.data(), tag);
+                stats.record(Stage::GRAPH_INSERT, stats_now_ns() - insert_start);
+                if (status == 0) {
+                    segment->num_inserted++;
+                    // Deleted while in flight; lazy_delete_tag found no segment
+                    // holding the tag and left the point to us.
+                    if (tombstones[tag].load(std::memory_order_seq_cst) && segment->index->lazy_delete(tag) == 0) {
+                        segment->num_deleted++;
+                        segment->pending_deletes++;
+                    }
+                    return true;
+                }
+                if (segment->num_inserted.load() == 0) return false; // Not a capacity problem.
+            }
+        }
+        // The mutable segment is full (or was sealed under us).
+        roll_mutable_segment(segment);
+    }
+}
+
+void MuveraRetriever::add_document(const TokenMatrixView& P, const std::string doc_id) {
+    add_document(P, doc_id, {});
+}
+
+void MuveraRetriever::add_document(const TokenMatrixView& P, const std::string doc_id, const std::vector<std::string>& labels) {
+    CacheInvalidation invalidation(*this);
     if (!initialized) {
         throw std::runtime_error("MuveraRetriever add_document on uninitialized index!");
     }
-    std::vector<float> encoding = fde_engine->encode_document(P);
-    doc_ids.push_back(doc_id);
-    diskann_index->insert_point(encoding.data(), doc_ids.size() - 1);
+    check_dimensions(P.dimensions, "MuveraRetriever.add_document");
+    if (!labels.empty() && !labels_enabled) {
+        throw std::runtime_error("MuveraRetriever.add_document: labels require enable_labels().");
+    }
+    // Encoding and the DiskANN insert run outside write_mutex so that
+    // concurrent writers only serialize on tag assignment.
+    std::vector<float> scratch;
+    std::vector<float> encoding = fde_engine->encode_document(prune_document(P, scratch));
+    uint32_t tag;
+    {
+        std::lock_guard<std::mutex> write_guard(write_mutex);
+        tag = reserve_tag(doc_id, intern_labels(labels));
+    }
+    insert_encoding(encoding, tag, doc_id);
+}
+
+void MuveraRetriever::delete_document(const std::string doc_id) {
+    CacheInvalidation invalidation(*this);
+    std::lock_guard<std::mutex> write_guard(write_mutex);
+    auto it = doc_id_to_internal.find(doc_id);
+    if (it == doc_id_to_internal.end()) {
+        throw std::runtime_error("MuveraRetriever.delete_document: unknown doc_id " + doc_id);
+    }
+    lazy_delete_tag(it->second, doc_id);
+}
+
+void MuveraRetriever::update_document(const TokenMatrixView& P, const std::string doc_id) {
+    replace_document(P, doc_id, nullptr);
+}
+
+void MuveraRetriever::update_document(const TokenMatrixView& P, const std::string doc_id, const std::vector<std::string>& labels) {
+    if (!labels_enabled) {
+        throw std::runtime_error("MuveraRetriever.update_document: labels require enable_labels().");
+    }
+    replace_document(P, doc_id, &labels);
+}
+
+void MuveraRetriever::replace_document(const TokenMatrixView& P, const std::string& doc_id, const std::vector<std::string>* labels) {
+    CacheInvalidation invalidation(*this);
+    check_dimensions(P.dimensions, "MuveraRetriever.update_document");
+    std::vector<float> scratch;
+    std::vector<float> encoding = fde_engine->encode_document(prune_document(P, scratch));
+    uint32_t old_tag, tag;
+    {
+        std::lock_guard<std::mutex> write_guard(write_mutex);
+        auto it = doc_id_to_internal.find(doc_id);
+        if (it == doc_id_to_internal.end()) {
+            throw std::runtime_error("MuveraRetriever.update_document: unknown doc_id " + doc_id);
+        }
+        old_tag = it->second;
+        std::vector<uint32_t> label_ids_of_doc;
+        if (labels) {
+            label_ids_of_doc = intern_labels(*labels);
+        } else {
+            label_ids_of_doc = tag_labels[old_tag];
+            label_ids_of_doc.erase(std::remove(label_ids_of_doc.begin(), label_ids_of_doc.end(), UNLABELED), label_ids_of_doc.end());
+        }
+        tag = append_tag(doc_id, label_ids_of_doc);
+    }
+    // The new point goes in before the old one is deleted, so a failed
+    // insert leaves the old version in place. Until the map is repointed,
+    // searches may find both versions; top_documents keeps the better one.
+    insert_encoding(encoding, tag, doc_id);
+    std::lock_guard<std::mutex> write_guard(write_mutex);
+    auto it = doc_id_to_internal.find(doc_id);
+    if (it != doc_id_to_internal.end() && it->second == old_tag) {
+        it->second = tag;
+        lazy_delete_tag(old_tag, doc_id);
+    } else {
+        // Deleted or replaced again while inserting; that write wins.
+        lazy_delete_tag(tag, doc_id);
+    }
+}
+
+std::vector<std::string> MuveraRetriever::get_top_k(const TokenMatrixView& Q, const size_t top_k) const {
+    if (!initialized) {
+        throw std::runtime_error("MuveraRetriever get_top_k on uninitialized index!");
+    }
+    check_dimensions(Q.dimensions, "MuveraRetriever.get_top_k");
+    StageTimer query_timer(stats, Stage::QUERY);
+    return cached_top_k(Q, top_k,
+        [this](const TokenMatrixView& query) { return fde_engine->encode_query(query); },
+        [&](const std::vector<float>& encoding, bool&) { return result_ids(search_encoded_scored(Q, encoding, top_k)); });
 }
 
-std::vector<std::string> MuveraRetriever::get_top_k(const std::vector<std::vector<float>>& Q, const size_t top_k) const {
+std::vector<std::string> MuveraRetriever::get_top_k(const TokenMatrixView& Q, const size_t top_k, const std::string& label) const {
     if (!initialized) {
         throw std::runtime_error("MuveraRetriever get_top_k on uninitialized index!");
     }
-    std::vector<float> query_encoding = fde_engine->encode_query(Q);
-    // TODO: search diskann_index with the query encoding and return corresponding tags
+    if (!labels_enabled) {
+        throw std::runtime_error("MuveraRetriever.get_top_k: labels are not enabled.");
+    }
+    check_dimensions(Q.dimensions, "MuveraRetriever.get_top_k");
+    StageTimer query_timer(stats, Stage::QUERY);
+    uint32_t label_id;
+    size_t num_live;
+    {
+        std::shared_lock<WriterPreferringSharedMutex> labels_guard(labels_lock);
+        auto it = label_ids.find(label);
+        if (it == label_ids.end()) return {};
+        label_id = it->second;
+        auto live = label_live.find(label_id);
+        num_live = live == label_live.end() ? 0 : live->second;
+    }
+    if (num_live == 0) return {};
+    const std::vector<float> query_encoding = fde_engine->encode_query(Q);
+    if (num_live <= filter_brute_force_threshold) {
+        return result_ids(scan_label(query_encoding, top_k, label_id));
+    }
+    return result_ids(search_segments(query_encoding, top_k, &label_id));
+}
+
+std::vector<std::vector<float>> MuveraRetriever::encode_queries(const RaggedTokenView& Q, const size_t num_threads) const {
+    check_dimensions(Q.dimensions, "MuveraRetriever.encode_queries");
+    const size_t d_final = fde_engine->get_d_final();
+    std::vector<float> batch(Q.num_docs * d_final);
+    fde_engine->encode_queries(Q, batch.data(), num_threads);
+    std::vector<std::vector<float>> encodings(Q.num_docs);
+    for (size_t i = 0; i < Q.num_docs; i++) {
+        encodings[i].assign(batch.begin() + i * d_final, batch.begin() + (i + 1) * d_final);
+    }
+    return encodings;
+}
+
+std::vector<ScoredDocument> MuveraRetriever::search_encoded_scored(const TokenMatrixView& Q, const std::vector<float>& query_encoding, const size_t top_k) const {
+    if (!initialized) {
+        throw std::runtime_error("MuveraRetriever search_encoded_scored on uninitialized index!");
+    }
+    if (query_encoding.size() != embedding_dim) {
+        throw std::runtime_error("MuveraRetriever.search_encoded_scored: query encoding has the wrong dimension.");
+    }
+    return search_segments(query_encoding, top_k, nullptr);
+}
+
+std::vector<ScoredDocument> MuveraRetriever::search_segments(const std::vector<float>& query_encoding, const size_t top_k, const uint32_t* label) const {
+    const size_t L = std::max<size_t>(top_k, search_width);
     std::vector<uint32_t> tags(top_k);
     std::vector<float> distances(top_k);
+    std::vector<float> result_buffer(top_k * embedding_dim);
     std::vector<float*> result_vectors;
     for (size_t i = 0; i < top_k; i++) {
-        float* v = new float[embedding_dim];
-        result_vectors.push_back(v);
-    }
-    diskann_index->search_with_tags(
-        query_encoding.data(),
-        static_cast<const uint32_t>(top_k),
-        static_cast<const uint32_t>(top_k), // beam width L
-        tags.data(),
-        distances.data(),
-        result_vectors
-    );
-    for (auto v : result_vectors) delete[] v;
-    std::vector<std::string> final_result = std::vector<std::string>();
-    for (auto ri : tags) {
-        final_result.push_back(doc_ids[ri]);
+        result_vectors.push_back(result_buffer.data() + i * embedding_dim);
+    }
+    const std::string filter_label = label ? std::to_string(*label) : std::string();
+
+    // Every segment contributes its own top-k; merge them by distance.
+    std::vector<std::pair<float, uint32_t>> candidates;
+    auto current = get_segments();
+    const uint64_t search_start = stats_now_ns();
+    size_t num_searched = 0, num_graph_results = 0;
+    for (const auto& segment : *current) {
+        if (segment->num_live() == 0) continue;
+        // A segment that never took the label has no start point for it.
+        if (label != nullptr && !segment->has_label(*label)) continue;
+        num_searched++;
+        const size_t num_results = segment->index->search_with_tags(
+            query_encoding.data(),
+            static_cast<const uint32_t>(top_k),
+            static_cast<const uint32_t>(L),
+            tags.data(),
+            distances.data(),
+            result_vectors,
+            label != nullptr,
+            filter_label
+        );
+        num_graph_results += num_results;
+        for (size_t i = 0; i < num_results; i++) {
+            if (tombstones[tags[i]].load(std::memory_order_acquire)) continue;
+            candidates.push_back({distances[i], tags[i]});
+        }
+    }
+    stats.record(Stage::GRAPH_SEARCH, stats_now_ns() - search_start);
+    stats.add(Counter::SEGMENTS_SEARCHED, num_searched);
+    stats.add(Counter::GRAPH_CANDIDATES, num_graph_results);
+
+    StageTimer rerank_timer(stats, Stage::RERANK);
+    return top_documents(candidates, top_k);
+}
+
+std::vector<ScoredDocument> MuveraRetriever::top_documents(std::vector<std::pair<float, uint32_t>>& candidates, const size_t top_k) const {
+    // Sorted top_k at a time; more are only needed when duplicates were dropped.
+    std::vector<ScoredDocument> final_result;
+    std::unordered_set<std::string_view> seen;
+    size_t num_sorted = 0;
+    while (final_result.size() < top_k && num_sorted < candidates.size()) {
+        const size_t end = std::min(candidates.size(), num_sorted + top_k - final_result.size());
+        std::partial_sort(candidates.begin() + num_sorted, candidates.begin() + end, candidates.end());
+        for (; num_sorted < end; num_sorted++) {
+            const std::string& doc_id = doc_ids[candidates[num_sorted].second];
+            if (seen.insert(doc_id).second) final_result.push_back({doc_id, -candidates[num_sorted].first});
+        }
     }
     return final_result;
-}
\ No newline at end of file
+}
+
+std::vector<ScoredDocument> MuveraRetriever::scan_label(const std::vector<float>& query_encoding, const size_t top_k, const uint32_t label) const {
+    StageTimer scan_timer(stats, Stage::FILTER_SCAN);
+    std::vector<uint32_t> postings;
+    {
+        std::shared_lock<WriterPreferringSharedMutex> labels_guard(labels_lock);
+        auto it = label_postings.find(label);
+        if (it != label_postings.end()) postings = it->second;
+    }
+    const float query_norm = std::sqrt(dot_product(query_encoding.data(), query_encoding.data(), embedding_dim));
+
+    // Same distance as the COSINE graph search, so scores are comparable.
+    std::vector<std::pair<float, uint32_t>> candidates;
+    std::vector<float> fde(embedding_dim);
+    auto current = get_segments();
+    for (uint32_t tag : postings) {
+        if (tombstones[tag].load(std::memory_order_acquire)) continue;
+        bool found = false;
+        for (auto it = current->rbegin(); it != current->rend() && !found; ++it) {
+            found = (*it)->index->get_vector_by_tag(tag, fde.data()) == 0;
+        }
+        if (!found) continue; // Not inserted yet, or deleted since the tombstone check.
+        const float norm = std::sqrt(dot_product(fde.data(), fde.data(), embedding_dim));
+        const float denom = query_norm * norm;
+        const float cosine = denom > 0 ? dot_product(query_encoding.data(), fde.data(), embedding_dim) / denom : 0.0f;
+        candidates.push_back({1.0f - cosine, tag});
+    }
+    stats.add(Counter::GRAPH_CANDIDATES, candidates.size());
+    return top_documents(candidates, top_k);
+}
@@ -0,0 +1,165 @@
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+#include "counter_rng.h"
+#include "query_cache.h"
+
+
+QueryCache::FrequencySketch::FrequencySketch(const size_t capacity) {
+    size_t width = 64;
+    while (width < 4 * capacity) width <<= 1;
+    counters.assign(4 * width, 0);
+    mask = width - 1;
+    sample_size = 10 * std::max<size_t>(1, capacity);
+}
+
+size_t QueryCache::FrequencySketch::index(const uint64_t hash, const size_t row) const {
+    return row * (mask + 1) + (splitmix64(hash + row) & mask);
+}
+
+void QueryCache::FrequencySketch::increment(const uint64_t hash) {
+    for (size_t row = 0; row < 4; row++) {
+        uint8_t& counter = counters[index(hash, row)];
+        if (counter < 255) counter++;
+    }
+    if (++additions >= sample_size) {
+        for (uint8_t& counter : counters) counter >>= 1;
+        additions /= 2;
+    }
+}
+
+uint8_t QueryCache::FrequencySketch::estimate(const uint64_t hash) const {
+    uint8_t result = 255;
+    for (size_t row = 0; row < 4; row++) {
+        result = std::min(result, counters[index(hash, row)]);
+    }
+    return result;
+}
+
+QueryCache::QueryCache(const QueryCacheOptions _options) : options(_options), num_entries(0) {
+    if (options.capacity == 0 || options.num_shards == 0) {
+        throw std::runtime_error("QueryCache: capacity and num_shards must be positive.");
+    }
+    const size_t num_shards = std::min(options.num_shards, options.capacity);
+    shard_capacity = (options.capacity + num_shards - 1) / num_shards;
+    for (size_t s = 0; s < num_shards; s++) {
+        shards.push_back(std::make_unique<Shard>());
+        if (options.eviction == CacheEviction::TINY_LFU) {
+            shards.back()->sketch = std::make_unique<FrequencySketch>(shard_capacity);
+        }
+    }
+}
+
+uint64_t QueryCache::hash_query(const TokenMatrixView& Q) {
+    // Word-at-a-time multiplicative hash of the token bytes, finalized with
+    // SplitMix64 so that every bit of the result depends on the input.
+    const size_t num_bytes = Q.num_tokens * Q.dimensions * sizeof(float);
+    const unsigned char* bytes = reinterpret_cast<const unsigned char*>(Q.data);
+    uint64_t hash = splitmix64(Q.num_tokens * 0x100000001b3ULL + Q.dimensions);
+    size_t i = 0;
+    for (; i + sizeof(uint64_t) <= num_bytes; i += sizeof(uint64_t)) {
+        uint64_t word;
+        std::memcpy(&word, bytes + i, sizeof(word));
+        hash = (((hash << 5) | (hash >> 59)) ^ word) * 0x9e3779b97f4a7c15ULL;
+    }
+    if (i < num_bytes) {
+        uint64_t word = 0;
+        std::memcpy(&word, bytes + i, num_bytes - i);
+        hash = (((hash << 5) | (hash >> 59)) ^ word) * 0x9e3779b97f4a7c15ULL;
+    }
+    return splitmix64(hash);
+}
+
+bool QueryCache::matches(const Entry& entry, const TokenMatrixView& Q) {
+    return entry.dimensions == Q.dimensions
+        && entry.tokens.size() == Q.num_tokens * Q.dimensions
+        && std::memcmp(entry.tokens.data(), Q.data, entry.tokens.size() * sizeof(float)) == 0;
+}
+
+QueryCache::Lookup QueryCache::lookup(const TokenMatrixView& Q, const uint64_t hash, const size_t top_k, const uint64_t generation) {
+    Lookup result;
+    Shard& shard = shard_for(hash);
+    std::lock_guard<std::mutex> guard(shard.mutex);
+    if (shard.sketch) shard.sketch->increment(hash);
+    auto it = shard.index.find(hash);
+    if (it == shard.index.end() || !matches(*it->second, Q)) return result;
+    shard.entries.splice(shard.entries.begin(), shard.entries, it->second);
+    const Entry& entry = *it->second;
+    result.encoding = entry.encoding;
+    if (entry.has_results && entry.results_top_k == top_k && entry.results_generation == generation) {
+        result.has_results = true;
+        result.results = entry.results;
+    }
+    return result;
+}
+
+void QueryCache::insert(const TokenMatrixView& Q, const uint64_t hash, const size_t top_k, const uint64_t generation,
+    const std::vector<float>& encoding, const std::vector<std::string>& results)
+{
+    if (!options.cache_encodings && !options.cache_results) return;
+    Shard& shard = shard_for(hash);
+    std::lock_guard<std::mutex> guard(shard.mutex);
+    auto it = shard.index.find(hash);
+    if (it != shard.index.end() && !matches(*it->second, Q)) {
+        // A different query with the same hash; the newer one replaces it.
+        shard.entries.erase(it->second);
+        shard.index.erase(it);
+        num_entries--;
+        it = shard.index.end();
+    }
+    if (it == shard.index.end()) {
+        if (shard.entries.size() >= shard_capacity) {
+            const Entry& victim = shard.entries.back();
+            if (shard.sketch && shard.sketch->estimate(hash) <= shard.sketch->estimate(victim.hash)) {
+                return; // Not admitted: the victim is at least as popular.
+            }
+            shard.index.erase(victim.hash);
+            shard.entries.pop_back();
+            num_entries--;
+        }
+        Entry entry;
+        entry.hash = hash;
+        entry.tokens.assign(Q.data, Q.data + Q.num_tokens * Q.dimensions);
+        entry.dimensions = Q.dimensions;
+        shard.entries.push_front(std::move(entry));
+        it = shard.index.emplace(hash, shard.entries.begin()).first;
+        num_entries++;
+    }
+    shard.entries.splice(shard.entries.begin(), shard.entries, it->second);
+    Entry& entry = *it->second;
+    if (options.cache_encodings && entry.encoding.empty()) {
+        entry.encoding = encoding;
+    }
+    if (options.cache_results && (!entry.has_results || generation >= entry.results_generation)) {
+        entry.has_results = true;
+        entry.results_top_k = top_k;
+        entry.results_generation = generation;
+        entry.results = results;
+    }
+}
+
+size_t QueryCache::memory_bytes() const {
+    size_t bytes = 0;
+    for (const auto& shard : shards) {
+        std::lock_guard<std::mutex> guard(shard->mutex);
+        bytes += unordered_map_bytes(shard->index);
+        if (shard->sketch) bytes += shard->sketch->memory_bytes();
+        for (const Entry& entry : shard->entries) {
+            bytes += sizeof(Entry) + 2 * sizeof(void*); // list node
+            bytes += (entry.tokens.capacity() + entry.encoding.capacity()) * sizeof(float);
+            bytes += entry.results.capacity() * sizeof(std::string);
+            for (const auto& id : entry.results) bytes += string_heap_bytes(id);
+        }
+    }
+    return bytes;
+}
+
+void QueryCache::clear() {
+    for (auto& shard : shards) {
+        std::lock_guard<std::mutex> guard(shard->mutex);
+        num_entries -= shard->entries.size();
+        shard->entries.clear();
+        shard->index.clear();
+    }
+}
@@ -1,10 +1,13 @@
 #include <immintrin.h>
 
+#include <algorithm>
 #include <bitset>
 #include <cstdint>
 #include <memory>
+#include <mutex>
 #include <queue>
 #include <random>
+#include <unordered_set>
 #include <vector>
 
 #include <sstream>
@@ -20,21 +23,89 @@
 RelaxedChamferRetriever::RelaxedChamferRetriever(const size_t _dimensions,
     const size_t _max_points, const size_t _softmax_s): AbstractRetriever(_dimensions, _max_points) {
     similarity_engine = std::make_unique<RelaxedChamferSimilarity>(_dimensions, _softmax_s);
-    dataset = std::vector<std::vector<std::vector<float>>>();
-    doc_ids = std::vector<std::string>();
+    doc_id_to_internal = std::unordered_map<std::string, uint32_t>();
 };
 
 
-void RelaxedChamferRetriever::index_dataset(const std::vector<std::vector<std::vector<float>>>& _dataset, const std::vector<std::string> _doc_ids)
+void RelaxedChamferRetriever::index_dataset(const RaggedTokenView& _dataset, const std::vector<std::string> _doc_ids)
 {
-    if (dataset.size() != doc_ids.size()) {
+    CacheInvalidation invalidation(*this);
+    if (_dataset.num_docs != _doc_ids.size()) {
         throw std::runtime_error("RelaxedChamferRetriever.index_dataset: dataset and doc_ids have different sizes.");
     }
-    dataset = _dataset;
-    doc_ids.insert(doc_ids.end(), _doc_ids.begin(), _doc_ids.end());
+    check_dimensions(_dataset.dimensions, "RelaxedChamferRetriever.index_dataset");
+    _dataset.validate();
+    // Checked before anything is cleared, so a rejected dataset leaves the index as it was.
+    std::unordered_set<std::string> unique_doc_ids;
+    unique_doc_ids.reserve(_doc_ids.size());
+    for (const std::string& doc_id : _doc_ids) {
+        if (!unique_doc_ids.insert(doc_id).second) {
+            throw std::runtime_error("RelaxedChamferRetriever.index_dataset: duplicate doc_id " + doc_id);
+        }
+    }
+    std::vector<float> pruned_tokens;
+    std::vector<int64_t> pruned_offsets;
+    const RaggedTokenView stored = prune_documents(_dataset, pruned_tokens, pruned_offsets);
+    // The arena is filled before taking the locks. Pinned workers first touch
+    // the documents they copy, so the pages follow the policy.
+    const MemoryPolicy policy = get_memory_policy();
+    const int64_t first_token = stored.num_docs > 0 ? stored.offsets[0] : 0;
+    const size_t total_tokens = stored.num_docs > 0 ? stored.offsets[stored.num_docs] - first_token : 0;
+    LargeBuffer arena(total_tokens * dimensions * sizeof(float), policy);
+    float* arena_tokens = arena.as<float>();
+    auto copy_document = [&](size_t i) {
+        const TokenMatrixView P = stored.document(i);
+        std::copy(P.data, P.data + P.num_tokens * dimensions, arena_tokens + (stored.offsets[i] - first_token) * dimensions);
+    };
+    if (policy.pin_threads) {
+        pinned_parallel_for(policy, 0, stored.num_docs, 0, copy_document);
+    } else {
+        parallel_for(0, stored.num_docs, 0, copy_document);
+    }
+    std::lock_guard<std::mutex> write_guard(write_mutex);
+    std::unique_lock<WriterPreferringSharedMutex> dataset_guard(dataset_lock);
+    dataset.clear();
+    doc_ids.clear();
+    doc_id_to_internal.clear();
+    token_arena = std::move(arena);
+    for (uint32_t i = 0; i < _doc_ids.size(); i++) {
+        doc_id_to_internal.emplace(_doc_ids[i], i);
+        const size_t num_tokens = stored.offsets[i + 1] - stored.offsets[i];
+        dataset.push_back(StoredTokens(arena_tokens + (stored.offsets[i] - first_token) * dimensions, num_tokens));
+        doc_ids.push_back(_doc_ids[i]);
+    }
     initialized = true;
 };
 
+void RelaxedChamferRetriever::set_memory_policy(const MemoryPolicy& policy) {
+    policy.validate();
+    std::lock_guard<std::mutex> write_guard(write_mutex);
+    memory_policy = policy;
+}
+
+MemoryPolicy RelaxedChamferRetriever::get_memory_policy() const {
+    std::lock_guard<std::mutex> write_guard(write_mutex);
+    return memory_policy;
+}
+
+MemoryUsage RelaxedChamferRetriever::memory_usage() const {
+    std::lock_guard<std::mutex> write_guard(write_mutex);
+    MemoryUsage usage = base_memory_usage();
+    size_t dataset_bytes = dataset.allocated_bytes() + token_arena.size();
+    for (size_t i = 0; i < dataset.size(); i++) dataset_bytes += dataset[i].owned.capacity() * sizeof(float);
+    usage.add("dataset", dataset_bytes);
+    return usage;
+}
+
+MemoryUsage RelaxedChamferRetriever::estimate_memory_usage(const size_t dimensions, const size_t num_docs,
+    const size_t avg_tokens_per_doc, const size_t avg_doc_id_length)
+{
+    MemoryUsage usage = estimate_base_memory_usage(num_docs, avg_doc_id_length);
+    usage.add("dataset", ChunkedTable<StoredTokens>::allocated_bytes_for(num_docs)
+        + num_docs * avg_tokens_per_doc * dimensions * sizeof(float));
+    return usage;
+}
+
 void RelaxedChamferRetriever::load_index(const std::string &checkpoint_dir) {
 
     throw std::logic_error("RelaxedChamferRetriever::load_index() is not yet implemented.");
@@ -47,29 +118,99 @@ void RelaxedChamferRetriever::save_index(const std::string &checkpoint_dir) {
 
 }
 
-void RelaxedChamferRetriever::add_document(const std::vector<std::vector<float>>& P, const std::string doc_id) {
+void RelaxedChamferRetriever::add_document(const TokenMatrixView& P, const std::string doc_id) {
+    CacheInvalidation invalidation(*this);
     if (!initialized) {
         throw std::runtime_error("RelaxedChamferRetriever add_document on uninitialized index!");
     }
-    dataset.push_back(P);
+    check_dimensions(P.dimensions, "RelaxedChamferRetriever.add_document");
+    std::vector<float> scratch;
+    const TokenMatrixView stored = prune_document(P, scratch);
+    std::vector<float> P_flat(stored.data, stored.data + stored.num_tokens * dimensions);
+    std::lock_guard<std::mutex> write_guard(write_mutex);
+    if (doc_id_to_internal.count(doc_id)) {
+        throw std::runtime_error("RelaxedChamferRetriever.add_document: doc_id " + doc_id + " already exists.");
+    }
+    // doc_ids is published first so that every visible dataset entry has an id.
+    doc_id_to_internal[doc_id] = dataset.size();
     doc_ids.push_back(doc_id);
+    dataset.push_back(StoredTokens(std::move(P_flat), dimensions));
 };
 
-std::vector<std::string> RelaxedChamferRetriever::get_top_k(const std::vector<std::vector<float>>& Q, const size_t top_k) const {
+void RelaxedChamferRetriever::delete_document(const std::string doc_id) {
+    CacheInvalidation invalidation(*this);
+    std::lock_guard<std::mutex> write_guard(write_mutex);
+    std::unique_lock<WriterPreferringSharedMutex> dataset_guard(dataset_lock);
+    auto it = doc_id_to_internal.find(doc_id);
+    if (it == doc_id_to_internal.end()) {
+        throw std::runtime_error("RelaxedChamferRetriever.delete_document: unknown doc_id " + doc_id);
+    }
+    const uint32_t idx = it->second;
+    const uint32_t last = dataset.size() - 1;
+    doc_id_to_internal.erase(it);
+    if (idx != last) {
+        dataset[idx] = std::move(dataset[last]);
+        doc_ids[idx] = std::move(doc_ids[last]);
+        doc_id_to_internal[doc_ids[idx]] = idx;
+    }
+    dataset.pop_back();
+    doc_ids.pop_back();
+};
+
+void RelaxedChamferRetriever::update_document(const TokenMatrixView& P, const std::string doc_id) {
+    CacheInvalidation invalidation(*this);
+    check_dimensions(P.dimensions, "RelaxedChamferRetriever.update_document");
+    std::vector<float> scratch;
+    const TokenMatrixView stored = prune_document(P, scratch);
+    std::vector<float> P_flat(stored.data, stored.data + stored.num_tokens * dimensions);
+    std::lock_guard<std::mutex> write_guard(write_mutex);
+    std::unique_lock<WriterPreferringSharedMutex> dataset_guard(dataset_lock);
+    auto it = doc_id_to_internal.find(doc_id);
+    if (it == doc_id_to_internal.end()) {
+        throw std::runtime_error("RelaxedChamferRetriever.update_document: unknown doc_id " + doc_id);
+    }
+    dataset[it->second] = StoredTokens(std::move(P_flat), dimensions);
+};
+
+std::vector<std::string> RelaxedChamferRetriever::get_top_k(const TokenMatrixView& Q, const size_t top_k) const {
     if (!initialized) {
         throw std::runtime_error("RelaxedChamferRetriever get_top_k on uninitialized index!");
     }
+    check_dimensions(Q.dimensions, "RelaxedChamferRetriever.get_top_k");
+    StageTimer query_timer(stats, Stage::QUERY);
+    return cached_top_k(Q, top_k,
+        [](const TokenMatrixView&) { return std::vector<float>(); },
+        [&](const std::vector<float>& encoding, bool&) { return result_ids(search_encoded_scored(Q, encoding, top_k)); });
+};
+
+std::vector<ScoredDocument> RelaxedChamferRetriever::search_encoded_scored(const TokenMatrixView& Q, const std::vector<float>& encoding, const size_t top_k) const {
+    if (!initialized) {
+        throw std::runtime_error("RelaxedChamferRetriever search_encoded_scored on uninitialized index!");
+    }
+    check_dimensions(Q.dimensions, "RelaxedChamferRetriever.search_encoded_scored");
+    std::shared_lock<WriterPreferringSharedMutex> dataset_guard(dataset_lock);
+    const size_t num_docs = dataset.size();
     std::priority_queue<std::pair<float, uint32_t>, std::vector<std::pair<float, uint32_t>>, std::greater<std::pair<float, uint32_t>>> pq;
-    for (size_t i = 0; i < dataset.size(); i++) {
-        float similarity = similarity_engine->compute_similarity(dataset[i], Q);
+    const uint64_t scan_start = stats_now_ns();
+    size_t num_doc_tokens = 0;
+    for (size_t i = 0; i < num_docs; i++) {
+        const StoredTokens& P = dataset[i];
+        num_doc_tokens += P.num_tokens;
+        float similarity = similarity_engine->compute_similarity(TokenMatrixView{P.data, P.num_tokens, dimensions}, Q);
         pq.push({similarity, i});
         if (pq.size() > top_k) pq.pop();
     }
-    std::vector<std::string> results = std::vector<std::string>();
+    stats.record(Stage::CHAMFER_SCAN, stats_now_ns() - scan_start);
+    stats.add(Counter::DISTANCE_COMPUTATIONS, num_doc_tokens * Q.num_tokens);
+
+    StageTimer rerank_timer(stats, Stage::RERANK);
+    std::vector<ScoredDocument> results = std::vector<ScoredDocument>();
     while (!pq.empty()) {
         auto t = pq.top();
         pq.pop();
-        results.push_back(doc_ids[t.second]);
+        results.push_back({doc_ids[t.second], t.first});
     }
+    // The min-heap pops worst-first; return the best match first.
+    std::reverse(results.begin(), results.end());
     return results;
 };
\ No newline at end of file
@@ -0,0 +1,195 @@
+#include <algorithm>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <vector>
+
+#include "scheduler.h"
+
+
+QueryScheduler::QueryScheduler(const AbstractRetriever& _retriever, const QuerySchedulerOptions _options)
+    : retriever(_retriever), options(_options) {
+    if (options.max_pending == 0 || options.max_batch == 0) {
+        throw std::runtime_error("QueryScheduler: max_pending and max_batch must be positive.");
+    }
+    const size_t num_search_threads = options.search_threads > 0
+        ? options.search_threads
+        : std::max(1u, std::thread::hardware_concurrency());
+    encode_thread = std::thread(&QueryScheduler::encode_loop, this);
+    for (size_t t = 0; t < num_search_threads; t++) {
+        search_threads.emplace_back(&QueryScheduler::search_loop, this);
+    }
+}
+
+QueryScheduler::~QueryScheduler() {
+    shutdown();
+}
+
+void QueryScheduler::shutdown() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    encode_cv.notify_all();
+    if (encode_thread.joinable()) encode_thread.join();
+    for (auto& t : search_threads) {
+        if (t.joinable()) t.join();
+    }
+}
+
+size_t QueryScheduler::num_pending() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return pending;
+}
+
+void QueryScheduler::enqueue(const TokenMatrixView& Q, const size_t top_k, Callback callback) {
+    if (Q.dimensions != retriever.get_dimensions()) {
+        throw std::runtime_error("QueryScheduler.submit_query: token dimension mismatch.");
+    }
+    auto request = std::make_unique<Request>();
+    request->tokens.assign(Q.data, Q.data + Q.num_tokens * Q.dimensions);
+    request->num_tokens = Q.num_tokens;
+    request->top_k = top_k;
+    request->callback = std::move(callback);
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (stopping) {
+            throw QueryRejected("QueryScheduler.submit_query: scheduler is shut down.");
+        }
+        if (pending >= options.max_pending) {
+            throw QueryRejected("QueryScheduler.submit_query: queue is full.");
+        }
+        pending++;
+        submitted.push_back(std::move(request));
+    }
+    encode_cv.notify_one();
+}
+
+std::future<std::vector<std::string>> QueryScheduler::submit_query(const TokenMatrixView& Q, const size_t top_k) {
+    auto promise = std::make_shared<std::promise<std::vector<std::string>>>();
+    std::future<std::vector<std::string>> result = promise->get_future();
+    enqueue(Q, top_k, [promise](std::vector<std::string> results, std::exception_ptr error) {
+        if (error) {
+            promise->set_exception(error);
+        } else {
+            promise->set_value(std::move(results));
+        }
+    });
+    return result;
+}
+
+std::future<std::vector<std::string>> QueryScheduler::submit_query(const std::vector<std::vector<float>>& Q, const size_t top_k) {
+    const size_t dimensions = retriever.get_dimensions();
+    const std::vector<float> Q_flat = flatten_tokens(Q, dimensions);
+    return submit_query(TokenMatrixView{Q_flat.data(), Q.size(), dimensions}, top_k);
+}
+
+void QueryScheduler::submit_query(const TokenMatrixView& Q, const size_t top_k, Callback callback) {
+    if (!callback) {
+        throw std::runtime_error("QueryScheduler.submit_query: empty callback.");
+    }
+    enqueue(Q, top_k, std::move(callback));
+}
+
+void QueryScheduler::encode_batch(std::vector<std::unique_ptr<Request>>& batch) {
+    const size_t dimensions = retriever.get_dimensions();
+    std::vector<float> tokens;
+    std::vector<int64_t> offsets = {0};
+    for (const auto& request : batch) {
+        tokens.insert(tokens.end(), request->tokens.begin(), request->tokens.end());
+        offsets.push_back(offsets.back() + request->num_tokens);
+    }
+    try {
+        const RaggedTokenView view{tokens.data(), offsets.data(), batch.size(), static_cast<size_t>(offsets.back()), dimensions};
+        std::vector<std::vector<float>> encodings = retriever.encode_queries(view, options.encode_threads);
+        for (size_t i = 0; i < batch.size(); i++) {
+            batch[i]->encoding = std::move(encodings[i]);
+        }
+        return;
+    } catch (...) {
+        if (batch.size() == 1) {
+            batch[0]->error = std::current_exception();
+            return;
+        }
+    }
+    // Retry one query at a time so that a bad query only fails itself.
+    for (auto& request : batch) {
+        const int64_t single_offsets[2] = {0, static_cast<int64_t>(request->num_tokens)};
+        try {
+            const RaggedTokenView view{request->tokens.data(), single_offsets, 1, request->num_tokens, dimensions};
+            request->encoding = std::move(retriever.encode_queries(view, options.encode_threads)[0]);
+        } catch (...) {
+            request->error = std::current_exception();
+        }
+    }
+}
+
+void QueryScheduler::encode_loop() {
+    while (true) {
+        std::vector<std::unique_ptr<Request>> batch;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            encode_cv.wait(lock, [&] { return stopping || !submitted.empty(); });
+            if (submitted.empty()) break;
+            if (submitted.size() < options.max_batch && options.batch_window.count() > 0) {
+                encode_cv.wait_for(lock, options.batch_window, [&] {
+                    return stopping || submitted.size() >= options.max_batch;
+                });
+            }
+            const size_t batch_size = std::min(options.max_batch, submitted.size());
+            for (size_t i = 0; i < batch_size; i++) {
+                batch.push_back(std::move(submitted.front()));
+                submitted.pop_front();
+            }
+        }
+        encode_batch(batch);
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            for (auto& request : batch) encoded.push_back(std::move(request));
+        }
+        if (batch.size() == 1) {
+            search_cv.notify_one();
+        } else {
+            search_cv.notify_all();
+        }
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        encoding_done = true;
+    }
+    search_cv.notify_all();
+}
+
+void QueryScheduler::search_loop() {
+    while (true) {
+        std::unique_ptr<Request> request;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            search_cv.wait(lock, [&] { return encoding_done || !encoded.empty(); });
+            if (encoded.empty()) break;
+            request = std::move(encoded.front());
+            encoded.pop_front();
+        }
+        std::vector<std::string> results;
+        std::exception_ptr error = request->error;
+        if (!error) {
+            try {
+                const TokenMatrixView Q{request->tokens.data(), request->num_tokens, retriever.get_dimensions()};
+                results = retriever.search_encoded(Q, request->encoding, request->top_k);
+            } catch (...) {
+                error = std::current_exception();
+            }
+        }
+        // An exception escaping a user callback has nowhere to go; drop it
+        // rather than terminate the worker.
+        try {
+            request->callback(std::move(results), error);
+        } catch (...) {
+        }
+        request.reset();
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            pending--;
+        }
+    }
+}
@@ -0,0 +1,905 @@
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "sharded_retriever.h"
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+const Clock::time_point NO_DEADLINE = Clock::time_point::max();
+
+// Largest payload a frame may carry; a shard's whole dataset travels in one
+// OP_INDEX_DATASET frame. A frame is read into memory only as its bytes
+// arrive, FRAME_READ_CHUNK at a time, so a corrupt size costs no more than
+// what the peer actually sends.
+const uint64_t MAX_FRAME_BYTES = uint64_t(16) << 30;
+const size_t FRAME_READ_CHUNK = size_t(64) << 20;
+
+// Requests are framed as [op: u8][payload size: u64][payload] and responses
+// as [status: u8][payload size: u64][payload]; an error response carries the
+// exception message.
+enum ShardOp : uint8_t {
+    OP_HELLO = 1,
+    OP_INDEX_DATASET,
+    OP_ADD_DOCUMENT,
+    OP_DELETE_DOCUMENT,
+    OP_UPDATE_DOCUMENT,
+    OP_SEARCH,
+    OP_NUM_DOCUMENTS,
+};
+
+enum ShardStatus : uint8_t {
+    STATUS_OK = 0,
+    STATUS_ERROR = 1,
+};
+
+class WireWriter {
+    public:
+    std::string buffer;
+
+    template <typename T>
+    void put(const T value) { buffer.append(reinterpret_cast<const char*>(&value), sizeof(T)); }
+    template <typename T>
+    void put_array(const T* data, const size_t n) {
+        put<uint64_t>(n);
+        buffer.append(reinterpret_cast<const char*>(data), n * sizeof(T));
+    }
+    void put_string(const std::string& s) { put_array(s.data(), s.size()); }
+    void put_tokens(const TokenMatrixView& P) {
+        put<uint64_t>(P.dimensions);
+        put_array(P.data, P.num_tokens * P.dimensions);
+    }
+};
+
+class WireReader {
+    private:
+    const char* pos;
+    const char* end;
+
+    void take(void* out, const size_t bytes) {
+        if (static_cast<size_t>(end - pos) < bytes) {
+            throw std::runtime_error("ShardServer: truncated message.");
+        }
+        std::memcpy(out, pos, bytes);
+        pos += bytes;
+    }
+
+    public:
+    explicit WireReader(const std::string& message) : pos(message.data()), end(message.data() + message.size()) {}
+    explicit WireReader(std::string&&) = delete; // would dangle
+
+    template <typename T>
+    T get() {
+        T value;
+        take(&value, sizeof(T));
+        return value;
+    }
+    template <typename T>
+    std::vector<T> get_array() {
+        const uint64_t n = get<uint64_t>();
+        if (n > static_cast<size_t>(end - pos) / sizeof(T)) {
+            throw std::runtime_error("ShardServer: truncated message.");
+        }
+        std::vector<T> values(n);
+        take(values.data(), n * sizeof(T));
+        return values;
+    }
+    std::string get_string() {
+        const std::vector<char> chars = get_array<char>();
+        return std::string(chars.begin(), chars.end());
+    }
+    // Copies the tokens into storage, which the returned view points into.
+    TokenMatrixView get_tokens(std::vector<float>& storage) {
+        const uint64_t dimensions = get<uint64_t>();
+        storage = get_array<float>();
+        if (dimensions == 0 || storage.size() % dimensions != 0) {
+            throw std::runtime_error("ShardServer: malformed token matrix.");
+        }
+        return TokenMatrixView{storage.data(), storage.size() / dimensions, dimensions};
+    }
+};
+
+[[noreturn]] void throw_errno(const std::string& what) {
+    throw std::runtime_error(what + ": " + std::strerror(errno));
+}
+
+// Waits until fd is ready for events, throwing once the deadline passes.
+void wait_ready(const int fd, const short events, const Clock::time_point deadline) {
+    while (true) {
+        int timeout_ms = -1;
+        if (deadline != NO_DEADLINE) {
+            const auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - Clock::now()).count();
+            if (remaining <= 0) throw std::runtime_error("ShardedRetriever: shard timed out.");
+            timeout_ms = static_cast<int>(std::min<int64_t>(remaining, 1 << 30));
+        }
+        pollfd p{fd, events, 0};
+        const int ready = poll(&p, 1, timeout_ms);
+        if (ready > 0) return;
+        if (ready < 0 && errno != EINTR) throw_errno("ShardedRetriever: poll failed");
+    }
+}
+
+void send_all(const int fd, const char* data, size_t size, const Clock::time_point deadline) {
+    while (size > 0) {
+        const ssize_t sent = send(fd, data, size, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) wait_ready(fd, POLLOUT, deadline);
+            else if (errno != EINTR) throw_errno("ShardedRetriever: send failed");
+            continue;
+        }
+        data += sent;
+        size -= sent;
+    }
+}
+
+void recv_all(const int fd, char* data, size_t size, const Clock::time_point deadline) {
+    while (size > 0) {
+        const ssize_t received = recv(fd, data, size, 0);
+        if (received == 0) throw std::runtime_error("ShardedRetriever: connection closed.");
+        if (received < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) wait_ready(fd, POLLIN, deadline);
+            else if (errno != EINTR) throw_errno("ShardedRetriever: recv failed");
+            continue;
+        }
+        data += received;
+        size -= received;
+    }
+}
+
+void write_frame(const int fd, const uint8_t tag, const std::string& payload, const Clock::time_point deadline) {
+    if (payload.size() > MAX_FRAME_BYTES) {
+        throw std::runtime_error("ShardedRetriever: frame of " + std::to_string(payload.size()) + " bytes exceeds the "
+            + std::to_string(MAX_FRAME_BYTES) + " byte limit.");
+    }
+    WireWriter header;
+    header.put<uint8_t>(tag);
+    header.put<uint64_t>(payload.size());
+    send_all(fd, header.buffer.data(), header.buffer.size(), deadline);
+    send_all(fd, payload.data(), payload.size(), deadline);
+}
+
+std::pair<uint8_t, std::string> read_frame(const int fd, const Clock::time_point deadline) {
+    char header[sizeof(uint8_t) + sizeof(uint64_t)];
+    recv_all(fd, header, sizeof(header), deadline);
+    uint64_t size;
+    std::memcpy(&size, header + 1, sizeof(size));
+    if (size > MAX_FRAME_BYTES) {
+        throw std::runtime_error("ShardedRetriever: frame of " + std::to_string(size) + " bytes exceeds the "
+            + std::to_string(MAX_FRAME_BYTES) + " byte limit.");
+    }
+    std::string payload;
+    while (payload.size() < size) {
+        const size_t received = payload.size();
+        payload.resize(received + std::min<uint64_t>(FRAME_READ_CHUNK, size - received));
+        recv_all(fd, &payload[received], payload.size() - received, deadline);
+    }
+    return {static_cast<uint8_t>(header[0]), std::move(payload)};
+}
+
+void set_nonblocking(const int fd) {
+    const int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) throw_errno("ShardedRetriever: fcntl failed");
+}
+
+struct Endpoint {
+    bool is_unix;
+    std::string path; // unix
+    std::string host; // tcp
+    std::string port; // tcp
+};
+
+Endpoint parse_endpoint(const std::string& endpoint) {
+    if (endpoint.rfind("unix:", 0) == 0 && endpoint.size() > 5) {
+        return {true, endpoint.substr(5), "", ""};
+    }
+    const size_t colon = endpoint.rfind(':');
+    if (endpoint.rfind("tcp:", 0) == 0 && colon > 4 && colon + 1 < endpoint.size()) {
+        return {false, "", endpoint.substr(4, colon - 4), endpoint.substr(colon + 1)};
+    }
+    throw std::runtime_error("ShardedRetriever: endpoint must be unix:/path or tcp:host:port, got " + endpoint);
+}
+
+sockaddr_un unix_address(const std::string& path) {
+    sockaddr_un address{};
+    if (path.size() >= sizeof(address.sun_path)) {
+        throw std::runtime_error("ShardedRetriever: unix socket path too long: " + path);
+    }
+    address.sun_family = AF_UNIX;
+    std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
+    return address;
+}
+
+struct AddrInfoDeleter {
+    void operator()(addrinfo* info) const { freeaddrinfo(info); }
+};
+
+std::unique_ptr<addrinfo, AddrInfoDeleter> resolve(const Endpoint& endpoint, const bool passive) {
+    addrinfo hints{};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (passive) hints.ai_flags = AI_PASSIVE;
+    addrinfo* result = nullptr;
+    const int status = getaddrinfo(endpoint.host.c_str(), endpoint.port.c_str(), &hints, &result);
+    if (status != 0) {
+        throw std::runtime_error("ShardedRetriever: cannot resolve " + endpoint.host + ": " + gai_strerror(status));
+    }
+    return std::unique_ptr<addrinfo, AddrInfoDeleter>(result);
+}
+
+// Non-blocking connect bounded by the deadline; returns a non-blocking socket.
+int connect_endpoint(const std::string& endpoint, const Clock::time_point deadline) {
+    const Endpoint parsed = parse_endpoint(endpoint);
+    auto try_connect = [&](const int family, const sockaddr* address, const socklen_t length) {
+        const int fd = socket(family, SOCK_STREAM, 0);
+        if (fd < 0) throw_errno("ShardedRetriever: socket failed");
+        try {
+            set_nonblocking(fd);
+            if (connect(fd, address, length) < 0) {
+                if (errno != EINPROGRESS && errno != EAGAIN) throw_errno("ShardedRetriever: cannot connect to " + endpoint);
+                wait_ready(fd, POLLOUT, deadline);
+                int error = 0;
+                socklen_t error_length = sizeof(error);
+                getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &error_length);
+                if (error != 0) {
+                    errno = error;
+                    throw_errno("ShardedRetriever: cannot connect to " + endpoint);
+                }
+            }
+            if (family != AF_UNIX) {
+                const int one = 1;
+                setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            }
+        } catch (...) {
+            close(fd);
+            throw;
+        }
+        return fd;
+    };
+    if (parsed.is_unix) {
+        const sockaddr_un address = unix_address(parsed.path);
+        return try_connect(AF_UNIX, reinterpret_cast<const sockaddr*>(&address), sizeof(address));
+    }
+    auto addresses = resolve(parsed, false);
+    std::exception_ptr error;
+    for (addrinfo* info = addresses.get(); info != nullptr; info = info->ai_next) {
+        try {
+            return try_connect(info->ai_family, info->ai_addr, info->ai_addrlen);
+        } catch (...) {
+            error = std::current_exception();
+        }
+    }
+    std::rethrow_exception(error);
+}
+
+uint64_t fnv1a(const std::string& s) {
+    uint64_t hash = 14695981039346656037ull;
+    for (const unsigned char c : s) {
+        hash ^= c;
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+std::vector<ScoredDocument> merge_results(std::vector<ScoredDocument> results, const size_t top_k) {
+    // Ties are broken by doc_id so the merge does not depend on which shard
+    // answered first.
+    auto better = [](const ScoredDocument& a, const ScoredDocument& b) {
+        return a.score != b.score ? a.score > b.score : a.doc_id < b.doc_id;
+    };
+    const size_t num_final = std::min(top_k, results.size());
+    std::partial_sort(results.begin(), results.begin() + num_final, results.end(), better);
+    results.resize(num_final);
+    return results;
+}
+
+// Throws once the caller has given up on a search.
+void check_deadline(const Clock::time_point deadline) {
+    if (Clock::now() >= deadline) throw std::runtime_error("ShardedRetriever: shard timed out.");
+}
+
+// Holds one of a shard's search slots for the duration of a search.
+class ShardSearchSlot {
+    private:
+    std::atomic<size_t>& searches;
+
+    public:
+    ShardSearchSlot(std::atomic<size_t>& _searches, const size_t max_searches) : searches(_searches) {
+        if (searches.fetch_add(1) >= max_searches) {
+            searches.fetch_sub(1);
+            throw std::runtime_error("ShardedRetriever: shard is busy.");
+        }
+    }
+    ~ShardSearchSlot() { searches.fetch_sub(1); }
+    ShardSearchSlot(const ShardSearchSlot&) = delete;
+    ShardSearchSlot& operator=(const ShardSearchSlot&) = delete;
+};
+
+class LocalShard : public Shard {
+    private:
+    std::unique_ptr<AbstractRetriever> retriever;
+
+    public:
+    explicit LocalShard(std::unique_ptr<AbstractRetriever> _retriever) : retriever(std::move(_retriever)) {}
+
+    void index_dataset(const RaggedTokenView& dataset, const std::vector<std::string>& doc_ids) override {
+        retriever->index_dataset(dataset, doc_ids);
+    }
+    void add_document(const TokenMatrixView& P, const std::string& doc_id) override { retriever->add_document(P, doc_id); }
+    void delete_document(const std::string& doc_id) override { retriever->delete_document(doc_id); }
+    void update_document(const TokenMatrixView& P, const std::string& doc_id) override { retriever->update_document(P, doc_id); }
+    std::vector<ScoredDocument> search(const TokenMatrixView& Q, const std::vector<float>& encoding,
+        const size_t top_k, const Clock::time_point deadline) const override {
+        // The retriever cannot be interrupted, so a late search is not started.
+        check_deadline(deadline);
+        return retriever->search_encoded_scored(Q, encoding, top_k);
+    }
+    size_t num_documents() const override { return retriever->num_documents(); }
+    StatsSnapshot get_stats() const override { return retriever->get_stats(); }
+    void reset_stats() override { retriever->reset_stats(); }
+    MemoryUsage memory_usage() const override { return retriever->memory_usage(); }
+};
+
+// Talks to a ShardServer over a small pool of persistent connections. A
+// connection that times out or fails is closed, since a late response would
+// otherwise be read as the answer to the next request.
+class RemoteShard : public Shard {
+    private:
+    const std::string endpoint;
+    mutable std::mutex idle_mutex;
+    mutable std::vector<int> idle;
+
+    std::string call(const uint8_t op, const std::string& payload, const Clock::time_point deadline) const {
+        int fd = -1;
+        {
+            std::lock_guard<std::mutex> lock(idle_mutex);
+            if (!idle.empty()) {
+                fd = idle.back();
+                idle.pop_back();
+            }
+        }
+        if (fd < 0) fd = connect_endpoint(endpoint, deadline);
+        std::pair<uint8_t, std::string> response;
+        try {
+            write_frame(fd, op, payload, deadline);
+            response = read_frame(fd, deadline);
+        } catch (...) {
+            close(fd);
+            throw;
+        }
+        {
+            std::lock_guard<std::mutex> lock(idle_mutex);
+            idle.push_back(fd);
+        }
+        if (response.first != STATUS_OK) throw std::runtime_error(response.second);
+        return std::move(response.second);
+    }
+
+    public:
+    RemoteShard(const std::string& _endpoint, const size_t dimensions) : endpoint(_endpoint) {
+        const std::string response = call(OP_HELLO, "", Clock::now() + std::chrono::seconds(10));
+        WireReader reader(response);
+        if (reader.get<uint64_t>() != dimensions) {
+            throw std::runtime_error("ShardedRetriever: shard " + endpoint + " has a different token dimension.");
+        }
+    }
+
+    ~RemoteShard() {
+        for (const int fd : idle) close(fd);
+    }
+
+    void index_dataset(const RaggedTokenView& dataset, const std::vector<std::string>& doc_ids) override {
+        WireWriter writer;
+        writer.put<uint64_t>(dataset.dimensions);
+        writer.put_array(dataset.offsets, dataset.num_docs + 1);
+        writer.put_array(dataset.tokens, dataset.num_tokens * dataset.dimensions);
+        writer.put<uint64_t>(doc_ids.size());
+        for (const auto& doc_id : doc_ids) writer.put_string(doc_id);
+        call(OP_INDEX_DATASET, writer.buffer, NO_DEADLINE);
+    }
+
+    void add_document(const TokenMatrixView& P, const std::string& doc_id) override {
+        WireWriter writer;
+        writer.put_string(doc_id);
+        writer.put_tokens(P);
+        call(OP_ADD_DOCUMENT, writer.buffer, NO_DEADLINE);
+    }
+
+    void delete_document(const std::string& doc_id) override {
+        WireWriter writer;
+        writer.put_string(doc_id);
+        call(OP_DELETE_DOCUMENT, writer.buffer, NO_DEADLINE);
+    }
+
+    void update_document(const TokenMatrixView& P, const std::string& doc_id) override {
+        WireWriter writer;
+        writer.put_string(doc_id);
+        writer.put_tokens(P);
+        call(OP_UPDATE_DOCUMENT, writer.buffer, NO_DEADLINE);
+    }
+
+    std::vector<ScoredDocument> search(const TokenMatrixView& Q, const std::vector<float>& encoding,
+        const size_t top_k, const Clock::time_point deadline) const override {
+        check_deadline(deadline);
+        WireWriter writer;
+        writer.put<uint64_t>(top_k);
+        writer.put_tokens(Q);
+        writer.put_array(encoding.data(), encoding.size());
+        const std::string response = call(OP_SEARCH, writer.buffer, deadline);
+        WireReader reader(response);
+        std::vector<ScoredDocument> results(reader.get<uint64_t>());
+        for (auto& result : results) {
+            result.doc_id = reader.get_string();
+            result.score = reader.get<float>();
+        }
+        return results;
+    }
+
+    size_t num_documents() const override {
+        const std::string response = call(OP_NUM_DOCUMENTS, "", NO_DEADLINE);
+        WireReader reader(response);
+        return reader.get<uint64_t>();
+    }
+
+    StatsSnapshot get_stats() const override { return StatsSnapshot(); }
+    void reset_stats() override {}
+    MemoryUsage memory_usage() const override { return MemoryUsage(); }
+};
+
+std::string handle_request(AbstractRetriever& retriever, const uint8_t op, WireReader& reader) {
+    WireWriter writer;
+    std::vector<float> tokens;
+    switch (op) {
+        case OP_HELLO:
+            writer.put<uint64_t>(retriever.get_dimensions());
+            break;
+        case OP_INDEX_DATASET: {
+            const uint64_t dimensions = reader.get<uint64_t>();
+            const std::vector<int64_t> offsets = reader.get_array<int64_t>();
+            tokens = reader.get_array<float>();
+            std::vector<std::string> doc_ids(reader.get<uint64_t>());
+            for (auto& doc_id : doc_ids) doc_id = reader.get_string();
+            if (offsets.empty() || dimensions == 0) throw std::runtime_error("ShardServer: malformed dataset.");
+            retriever.index_dataset(RaggedTokenView{tokens.data(), offsets.data(), offsets.size() - 1, tokens.size() / dimensions, dimensions}, doc_ids);
+            break;
+        }
+        case OP_ADD_DOCUMENT: {
+            const std::string doc_id = reader.get_string();
+            retriever.add_document(reader.get_tokens(tokens), doc_id);
+            break;
+        }
+        case OP_DELETE_DOCUMENT:
+            retriever.delete_document(reader.get_string());
+            break;
+        case OP_UPDATE_DOCUMENT: {
+            const std::string doc_id = reader.get_string();
+            retriever.update_document(reader.get_tokens(tokens), doc_id);
+            break;
+        }
+        case OP_SEARCH: {
+            const uint64_t top_k = reader.get<uint64_t>();
+            const TokenMatrixView Q = reader.get_tokens(tokens);
+            const std::vector<float> encoding = reader.get_array<float>();
+            const std::vector<ScoredDocument> results = retriever.search_encoded_scored(Q, encoding, top_k);
+            writer.put<uint64_t>(results.size());
+            for (const auto& result : results) {
+                writer.put_string(result.doc_id);
+                writer.put<float>(result.score);
+            }
+            break;
+        }
+        case OP_NUM_DOCUMENTS:
+            writer.put<uint64_t>(retriever.num_documents());
+            break;
+        default:
+            throw std::runtime_error("ShardServer: unknown request " + std::to_string(op));
+    }
+    return std::move(writer.buffer);
+}
+
+} // namespace
+
+
+ShardedRetriever::ShardedRetriever(const size_t _dimensions, const size_t _max_points_per_shard, const size_t _d_proj,
+    const size_t _d_final, const size_t _k_sim, const size_t _r_reps, const uint64_t _seed,
+    const size_t num_shards, const ShardingOptions _options)
+    : AbstractRetriever(_dimensions, _max_points_per_shard * num_shards), options(_options) {
+    init(num_shards);
+    fde_engine = std::make_unique<FDESimilarity>(_dimensions, _d_proj, _d_final, _k_sim, _r_reps, _seed);
+    for (size_t s = 0; s < num_shards; s++) {
+        shards.push_back(std::make_unique<LocalShard>(std::make_unique<MuveraRetriever>(
+            _dimensions, _max_points_per_shard, _d_proj, _d_final, _k_sim, _r_reps, _seed)));
+    }
+}
+
+ShardedRetriever::ShardedRetriever(const size_t _dimensions, const size_t _d_proj, const size_t _d_final,
+    const size_t _k_sim, const size_t _r_reps, const uint64_t _seed,
+    const std::vector<std::string>& endpoints, const ShardingOptions _options)
+    : AbstractRetriever(_dimensions, 0), options(_options) {
+    init(endpoints.size());
+    fde_engine = std::make_unique<FDESimilarity>(_dimensions, _d_proj, _d_final, _k_sim, _r_reps, _seed);
+    for (const auto& endpoint : endpoints) {
+        shards.push_back(std::make_unique<RemoteShard>(endpoint, _dimensions));
+    }
+    // Remote shards may already hold documents.
+    initialized = true;
+}
+
+ShardedRetriever::ShardedRetriever(const size_t _dimensions, const size_t _d_proj, const size_t _d_final,
+    const size_t _k_sim, const size_t _r_reps, const uint64_t _seed,
+    std::vector<std::unique_ptr<AbstractRetriever>> local_shards, const ShardingOptions _options)
+    : AbstractRetriever(_dimensions, 0), options(_options) {
+    init(local_shards.size());
+    fde_engine = std::make_unique<FDESimilarity>(_dimensions, _d_proj, _d_final, _k_sim, _r_reps, _seed);
+    for (auto& retriever : local_shards) {
+        if (!retriever) throw std::runtime_error("ShardedRetriever: null shard retriever.");
+        shards.push_back(std::make_unique<LocalShard>(std::move(retriever)));
+    }
+    initialized = true;
+}
+
+ShardedRetriever::~ShardedRetriever() = default;
+
+void ShardedRetriever::init(const size_t num_shards) {
+    if (num_shards == 0) {
+        throw std::runtime_error("ShardedRetriever: at least one shard is required.");
+    }
+    if (options.partition == ShardPartition::RANGE) {
+        const auto& boundaries = options.range_boundaries;
+        if (boundaries.size() != num_shards - 1) {
+            throw std::runtime_error("ShardedRetriever: RANGE partitioning needs num_shards - 1 boundaries.");
+        }
+        for (size_t i = 1; i < boundaries.size(); i++) {
+            if (!(boundaries[i - 1] < boundaries[i])) {
+                throw std::runtime_error("ShardedRetriever: range boundaries must be strictly increasing.");
+            }
+        }
+    } else if (!options.range_boundaries.empty()) {
+        throw std::runtime_error("ShardedRetriever: range boundaries given for HASH partitioning.");
+    }
+    size_t num_threads = options.fanout_threads > 0
+        ? options.fanout_threads
+        : std::max(1u, std::thread::hardware_concurrency());
+    num_threads = std::max(num_threads, num_shards);
+    fanout_pool = std::make_unique<ThreadPool>(num_threads);
+    // Leaves a thread for every other shard.
+    max_shard_searches = num_threads - (num_shards - 1);
+    shard_searches = std::vector<std::atomic<size_t>>(num_shards);
+}
+
+size_t ShardedRetriever::shard_for(const std::string& doc_id) const {
+    if (options.partition == ShardPartition::RANGE) {
+        const auto& boundaries = options.range_boundaries;
+        return std::upper_bound(boundaries.begin(), boundaries.end(), doc_id) - boundaries.begin();
+    }
+    return fnv1a(doc_id) % shards.size();
+}
+
+void ShardedRetriever::index_dataset(const RaggedTokenView& _dataset, const std::vector<std::string> _doc_ids) {
+    CacheInvalidation invalidation(*this);
+    if (_dataset.num_docs != _doc_ids.size()) {
+        throw std::runtime_error("ShardedRetriever.index_dataset: dataset and doc_ids have different sizes.");
+    }
+    check_dimensions(_dataset.dimensions, "ShardedRetriever.index_dataset");
+    _dataset.validate();
+    // Pruned here so that every shard, local or remote, stores the same tokens.
+    std::vector<float> pruned_tokens;
+    std::vector<int64_t> pruned_offsets;
+    const RaggedTokenView stored = prune_documents(_dataset, pruned_tokens, pruned_offsets);
+    std::vector<std::vector<size_t>> members(shards.size());
+    for (size_t i = 0; i < _doc_ids.size(); i++) {
+        members[shard_for(_doc_ids[i])].push_back(i);
+    }
+    parallel_for(0, shards.size(), shards.size(), [&](const size_t s) {
+        std::vector<float> tokens;
+        std::vector<int64_t> offsets = {0};
+        std::vector<std::string> ids;
+        for (const size_t i : members[s]) {
+            const TokenMatrixView P = stored.document(i);
+            tokens.insert(tokens.end(), P.data, P.data + P.num_tokens * dimensions);
+            offsets.push_back(offsets.back() + P.num_tokens);
+            ids.push_back(_doc_ids[i]);
+        }
+        shards[s]->index_dataset(RaggedTokenView{tokens.data(), offsets.data(), ids.size(), tokens.size() / dimensions, dimensions}, ids);
+    });
+    initialized = true;
+}
+
+void ShardedRetriever::load_index(const std::string &checkpoint_dir) {
+
+    throw std::logic_error("ShardedRetriever::load_index() is not yet implemented.");
+
+}
+
+void ShardedRetriever::save_index(const std::string &checkpoint_dir) {
+
+    throw std::logic_error("ShardedRetriever::save_index() is not yet implemented.");
+
+}
+
+void ShardedRetriever::add_document(const TokenMatrixView& P, const std::string doc_id) {
+    CacheInvalidation invalidation(*this);
+    check_dimensions(P.dimensions, "ShardedRetriever.add_document");
+    std::vector<float> scratch;
+    shards[shard_for(doc_id)]->add_document(prune_document(P, scratch), doc_id);
+}
+
+void ShardedRetriever::delete_document(const std::string doc_id) {
+    CacheInvalidation invalidation(*this);
+    shards[shard_for(doc_id)]->delete_document(doc_id);
+}
+
+void ShardedRetriever::update_document(const TokenMatrixView& P, const std::string doc_id) {
+    CacheInvalidation invalidation(*this);
+    check_dimensions(P.dimensions, "ShardedRetriever.update_document");
+    std::vector<float> scratch;
+    shards[shard_for(doc_id)]->update_document(prune_document(P, scratch), doc_id);
+}
+
+size_t ShardedRetriever::num_documents() const {
+    size_t total = 0;
+    for (const auto& shard : shards) total += shard->num_documents();
+    return total;
+}
+
+StatsSnapshot ShardedRetriever::get_stats() const {
+    StatsSnapshot snapshot = stats.snapshot();
+    snapshot.merge(fde_engine->get_stats());
+    for (const auto& shard : shards) snapshot.merge(shard->get_stats());
+    return snapshot;
+}
+
+MemoryUsage ShardedRetriever::memory_usage() const {
+    MemoryUsage usage = fde_engine->memory_usage();
+    {
+        std::lock_guard<std::mutex> write_guard(write_mutex);
+        usage.merge(base_memory_usage());
+    }
+    for (const auto& shard : shards) usage.merge(shard->memory_usage());
+    return usage;
+}
+
+void ShardedRetriever::reset_stats() {
+    stats.reset();
+    fde_engine->reset_stats();
+    for (auto& shard : shards) shard->reset_stats();
+}
+
+std::vector<std::string> ShardedRetriever::get_top_k(const TokenMatrixView& Q, const size_t top_k) const {
+    check_dimensions(Q.dimensions, "ShardedRetriever.get_top_k");
+    StageTimer query_timer(stats, Stage::QUERY);
+    return cached_top_k(Q, top_k,
+        [this](const TokenMatrixView& query) { return fde_engine->encode_query(query); },
+        [&](const std::vector<float>& encoding, bool& cacheable) {
+            ShardedSearchResult result = search_shards(Q, encoding, top_k);
+            cacheable = result.missing_shards.empty(); // Partial answers are not cached.
+            return result_ids(result.results);
+        });
+}
+
+std::vector<std::vector<float>> ShardedRetriever::encode_queries(const RaggedTokenView& Q, const size_t num_threads) const {
+    check_dimensions(Q.dimensions, "ShardedRetriever.encode_queries");
+    const size_t d_final = fde_engine->get_d_final();
+    std::vector<float> batch(Q.num_docs * d_final);
+    fde_engine->encode_queries(Q, batch.data(), num_threads);
+    std::vector<std::vector<float>> encodings(Q.num_docs);
+    for (size_t i = 0; i < Q.num_docs; i++) {
+        encodings[i].assign(batch.begin() + i * d_final, batch.begin() + (i + 1) * d_final);
+    }
+    return encodings;
+}
+
+std::vector<ScoredDocument> ShardedRetriever::search_encoded_scored(const TokenMatrixView& Q, const std::vector<float>& encoding, const size_t top_k) const {
+    return search_shards(Q, encoding, top_k).results;
+}
+
+ShardedSearchResult ShardedRetriever::search_shards(const TokenMatrixView& Q, const std::vector<float>& encoding, const size_t top_k) const {
+    check_dimensions(Q.dimensions, "ShardedRetriever.search_shards");
+    // Shard searches may outlive this call when they miss the deadline, so
+    // they share ownership of the query and their result slots.
+    struct Gather {
+        std::mutex mutex;
+        std::condition_variable done_cv;
+        std::vector<float> tokens;
+        size_t num_tokens;
+        std::vector<float> encoding;
+        std::vector<std::vector<ScoredDocument>> results;
+        std::vector<std::exception_ptr> errors;
+        std::vector<bool> done;
+        size_t remaining;
+    };
+    auto gather = std::make_shared<Gather>();
+    gather->tokens.assign(Q.data, Q.data + Q.num_tokens * dimensions);
+    gather->num_tokens = Q.num_tokens;
+    gather->encoding = encoding;
+    gather->results.resize(shards.size());
+    gather->errors.resize(shards.size());
+    gather->done.assign(shards.size(), false);
+    gather->remaining = shards.size();
+
+    const Clock::time_point deadline = options.shard_timeout.count() > 0
+        ? Clock::now() + options.shard_timeout
+        : NO_DEADLINE;
+    for (size_t s = 0; s < shards.size(); s++) {
+        fanout_pool->submit([this, gather, s, top_k, deadline]() {
+            std::vector<ScoredDocument> results;
+            std::exception_ptr error;
+            try {
+                const ShardSearchSlot slot(shard_searches[s], max_shard_searches);
+                const TokenMatrixView shard_Q{gather->tokens.data(), gather->num_tokens, dimensions};
+                results = shards[s]->search(shard_Q, gather->encoding, top_k, deadline);
+            } catch (...) {
+                error = std::current_exception();
+            }
+            std::lock_guard<std::mutex> lock(gather->mutex);
+            gather->results[s] = std::move(results);
+            gather->errors[s] = error;
+            gather->done[s] = true;
+            gather->remaining--;
+            gather->done_cv.notify_all();
+        });
+    }
+
+    ShardedSearchResult result;
+    std::exception_ptr first_error;
+    {
+        std::unique_lock<std::mutex> lock(gather->mutex);
+        auto all_done = [&] { return gather->remaining == 0; };
+        if (deadline == NO_DEADLINE) gather->done_cv.wait(lock, all_done);
+        else gather->done_cv.wait_until(lock, deadline, all_done);
+        for (size_t s = 0; s < shards.size(); s++) {
+            if (!gather->done[s] || gather->errors[s]) {
+                if (!first_error) first_error = gather->errors[s];
+                result.missing_shards.push_back(s);
+                continue;
+            }
+            for (auto& scored : gather->results[s]) result.results.push_back(std::move(scored));
+        }
+    }
+    stats.add(Counter::SHARDS_MISSING, result.missing_shards.size());
+    if (result.missing_shards.size() == shards.size()) {
+        if (first_error) std::rethrow_exception(first_error);
+        throw std::runtime_error("ShardedRetriever.search_shards: no shard answered before the timeout.");
+    }
+    result.results = merge_results(std::move(result.results), top_k);
+    return result;
+}
+
+
+ShardServer::ShardServer(AbstractRetriever& _retriever, const std::string& endpoint) : retriever(_retriever) {
+    const Endpoint parsed = parse_endpoint(endpoint);
+    auto listen_on = [&](const int family, const sockaddr* address, const socklen_t length) {
+        const int fd = socket(family, SOCK_STREAM, 0);
+        if (fd < 0) throw_errno("ShardServer: socket failed");
+        const int one = 1;
+        if (family != AF_UNIX) setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (bind(fd, address, length) < 0 || listen(fd, 128) < 0) {
+            const int error = errno;
+            close(fd);
+            errno = error;
+            throw_errno("ShardServer: cannot listen on " + endpoint);
+        }
+        return fd;
+    };
+    if (parsed.is_unix) {
+        const sockaddr_un address = unix_address(parsed.path);
+        unlink(parsed.path.c_str());
+        listen_fd = listen_on(AF_UNIX, reinterpret_cast<const sockaddr*>(&address), sizeof(address));
+        unix_path = parsed.path;
+        bound_endpoint = endpoint;
+        return;
+    }
+    auto addresses = resolve(parsed, true);
+    listen_fd = listen_on(addresses->ai_family, addresses->ai_addr, addresses->ai_addrlen);
+    sockaddr_storage bound{};
+    socklen_t bound_length = sizeof(bound);
+    getsockname(listen_fd, reinterpret_cast<sockaddr*>(&bound), &bound_length);
+    const uint16_t port = bound.ss_family == AF_INET6
+        ? ntohs(reinterpret_cast<const sockaddr_in6*>(&bound)->sin6_port)
+        : ntohs(reinterpret_cast<const sockaddr_in*>(&bound)->sin_port);
+    bound_endpoint = "tcp:" + parsed.host + ":" + std::to_string(port);
+}
+
+ShardServer::~ShardServer() {
+    stop();
+    if (listen_fd >= 0) close(listen_fd);
+    if (!unix_path.empty()) unlink(unix_path.c_str());
+}
+
+void ShardServer::serve() {
+    while (!stopping) {
+        reap_finished_connections();
+        pollfd p{listen_fd, POLLIN, 0};
+        if (poll(&p, 1, 100) <= 0) continue;
+        const int fd = accept(listen_fd, nullptr, nullptr);
+        if (fd < 0) continue;
+        std::lock_guard<std::mutex> lock(connections_mutex);
+        connections.emplace_back();
+        Connection& connection = connections.back();
+        connection.fd = fd;
+        connection.thread = std::thread(&ShardServer::handle_connection, this, fd, std::ref(connection.finished));
+    }
+    // Connections accepted after stop() shut the others down are covered here.
+    std::lock_guard<std::mutex> lock(connections_mutex);
+    shutdown_connections();
+    for (auto& connection : connections) {
+        connection.thread.join();
+        close(connection.fd);
+    }
+    connections.clear();
+}
+
+void ShardServer::stop() {
+    stopping = true;
+    std::lock_guard<std::mutex> lock(connections_mutex);
+    shutdown_connections();
+}
+
+void ShardServer::shutdown_connections() {
+    // Wakes handlers blocked in recv or send: both then fail and the
+    // handler returns.
+    for (auto& connection : connections) shutdown(connection.fd, SHUT_RDWR);
+}
+
+void ShardServer::reap_finished_connections() {
+    std::lock_guard<std::mutex> lock(connections_mutex);
+    for (auto it = connections.begin(); it != connections.end();) {
+        if (!it->finished.load(std::memory_order_acquire)) {
+            ++it;
+            continue;
+        }
+        it->thread.join();
+        close(it->fd);
+        it = connections.erase(it);
+    }
+}
+
+size_t ShardServer::num_connections() {
+    std::lock_guard<std::mutex> lock(connections_mutex);
+    return connections.size();
+}
+
+void ShardServer::handle_connection(const int fd, std::atomic<bool>& finished) {
+    try {
+        set_nonblocking(fd);
+        const int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        while (!stopping) {
+            pollfd p{fd, POLLIN, 0};
+            if (poll(&p, 1, 100) <= 0) continue;
+            const std::pair<uint8_t, std::string> request = read_frame(fd, NO_DEADLINE);
+            uint8_t status = STATUS_OK;
+            std::string response;
+            try {
+                WireReader reader(request.second);
+                response = handle_request(retriever, request.first, reader);
+            } catch (const std::exception& e) {
+                status = STATUS_ERROR;
+                response = e.what();
+            }
+            write_frame(fd, status, response, NO_DEADLINE);
+        }
+    } catch (const std::exception&) {
+        // The client hung up, the connection broke or stop() shut it down;
+        // nothing to answer.
+    }
+    // The client sees the end of the stream now; serve() closes the fd.
+    shutdown(fd, SHUT_RDWR);
+    finished.store(true, std::memory_order_release);
+}
@@ -0,0 +1,122 @@
+#include <algorithm>
+
+#include "stats.h"
+
+const char* stage_name(const Stage stage) {
+    switch (stage) {
+        case Stage::HASH: return "hash";
+        case Stage::PROJECTION: return "projection";
+        case Stage::COUNTSKETCH: return "countsketch";
+        case Stage::GRAPH_SEARCH: return "graph_search";
+        case Stage::GRAPH_INSERT: return "graph_insert";
+        case Stage::RERANK: return "rerank";
+        case Stage::CHAMFER_SCAN: return "chamfer_scan";
+        case Stage::FILTER_SCAN: return "filter_scan";
+        case Stage::TOKEN_PRUNING: return "token_pruning";
+        case Stage::QUERY: return "query";
+        case Stage::NUM_STAGES: break;
+    }
+    return "unknown";
+}
+
+const char* counter_name(const Counter counter) {
+    switch (counter) {
+        case Counter::DOCUMENTS_ENCODED: return "documents_encoded";
+        case Counter::QUERIES_ENCODED: return "queries_encoded";
+        case Counter::OCCUPIED_BUCKETS: return "occupied_buckets";
+        case Counter::SEGMENTS_SEARCHED: return "segments_searched";
+        case Counter::GRAPH_CANDIDATES: return "graph_candidates";
+        case Counter::DISTANCE_COMPUTATIONS: return "distance_computations";
+        case Counter::SHARDS_MISSING: return "shards_missing";
+        case Counter::QUERY_CACHE_HITS: return "query_cache_hits";
+        case Counter::QUERY_CACHE_MISSES: return "query_cache_misses";
+        case Counter::ENCODING_CACHE_HITS: return "encoding_cache_hits";
+        case Counter::TOKENS_PRUNED: return "tokens_pruned";
+        case Counter::NUM_COUNTERS: break;
+    }
+    return "unknown";
+}
+
+// Bucket 4k + j covers (2^k * (4 + j - 1) / 4, 2^k * (4 + j) / 4] for k >= 2;
+// the first eight buckets are exact nanosecond counts 0..7.
+size_t StatsRegistry::bucket_for(const uint64_t ns) {
+    if (ns < 2 * sub_buckets) return ns;
+    const size_t octave = 63 - __builtin_clzll(ns); // >= 3
+    const size_t sub = (ns >> (octave - 2)) & (sub_buckets - 1);
+    const size_t round_up = (ns & ((1ULL << (octave - 2)) - 1)) != 0;
+    return std::min(num_buckets - 1, (octave - 1) * sub_buckets + sub + round_up);
+}
+
+uint64_t StatsRegistry::bucket_upper_ns(const size_t bucket) {
+    if (bucket < 2 * sub_buckets) return bucket;
+    const size_t octave = bucket / sub_buckets + 1;
+    const size_t sub = bucket % sub_buckets;
+    return (1ULL << octave) + sub * (1ULL << (octave - 2));
+}
+
+static void finalize_stage(StageStats& stats) {
+    if (stats.count == 0) return;
+    stats.mean_us = stats.total_ns / 1e3 / stats.count;
+    auto quantile = [&](double q) {
+        const uint64_t rank = std::max<uint64_t>(1, static_cast<uint64_t>(q * stats.count + 0.999999));
+        uint64_t seen = 0;
+        for (size_t b = 0; b < stats.histogram.size(); b++) {
+            seen += stats.histogram[b];
+            if (seen >= rank) return StatsRegistry::bucket_upper_ns(b) / 1e3;
+        }
+        return StatsRegistry::bucket_upper_ns(stats.histogram.size() - 1) / 1e3;
+    };
+    stats.p50_us = quantile(0.50);
+    stats.p99_us = quantile(0.99);
+    stats.max_us = quantile(1.0);
+}
+
+void StatsSnapshot::merge(const StatsSnapshot& other) {
+    enabled = enabled || other.enabled;
+    for (const auto& [name, value] : other.counters) counters[name] += value;
+    for (const auto& [name, stage] : other.stages) {
+        StageStats& merged = stages[name];
+        merged.count += stage.count;
+        merged.total_ns += stage.total_ns;
+        merged.histogram.resize(std::max(merged.histogram.size(), stage.histogram.size()), 0);
+        for (size_t b = 0; b < stage.histogram.size(); b++) merged.histogram[b] += stage.histogram[b];
+        finalize_stage(merged);
+    }
+}
+
+#if MUVERA_ENABLE_STATS
+StatsSnapshot StatsRegistry::snapshot() const {
+    StatsSnapshot result;
+    for (size_t c = 0; c < num_counters; c++) {
+        uint64_t total = 0;
+        for (size_t i = 0; i < num_slots; i++) total += slots[i].counters[c].load(std::memory_order_relaxed);
+        if (total) result.counters[counter_name(static_cast<Counter>(c))] = total;
+    }
+    for (size_t s = 0; s < num_stages; s++) {
+        StageStats stats;
+        stats.histogram.assign(num_buckets, 0);
+        for (size_t i = 0; i < num_slots; i++) {
+            stats.count += slots[i].stage_count[s].load(std::memory_order_relaxed);
+            stats.total_ns += slots[i].stage_total_ns[s].load(std::memory_order_relaxed);
+            for (size_t b = 0; b < num_buckets; b++) {
+                stats.histogram[b] += slots[i].histograms[s][b].load(std::memory_order_relaxed);
+            }
+        }
+        if (stats.count == 0) continue;
+        finalize_stage(stats);
+        result.stages[stage_name(static_cast<Stage>(s))] = std::move(stats);
+    }
+    return result;
+}
+
+void StatsRegistry::reset() {
+    for (size_t i = 0; i < num_slots; i++) {
+        for (auto& c : slots[i].counters) c.store(0, std::memory_order_relaxed);
+        for (size_t s = 0; s < num_stages; s++) {
+            slots[i].stage_count[s].store(0, std::memory_order_relaxed);
+            slots[i].stage_total_ns[s].store(0, std::memory_order_relaxed);
+            for (auto& b : slots[i].histograms[s]) b.store(0, std::memory_order_relaxed);
+        }
+    }
+}
+#endif
@@ -0,0 +1,186 @@
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <numeric>
+#include <stdexcept>
+
+#include "concurrency.h"
+#include "counter_rng.h"
+#include "token_pruning.h"
+
+// Lloyd iterations of the CLUSTER cap; the farthest-point seeding already
+// spreads the centers, so a few passes settle the assignments.
+static const size_t cluster_iterations = 5;
+
+void TokenPruningOptions::validate() const {
+    if (!(merge_threshold >= 0.0f && merge_threshold <= 1.0f)) {
+        throw std::runtime_error("TokenPruningOptions.validate: merge_threshold must be in [0, 1].");
+    }
+}
+
+uint64_t TokenPruningOptions::fingerprint() const {
+    if (!is_enabled()) return 0;
+    uint32_t threshold_bits;
+    std::memcpy(&threshold_bits, &merge_threshold, sizeof(threshold_bits));
+    uint64_t hash = splitmix64(threshold_bits);
+    hash = splitmix64(hash ^ max_tokens);
+    return splitmix64(hash ^ static_cast<uint64_t>(cap_policy));
+}
+
+static float norm(const float* v, const size_t dimensions) {
+    return std::sqrt(dot_product(v, v, dimensions));
+}
+
+// Greedy single pass: each token joins the first cluster whose summed
+// direction is within the threshold, else starts a new one. Clusters are
+// returned as [num_clusters x dimensions] means.
+static std::vector<float> merge_near_duplicates(const TokenMatrixView& P, const float threshold) {
+    const size_t dimensions = P.dimensions;
+    std::vector<float> sums;
+    std::vector<float> sum_norms;
+    std::vector<size_t> counts;
+    for (size_t t = 0; t < P.num_tokens; t++) {
+        const float* token = P.row(t);
+        const float token_norm = norm(token, dimensions);
+        size_t target = counts.size();
+        if (token_norm > 0.0f) {
+            for (size_t c = 0; c < counts.size(); c++) {
+                if (sum_norms[c] > 0.0f
+                    && dot_product(sums.data() + c * dimensions, token, dimensions) >= threshold * sum_norms[c] * token_norm) {
+                    target = c;
+                    break;
+                }
+            }
+        }
+        if (target == counts.size()) {
+            sums.insert(sums.end(), token, token + dimensions);
+            sum_norms.push_back(token_norm);
+            counts.push_back(1);
+            continue;
+        }
+        float* sum = sums.data() + target * dimensions;
+        for (size_t i = 0; i < dimensions; i++) sum[i] += token[i];
+        sum_norms[target] = norm(sum, dimensions);
+        counts[target]++;
+    }
+    for (size_t c = 0; c < counts.size(); c++) {
+        for (size_t i = 0; i < dimensions; i++) sums[c * dimensions + i] /= counts[c];
+    }
+    return sums;
+}
+
+static std::vector<float> keep_largest_norms(const TokenMatrixView& P, const size_t max_tokens) {
+    std::vector<float> norms(P.num_tokens);
+    for (size_t t = 0; t < P.num_tokens; t++) norms[t] = norm(P.row(t), P.dimensions);
+    std::vector<size_t> order(P.num_tokens);
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) { return norms[a] > norms[b]; });
+    order.resize(max_tokens);
+    std::sort(order.begin(), order.end());
+    std::vector<float> kept;
+    kept.reserve(max_tokens * P.dimensions);
+    for (size_t t : order) kept.insert(kept.end(), P.row(t), P.row(t) + P.dimensions);
+    return kept;
+}
+
+// Spherical k-means with k = max_tokens: centers are seeded from the largest
+// token by farthest-point (lowest best cosine) sampling, tokens are assigned
+// by cosine to the center direction, and each center becomes the mean of its
+// tokens. Deterministic for a given document.
+static std::vector<float> cluster_tokens(const TokenMatrixView& P, const size_t max_tokens) {
+    const size_t dimensions = P.dimensions;
+    std::vector<float> unit(P.num_tokens * dimensions, 0.0f);
+    size_t largest = 0;
+    float largest_norm = -1.0f;
+    for (size_t t = 0; t < P.num_tokens; t++) {
+        const float token_norm = norm(P.row(t), dimensions);
+        if (token_norm > largest_norm) {
+            largest_norm = token_norm;
+            largest = t;
+        }
+        if (token_norm > 0.0f) {
+            for (size_t i = 0; i < dimensions; i++) unit[t * dimensions + i] = P.row(t)[i] / token_norm;
+        }
+    }
+
+    std::vector<size_t> seeds = {largest};
+    std::vector<float> best(P.num_tokens, -2.0f);
+    while (seeds.size() < max_tokens) {
+        const float* seed = unit.data() + seeds.back() * dimensions;
+        size_t farthest = 0;
+        for (size_t t = 0; t < P.num_tokens; t++) {
+            best[t] = std::max(best[t], dot_product(seed, unit.data() + t * dimensions, dimensions));
+            if (best[t] < best[farthest]) farthest = t;
+        }
+        seeds.push_back(farthest);
+    }
+
+    std::vector<float> centers;
+    for (size_t seed : seeds) centers.insert(centers.end(), P.row(seed), P.row(seed) + dimensions);
+    std::vector<size_t> assignment(P.num_tokens, 0);
+    for (size_t iteration = 0; iteration < cluster_iterations; iteration++) {
+        for (size_t t = 0; t < P.num_tokens; t++) {
+            float best_similarity = -2.0f;
+            for (size_t c = 0; c < max_tokens; c++) {
+                const float* center = centers.data() + c * dimensions;
+                const float center_norm = norm(center, dimensions);
+                const float similarity = center_norm > 0.0f
+                    ? dot_product(center, unit.data() + t * dimensions, dimensions) / center_norm : -1.0f;
+                if (similarity > best_similarity) {
+                    best_similarity = similarity;
+                    assignment[t] = c;
+                }
+            }
+        }
+        std::vector<float> sums(max_tokens * dimensions, 0.0f);
+        std::vector<size_t> counts(max_tokens, 0);
+        for (size_t t = 0; t < P.num_tokens; t++) {
+            float* sum = sums.data() + assignment[t] * dimensions;
+            for (size_t i = 0; i < dimensions; i++) sum[i] += P.row(t)[i];
+            counts[assignment[t]]++;
+        }
+        for (size_t c = 0; c < max_tokens; c++) {
+            if (counts[c] == 0) continue; // an empty cluster keeps its center
+            for (size_t i = 0; i < dimensions; i++) centers[c * dimensions + i] = sums[c * dimensions + i] / counts[c];
+        }
+    }
+    return centers;
+}
+
+size_t prune_tokens(const TokenMatrixView& P, const TokenPruningOptions& options, std::vector<float>& out) {
+    std::vector<float> merged;
+    TokenMatrixView current = P;
+    if (options.merge_threshold > 0.0f && P.num_tokens > 1) {
+        merged = merge_near_duplicates(P, options.merge_threshold);
+        current = TokenMatrixView{merged.data(), merged.size() / P.dimensions, P.dimensions};
+    }
+    if (options.max_tokens > 0 && current.num_tokens > options.max_tokens) {
+        merged = options.cap_policy == TokenCapPolicy::NORM
+            ? keep_largest_norms(current, options.max_tokens)
+            : cluster_tokens(current, options.max_tokens);
+        current = TokenMatrixView{merged.data(), options.max_tokens, P.dimensions};
+    }
+    out.insert(out.end(), current.data, current.data + current.num_tokens * current.dimensions);
+    return current.num_tokens;
+}
+
+RaggedTokenView prune_dataset(const RaggedTokenView& dataset, const TokenPruningOptions& options,
+    std::vector<float>& tokens, std::vector<int64_t>& offsets, const size_t num_threads)
+{
+    std::vector<std::vector<float>> pruned(dataset.num_docs);
+    parallel_for(0, dataset.num_docs, num_threads, [&](size_t i) {
+        prune_tokens(dataset.document(i), options, pruned[i]);
+    });
+    offsets.assign(1, 0);
+    offsets.reserve(dataset.num_docs + 1);
+    size_t total = 0;
+    for (const auto& document : pruned) total += document.size();
+    tokens.clear();
+    tokens.reserve(total);
+    for (auto& document : pruned) {
+        tokens.insert(tokens.end(), document.begin(), document.end());
+        offsets.push_back(offsets.back() + document.size() / dataset.dimensions);
+        std::vector<float>().swap(document);
+    }
+    return RaggedTokenView{tokens.data(), offsets.data(), dataset.num_docs, tokens.size() / dataset.dimensions, dataset.dimensions};
+}
@@ -1,4 +1,6 @@
+#include <algorithm>
 #include <iostream>
+#include <random>
 #include <vector>
 #include <cassert>
 #include <cmath>
@@ -48,6 +50,30 @@ void test_simhash_basic() {
     std::cout << "✅ test_simhash_basic passed\n";
 }
 
+void test_simhash_buckets() {
+    // Each hyperplane is drawn independently, so random vectors spread over
+    // many of the 2^k_sim buckets rather than only all-zeros / all-ones.
+    const size_t dimensions = 32;
+    SimHash simhash(dimensions, 4, 42);
+    std::mt19937 gen(1);
+    std::normal_distribution<float> normal(0.0f, 1.0f);
+    std::vector<bool> seen(16, false);
+    for (uint32_t i = 0; i < 200; i++) {
+        std::vector<float> v(dimensions);
+        for (float& x : v) x = normal(gen);
+        seen[simhash.compute_hash(v)] = true;
+    }
+    assert(std::count(seen.begin(), seen.end(), true) >= 12);
+
+    // Parameters are a pure function of the seed.
+    FDESimilarity a(dimensions, 16, 1024, 4, 3, 7), b(dimensions, 16, 1024, 4, 3, 7), c(dimensions, 16, 1024, 4, 3, 8);
+    std::vector<std::vector<float>> P = {std::vector<float>(dimensions, 0.5f), std::vector<float>(dimensions, -0.25f)};
+    P[0][3] = 2.0f;
+    assert(a.encode_document(P) == b.encode_document(P));
+    assert(a.encode_document(P) != c.encode_document(P));
+    std::cout << "✅ test_simhash_buckets passed\n";
+}
+
 void test_fde_basic() {
     FDESimilarity fdeSimilarityEngine(3, 128, 10240, 10, 5, 42);
     std::cout << "Initialized similarity engine" << std::endl;
@@ -68,10 +94,56 @@ void test_fde_basic() {
     std::cout << "✅ test_fde_basic passed\n";
 }
 
+void test_fde_token_matrix_view() {
+    FDESimilarity fdeSimilarityEngine(3, 16, 256, 4, 3, 42);
+    std::vector<std::vector<float>> A = {{1.0, 2.0, 3.0}, {1.0, -2.0, 3.0}};
+    std::vector<float> A_flat = {1.0, 2.0, 3.0, 1.0, -2.0, 3.0};
+    TokenMatrixView A_view{A_flat.data(), 2, 3};
+    assert(fdeSimilarityEngine.encode_document(A) == fdeSimilarityEngine.encode_document(A_view));
+    assert(fdeSimilarityEngine.encode_query(A) == fdeSimilarityEngine.encode_query(A_view));
+
+    std::vector<int64_t> offsets = {0, 1, 2};
+    RaggedTokenView ragged{A_flat.data(), offsets.data(), 2, 2, 3};
+    ragged.validate();
+    assert(ragged.document(1).num_tokens == 1);
+    assert(ragged.document(1).row(0)[1] == -2.0f);
+    std::cout << "✅ test_fde_token_matrix_view passed\n";
+}
+
+void test_fde_batch_encode() {
+    FDESimilarity fdeSimilarityEngine(3, 16, 256, 4, 3, 42);
+    std::vector<float> tokens = {1.0, 2.0, 3.0, 1.0, -2.0, 3.0, 4.0, 5.0, 6.0, -4.0, 5.0, -6.0, 0.5, 0.5, 0.5};
+    std::vector<int64_t> offsets = {0, 2, 2, 5};
+    RaggedTokenView docs{tokens.data(), offsets.data(), 3, 5, 3};
+    const size_t d_final = fdeSimilarityEngine.get_d_final();
+
+    std::vector<float> batch(3 * d_final);
+    std::vector<int8_t> batch_int8(3 * d_final);
+    fdeSimilarityEngine.encode_documents(docs, batch.data(), 2);
+    fdeSimilarityEngine.encode_documents(docs, batch_int8.data(), 2);
+    for (size_t i = 0; i < 3; i++) {
+        std::vector<float> single = fdeSimilarityEngine.encode_document(docs.document(i));
+        assert(std::equal(single.begin(), single.end(), batch.begin() + i * d_final));
+        float max_abs = 0.0;
+        for (float x : single) max_abs = std::max(max_abs, std::abs(x));
+        for (size_t j = 0; j < d_final; j++) {
+            assert(std::abs(batch_int8[i * d_final + j] - single[j] * 127.0f / max_abs) <= 0.5f + 1e-3f || max_abs == 0.0f);
+        }
+    }
+
+    fdeSimilarityEngine.encode_queries(docs, batch.data(), 2);
+    std::vector<float> query = fdeSimilarityEngine.encode_query(docs.document(2));
+    assert(std::equal(query.begin(), query.end(), batch.begin() + 2 * d_final));
+    std::cout << "✅ test_fde_batch_encode passed\n";
+}
+
 int main() {
     test_dot_product_simple();
     test_exact_chamfer_similarity_simple();
     test_simhash_basic();
+    test_simhash_buckets();
     test_fde_basic();
+    test_fde_token_matrix_view();
+    test_fde_batch_encode();
     return 0;
 }
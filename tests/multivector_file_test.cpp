@@ -0,0 +1,112 @@
+#include <algorithm>
+#include <iostream>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <cassert>
+#include <cmath>
+#include <cstdio>
+#include <unistd.h>
+
+#include "multivector_file.h"
+#include "retriever.h"
+
+void test_fp16_round_trip() {
+    const std::vector<float> exact = {0.0f, -0.0f, 1.0f, -2.5f, 0.5f, 65504.0f, 6.103515625e-05f, 5.960464477539063e-08f};
+    for (float x : exact) {
+        assert(fp16_to_float(float_to_fp16(x)) == x);
+    }
+    assert(std::isinf(fp16_to_float(float_to_fp16(1e6f))));
+    assert(fp16_to_float(float_to_fp16(1e-9f)) == 0.0f);
+    // 1 + 2^-11 is halfway between 1 and the next fp16; ties round to even.
+    assert(fp16_to_float(float_to_fp16(1.0f + 1.0f / 2048)) == 1.0f);
+    for (float x = -4.0f; x < 4.0f; x += 0.01f) {
+        assert(std::abs(fp16_to_float(float_to_fp16(x)) - x) <= std::abs(x) / 1024 + 1e-7f);
+    }
+    std::cout << "✅ test_fp16_round_trip passed\n";
+}
+
+void test_multivector_file_round_trip() {
+    const size_t dimensions = 8;
+    std::mt19937 gen(3);
+    std::uniform_real_distribution<float> dist(-1.0f, 1.0f);
+    std::vector<float> tokens;
+    std::vector<int64_t> offsets = {0};
+    std::vector<std::string> doc_ids;
+    for (size_t d = 0; d < 5; d++) {
+        const size_t num_tokens = d == 2 ? 0 : d + 1; // includes an empty document
+        for (size_t i = 0; i < num_tokens * dimensions; i++) tokens.push_back(dist(gen));
+        offsets.push_back(offsets.back() + num_tokens);
+        doc_ids.push_back("doc-" + std::to_string(d));
+    }
+    const RaggedTokenView dataset{tokens.data(), offsets.data(), doc_ids.size(), tokens.size() / dimensions, dimensions};
+
+    const std::string fp32_path = "multivector_file_test_fp32.mvf";
+    write_multivector_file(fp32_path, dataset, doc_ids);
+    {
+        MultiVectorFile file(fp32_path);
+        assert(file.num_docs() == doc_ids.size());
+        assert(file.dimensions() == dimensions);
+        assert(file.dtype() == MultiVectorDType::FP32);
+        assert(file.doc_ids() == doc_ids);
+        // Documents are views into the mapping, 64-byte aligned at the start.
+        assert(reinterpret_cast<uintptr_t>(file.view().tokens) % 64 == 0);
+        for (size_t d = 0; d < doc_ids.size(); d++) {
+            const TokenMatrixView doc = file.document(d);
+            assert(doc.num_tokens == static_cast<size_t>(offsets[d + 1] - offsets[d]));
+            assert(std::equal(doc.data, doc.data + doc.num_tokens * dimensions, tokens.begin() + offsets[d] * dimensions));
+        }
+
+        ExactChamferRetriever retriever(dimensions, 10);
+        retriever.index_dataset(file);
+        std::vector<float> scratch;
+        const std::vector<std::string> result = retriever.get_top_k(file.document(4, scratch), 1);
+        assert(result.size() == 1 && result[0] == "doc-4");
+    }
+
+    const std::string fp16_path = "multivector_file_test_fp16.mvf";
+    write_multivector_file(fp16_path, dataset, doc_ids, MultiVectorDType::FP16);
+    {
+        MultiVectorFile file(fp16_path);
+        assert(file.dtype() == MultiVectorDType::FP16);
+        bool threw = false;
+        try {
+            file.view();
+        } catch (const std::runtime_error&) {
+            threw = true;
+        }
+        assert(threw);
+        const std::vector<float> decoded = file.decode_tokens();
+        assert(decoded.size() == tokens.size());
+        for (size_t i = 0; i < tokens.size(); i++) assert(std::abs(decoded[i] - tokens[i]) < 1e-3f);
+        std::vector<float> scratch;
+        const TokenMatrixView doc = file.document(3, scratch);
+        assert(doc.num_tokens == 4 && doc.data[0] == decoded[offsets[3] * dimensions]);
+    }
+
+    // Truncated files are rejected instead of read out of bounds.
+    {
+        std::FILE* f = std::fopen(fp32_path.c_str(), "r+b");
+        std::fseek(f, 0, SEEK_END);
+        const long size = std::ftell(f);
+        std::fclose(f);
+        assert(::truncate(fp32_path.c_str(), size / 2) == 0);
+        bool threw = false;
+        try {
+            MultiVectorFile file(fp32_path);
+        } catch (const std::runtime_error&) {
+            threw = true;
+        }
+        assert(threw);
+    }
+    std::remove(fp32_path.c_str());
+    std::remove(fp16_path.c_str());
+    std::cout << "✅ test_multivector_file_round_trip passed\n";
+}
+
+int main() {
+    test_fp16_round_trip();
+    test_multivector_file_round_trip();
+    return 0;
+}
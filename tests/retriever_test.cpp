@@ -1,12 +1,21 @@
 #include <iostream>
 #include <algorithm>
+#include <atomic>
 #include <chrono>
+#include <cmath>
+#include <future>
+#include <limits>
+#include <random>
 #include <string>
+#include <thread>
 #include <vector>
 #include <cassert>
+#include <cstdio>
 
 #include "fde.h"
+#include "fde_file.h"
 #include "retriever.h"
+#include "scheduler.h"
 
 void test_exact_chamfer_retriever_simple() {
     std::vector<float> a_1 = {1.0, 2.0, 3.0};
@@ -30,6 +39,10 @@ void test_exact_chamfer_retriever_simple() {
     std::vector<std::string> result = exactChamferRetriever.get_top_k(A, 1);
     assert(result.size() == 1);
     assert(result[0] == "1");
+    // Results are ranked best-first.
+    result = exactChamferRetriever.get_top_k(A, 2);
+    assert(result.size() == 2);
+    assert(result[0] == "1" && result[1] == "2");
     std::cout << "✅ test_exact_chamfer_retriever_simple passed" << std::endl;
 }
 
@@ -58,6 +71,39 @@ void test_relaxed_chamfer_retriever_simple() {
     std::cout << "✅ test_relaxed_chamfer_retriever_simple passed" << std::endl;
 }
 
+void test_exact_chamfer_retriever_delete_update() {
+    std::vector<std::vector<float>> A = {{1.0, 2.0, 3.0}, {1.0, -2.0, 3.0}};
+    std::vector<std::vector<float>> B = {{4.0, 5.0, 6.0}, {4.0, -5.0, 6.0}};
+    std::vector<std::vector<float>> C = {{-1.0, 0.0, 2.0}, {-3.0, 1.0, 0.5}};
+    std::vector<std::vector<std::vector<float>>> dataset = {A, B, C};
+    std::vector<std::string> doc_ids = {"1", "2", "3"};
+    ExactChamferRetriever exactChamferRetriever(3, 500);
+    exactChamferRetriever.index_dataset(dataset, doc_ids);
+
+    // A dataset with a repeated doc_id is rejected without clearing the index.
+    bool threw = false;
+    try {
+        exactChamferRetriever.index_dataset(std::vector<std::vector<std::vector<float>>>{A, C}, {"4", "4"});
+    } catch (const std::runtime_error&) {
+        threw = true;
+    }
+    assert(threw);
+    assert(exactChamferRetriever.num_documents() == 3);
+
+    exactChamferRetriever.delete_document("1");
+    assert(exactChamferRetriever.num_documents() == 2);
+    std::vector<std::string> result = exactChamferRetriever.get_top_k(A, 3);
+    assert(result.size() == 2);
+    assert(std::find(result.begin(), result.end(), "1") == result.end());
+
+    // "3" was swapped into the deleted slot and must still be addressable.
+    exactChamferRetriever.update_document(A, "3");
+    result = exactChamferRetriever.get_top_k(A, 1);
+    assert(result.size() == 1);
+    assert(result[0] == "3");
+    std::cout << "✅ test_exact_chamfer_retriever_delete_update passed" << std::endl;
+}
+
 void test_muvera_retriever_basic() {
     std::vector<float> a_1 = {1.0, 2.0, 3.0};
     std::vector<float> a_2 = {1.0, -2.0, 3.0};
@@ -73,9 +119,58 @@ void test_muvera_retriever_basic() {
     std::vector<std::string> result = muveraRetriever.get_top_k(A, 1);
     assert(result.size() == 1);
     assert(result[0] == "1");
+
+    // The first insert into an empty retriever, and a labeled bulk build,
+    // never hand DiskANN the reserved tag 0.
+    MuveraRetriever empty(3, 500, 128, 10240, 10, 5, 42);
+    empty.index_dataset(std::vector<std::vector<std::vector<float>>>{}, {});
+    empty.add_document(A, "1");
+    assert(empty.get_top_k(A, 1) == std::vector<std::string>{"1"});
+    MuveraRetriever labeled(3, 500, 128, 10240, 10, 5, 42);
+    labeled.set_filter_brute_force_threshold(0);
+    labeled.index_dataset(dataset, doc_ids, {{"a"}});
+    labeled.add_document(A, "2", {"a"});
+    result = labeled.get_top_k(A, 2, "a");
+    assert(result.size() == 2);
     std::cout << "✅ test_muvera_retriever_basic passed" << std::endl;
 }
 
+void test_muvera_retriever_delete_update() {
+    std::vector<std::vector<float>> A = {{1.0, 2.0, 3.0}, {1.0, -2.0, 3.0}};
+    std::vector<std::vector<float>> B = {{4.0, 5.0, 6.0}, {4.0, -5.0, 6.0}};
+    std::vector<std::vector<float>> C = {{-1.0, 0.0, 2.0}, {-3.0, 1.0, 0.5}};
+    std::vector<std::vector<std::vector<float>>> dataset = {A, B, C};
+    std::vector<std::string> doc_ids = {"1", "2", "3"};
+    MuveraRetriever muveraRetriever(3, 4, 128, 10240, 10, 5, 42);
+    muveraRetriever.index_dataset(dataset, doc_ids);
+
+    // A batch with a taken or repeated doc_id is rejected before any document is added.
+    for (const std::vector<std::string>& bad_ids : {std::vector<std::string>{"4", "1"}, std::vector<std::string>{"4", "4"}}) {
+        bool threw = false;
+        try {
+            muveraRetriever.index_dataset(std::vector<std::vector<std::vector<float>>>{A, C}, bad_ids);
+        } catch (const std::runtime_error&) {
+            threw = true;
+        }
+        assert(threw);
+        assert(muveraRetriever.num_documents() == 3);
+    }
+
+    muveraRetriever.delete_document("1");
+    assert(muveraRetriever.num_documents() == 2);
+    std::vector<std::string> result = muveraRetriever.get_top_k(A, 3);
+    assert(std::find(result.begin(), result.end(), "1") == result.end());
+
+    // Updates beyond the mutable segment's capacity roll into a new segment.
+    muveraRetriever.update_document(A, "3");
+    muveraRetriever.update_document(B, "2");
+    assert(muveraRetriever.num_documents() == 2);
+    result = muveraRetriever.get_top_k(A, 1);
+    assert(result.size() == 1);
+    assert(result[0] == "3");
+    std::cout << "✅ test_muvera_retriever_delete_update passed" << std::endl;
+}
+
 void test_muvera_retriever_large_100D_top50() {
     const size_t dimensions = 100;
     const size_t num_docs = 500;
@@ -141,9 +236,820 @@ void test_muvera_retriever_large_100D_top50() {
     std::cout << "   Query time:    " << query_time_ms << " ms" << std::endl;
 }
 
+void test_retriever_stats() {
+    // Histogram buckets are contiguous and every duration lands in a bucket
+    // whose upper bound is within a quarter octave above it.
+    for (uint64_t ns : {0ULL, 1ULL, 7ULL, 8ULL, 9ULL, 1000ULL, 123456789ULL}) {
+        const size_t bucket = StatsRegistry::bucket_for(ns);
+        assert(ns <= StatsRegistry::bucket_upper_ns(bucket));
+        assert(bucket == 0 || ns > StatsRegistry::bucket_upper_ns(bucket - 1));
+    }
+
+    const size_t dimensions = 16;
+    std::mt19937 gen(5);
+    std::uniform_real_distribution<float> dist(-1.0f, 1.0f);
+    std::vector<std::vector<std::vector<float>>> dataset(20, std::vector<std::vector<float>>(3, std::vector<float>(dimensions)));
+    for (auto& doc : dataset) for (auto& v : doc) for (auto& x : v) x = dist(gen);
+    std::vector<std::string> doc_ids;
+    for (size_t d = 0; d < dataset.size(); d++) doc_ids.push_back(std::to_string(d));
+
+    MuveraRetriever muveraRetriever(dimensions, 100, 16, 1024, 4, 4, 42);
+    muveraRetriever.index_dataset(dataset, doc_ids);
+    muveraRetriever.reset_stats();
+    for (size_t q = 0; q < 5; q++) muveraRetriever.get_top_k(dataset[q], 3);
+    StatsSnapshot muvera_stats = muveraRetriever.get_stats();
+
+    ExactChamferRetriever exactChamferRetriever(dimensions, 100);
+    exactChamferRetriever.index_dataset(dataset, doc_ids);
+    exactChamferRetriever.get_top_k(dataset[0], 3);
+    StatsSnapshot exact_stats = exactChamferRetriever.get_stats();
+
+#if MUVERA_ENABLE_STATS
+    assert(muvera_stats.enabled);
+    assert(muvera_stats.stages.at("query").count == 5);
+    assert(muvera_stats.stages.at("graph_search").count == 5);
+    assert(muvera_stats.stages.at("rerank").count == 5);
+    assert(muvera_stats.stages.at("hash").count == 5);
+    assert(muvera_stats.counters.at("queries_encoded") == 5);
+    assert(muvera_stats.counters.count("documents_encoded") == 0); // cleared by reset_stats
+    assert(muvera_stats.counters.at("occupied_buckets") > 0);
+    const StageStats& query = muvera_stats.stages.at("query");
+    assert(query.p50_us <= query.p99_us && query.p99_us <= query.max_us);
+
+    assert(exact_stats.stages.at("chamfer_scan").count == 1);
+    assert(exact_stats.counters.at("distance_computations") == 20 * 3 * 3);
+#else
+    assert(!muvera_stats.enabled && muvera_stats.stages.empty());
+    assert(exact_stats.counters.empty());
+#endif
+    std::cout << "✅ test_retriever_stats passed" << std::endl;
+}
+
+void test_muvera_retriever_segments() {
+    const size_t dimensions = 16;
+    const size_t segment_capacity = 8;
+    std::mt19937 gen(99);
+    std::uniform_real_distribution<float> dist(-1.0f, 1.0f);
+    auto make_doc = [&]() {
+        std::vector<std::vector<float>> doc(3, std::vector<float>(dimensions));
+        for (auto& v : doc) for (auto& x : v) x = dist(gen);
+        return doc;
+    };
+
+    MuveraRetriever muveraRetriever(dimensions, segment_capacity, 16, 1024, 4, 4, 42);
+    muveraRetriever.set_compaction_policy(2);
+    std::vector<std::vector<std::vector<float>>> dataset = {make_doc(), make_doc()};
+    muveraRetriever.index_dataset(dataset, {"0", "1"});
+
+    // Grow far past max_points; every full mutable segment gets sealed.
+    const size_t num_docs = 60;
+    for (size_t d = 2; d < num_docs; d++) {
+        dataset.push_back(make_doc());
+        muveraRetriever.add_document(dataset[d], std::to_string(d));
+    }
+    muveraRetriever.delete_document("5");
+    muveraRetriever.compact();
+    assert(muveraRetriever.num_documents() == num_docs - 1);
+    assert(muveraRetriever.num_segments() < num_docs / segment_capacity);
+
+    for (size_t d = 0; d < num_docs; d++) {
+        std::vector<std::string> result = muveraRetriever.get_top_k(dataset[d], 5);
+        bool found_self = std::find(result.begin(), result.end(), std::to_string(d)) != result.end();
+        assert(found_self == (d != 5));
+    }
+    std::cout << "✅ test_muvera_retriever_segments passed with " << muveraRetriever.num_segments()
+              << " segments" << std::endl;
+}
+
+void test_muvera_retriever_labels() {
+    const size_t dimensions = 16;
+    std::mt19937 gen(5);
+    std::uniform_real_distribution<float> dist(-1.0f, 1.0f);
+    auto make_doc = [&]() {
+        std::vector<std::vector<float>> doc(3, std::vector<float>(dimensions));
+        for (auto& v : doc) for (auto& x : v) x = dist(gen);
+        return doc;
+    };
+
+    // Even documents are "even", every tenth is also "rare", odd ones are unlabeled.
+    const size_t num_docs = 60;
+    std::vector<std::vector<std::vector<float>>> dataset;
+    std::vector<std::string> doc_ids;
+    std::vector<std::vector<std::string>> labels;
+    for (size_t d = 0; d < num_docs; d++) {
+        dataset.push_back(make_doc());
+        doc_ids.push_back(std::to_string(d));
+        labels.push_back({});
+        if (d % 2 == 0) labels.back().push_back("even");
+        if (d % 10 == 0) labels.back().push_back("rare");
+    }
+    MuveraRetriever muveraRetriever(dimensions, 8, 16, 1024, 4, 4, 42);
+    muveraRetriever.set_compaction_policy(2);
+    // Labeled queries are scanned unless the threshold is lowered.
+    assert(muveraRetriever.get_filter_brute_force_threshold() == std::numeric_limits<size_t>::max());
+    muveraRetriever.set_filter_brute_force_threshold(10);
+    muveraRetriever.index_dataset(dataset, doc_ids, labels);
+    assert(muveraRetriever.has_labels());
+    for (size_t d = 0; d < 20; d++) {
+        dataset.push_back(make_doc());
+        muveraRetriever.add_document(dataset.back(), std::to_string(num_docs + d), d % 2 == 0 ? std::vector<std::string>{"even"} : std::vector<std::string>{});
+    }
+    muveraRetriever.compact();
+
+    // Graph search restricted to "even".
+    std::vector<std::string> result = muveraRetriever.get_top_k(dataset[1], 10, "even");
+    assert(result.size() == 10);
+    for (const auto& id : result) assert(std::stoi(id) % 2 == 0);
+    result = muveraRetriever.get_top_k(dataset[4], 5, "even");
+    assert(std::find(result.begin(), result.end(), "4") != result.end());
+
+    // "rare" has 6 documents, under the threshold, so it is scanned exactly.
+    result = muveraRetriever.get_top_k(dataset[0], 10, "rare");
+    assert(result.size() == 6);
+    assert(result[0] == "0");
+    for (const auto& id : result) assert(std::stoi(id) % 10 == 0);
+
+    // Deletes leave the label; updates keep or replace it.
+    muveraRetriever.delete_document("10");
+    muveraRetriever.update_document(dataset[20], "20");
+    muveraRetriever.update_document(dataset[30], "30", {"odd"});
+    result = muveraRetriever.get_top_k(dataset[0], 10, "rare");
+    assert(result.size() == 4);
+    assert(std::find(result.begin(), result.end(), "20") != result.end());
+    assert(std::find(result.begin(), result.end(), "10") == result.end());
+    result = muveraRetriever.get_top_k(dataset[30], 10, "odd");
+    assert(result == std::vector<std::string>{"30"});
+
+    assert(muveraRetriever.get_top_k(dataset[0], 10, "unknown").empty());
+    result = muveraRetriever.get_top_k(dataset[1], 3);
+    assert(result.size() == 3);
+
+    // Through the graph: only the segments holding a label are searched.
+    muveraRetriever.set_filter_brute_force_threshold(0);
+    result = muveraRetriever.get_top_k(dataset[0], 10, "rare");
+    assert(result.size() == 4);
+    for (const auto& id : result) assert(std::stoi(id) % 10 == 0);
+    result = muveraRetriever.get_top_k(dataset[30], 10, "odd");
+    assert(result == std::vector<std::string>{"30"});
+
+    // More distinct labels than a mutable segment has frozen points for.
+    MuveraRetriever many_labels(dimensions, 1024, 16, 1024, 4, 4, 42);
+    many_labels.set_filter_brute_force_threshold(0);
+    many_labels.index_dataset(std::vector<std::vector<std::vector<float>>>{dataset[0]}, {"seed"}, {{"seed"}});
+    for (size_t d = 0; d < 300; d++) {
+        many_labels.add_document(dataset[d % dataset.size()], "doc" + std::to_string(d), {"label" + std::to_string(d)});
+    }
+    for (size_t d : {0, 255, 299}) {
+        result = many_labels.get_top_k(dataset[d % dataset.size()], 5, "label" + std::to_string(d));
+        assert(result == std::vector<std::string>{"doc" + std::to_string(d)});
+    }
+
+    // A failed insert is rolled back, so the doc_id stays free.
+    std::vector<std::string> too_many_labels;
+    for (size_t l = 0; l < 300; l++) too_many_labels.push_back("extra" + std::to_string(l));
+    bool threw = false;
+    try {
+        many_labels.add_document(dataset[1], "overlabeled", too_many_labels);
+    } catch (const std::runtime_error&) {
+        threw = true;
+    }
+    assert(threw);
+    assert(many_labels.get_top_k(dataset[1], 5, "extra0").empty());
+    many_labels.add_document(dataset[1], "overlabeled", {"extra0"});
+    assert(many_labels.get_top_k(dataset[1], 5, "extra0") == std::vector<std::string>{"overlabeled"});
+    // A failed update keeps the previous version.
+    threw = false;
+    try {
+        many_labels.update_document(dataset[1], "doc0", too_many_labels);
+    } catch (const std::runtime_error&) {
+        threw = true;
+    }
+    assert(threw);
+    assert(many_labels.num_documents() == 302);
+    assert(many_labels.get_top_k(dataset[0], 5, "label0") == std::vector<std::string>{"doc0"});
+    std::cout << "✅ test_muvera_retriever_labels passed" << std::endl;
+}
+
+void test_query_cache() {
+    const size_t dimensions = 4;
+    std::vector<std::vector<float>> tokens;
+    for (size_t q = 0; q < 8; q++) tokens.push_back({float(q), 1.0f, -1.0f, 0.5f});
+    auto view = [&](size_t q) { return TokenMatrixView{tokens[q].data(), 1, dimensions}; };
+    auto hash = [&](size_t q) { return QueryCache::hash_query(view(q)); };
+
+    // LRU: the least recently used query is evicted.
+    QueryCacheOptions options;
+    options.capacity = 2;
+    options.num_shards = 1;
+    options.eviction = CacheEviction::LRU;
+    QueryCache lru(options);
+    lru.insert(view(0), hash(0), 5, 0, {1.0f}, {"a"});
+    lru.insert(view(1), hash(1), 5, 0, {2.0f}, {"b"});
+    assert(lru.lookup(view(0), hash(0), 5, 0).has_results);
+    lru.insert(view(2), hash(2), 5, 0, {3.0f}, {"c"});
+    assert(lru.size() == 2);
+    assert(lru.lookup(view(1), hash(1), 5, 0).encoding.empty());
+    QueryCache::Lookup hit = lru.lookup(view(0), hash(0), 5, 0);
+    assert(hit.results == std::vector<std::string>{"a"});
+    // A newer generation or another top_k only reuses the encoding.
+    hit = lru.lookup(view(0), hash(0), 5, 1);
+    assert(!hit.has_results && hit.encoding == std::vector<float>{1.0f});
+    assert(!lru.lookup(view(0), hash(0), 6, 0).has_results);
+
+    // TinyLFU: a one-off query does not displace a popular one.
+    options.eviction = CacheEviction::TINY_LFU;
+    options.capacity = 1;
+    QueryCache tiny_lfu(options);
+    for (size_t i = 0; i < 3; i++) tiny_lfu.lookup(view(0), hash(0), 5, 0);
+    tiny_lfu.insert(view(0), hash(0), 5, 0, {1.0f}, {"a"});
+    tiny_lfu.lookup(view(1), hash(1), 5, 0);
+    tiny_lfu.insert(view(1), hash(1), 5, 0, {2.0f}, {"b"});
+    assert(tiny_lfu.lookup(view(0), hash(0), 5, 0).has_results);
+    for (size_t i = 0; i < 5; i++) tiny_lfu.lookup(view(1), hash(1), 5, 0);
+    tiny_lfu.insert(view(1), hash(1), 5, 0, {2.0f}, {"b"});
+    assert(tiny_lfu.lookup(view(1), hash(1), 5, 0).has_results);
+    assert(!tiny_lfu.lookup(view(0), hash(0), 5, 0).has_results);
+
+    // Through a retriever: hits, and invalidation by writes.
+    std::mt19937 gen(3);
+    std::uniform_real_distribution<float> dist(-1.0f, 1.0f);
+    auto make_doc = [&]() {
+        std::vector<std::vector<float>> doc(3, std::vector<float>(16));
+        for (auto& v : doc) for (auto& x : v) x = dist(gen);
+        return doc;
+    };
+    std::vector<std::vector<std::vector<float>>> dataset;
+    std::vector<std::string> doc_ids;
+    for (size_t d = 0; d < 20; d++) {
+        dataset.push_back(make_doc());
+        doc_ids.push_back(std::to_string(d));
+    }
+    MuveraRetriever muveraRetriever(16, 64, 16, 1024, 4, 4, 42);
+    muveraRetriever.index_dataset(dataset, doc_ids);
+    muveraRetriever.enable_query_cache();
+    const std::vector<std::string> first = muveraRetriever.get_top_k(dataset[3], 5);
+    assert(muveraRetriever.get_top_k(dataset[3], 5) == first);
+    assert(muveraRetriever.query_cache_size() == 1);
+    assert(first[0] == "3");
+    muveraRetriever.delete_document("3");
+    const std::vector<std::string> after_delete = muveraRetriever.get_top_k(dataset[3], 5);
+    assert(std::find(after_delete.begin(), after_delete.end(), "3") == after_delete.end());
+    muveraRetriever.add_document(dataset[3], "copy");
+    assert(muveraRetriever.get_top_k(dataset[3], 1) == std::vector<std::string>{"copy"});
+
+    const StatsSnapshot snapshot = muveraRetriever.get_stats();
+    if (snapshot.enabled) {
+        assert(snapshot.counters.at("query_cache_hits") == 1);
+        assert(snapshot.counters.at("query_cache_misses") == 3);
+        assert(snapshot.counters.at("encoding_cache_hits") == 2);
+    }
+    muveraRetriever.disable_query_cache();
+    assert(muveraRetriever.query_cache_size() == 0);
+    std::cout << "✅ test_query_cache passed" << std::endl;
+}
+
+void test_memory_policy() {
+    // Every policy yields a usable buffer, whether or not the kernel honors it.
+    MemoryPolicy policy;
+    for (HugePagePolicy huge_pages : {HugePagePolicy::NONE, HugePagePolicy::TRANSPARENT, HugePagePolicy::EXPLICIT}) {
+        for (NumaPolicy numa : {NumaPolicy::FIRST_TOUCH, NumaPolicy::INTERLEAVE, NumaPolicy::BIND}) {
+            policy.huge_pages = huge_pages;
+            policy.numa = numa;
+            policy.numa_node = numa_nodes()[0];
+            LargeBuffer buffer(3 << 20, policy);
+            float* data = buffer.as<float>();
+            assert(reinterpret_cast<uintptr_t>(data) % 64 == 0);
+            for (size_t i = 0; i < buffer.size() / sizeof(float); i++) data[i] = float(i);
+            assert(data[(3 << 20) / sizeof(float) - 1] == float((3 << 20) / sizeof(float) - 1));
+        }
+    }
+    policy.numa = NumaPolicy::BIND;
+    policy.numa_node = 1 << 20;
+    bool threw = false;
+    try {
+        policy.validate();
+    } catch (const std::runtime_error&) {
+        threw = true;
+    }
+    assert(threw);
+
+    // Pinned workers cover every index exactly once.
+    policy = MemoryPolicy();
+    policy.pin_threads = true;
+    std::vector<std::atomic<int>> visits(1000);
+    pinned_parallel_for(policy, 0, visits.size(), 4, [&](size_t i) { visits[i]++; });
+    for (const auto& v : visits) assert(v.load() == 1);
+
+    // The policy changes placement only, never results.
+    std::mt19937 gen(11);
+    std::uniform_real_distribution<float> dist(-1.0f, 1.0f);
+    std::vector<std::vector<std::vector<float>>> dataset;
+    std::vector<std::string> doc_ids;
+    for (size_t d = 0; d < 40; d++) {
+        dataset.push_back(std::vector<std::vector<float>>(3, std::vector<float>(16)));
+        for (auto& v : dataset.back()) for (auto& x : v) x = dist(gen);
+        doc_ids.push_back(std::to_string(d));
+    }
+    MuveraRetriever baseline(16, 64, 16, 1024, 4, 4, 42);
+    MuveraRetriever placed(16, 64, 16, 1024, 4, 4, 42);
+    policy.huge_pages = HugePagePolicy::TRANSPARENT;
+    policy.numa = NumaPolicy::INTERLEAVE;
+    placed.set_memory_policy(policy);
+    baseline.index_dataset(dataset, doc_ids);
+    placed.index_dataset(dataset, doc_ids);
+    for (size_t q = 0; q < 5; q++) {
+        assert(baseline.get_top_k(dataset[q], 5) == placed.get_top_k(dataset[q], 5));
+    }
+
+    // Brute-force documents live in the placed arena until they are swapped,
+    // updated or joined by individually stored ones.
+    ExactChamferRetriever exact_baseline(16, 64);
+    ExactChamferRetriever exact_placed(16, 64);
+    exact_placed.set_memory_policy(policy);
+    assert(exact_placed.get_memory_policy().pin_threads);
+    exact_baseline.index_dataset(dataset, doc_ids);
+    exact_placed.index_dataset(dataset, doc_ids);
+    for (ExactChamferRetriever* exact : {&exact_baseline, &exact_placed}) {
+        exact->add_document(dataset[7], "added");
+        exact->delete_document("3");
+        exact->update_document(dataset[9], "5");
+    }
+    for (size_t q = 0; q < 10; q++) {
+        assert(exact_baseline.get_top_k(dataset[q], 5) == exact_placed.get_top_k(dataset[q], 5));
+    }
+    assert(exact_placed.memory_usage().components.at("dataset") == exact_baseline.memory_usage().components.at("dataset"));
+    RelaxedChamferRetriever relaxed_placed(16, 64, 1);
+    relaxed_placed.set_memory_policy(policy);
+    relaxed_placed.index_dataset(dataset, doc_ids);
+    assert(relaxed_placed.get_top_k(dataset[4], 1) == std::vector<std::string>{"4"});
+    std::cout << "✅ test_memory_policy passed on " << numa_nodes().size() << " NUMA node(s)" << std::endl;
+}
+
+void test_memory_usage() {
+    std::mt19937 gen(13);
+    std::uniform_real_distribution<float> dist(-1.0f, 1.0f);
+    const size_t dimensions = 16, num_docs = 300, tokens_per_doc = 4;
+    std::vector<std::vector<std::vector<float>>> dataset;
+    std::vector<std::string> doc_ids;
+    for (size_t d = 0; d < num_docs; d++) {
+        dataset.push_back(std::vector<std::vector<float>>(tokens_per_doc, std::vector<float>(dimensions)));
+        for (auto& v : dataset.back()) for (auto& x : v) x = dist(gen);
+        doc_ids.push_back(std::to_string(d));
+    }
+    auto within = [](size_t measured, size_t estimated, double tolerance) {
+        return measured <= estimated * (1 + tolerance) && estimated <= measured * (1 + tolerance);
+    };
+
+    ExactChamferRetriever exact(dimensions, num_docs);
+    exact.index_dataset(dataset, doc_ids);
+    const MemoryUsage exact_usage = exact.memory_usage();
+    const MemoryUsage exact_estimate = ExactChamferRetriever::estimate_memory_usage(dimensions, num_docs, tokens_per_doc, 3);
+    assert(exact_usage.components.at("dataset") == exact_estimate.components.at("dataset"));
+    assert(within(exact_usage.total(), exact_estimate.total(), 0.25));
+
+    // The encoder estimate is exact for the AMS projection.
+    FDESimilarity encoder(dimensions, 16, 1024, 4, 4, 42);
+    assert(encoder.memory_usage().components == FDESimilarity::estimate_memory_usage(dimensions, 4, 4).components);
+
+    MuveraRetriever muvera(dimensions, 64, 16, 1024, 4, 4, 42);
+    muvera.index_dataset(dataset, doc_ids);
+    MemoryUsage muvera_usage = muvera.memory_usage();
+    for (const char* component : {"doc_ids", "doc_id_map", "tombstones", "fde.simhash_hyperplanes", "fde.ams_tables",
+            "diskann.vectors", "diskann.graph"}) {
+        assert(muvera_usage.components.count(component) == 1 && muvera_usage.components.at(component) > 0);
+    }
+    assert(muvera_usage.components.count("query_cache") == 0);
+    MemoryUsage muvera_estimate = MuveraRetriever::estimate_memory_usage(dimensions, 64, 16, 1024, 4, 4, num_docs, 3);
+    assert(muvera_usage.components.at("diskann.vectors") == muvera_estimate.components.at("diskann.vectors"));
+    // The estimate is a peak that includes the transient build buffer.
+    muvera_estimate.components.erase("build.fde_buffer");
+    assert(within(muvera_usage.total(), muvera_estimate.total(), 0.25));
+
+    // Cached queries and labels show up as their own components.
+    muvera.enable_query_cache();
+    muvera.get_top_k(dataset[0], 5);
+    muvera_usage = muvera.memory_usage();
+    assert(muvera_usage.components.at("query_cache") > tokens_per_doc * dimensions * sizeof(float));
+    MuveraRetriever labeled(dimensions, 64, 16, 1024, 4, 4, 42);
+    labeled.index_dataset(dataset, doc_ids, std::vector<std::vector<std::string>>(num_docs, {"tenant"}));
+    const MemoryUsage labeled_usage = labeled.memory_usage();
+    assert(labeled_usage.components.at("labels") > 0 && labeled_usage.components.at("diskann.labels") > 0);
+    std::cout << "✅ test_memory_usage passed" << std::endl;
+}
+
+void test_checkpointed_build() {
+    std::mt19937 gen(19);
+    std::uniform_real_distribution<float> dist(-1.0f, 1.0f);
+    const size_t dimensions = 16, num_docs = 300;
+    std::vector<std::vector<std::vector<float>>> dataset;
+    std::vector<std::string> doc_ids;
+    for (size_t d = 0; d < num_docs; d++) {
+        dataset.push_back(std::vector<std::vector<float>>(2 + d % 3, std::vector<float>(dimensions)));
+        for (auto& v : dataset.back()) for (auto& x : v) x = dist(gen);
+        doc_ids.push_back(std::to_string(d));
+    }
+    std::vector<float> tokens;
+    std::vector<int64_t> offsets;
+    flatten_dataset(dataset, dimensions, tokens, offsets);
+    const RaggedTokenView view{tokens.data(), offsets.data(), num_docs, tokens.size() / dimensions, dimensions};
+    const std::string path = "retriever_test_checkpoint.fde";
+    std::remove(path.c_str());
+    std::remove((path + ".manifest").c_str());
+
+    // A build killed after its first committed chunk.
+    FDESimilarity encoder(dimensions, 16, 1024, 4, 4, 42);
+    {
+        FDEMatrixFile partial(path, num_docs, encoder.get_d_final(), encoder.fingerprint(), dataset_fingerprint(view, doc_ids));
+        assert(partial.completed_docs() == 0);
+        const RaggedTokenView first{view.tokens, view.offsets, 100, view.num_tokens, dimensions};
+        encoder.encode_documents(first, partial.data());
+        partial.commit(100);
+    }
+
+    // The restarted build only encodes the rest and matches a plain build.
+    MuveraRetriever baseline(dimensions, 64, 16, 1024, 4, 4, 42);
+    baseline.index_dataset(view, doc_ids);
+    MuveraRetriever resumed(dimensions, 64, 16, 1024, 4, 4, 42);
+    assert(resumed.index_dataset_checkpointed(view, doc_ids, path, 64) == 200);
+    for (size_t q = 0; q < 10; q++) {
+        assert(resumed.get_top_k(dataset[q], 5) == baseline.get_top_k(dataset[q], 5));
+    }
+
+    // A complete file is reused by a build with other graph parameters.
+    MuveraRetriever retuned(dimensions, 64, 16, 1024, 4, 4, 42);
+    retuned.set_graph_parameters(32, 64, 1.1f);
+    assert(retuned.index_dataset_checkpointed(view, doc_ids, path, 64) == 0);
+    assert(retuned.get_top_k(dataset[7], 1)[0] == "7");
+    bool threw = false;
+    try {
+        retuned.set_graph_parameters(16, 32, 1.2f);
+    } catch (const std::runtime_error&) {
+        threw = true;
+    }
+    assert(threw);
+
+    // Another encoder or another dataset starts over.
+    MuveraRetriever reseeded(dimensions, 64, 16, 1024, 4, 4, 43);
+    assert(reseeded.index_dataset_checkpointed(view, doc_ids, path, 64) == num_docs);
+    std::vector<std::string> renamed = doc_ids;
+    renamed[0] = "renamed";
+    MuveraRetriever relabeled(dimensions, 64, 16, 1024, 4, 4, 43);
+    assert(relabeled.index_dataset_checkpointed(view, renamed, path, 1000) == num_docs);
+    assert(relabeled.get_top_k(dataset[0], 1)[0] == "renamed");
+
+    std::remove(path.c_str());
+    std::remove((path + ".manifest").c_str());
+    std::cout << "✅ test_checkpointed_build passed" << std::endl;
+}
+
+void test_token_pruning() {
+    // Three near-copies of a, two of b and one c.
+    const std::vector<float> tokens = {
+        1.0f, 0.0f, 0.0f,   0.0f, 2.0f, 0.0f,   0.99f, 0.05f, 0.0f,
+        0.0f, 0.0f, 3.0f,   1.01f, -0.05f, 0.0f, 0.0f, 2.0f, 0.02f,
+    };
+    const TokenMatrixView P{tokens.data(), 6, 3};
+    TokenPruningOptions options;
+    options.merge_threshold = 0.95f;
+    std::vector<float> out;
+    assert(prune_tokens(P, options, out) == 3);
+    assert(std::abs(out[0] - 1.0f) < 1e-5 && std::abs(out[1]) < 1e-5); // mean of the a's
+    assert(std::abs(out[4] - 2.0f) < 1e-5 && std::abs(out[8] - 3.0f) < 1e-5);
+
+    // The norm cap keeps the largest tokens in document order.
+    options = TokenPruningOptions();
+    options.max_tokens = 2;
+    out.clear();
+    assert(prune_tokens(P, options, out) == 2);
+    assert(out[2] == 3.0f && out[4] == 2.0f && out[5] == 0.02f);
+
+    // The cluster cap replaces the tokens by group means.
+    options.cap_policy = TokenCapPolicy::CLUSTER;
+    options.max_tokens = 3;
+    out.clear();
+    assert(prune_tokens(P, options, out) == 3);
+    float a_norm = 0.0f;
+    for (size_t c = 0; c < 3; c++) a_norm = std::max(a_norm, out[c * 3]);
+    assert(std::abs(a_norm - 1.0f) < 1e-5);
+
+    out.clear();
+    assert(prune_tokens(TokenMatrixView{tokens.data(), 0, 3}, options, out) == 0 && out.empty());
+    options.merge_threshold = 1.5f;
+    bool threw = false;
+    try {
+        options.validate();
+    } catch (const std::runtime_error&) {
+        threw = true;
+    }
+    assert(threw);
+
+    // Documents padded with near-duplicate tokens retrieve as before while
+    // storing a third of the tokens.
+    std::mt19937 gen(23);
+    std::uniform_real_distribution<float> dist(-1.0f, 1.0f);
+    std::normal_distribution<float> noise(0.0f, 1e-3f);
+    const size_t dimensions = 16, num_docs = 60;
+    std::vector<std::vector<std::vector<float>>> dataset;
+    std::vector<std::string> doc_ids;
+    for (size_t d = 0; d < num_docs; d++) {
+        dataset.emplace_back();
+        for (size_t t = 0; t < 4; t++) {
+            std::vector<float> token(dimensions);
+            for (auto& x : token) x = dist(gen);
+            for (size_t copy = 0; copy < 3; copy++) {
+                dataset.back().push_back(token);
+                for (auto& x : dataset.back().back()) x += noise(gen);
+            }
+        }
+        doc_ids.push_back(std::to_string(d));
+    }
+    TokenPruningOptions merge;
+    merge.merge_threshold = 0.99f;
+    ExactChamferRetriever full(dimensions, num_docs);
+    ExactChamferRetriever pruned(dimensions, num_docs);
+    pruned.set_token_pruning(merge);
+    assert(pruned.get_token_pruning().merge_threshold == merge.merge_threshold);
+    full.index_dataset(dataset, doc_ids);
+    pruned.index_dataset(dataset, doc_ids);
+    for (size_t q = 0; q < 10; q++) {
+        assert(pruned.get_top_k(dataset[q], 1) == full.get_top_k(dataset[q], 1));
+    }
+    pruned.add_document(dataset[0], "copy");
+    // Two thirds of the original tokens are gone, less the added document's four.
+    const size_t token_bytes = dimensions * sizeof(float);
+    assert(full.memory_usage().components.at("dataset") - pruned.memory_usage().components.at("dataset")
+        >= num_docs * 8 * token_bytes - 4 * token_bytes);
+    const StatsSnapshot stats = pruned.get_stats();
+    if (stats.enabled) assert(stats.counters.at("tokens_pruned") == (num_docs + 1) * 8);
+
+    MuveraRetriever muvera(dimensions, 64, 16, 1024, 4, 4, 42);
+    muvera.set_token_pruning(merge);
+    muvera.index_dataset(dataset, doc_ids);
+    for (size_t q = 0; q < 10; q++) assert(muvera.get_top_k(dataset[q], 1)[0] == doc_ids[q]);
+    pruned.set_token_pruning(TokenPruningOptions());
+    assert(!pruned.get_token_pruning().is_enabled());
+    std::cout << "✅ test_token_pruning passed" << std::endl;
+}
+
+// Readers keep querying while a writer appends and deletes documents.
+void run_concurrent_reads_during_ingestion(AbstractRetriever& retriever, const std::string& name) {
+    const size_t dimensions = 16;
+    const size_t initial_docs = 50;
+    const size_t added_docs = 200;
+    std::mt19937 gen(7);
+    std::uniform_real_distribution<float> dist(-1.0f, 1.0f);
+    auto make_doc = [&]() {
+        std::vector<std::vector<float>> doc(3, std::vector<float>(dimensions));
+        for (auto& v : doc) for (auto& x : v) x = dist(gen);
+        return doc;
+    };
+
+    std::vector<std::vector<std::vector<float>>> dataset;
+    std::vector<std::string> doc_ids;
+    for (size_t d = 0; d < initial_docs; d++) {
+        dataset.push_back(make_doc());
+        doc_ids.push_back(std::to_string(d));
+    }
+    std::vector<std::vector<std::vector<float>>> new_docs;
+    for (size_t d = 0; d < added_docs; d++) new_docs.push_back(make_doc());
+    retriever.index_dataset(dataset, doc_ids);
+
+    std::atomic<bool> done(false);
+    std::atomic<size_t> queries(0);
+    std::vector<std::thread> readers;
+    for (size_t t = 0; t < 4; t++) {
+        readers.emplace_back([&, t]() {
+            while (!done.load()) {
+                std::vector<std::string> result = retriever.get_top_k(dataset[t], 10);
+                assert(result.size() <= 10);
+                for (const auto& id : result) assert(!id.empty());
+                queries++;
+            }
+        });
+    }
+    while (queries.load() == 0) std::this_thread::yield();
+    for (size_t d = 0; d < added_docs; d++) {
+        retriever.add_document(new_docs[d], std::to_string(initial_docs + d));
+        if (d % 10 == 0) retriever.delete_document(std::to_string(d + 10));
+        std::this_thread::yield();
+    }
+    done = true;
+    for (auto& r : readers) r.join();
+    assert(retriever.num_documents() == initial_docs + added_docs - added_docs / 10);
+    std::cout << "✅ test_concurrent_reads_during_ingestion (" << name << ") passed after "
+              << queries.load() << " concurrent queries" << std::endl;
+}
+
+void test_concurrent_reads_during_ingestion() {
+    ExactChamferRetriever exactChamferRetriever(16, 500);
+    run_concurrent_reads_during_ingestion(exactChamferRetriever, "ExactChamferRetriever");
+    MuveraRetriever muveraRetriever(16, 500, 16, 1024, 4, 4, 42);
+    run_concurrent_reads_during_ingestion(muveraRetriever, "MuveraRetriever");
+}
+
+// Readers never see a document twice while a writer keeps replacing it.
+void test_concurrent_updates() {
+    const size_t dimensions = 16;
+    std::mt19937 gen(9);
+    std::uniform_real_distribution<float> dist(-1.0f, 1.0f);
+    std::vector<std::vector<std::vector<float>>> dataset(20, std::vector<std::vector<float>>(3, std::vector<float>(dimensions)));
+    std::vector<std::string> doc_ids;
+    for (size_t d = 0; d < dataset.size(); d++) {
+        for (auto& v : dataset[d]) for (auto& x : v) x = dist(gen);
+        doc_ids.push_back(std::to_string(d));
+    }
+    MuveraRetriever muveraRetriever(dimensions, 64, 16, 1024, 4, 4, 42);
+    muveraRetriever.index_dataset(dataset, doc_ids);
+
+    std::atomic<bool> done(false);
+    std::vector<std::thread> readers;
+    for (size_t t = 0; t < 4; t++) {
+        readers.emplace_back([&, t]() {
+            while (!done.load()) {
+                std::vector<std::string> result = muveraRetriever.get_top_k(dataset[t], dataset.size());
+                std::sort(result.begin(), result.end());
+                assert(std::adjacent_find(result.begin(), result.end()) == result.end());
+            }
+        });
+    }
+    for (size_t round = 0; round < 1000; round++) {
+        muveraRetriever.update_document(dataset[round % 4], doc_ids[round % 4]);
+    }
+    done = true;
+    for (auto& r : readers) r.join();
+    assert(muveraRetriever.num_documents() == dataset.size());
+    std::cout << "✅ test_concurrent_updates passed" << std::endl;
+}
+
+// Deletes chase concurrent adds of the same documents, including the window
+// in which a doc_id is mapped but its point is not yet in a segment.
+void test_concurrent_add_delete() {
+    const size_t dimensions = 16;
+    const size_t num_docs = 300;
+    std::mt19937 gen(13);
+    std::uniform_real_distribution<float> dist(-1.0f, 1.0f);
+    std::vector<std::vector<std::vector<float>>> dataset(num_docs, std::vector<std::vector<float>>(3, std::vector<float>(dimensions)));
+    for (auto& doc : dataset) for (auto& v : doc) for (auto& x : v) x = dist(gen);
+    MuveraRetriever muveraRetriever(dimensions, 64, 16, 1024, 4, 4, 42);
+    muveraRetriever.index_dataset(std::vector<std::vector<std::vector<float>>>{dataset[0]}, {"seed"});
+
+    std::thread deleter([&]() {
+        for (size_t d = 0; d < num_docs; d++) {
+            while (true) {
+                try {
+                    muveraRetriever.delete_document(std::to_string(d));
+                    break;
+                } catch (const std::runtime_error& e) {
+                    assert(std::string(e.what()).find("unknown doc_id") != std::string::npos);
+                }
+            }
+        }
+    });
+    for (size_t d = 0; d < num_docs; d++) muveraRetriever.add_document(dataset[d], std::to_string(d));
+    deleter.join();
+    assert(muveraRetriever.num_documents() == 1);
+    for (size_t d = 0; d < num_docs; d += 10) {
+        assert(muveraRetriever.get_top_k(dataset[d], 5) == std::vector<std::string>{"seed"});
+    }
+    std::cout << "✅ test_concurrent_add_delete passed" << std::endl;
+}
+
+// Writers are not held up by a bulk build, and a doc_id claimed by both
+// ends up in exactly one of them.
+void test_concurrent_bulk_build() {
+    const size_t dimensions = 16;
+    const size_t num_docs = 2000;
+    std::mt19937 gen(17);
+    std::uniform_real_distribution<float> dist(-1.0f, 1.0f);
+    std::vector<std::vector<std::vector<float>>> dataset(num_docs, std::vector<std::vector<float>>(3, std::vector<float>(dimensions)));
+    std::vector<std::string> doc_ids;
+    for (size_t d = 0; d < num_docs; d++) {
+        for (auto& v : dataset[d]) for (auto& x : v) x = dist(gen);
+        doc_ids.push_back(std::to_string(d));
+    }
+    MuveraRetriever muveraRetriever(dimensions, 64, 16, 1024, 4, 4, 42);
+    muveraRetriever.index_dataset(std::vector<std::vector<std::vector<float>>>{dataset[0]}, {"seed"});
+
+    bool build_failed = false;
+    std::thread builder([&]() {
+        try {
+            muveraRetriever.index_dataset(dataset, doc_ids);
+        } catch (const std::runtime_error& e) {
+            assert(std::string(e.what()).find("already exists") != std::string::npos);
+            build_failed = true;
+        }
+    });
+    size_t num_added = 0;
+    bool add_failed = false;
+    for (size_t d = 0; d < 50; d++) {
+        muveraRetriever.add_document(dataset[d], "extra" + std::to_string(d));
+        num_added++;
+    }
+    try {
+        muveraRetriever.add_document(dataset[num_docs - 1], doc_ids[num_docs - 1]);
+        num_added++;
+    } catch (const std::runtime_error& e) {
+        assert(std::string(e.what()).find("already exists") != std::string::npos);
+        add_failed = true;
+    }
+    builder.join();
+    assert(build_failed != add_failed);
+    assert(muveraRetriever.num_documents() == 1 + num_added + (build_failed ? 0 : num_docs));
+    const std::vector<std::string> result = muveraRetriever.get_top_k(dataset[num_docs - 1], 1);
+    assert(result == std::vector<std::string>{doc_ids[num_docs - 1]});
+    std::cout << "✅ test_concurrent_bulk_build passed" << std::endl;
+}
+
+// Holds every search until released, to fill the scheduler's queue.
+class BlockingRetriever : public ExactChamferRetriever {
+    public:
+    std::atomic<bool> released{false};
+    using ExactChamferRetriever::ExactChamferRetriever;
+    std::vector<std::string> search_encoded(const TokenMatrixView& Q, const std::vector<float>& encoding, const size_t top_k) const override {
+        while (!released.load()) std::this_thread::yield();
+        return get_top_k(Q, top_k);
+    }
+};
+
+void test_query_scheduler() {
+    const size_t dimensions = 16;
+    std::mt19937 gen(3);
+    std::normal_distribution<float> normal(0.0f, 1.0f);
+    std::vector<std::vector<std::vector<float>>> dataset(300);
+    std::vector<std::string> doc_ids;
+    for (size_t d = 0; d < dataset.size(); d++) {
+        dataset[d].assign(4, std::vector<float>(dimensions));
+        for (auto& token : dataset[d]) for (float& x : token) x = normal(gen);
+        doc_ids.push_back(std::to_string(d));
+    }
+    MuveraRetriever muveraRetriever(dimensions, 500, 16, 1024, 4, 4, 42);
+    muveraRetriever.index_dataset(dataset, doc_ids);
+
+    // Batched, pipelined answers match synchronous get_top_k.
+    QuerySchedulerOptions options;
+    options.max_batch = 8;
+    options.search_threads = 4;
+    QueryScheduler scheduler(muveraRetriever, options);
+    std::vector<std::future<std::vector<std::string>>> futures;
+    for (size_t q = 0; q < 100; q++) futures.push_back(scheduler.submit_query(dataset[q], 10));
+    std::atomic<size_t> callbacks(0);
+    const std::vector<float> Q_flat = flatten_tokens(dataset[7], dimensions);
+    scheduler.submit_query(TokenMatrixView{Q_flat.data(), 4, dimensions}, 10,
+        [&](std::vector<std::string> results, std::exception_ptr error) {
+            assert(!error && results == muveraRetriever.get_top_k(dataset[7], 10));
+            callbacks++;
+        });
+    for (size_t q = 0; q < futures.size(); q++) {
+        assert(futures[q].get() == muveraRetriever.get_top_k(dataset[q], 10));
+    }
+    scheduler.shutdown();
+    assert(callbacks.load() == 1 && scheduler.num_pending() == 0);
+    bool rejected = false;
+    try { scheduler.submit_query(dataset[0], 10); } catch (const QueryRejected&) { rejected = true; }
+    assert(rejected);
+
+    // Admission control: queued plus in-flight queries are capped.
+    BlockingRetriever blocking(dimensions, 500);
+    blocking.index_dataset(dataset, doc_ids);
+    options.max_pending = 2;
+    options.search_threads = 1;
+    QueryScheduler bounded(blocking, options);
+    auto first = bounded.submit_query(dataset[0], 1);
+    auto second = bounded.submit_query(dataset[1], 1);
+    rejected = false;
+    try { bounded.submit_query(dataset[2], 1); } catch (const QueryRejected&) { rejected = true; }
+    assert(rejected && bounded.num_pending() == 2);
+    blocking.released = true;
+    assert(first.get()[0] == "0" && second.get()[0] == "1");
+
+    // Query errors surface through the future.
+    ExactChamferRetriever uninitialized(dimensions, 500);
+    QueryScheduler failing(uninitialized, options);
+    auto failed = failing.submit_query(dataset[0], 1);
+    bool threw = false;
+    try { failed.get(); } catch (const std::runtime_error&) { threw = true; }
+    assert(threw);
+    std::cout << "✅ test_query_scheduler passed" << std::endl;
+}
+
 int main() {
     test_exact_chamfer_retriever_simple();
+    test_exact_chamfer_retriever_delete_update();
     test_muvera_retriever_basic();
+    test_muvera_retriever_delete_update();
+    test_muvera_retriever_segments();
+    test_muvera_retriever_labels();
+    test_retriever_stats();
+    test_concurrent_reads_during_ingestion();
+    test_concurrent_updates();
+    test_concurrent_add_delete();
+    test_concurrent_bulk_build();
+    test_query_scheduler();
+    test_query_cache();
+    test_memory_policy();
+    test_memory_usage();
+    test_checkpointed_build();
+    test_token_pruning();
     test_muvera_retriever_large_100D_top50();
     return 0;
 }
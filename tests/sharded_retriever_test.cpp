@@ -0,0 +1,276 @@
+#include <iostream>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "fde.h"
+#include "retriever.h"
+#include "scheduler.h"
+#include "sharded_retriever.h"
+
+static const size_t DIMENSIONS = 16;
+
+static void make_dataset(const size_t num_docs, std::vector<std::vector<std::vector<float>>>& dataset, std::vector<std::string>& doc_ids) {
+    std::mt19937 gen(11);
+    std::normal_distribution<float> normal(0.0f, 1.0f);
+    dataset.assign(num_docs, std::vector<std::vector<float>>(4, std::vector<float>(DIMENSIONS)));
+    doc_ids.clear();
+    for (size_t d = 0; d < num_docs; d++) {
+        for (auto& token : dataset[d]) for (float& x : token) x = normal(gen);
+        doc_ids.push_back("doc" + std::to_string(1000 + d));
+    }
+}
+
+static void check_self_retrieval(const AbstractRetriever& retriever, const std::vector<std::vector<std::vector<float>>>& dataset,
+    const std::vector<std::string>& doc_ids) {
+    for (size_t q = 0; q < dataset.size(); q += 37) {
+        std::vector<std::string> result = retriever.get_top_k(dataset[q], 10);
+        assert(result.size() == 10);
+        assert(std::find(result.begin(), result.end(), doc_ids[q]) != result.end());
+    }
+}
+
+void test_sharded_retriever_local() {
+    std::vector<std::vector<std::vector<float>>> dataset;
+    std::vector<std::string> doc_ids;
+    make_dataset(400, dataset, doc_ids);
+
+    ShardedRetriever sharded(DIMENSIONS, 500, 16, 1024, 4, 4, 42, 4);
+    sharded.index_dataset(dataset, doc_ids);
+    assert(sharded.num_documents() == 400);
+    for (size_t s = 0; s < 4; s++) assert(sharded.shard_num_documents(s) > 50);
+    check_self_retrieval(sharded, dataset, doc_ids);
+
+    // Writes are routed to the owning shard.
+    const size_t owner = sharded.shard_for("new");
+    const size_t owner_docs = sharded.shard_num_documents(owner);
+    sharded.add_document(dataset[0], "new");
+    assert(sharded.shard_num_documents(owner) == owner_docs + 1);
+    assert(sharded.num_documents() == 401);
+    sharded.update_document(dataset[5], "new");
+    std::vector<std::string> result = sharded.get_top_k(dataset[5], 2);
+    assert(std::find(result.begin(), result.end(), "new") != result.end());
+    sharded.delete_document("new");
+    assert(sharded.num_documents() == 400);
+
+    // Memory usage sums the coordinator's encoder and every shard's retriever.
+    const MemoryUsage usage = sharded.memory_usage();
+    const MemoryUsage encoder_usage = FDESimilarity::estimate_memory_usage(DIMENSIONS, 4, 4);
+    assert(usage.components.at("fde.ams_tables") == 5 * encoder_usage.components.at("fde.ams_tables"));
+    assert(usage.components.at("diskann.vectors") > 0);
+
+    // The scheduler batches encodes through the coordinator's encoder.
+    QueryScheduler scheduler(sharded);
+    auto future = scheduler.submit_query(dataset[74], 10);
+    assert(future.get() == sharded.get_top_k(dataset[74], 10));
+
+    // Range partitioning keeps contiguous doc_ids together.
+    ShardingOptions options;
+    options.partition = ShardPartition::RANGE;
+    options.range_boundaries = {"doc1100", "doc1300"};
+    ShardedRetriever ranged(DIMENSIONS, 500, 16, 1024, 4, 4, 42, 3, options);
+    ranged.index_dataset(dataset, doc_ids);
+    assert(ranged.shard_num_documents(0) == 100);
+    assert(ranged.shard_num_documents(1) == 200);
+    assert(ranged.shard_num_documents(2) == 100);
+    check_self_retrieval(ranged, dataset, doc_ids);
+    std::cout << "✅ test_sharded_retriever_local passed" << std::endl;
+}
+
+// Answers every search late, to trip the coordinator's shard timeout.
+class SlowRetriever : public MuveraRetriever {
+    public:
+    mutable std::atomic<size_t> searches{0};
+    using MuveraRetriever::MuveraRetriever;
+    std::vector<ScoredDocument> search_encoded_scored(const TokenMatrixView& Q, const std::vector<float>& encoding, const size_t top_k) const override {
+        searches++;
+        std::this_thread::sleep_for(std::chrono::milliseconds(300));
+        return MuveraRetriever::search_encoded_scored(Q, encoding, top_k);
+    }
+};
+
+void test_sharded_retriever_remote() {
+    std::vector<std::vector<std::vector<float>>> dataset;
+    std::vector<std::string> doc_ids;
+    make_dataset(300, dataset, doc_ids);
+
+    MuveraRetriever worker_0(DIMENSIONS, 500, 16, 1024, 4, 4, 42);
+    SlowRetriever worker_1(DIMENSIONS, 500, 16, 1024, 4, 4, 42);
+    const std::string socket_path = "/tmp/muvera_shard_test_" + std::to_string(getpid()) + ".sock";
+    ShardServer server_0(worker_0, "unix:" + socket_path);
+    ShardServer server_1(worker_1, "tcp:127.0.0.1:0");
+    assert(server_1.endpoint() != "tcp:127.0.0.1:0");
+    std::thread serve_0([&] { server_0.serve(); });
+    std::thread serve_1([&] { server_1.serve(); });
+
+    {
+        ShardingOptions options;
+        options.shard_timeout = std::chrono::milliseconds(0);
+        ShardedRetriever sharded(DIMENSIONS, 16, 1024, 4, 4, 42, {server_0.endpoint(), server_1.endpoint()}, options);
+        sharded.index_dataset(dataset, doc_ids);
+        assert(sharded.num_documents() == 300);
+        assert(worker_0.num_documents() + worker_1.num_documents() == 300);
+        check_self_retrieval(sharded, dataset, doc_ids);
+
+        // Shard errors carry the worker's message.
+        bool threw = false;
+        try { sharded.add_document(dataset[0], doc_ids[0]); } catch (const std::runtime_error& e) {
+            threw = std::string(e.what()).find("already exists") != std::string::npos;
+        }
+        assert(threw);
+        sharded.delete_document(doc_ids[1]);
+        assert(sharded.num_documents() == 299);
+    }
+
+    {
+        // The slow shard misses the deadline; the fast shard's answer is returned.
+        ShardingOptions options;
+        options.shard_timeout = std::chrono::milliseconds(50);
+        ShardedRetriever sharded(DIMENSIONS, 16, 1024, 4, 4, 42, {server_0.endpoint(), server_1.endpoint()}, options);
+        size_t q = 0;
+        while (sharded.shard_for(doc_ids[q]) != 0) q++;
+        const FDESimilarity encoder(DIMENSIONS, 16, 1024, 4, 4, 42);
+        const std::vector<float> Q_flat = flatten_tokens(dataset[q], DIMENSIONS);
+        const TokenMatrixView Q{Q_flat.data(), dataset[q].size(), DIMENSIONS};
+        ShardedSearchResult result = sharded.search_shards(Q, encoder.encode_query(Q), 10);
+        assert(result.missing_shards == std::vector<size_t>{1});
+        assert(!result.results.empty() && result.results[0].doc_id == doc_ids[q]);
+        for (size_t i = 1; i < result.results.size(); i++) assert(result.results[i - 1].score >= result.results[i].score);
+#if MUVERA_ENABLE_STATS
+        assert(sharded.get_stats().counters.at("shards_missing") == 1);
+#endif
+    }
+
+    {
+        // A frame announcing more than the limit closes that connection
+        // before anything is allocated; the server keeps serving others.
+        const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        sockaddr_un address{};
+        address.sun_family = AF_UNIX;
+        std::strncpy(address.sun_path, socket_path.c_str(), sizeof(address.sun_path) - 1);
+        const int connected = connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address));
+        assert(connected == 0);
+        char header[9] = {1};
+        const uint64_t size = UINT64_MAX;
+        std::memcpy(header + 1, &size, sizeof(size));
+        const ssize_t sent = send(fd, header, sizeof(header), 0);
+        assert(sent == static_cast<ssize_t>(sizeof(header)));
+        char byte;
+        const ssize_t received = recv(fd, &byte, 1, 0);
+        assert(received == 0);
+        close(fd);
+        ShardedRetriever sharded(DIMENSIONS, 16, 1024, 4, 4, 42, {server_0.endpoint(), server_1.endpoint()});
+        assert(sharded.num_documents() == 299);
+    }
+
+    // Every client is gone, so the servers join their connection threads.
+    const auto reap_deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+    while ((server_0.num_connections() > 0 || server_1.num_connections() > 0) && std::chrono::steady_clock::now() < reap_deadline) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    assert(server_0.num_connections() == 0 && server_1.num_connections() == 0);
+
+    server_0.stop();
+    server_1.stop();
+    serve_0.join();
+    serve_1.join();
+    std::cout << "✅ test_sharded_retriever_remote passed" << std::endl;
+}
+
+void test_sharded_retriever_slow_local_shard() {
+    std::vector<std::vector<std::vector<float>>> dataset;
+    std::vector<std::string> doc_ids;
+    make_dataset(200, dataset, doc_ids);
+
+    std::vector<std::unique_ptr<AbstractRetriever>> local_shards;
+    local_shards.push_back(std::make_unique<MuveraRetriever>(DIMENSIONS, 500, 16, 1024, 4, 4, 42));
+    auto slow_shard = std::make_unique<SlowRetriever>(DIMENSIONS, 500, 16, 1024, 4, 4, 42);
+    const SlowRetriever& slow = *slow_shard;
+    local_shards.push_back(std::move(slow_shard));
+    ShardingOptions options;
+    options.shard_timeout = std::chrono::milliseconds(50);
+    options.fanout_threads = 2;
+    ShardedRetriever sharded(DIMENSIONS, 16, 1024, 4, 4, 42, std::move(local_shards), options);
+    sharded.index_dataset(dataset, doc_ids);
+    assert(sharded.num_documents() == 200);
+
+    // Back-to-back queries outpace the slow shard. Its late searches neither
+    // start nor take the fast shard's fanout thread, so every query still
+    // gets the fast shard's answer on time.
+    const FDESimilarity encoder(DIMENSIONS, 16, 1024, 4, 4, 42);
+    const size_t num_queries = 12;
+    size_t q = 0;
+    for (size_t i = 0; i < num_queries; i++, q++) {
+        while (sharded.shard_for(doc_ids[q]) != 0) q++;
+        const std::vector<float> Q_flat = flatten_tokens(dataset[q], DIMENSIONS);
+        const TokenMatrixView Q{Q_flat.data(), dataset[q].size(), DIMENSIONS};
+        const auto start = std::chrono::steady_clock::now();
+        ShardedSearchResult result = sharded.search_shards(Q, encoder.encode_query(Q), 10);
+        assert(std::chrono::steady_clock::now() - start < std::chrono::milliseconds(250));
+        assert(result.missing_shards == std::vector<size_t>{1});
+        assert(!result.results.empty() && result.results[0].doc_id == doc_ids[q]);
+    }
+    assert(slow.searches < num_queries / 2);
+    std::cout << "✅ test_sharded_retriever_slow_local_shard passed" << std::endl;
+}
+
+void test_shard_server_stop_with_stalled_client() {
+    std::vector<std::vector<std::vector<float>>> dataset;
+    std::vector<std::string> doc_ids;
+    make_dataset(20, dataset, doc_ids);
+    ExactChamferRetriever worker(DIMENSIONS, 20);
+    worker.index_dataset(dataset, doc_ids);
+    const std::string socket_path = "/tmp/muvera_shard_stall_" + std::to_string(getpid()) + ".sock";
+    ShardServer server(worker, "unix:" + socket_path);
+    std::atomic<bool> served{false};
+    std::thread serve([&] { server.serve(); served = true; });
+
+    // A client that stops three bytes into a frame header leaves its handler
+    // waiting for the rest with no deadline.
+    const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    std::strncpy(address.sun_path, socket_path.c_str(), sizeof(address.sun_path) - 1);
+    const int connected = connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address));
+    assert(connected == 0);
+    const char partial[3] = {1, 0, 0};
+    const ssize_t sent = send(fd, partial, sizeof(partial), 0);
+    assert(sent == static_cast<ssize_t>(sizeof(partial)));
+    const auto accept_deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+    while (server.num_connections() == 0 && std::chrono::steady_clock::now() < accept_deadline) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    assert(server.num_connections() == 1);
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+
+    // stop() interrupts the handler, so serve() returns promptly.
+    server.stop();
+    const auto stop_deadline = std::chrono::steady_clock::now() + std::chrono::seconds(2);
+    while (!served && std::chrono::steady_clock::now() < stop_deadline) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    assert(served);
+    serve.join();
+    char byte;
+    assert(recv(fd, &byte, 1, 0) == 0);
+    close(fd);
+    std::cout << "✅ test_shard_server_stop_with_stalled_client passed" << std::endl;
+}
+
+int main() {
+    test_sharded_retriever_local();
+    test_sharded_retriever_remote();
+    test_sharded_retriever_slow_local_shard();
+    test_shard_server_stop_with_stalled_client();
+    return 0;
+}
@@ -0,0 +1,92 @@
+// muvera_shard_worker: serves one MuveraRetriever shard to a ShardedRetriever
+// in another process, over a Unix socket or TCP.
+//
+//   muvera_shard_worker --listen unix:/tmp/shard0.sock | tcp:0.0.0.0:7000
+//                       --dimensions D [--max-points N] [--d-proj 16]
+//                       [--d-final 10240] [--k-sim 5] [--r-reps 20] [--seed 42]
+//                       [--data shard.mvf]
+//
+// The FDE parameters must match the coordinator's. With --data the shard
+// starts out indexed from the given .mvf file; otherwise the coordinator's
+// index_dataset fills it. Runs until SIGINT or SIGTERM.
+
+#include <csignal>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <thread>
+
+#include "multivector_file.h"
+#include "retriever.h"
+#include "sharded_retriever.h"
+
+struct WorkerOptions {
+    std::string listen;
+    size_t dimensions = 0;
+    size_t max_points = 1000000;
+    size_t d_proj = 16;
+    size_t d_final = 10240;
+    size_t k_sim = 5;
+    size_t r_reps = 20;
+    uint64_t seed = 42;
+    std::string data_path;
+};
+
+static WorkerOptions parse_options(int argc, char** argv) {
+    WorkerOptions options;
+    for (int i = 1; i < argc; i++) {
+        const std::string arg = argv[i];
+        auto value = [&]() -> std::string {
+            if (i + 1 >= argc) throw std::invalid_argument(arg + " requires a value");
+            return argv[++i];
+        };
+        if (arg == "--listen") options.listen = value();
+        else if (arg == "--dimensions") options.dimensions = std::stoull(value());
+        else if (arg == "--max-points") options.max_points = std::stoull(value());
+        else if (arg == "--d-proj") options.d_proj = std::stoull(value());
+        else if (arg == "--d-final") options.d_final = std::stoull(value());
+        else if (arg == "--k-sim") options.k_sim = std::stoull(value());
+        else if (arg == "--r-reps") options.r_reps = std::stoull(value());
+        else if (arg == "--seed") options.seed = std::stoull(value());
+        else if (arg == "--data") options.data_path = value();
+        else throw std::invalid_argument("unknown option " + arg);
+    }
+    if (options.listen.empty()) throw std::invalid_argument("--listen is required");
+    return options;
+}
+
+static ShardServer* running_server = nullptr;
+
+static void handle_signal(int) {
+    if (running_server) running_server->stop();
+}
+
+int main(int argc, char** argv) {
+    try {
+        WorkerOptions options = parse_options(argc, argv);
+        std::unique_ptr<MultiVectorFile> data;
+        if (!options.data_path.empty()) {
+            data = std::make_unique<MultiVectorFile>(options.data_path);
+            if (options.dimensions == 0) options.dimensions = data->dimensions();
+        }
+        if (options.dimensions == 0) throw std::invalid_argument("--dimensions is required without --data");
+
+        MuveraRetriever retriever(options.dimensions, options.max_points, options.d_proj, options.d_final,
+            options.k_sim, options.r_reps, options.seed);
+        if (data) retriever.index_dataset(*data);
+
+        ShardServer server(retriever, options.listen);
+        running_server = &server;
+        std::signal(SIGINT, handle_signal);
+        std::signal(SIGTERM, handle_signal);
+        std::cerr << "muvera_shard_worker: serving " << retriever.num_documents() << " documents on "
+                  << server.endpoint() << std::endl;
+        server.serve();
+        running_server = nullptr;
+    } catch (const std::exception& e) {
+        std::cerr << "muvera_shard_worker: " << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}